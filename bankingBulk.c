@@ -0,0 +1,546 @@
+#include "database.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "report.h"
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+/**************************************************************
+ * Banking Bulk Loader
+ *
+ * usage: bankingBulk import [-E hash|mmap[:path]] [-l prefix] [-t threads] <file|->
+ *        bankingBulk export [-E hash|mmap[:path]] [-l prefix] [-f text|csv|binary] [-|tcp:host:port|path]
+ *
+ * import:
+ * 	loads every account of a csv or binary file into an empty
+ * 	database and leaves it where a bankingServer given the same
+ * 	-E and -l starts from: a snapshot at <prefix>.snapshot for
+ * 	the hash engine, or the file of the mmap engine
+ * 	a csv file has a "name,balance" line per account, as a csv
+ * 	report writes them (see report.c): a first line of headers,
+ * 	"#" lines and any third column are skipped, and a name with a
+ * 	comma or quote is quoted, with "" for each quote
+ * 	a binary file is a binary report (see report.h), and is told
+ * 	apart by its first bytes
+ * 	the file is mapped and split into a slice per thread (-t, one
+ * 	per core by default); each thread parses its slice, then,
+ * 	once the accounts before each slice are counted, loads its
+ * 	accounts into the database in file order, the way a snapshot
+ * 	is loaded, so accounts get ids in the order of the file
+ * 	nothing is saved if any line is bad or any name is repeated
+ *
+ * export:
+ * 	writes every account of a stopped server's database as a
+ * 	report would, to stdout by default; a running server exports
+ * 	its live table itself, from a forked copy that takes no lock,
+ * 	on SIGUSR1 or every -r seconds (bankingServer -r 0 -f binary
+ * 	-o path, then kill -USR1)
+ ***************************************************************/
+
+#define BULK_READ_SIZE (1 << 20)
+
+/* an account parsed from the input, waiting to be loaded */
+typedef struct bulk_account bulk_account;
+struct bulk_account {
+	uint64_t hash;			//hash of the name
+	money balance;			//in cents
+	size_t name_offset;		//offset of the name field in the input, quotes included
+	uint16_t name_len;		//bytes of the name field
+	uint8_t quoted;			//the name field is quoted, with "" for each quote
+};
+
+/* the part of the input one thread parses, and the accounts it found there */
+typedef struct bulk_slice bulk_slice;
+struct bulk_slice {
+	size_t start;			//offset of the first record
+	size_t end;			//offset one past the last record
+	bulk_account *accounts;
+	uint32_t num_accounts;
+	uint32_t capacity;
+	uint32_t first_id;		//id of the slice's first account
+	size_t error_offset;		//offset of the first record that could not be parsed; SIZE_MAX if none
+	bulk_account *failed;		//first account that could not be loaded; NULL if none
+	int load_status;		//what load_account() returned for it
+};
+
+/******************************* GLOBALS **************************************/
+/* the whole input, mapped or read in */
+char *input;
+size_t input_size;
+
+/* the input is a binary report rather than csv */
+int input_binary;
+
+/* slices of the input, one per thread */
+bulk_slice *slices;
+int num_slices;
+
+/******************************************************************************/
+
+/* get the current time in seconds
+ *
+ * @return monotonic clock reading in seconds
+ */
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* map the input file, or read it all in if it can't be mapped (stdin, a pipe)
+ *
+ * @param1 path path of the input; "-" for stdin
+ *
+ * @return 0 if successful; -1 otherwise
+ */
+int open_input(char *path)
+{
+	int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+	if(fd == -1) return -1;
+
+	struct stat st;
+	if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		input_size = st.st_size;
+		input = mmap(NULL, input_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+		if(fd != STDIN_FILENO) close(fd);
+		if(input == MAP_FAILED) return -1;
+
+		madvise(input, input_size, MADV_SEQUENTIAL);
+		return 0;
+	}
+
+	size_t capacity = BULK_READ_SIZE;
+	input = malloc(capacity);
+	input_size = 0;
+
+	ssize_t ret;
+	do {
+		if(input_size == capacity) {
+			capacity *= 2;
+			input = realloc(input, capacity);
+		}
+		ret = read(fd, input + input_size, capacity - input_size);
+		if(ret > 0) input_size += ret;
+	} while(ret > 0);
+
+	if(fd != STDIN_FILENO) close(fd);
+
+	return ret == -1 ? -1 : 0;
+}
+
+/* copy the name of a parsed account out of the input, undoing csv quoting
+ *
+ * @param1 account the parsed account
+ * @param2 name pointer in which to put the terminated name
+ *
+ * @return length of the name; -1 if it is empty, too long or holds a NUL
+ */
+int bulk_account_name(bulk_account *account, char name[256])
+{
+	char *field = input + account->name_offset;
+	size_t len = 0;
+
+	if(!account->quoted) {
+		if(account->name_len > 255 || memchr(field, '\0', account->name_len)) return -1;
+		memcpy(name, field, account->name_len);
+		len = account->name_len;
+	} else {
+		//skip the quotes around the field, and the first of each pair inside it
+		size_t i;
+		for(i = 1; i + 1 < account->name_len; i++) {
+			if(field[i] == '"') i++;
+			if(len == 255 || field[i] == '\0') return -1;
+			name[len++] = field[i];
+		}
+	}
+
+	name[len] = '\0';
+
+	return len == 0 ? -1 : (int) len;
+}
+
+/* add an account to a slice once its name checks out
+ *
+ * @param1 slice the slice the account was found in
+ * @param2 account the parsed account; its hash is filled in here
+ *
+ * @return 0 if successful; -1 if the name is bad
+ */
+int add_bulk_account(bulk_slice *slice, bulk_account *account)
+{
+	char name[256];
+	if(bulk_account_name(account, name) == -1) return -1;
+
+	account->hash = hash_account_name(name);
+
+	if(slice->num_accounts == slice->capacity) {
+		slice->capacity *= 2;
+		slice->accounts = realloc(slice->accounts, slice->capacity * sizeof(bulk_account));
+	}
+	slice->accounts[slice->num_accounts++] = *account;
+
+	return 0;
+}
+
+/* parse one csv line
+ *
+ * @param1 start offset of the line in the input
+ * @param2 end offset of the newline ending it, or of the end of the input
+ * @param3 account pointer in which to put the account
+ *
+ * @return 1 if the line is an account; 0 if it is to be skipped; -1 if it is bad
+ */
+int parse_csv_line(size_t start, size_t end, bulk_account *account)
+{
+	char *line = input + start;
+	size_t len = end - start;
+	if(len > 0 && line[len - 1] == '\r') len--;
+
+	//blank lines, summary lines and the header line
+	if(len == 0 || line[0] == '#') return 0;
+	if(start == 0 && len >= 5 && memcmp(line, "name,", 5) == 0) return 0;
+
+	size_t pos = 0;
+	if(line[0] == '"') {
+		for(pos = 1; pos < len; pos++) {
+			if(line[pos] != '"') continue;
+			if(pos + 1 < len && line[pos + 1] == '"') pos++;
+			else break;
+		}
+		if(pos == len) return -1;
+		pos++;
+		account->quoted = 1;
+	} else {
+		while(pos < len && line[pos] != ',') pos++;
+		account->quoted = 0;
+	}
+
+	if(pos >= len || line[pos] != ',' || pos > UINT16_MAX) return -1;
+	account->name_offset = start;
+	account->name_len = pos;
+
+	//the balance runs to the next comma; anything after it is ignored
+	char *amount = line + pos + 1;
+	char *amount_end = memchr(amount, ',', len - pos - 1);
+	size_t amount_len = amount_end ? (size_t) (amount_end - amount) : len - pos - 1;
+
+	char amount_string[MONEY_STRING_SIZE];
+	if(amount_len >= sizeof(amount_string)) return -1;
+	memcpy(amount_string, amount, amount_len);
+	amount_string[amount_len] = '\0';
+
+	return parse_money(amount_string, &account->balance) ? 1 : -1;
+}
+
+/* thread runner parsing the accounts of a slice
+ *
+ * @param1 arg void pointer to the bulk_slice
+ */
+void * parse_runner(void* arg)
+{
+	bulk_slice *slice = (bulk_slice*) arg;
+	size_t pos = slice->start;
+
+	while(pos < slice->end) {
+		bulk_account account;
+		size_t record = pos;
+		int ret;
+
+		if(input_binary) {
+			//bounds were checked when the input was sliced
+			uint64_t be_balance;
+			memcpy(&be_balance, input + pos, sizeof(be_balance));
+			account.balance = be64toh(be_balance);
+			account.name_len = (unsigned char) input[pos + sizeof(be_balance)];
+			account.name_offset = pos + sizeof(be_balance) + 1;
+			account.quoted = 0;
+			pos = account.name_offset + account.name_len;
+			ret = account.balance >= 0 ? 1 : -1;
+		} else {
+			char *newline = memchr(input + pos, '\n', slice->end - pos);
+			size_t end = newline ? (size_t) (newline - input) : slice->end;
+			ret = parse_csv_line(pos, end, &account);
+			pos = end + 1;
+		}
+
+		if(ret == 1) ret = add_bulk_account(slice, &account);
+		if(ret == -1) {
+			slice->error_offset = record;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* split the input into a slice per thread, each starting on a record
+ *
+ * @param1 num_threads number of slices
+ *
+ * @return 0 if successful; -1 if a binary input is cut short, with
+ *         the first slice's error_offset at the cut record
+ */
+int slice_input(int num_threads)
+{
+	num_slices = num_threads;
+	slices = calloc(num_slices, sizeof(bulk_slice));
+
+	size_t first = input_binary ? REPORT_BINARY_MAGIC_SIZE : 0;
+	size_t pos = first;
+
+	int i;
+	for(i = 0; i < num_slices; i++) {
+		size_t target = first + (input_size - first) / num_slices * (i + 1);
+		if(i == num_slices - 1) target = input_size;
+
+		slices[i].start = pos;
+
+		if(input_binary) {
+			//records vary in length, so the only way to find where they start is to hop over them
+			while(pos < target) {
+				if(pos + 9 > input_size || pos + 9 + (unsigned char) input[pos + 8] > input_size) {
+					slices[0].error_offset = pos;
+					return -1;
+				}
+				pos += 9 + (unsigned char) input[pos + 8];
+			}
+		} else if(target > pos) {
+			char *newline = memchr(input + target - 1, '\n', input_size - target + 1);
+			pos = newline ? (size_t) (newline - input) + 1 : input_size;
+		}
+
+		slices[i].end = pos;
+		slices[i].error_offset = SIZE_MAX;
+		slices[i].capacity = (pos - slices[i].start) / 16 + 16;
+		slices[i].accounts = malloc(slices[i].capacity * sizeof(bulk_account));
+	}
+
+	return 0;
+}
+
+/* thread runner loading the accounts of a slice into the database
+ *
+ * @param1 arg void pointer to the bulk_slice
+ */
+void * load_runner(void* arg)
+{
+	bulk_slice *slice = (bulk_slice*) arg;
+
+	uint32_t i;
+	for(i = 0; i < slice->num_accounts; i++) {
+		bulk_account *account = &slice->accounts[i];
+		char name[256];
+		bulk_account_name(account, name);
+
+		//the engine checks for the name under the segment lock, so a name in two slices is always caught
+		int status = load_account(slice->first_id + i, name, account->hash, account->balance);
+		if(status != 0) {
+			slice->failed = account;
+			slice->load_status = status;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* run a thread on each slice and wait for them all
+ *
+ * @param1 runner thread runner, given a bulk_slice
+ */
+void run_slice_threads(void * (*runner)(void*))
+{
+	pthread_t ids[num_slices];
+
+	int i;
+	for(i = 0; i < num_slices; i++) {
+		pthread_create(&ids[i], NULL, runner, &slices[i]);
+	}
+
+	for(i = 0; i < num_slices; i++) {
+		pthread_join(ids[i], NULL);
+	}
+}
+
+/* open the database as a server given the same -E and -l would, without logging
+ *
+ * @param1 prefix prefix of the log and snapshot files; NULL for none
+ *
+ * @return 0 if successful; -1 otherwise
+ */
+int open_database(char *prefix)
+{
+	if(init_db() == -1) {
+		fprintf(stderr, "failed to open the %s storage engine\n", db_engine->name);
+		return -1;
+	}
+
+	if(!prefix) return 0;
+
+	uint32_t generation;
+	if(load_snapshot(prefix, &generation) == -1) {
+		fprintf(stderr, "snapshot of %s is corrupt\n", prefix);
+		return -1;
+	}
+	wal_replay(prefix, generation);
+
+	return 0;
+}
+
+/* load every account of the input into the empty database
+ *
+ * @param1 path path of the input; "-" for stdin
+ * @param2 prefix prefix of the snapshot to write; NULL for a persistent engine
+ * @param3 num_threads threads of each pass
+ *
+ * @return 0 if successful; -1 otherwise
+ */
+int bulk_import(char *path, char *prefix, int num_threads)
+{
+	if(num_account_records() != 0) {
+		fprintf(stderr, "the database already holds accounts; import only into an empty one\n");
+		return -1;
+	}
+
+	double start = now();
+
+	if(open_input(path) == -1) {
+		fprintf(stderr, "failed to read %s\n", path);
+		return -1;
+	}
+
+	input_binary = input_size >= REPORT_BINARY_MAGIC_SIZE && memcmp(input, REPORT_BINARY_MAGIC, REPORT_BINARY_MAGIC_SIZE) == 0;
+
+	//parse: every thread parses its own slice
+	int ret = slice_input(num_threads);
+	if(ret == 0) run_slice_threads(parse_runner);
+
+	size_t num_accounts = 0;
+	int i;
+	for(i = 0; i < num_slices; i++) {
+		if(slices[i].error_offset != SIZE_MAX) {
+			size_t offset = slices[i].error_offset;
+			if(input_binary) {
+				fprintf(stderr, "%s: bad account record at byte %zu\n", path, offset);
+			} else {
+				size_t line = 1;
+				char *ptr = input;
+				while((ptr = memchr(ptr, '\n', input + offset - ptr))) {
+					line++;
+					ptr++;
+				}
+				fprintf(stderr, "%s: bad account on line %zu\n", path, line);
+			}
+			return -1;
+		}
+
+		slices[i].first_id = num_accounts;
+		num_accounts += slices[i].num_accounts;
+	}
+
+	if(num_accounts > UINT32_MAX) {
+		fprintf(stderr, "%s: too many accounts\n", path);
+		return -1;
+	}
+
+	double parsed = now();
+
+	//load: every thread loads its own slice
+	reserve_db(num_accounts);
+	run_slice_threads(load_runner);
+
+	for(i = 0; i < num_slices; i++) {
+		if(!slices[i].failed) continue;
+
+		char name[256];
+		bulk_account_name(slices[i].failed, name);
+		if(slices[i].load_status == -1) fprintf(stderr, "%s: account %s is given more than once\n", path, name);
+		else fprintf(stderr, "no room to load account %s\n", name);
+		return -1;
+	}
+
+	//until now the accounts are past the end of the database, so a failed import leaves it empty
+	finish_load(num_accounts);
+
+	double loaded = now();
+
+	if(prefix && save_snapshot(prefix) == -1) {
+		fprintf(stderr, "failed to write snapshot of %s\n", prefix);
+		return -1;
+	}
+
+	double saved = now();
+
+	printf("imported %zu accounts with %d threads in %.2fs: parsed in %.2fs, loaded in %.2fs, saved in %.2fs\n",
+			num_accounts, num_threads, saved - start, parsed - start, loaded - parsed, saved - loaded);
+
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	char *command = (argc > 1) ? argv[1] : "";
+	char *engine_spec = "hash";
+	char *prefix = NULL;
+	report_format format = REPORT_CSV;
+
+	int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	int opt;
+	optind = 2;	//options follow the command
+	while(argc > 1 && (opt = getopt(argc, argv, "E:l:t:f:")) != -1) {
+		switch(opt) {
+			case 'E':
+				engine_spec = optarg;
+				if(select_storage_engine(engine_spec) == 0) break;
+				fprintf(stderr, "storage engine must be hash or mmap[:path]\n");
+				exit(EXIT_FAILURE);
+			case 'l':
+				prefix = optarg;
+				break;
+			case 't':
+				num_threads = atoi(optarg);
+				break;
+			case 'f':
+				if(parse_report_format(optarg, &format) == 0) break;
+				fprintf(stderr, "export format must be text, csv or binary\n");
+				exit(EXIT_FAILURE);
+			default:
+				command = "";
+		}
+	}
+
+	int is_import = strcmp(command, "import") == 0;
+	if((!is_import && strcmp(command, "export") != 0) || argc - optind > 1 || (is_import && argc - optind != 1)) {
+		fprintf(stderr, "usage: %s import [-E hash|mmap[:path]] [-l prefix] [-t threads] <file|->\n", argv[0]);
+		fprintf(stderr, "       %s export [-E hash|mmap[:path]] [-l prefix] [-f text|csv|binary] [-|tcp:host:port|path]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if(num_threads < 1) num_threads = 1;
+
+	//the hash engine keeps nothing without a snapshot, and a persistent engine takes no log, as in bankingServer
+	if(!db_engine->persistent && !prefix) {
+		fprintf(stderr, "the %s engine keeps its accounts in a snapshot and log (-l)\n", db_engine->name);
+		exit(EXIT_FAILURE);
+	}
+	if(db_engine->persistent && prefix) {
+		fprintf(stderr, "the %s engine keeps its accounts itself and takes no log (-l)\n", db_engine->name);
+		exit(EXIT_FAILURE);
+	}
+
+	if(open_database(prefix) == -1) exit(EXIT_FAILURE);
+
+	int ret;
+	if(is_import) {
+		ret = bulk_import(argv[optind], prefix, num_threads);
+	} else {
+		ret = report(argc > optind ? argv[optind] : "-", format);
+	}
+
+	free_db();
+
+	return ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,11 +1,10 @@
 #include "bankingClient.h"
-#include <regex.h>
 
 /**************************************************************
  * Banking Client
  *
  * main: 
- * 	make connection to server
+ * 	make connection to server (binary protocol unless -t is given)
  *     	spawn user_input_runner and server_response threads
  *
  * user_input_runner:
@@ -16,26 +15,95 @@
  * server_response_runner:
  * 	receive response from server
  * 	print response to stdout
+ * 	if the connection is lost, reconnect, serve the session's
+ * 	account again and resend the request that was not answered;
+ * 	binary requests carry the client's id, so the server answers
+ * 	a resent request that already ran with its first result
+ * 	instead of running it twice (see protocol.h)
+ *
+ * with -f, instead runs the commands of a file (or stdin for "-")
+ * as a batch:
+ * 	commands are streamed over -k connections (default 1) with up
+ * 	to -w requests in flight on each (default BATCH_WINDOW), with
+ * 	no pause between them; a receiver thread per connection
+ * 	prints each reply as "<input line>: <response>" as it arrives
+ * 	every command of an account's session, from serve to end, goes
+ * 	over the same connection, as does creating the account, so the
+ * 	commands of one account run in input order; commands of
+ * 	different accounts may run in any order
+ * 	with -S shards, the server is sharded (bankingServer -S) with
+ * 	shard i listening on port + i; each shard gets -k connections
+ * 	and an account's commands go to the shard that owns it
  ***************************************************************/
 
 int main(int argc, char** argv) 
 {
-	if(argc != 3) {
+	wire_protocol protocol = PROTOCOL_BINARY;
+	char *batch_path = NULL;
+	int batch_connections = 1;
+	long batch_window = BATCH_WINDOW;
+	int num_shards = 1;
+
+	int opt;
+	while((opt = getopt(argc, argv, "tf:k:w:S:")) != -1) {
+		switch(opt) {
+			case 't':
+				protocol = PROTOCOL_TEXT;
+				break;
+			case 'f':
+				batch_path = optarg;
+				break;
+			case 'k':
+				batch_connections = atoi(optarg);
+				break;
+			case 'w':
+				batch_window = atol(optarg);
+				break;
+			case 'S':
+				num_shards = atoi(optarg);
+				break;
+			default:
+				batch_connections = 0;
+		}
+	}
+
+	if(batch_connections < 1 || batch_window < 1 || num_shards < 1 || (num_shards > 1 && !batch_path)) {
+		fprintf(stderr, "usage: %s [-t] [-f file|- [-k connections] [-w window] [-S shards]] <server> <port>\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if(argc - optind != 2) {
 		fprintf(stderr, "wrong number of arguments\n");
 		exit(EXIT_FAILURE);
 	}
 
-	int sockfd = connect_to_server(argv[1], argv[2]);
+	char *server_name = argv[optind];
+	char *port_num = argv[optind + 1];
+
+	if(batch_path) return run_batch(server_name, port_num, protocol, batch_path, num_shards, batch_connections, batch_window);
+
+	int sockfd = connect_to_server(server_name, port_num);
 
 	if(sockfd == -1) {
 		fprintf(stderr, "failed to connect to server\n");
 		exit(EXIT_FAILURE);
 	}
 
+	printf("connected to server\n");
+
 	server server_info;
-	server_info.server_name = argv[1];
-	server_info.port_num = argv[2];
+	server_info.server_name = server_name;
+	server_info.port_num = port_num;
 	server_info.sockfd = sockfd;
+	server_info.protocol = protocol;
+	server_info.next_request_id = 1;
+	server_info.client_id = new_client_id();
+	server_info.unanswered_size = 0;
+	server_info.session_name[0] = '\0';
+	pthread_mutex_init(&server_info.lock, NULL);
+
+	//retries of clients cut off together are spread out with rand()
+	srand(server_info.client_id);
 
 	pthread_t input_runner_id;
 	pthread_t server_runner_id;
@@ -49,7 +117,8 @@ int main(int argc, char** argv)
 	return 0;
 }
 
-/* Attempt to connect to server every 3 seconds
+/* Attempt to connect to server, retrying quickly at first and backing off to
+ * every 3 seconds while it stays down
  *
  * @param1 server_name the domain name for the server
  * @param2 port_num the string representation of the port number
@@ -82,14 +151,14 @@ int connect_to_server(char server_name[256], char port_num[10])
 		}
 
 
+		useconds_t backoff = RETRY_MIN_USEC;
 		while(1) {
 			int connect_ret = connect(sockfd, ptr->ai_addr, ptr->ai_addrlen);
 			if(connect_ret != -1) break;
-			sleep(3);
+			retry_wait(&backoff);
 		}
 
 		//made connection
-		printf("connected to server\n");
 		freeaddrinfo(server_addr_info);
 		return sockfd;
 	}
@@ -98,6 +167,33 @@ int connect_to_server(char server_name[256], char port_num[10])
 	return -1;
 }
 
+/* Pick an id for this client that no other client will have
+ *
+ * @return a random id other than 0
+ */
+uint64_t new_client_id()
+{
+	uint64_t client_id = 0;
+	while(client_id == 0) {
+		if(getrandom(&client_id, sizeof(client_id), 0) != sizeof(client_id))
+			client_id = ((uint64_t) getpid() << 32) ^ time(NULL);
+	}
+
+	return client_id;
+}
+
+/* Sleep before a retry for a random time up to the backoff, so clients that were
+ * cut off together don't all retry together, then double the backoff
+ *
+ * @param1 backoff microseconds to wait at most; doubled up to RETRY_MAX_USEC
+ */
+void retry_wait(useconds_t *backoff)
+{
+	usleep(*backoff / 2 + rand() % (*backoff / 2 + 1));
+
+	*backoff = (*backoff * 2 > RETRY_MAX_USEC) ? RETRY_MAX_USEC : *backoff * 2;
+}
+
 /* Thread runner to accpet user input.
  * Checks that input is valid then sends the message to the server
  *
@@ -114,7 +210,8 @@ void * user_input_runner(void* arg)
 
 		if(!input_is_valid(user_input)) {
 			printf("Invalid input. Correct usage:\n\tcreate <accountname (char) >\n\tserve <accountname (char) >"
-					"\n\tdeposit <amount (double) >\n\twithdraw <amount (double) >"
+					"\n\tdeposit <amount (e.g. 12.50) >\n\twithdraw <amount (e.g. 12.50) >"
+					"\n\ttransfer <amount (e.g. 12.50) > <accountname (char) >"
 					"\n\tquery\n\tend\n\tquit\n");
 			continue;
 		}
@@ -165,29 +262,112 @@ void get_user_input(char user_input[263])
  */
 int input_is_valid(char user_input[263])
 {
-	regex_t regex;
-	int reti;
-	reti = regcomp(&regex, "(^(create|serve)[  ].+)"
-			"|^(end|query|quit)$"
-			"|(^(deposit|withdraw)[  ][0-9]+((\\.[0-9]+)?)|(\\.[0-9]+))$", REG_EXTENDED);
-	if(reti) {
-		fprintf(stderr, "Could not compile regex");
-		exit(EXIT_FAILURE);
+	if(strcmp(user_input, "quit") == 0) return 1;
+
+	client_command parsed;
+	return parse_user_input(user_input, &parsed);
+}
+
+/* copy an account name, cutting it to the 255 bytes the protocols carry */
+void copy_account_name(char name[256], char *argument)
+{
+	size_t name_len = strlen(argument);
+	if(name_len > 255) name_len = 255;
+
+	memcpy(name, argument, name_len);
+	name[name_len] = '\0';
+}
+
+/* Parse a command line by hand, one scan over the input:
+ * 	create|serve <name>, deposit|withdraw <amount>,
+ * 	transfer <amount> <name>, query, end
+ * with a single space between the parts
+ *
+ * @param1 user_input the input, terminated by '\0'
+ * @param2 parsed pointer in which to put the command, account name and amount
+ *
+ * @return 1 if the input is a valid command; 0 otherwise
+ */
+int parse_user_input(char *user_input, client_command *parsed)
+{
+	static const char *commands[] = {"create", "serve", "deposit", "withdraw", "query", "end", "transfer"};
+
+	//the command is everything up to the first space
+	size_t command_len = strcspn(user_input, " ");
+	int command = -1;
+	for(int i = CREATE; i <= TRANSFER; i++) {
+		if(strlen(commands[i]) == command_len && strncmp(user_input, commands[i], command_len) == 0)
+			command = i;
 	}
-	reti = regexec(&regex, user_input, 0, NULL, 0);
 
-	regfree(&regex);
+	char *argument = user_input + command_len;
+
+	parsed->command = command;
+	parsed->name[0] = '\0';
+	parsed->amount = 0;
+
+	switch(command) {
+		case QUERY:
+		case END:
+			return *argument == '\0';
+		case CREATE:
+		case SERVE:
+			if(*argument != ' ' || argument[1] == '\0') return 0;
+			copy_account_name(parsed->name, argument + 1);
+			return 1;
+		case DEPOSIT:
+		case WITHDRAW:
+			return *argument == ' ' && parse_money(argument + 1, &parsed->amount);
+		case TRANSFER: {
+			//"<amount> <account>"; the account follows the amount
+			if(*argument != ' ' || !parse_transfer_amount(argument + 1, &parsed->amount)) return 0;
+
+			char *account = strchr(argument + 1, ' ');
+			if(!account || account[1] == '\0') return 0;
+			copy_account_name(parsed->name, account + 1);
+			return 1;
+		}
+		default:
+			return 0;
+	}
+}
+
+/* Parse the amount of a transfer, which is followed by the account to credit
+ *
+ * @param1 argument the input after "transfer "
+ * @param2 amount pointer in which to put the amount in cents
+ *
+ * @return 1 if the amount is valid; 0 otherwise
+ */
+int parse_transfer_amount(char *argument, money *amount)
+{
+	char amount_string[MONEY_STRING_SIZE + 1];
+	size_t amount_len = strcspn(argument, " ");
+	if(amount_len >= sizeof(amount_string)) return 0;
 
-	return !reti;
+	memcpy(amount_string, argument, amount_len);
+	amount_string[amount_len] = '\0';
+
+	return parse_money(amount_string, amount);
 }
 
-/* Send valid input to the server
+/* Send valid input to the server in the protocol of the connection
  *
  * @param1 user_input the input read from stdin
  * @param2 server_info server struct containing info on the server
  */
 void send_message_to_server(char user_input[263], server *server_info)
 {
+	if(server_info->protocol == PROTOCOL_BINARY) {
+		pthread_mutex_lock(&server_info->lock);
+		server_info->unanswered_size = encode_user_input(user_input, server_info, server_info->unanswered);
+
+		//if the connection is lost, server_response_runner resends the request over a new one
+		send(server_info->sockfd, server_info->unanswered, server_info->unanswered_size, MSG_NOSIGNAL);
+		pthread_mutex_unlock(&server_info->lock);
+		return;
+	}
+
 	int ret = send(server_info->sockfd, user_input, 263, 0);
 
 	if(ret <= 0) {
@@ -197,6 +377,47 @@ void send_message_to_server(char user_input[263], server *server_info)
 	return;
 }
 
+/* Turn valid input into a binary frame followed by the account name, if any, and
+ * keep its command and request id as those of the unanswered request
+ *
+ * @param1 user_input the input read from stdin
+ * @param2 server_info server struct containing info on the server
+ * @param3 frame buffer of at least sizeof(binary_frame) + 255 bytes in which to put the frame
+ *
+ * @return number of bytes of frame to send
+ */
+size_t encode_user_input(char user_input[263], server *server_info, char *frame)
+{
+	client_command *parsed = &server_info->unanswered_command;
+	parse_user_input(user_input, parsed);
+
+	server_info->unanswered_id = server_info->next_request_id++;
+
+	return encode_command(parsed, server_info->unanswered_id, server_info->client_id, frame);
+}
+
+/* Turn a parsed command into a binary frame followed by the account name, if any
+ *
+ * @param1 parsed the command
+ * @param2 request_id id of the request
+ * @param3 client_id id of the client, if the request may be resent; 0 otherwise
+ * @param4 frame buffer of at least sizeof(binary_frame) + 255 bytes in which to put the frame
+ *
+ * @return number of bytes of frame to send
+ */
+size_t encode_command(client_command *parsed, uint32_t request_id, uint64_t client_id, char *frame)
+{
+	size_t name_len = strlen(parsed->name);
+	memcpy(frame + sizeof(binary_frame), parsed->name, name_len);
+
+	binary_frame header;
+	encode_frame(&header, parsed->command + 1, 0, name_len, request_id, parsed->amount);
+	header.account_id = htobe64(client_id);
+	memcpy(frame, &header, sizeof(header));
+
+	return sizeof(binary_frame) + name_len;
+}
+
 /* Thread runner to receive responses from server and print them to stdout
  *
  * @param1 arg void pointer to server struct containing info pertaining to the server
@@ -207,6 +428,11 @@ void * server_response_runner(void* arg)
 	server *server_info = (server*) arg;
 	char server_response[320];
 
+	if(server_info->protocol == PROTOCOL_BINARY) {
+		binary_response_loop(server_info);
+		return NULL;
+	}
+
 	while(1) {
 		ret = recv(server_info->sockfd, server_response, sizeof(server_response), 0);
 		if(ret == -1) {
@@ -215,6 +441,12 @@ void * server_response_runner(void* arg)
 			return;
 		}
 
+		//the server closed the connection, after saying why
+		if(ret == 0) {
+			printf("server has disconnected from client\n");
+			_exit(EXIT_SUCCESS);
+		}
+
 		if(strcmp(server_response, "Server has been shutdown") == 0) {
 			printf("server has disconnected from client\n");
 			_exit(EXIT_SUCCESS);
@@ -225,3 +457,478 @@ void * server_response_runner(void* arg)
 
 	return;
 }
+
+/* Receive binary replies from server and print them as the text protocol would,
+ * carrying on over a new connection whenever one is lost
+ *
+ * @param1 server_info server struct containing info on the server
+ */
+void binary_response_loop(server *server_info)
+{
+	binary_frame reply;
+
+	while(1) {
+		//replies are fixed size, so read exactly one at a time
+		int ret = recv(server_info->sockfd, &reply, sizeof(reply), MSG_WAITALL);
+		if(ret != sizeof(reply)) {
+			if(ret == -1) perror("receive: ");
+			if(reconnect_to_server(server_info) == -1) return;
+			continue;
+		}
+
+		decode_frame(&reply);
+
+		if(reply.opcode == OP_SHUTDOWN) {
+			printf("server has disconnected from client\n");
+			_exit(EXIT_SUCCESS);
+		}
+
+		pthread_mutex_lock(&server_info->lock);
+		note_reply(server_info, &reply);
+		pthread_mutex_unlock(&server_info->lock);
+
+		char message[TEXT_REPLY_SIZE];
+		format_reply(message, reply.opcode - 1, reply.status, reply.amount);
+
+		printf("response from sever: %s\n", message);
+
+		//the binary protocol also hands back the account's id
+		if(reply.status == 0 && (reply.opcode - 1 == CREATE || reply.opcode - 1 == SERVE))
+			printf("account id: %llu\n", (unsigned long long) reply.account_id);
+	}
+}
+
+/* Note the reply to the unanswered request, and the session it starts or ends,
+ * so a new connection knows what it has to redo; the caller holds server_info->lock
+ *
+ * @param1 server_info server struct containing info on the server
+ * @param2 reply the reply, in host byte order
+ */
+void note_reply(server *server_info, binary_frame *reply)
+{
+	if(server_info->unanswered_size == 0 || reply->request_id != server_info->unanswered_id) return;
+
+	server_info->unanswered_size = 0;
+
+	if(reply->status != 0) return;
+
+	if(reply->opcode - 1 == SERVE) strcpy(server_info->session_name, server_info->unanswered_command.name);
+	if(reply->opcode - 1 == END) server_info->session_name[0] = '\0';
+}
+
+/* Connect again after the connection is lost, serve the session's account again
+ * and resend the request still waiting for its reply; the server answers a resent
+ * request that already ran from its dedup cache, so it never runs twice
+ *
+ * @param1 server_info server struct containing info on the server
+ *
+ * @return -1 if the server can't be reached; 0 if successful
+ */
+int reconnect_to_server(server *server_info)
+{
+	printf("lost connection to server; reconnecting\n");
+
+	pthread_mutex_lock(&server_info->lock);
+
+	while(1) {
+		close(server_info->sockfd);
+
+		server_info->sockfd = connect_to_server(server_info->server_name, server_info->port_num);
+		if(server_info->sockfd == -1) {
+			pthread_mutex_unlock(&server_info->lock);
+			fprintf(stderr, "failed to connect to server\n");
+			return -1;
+		}
+
+		//the server ended the session with the old connection
+		if(server_info->session_name[0] != '\0' && serve_again(server_info) == -1) continue;
+
+		if(server_info->unanswered_size == 0) break;
+
+		ssize_t ret = send(server_info->sockfd, server_info->unanswered, server_info->unanswered_size, MSG_NOSIGNAL);
+		if(ret == (ssize_t) server_info->unanswered_size) break;
+	}
+
+	pthread_mutex_unlock(&server_info->lock);
+
+	printf("reconnected to server\n");
+
+	return 0;
+}
+
+/* Serve the session's account on a new connection, waiting for the server to
+ * notice the old connection is gone and end its session; the caller holds server_info->lock
+ *
+ * @param1 server_info server struct containing info on the server
+ *
+ * @return -1 if the new connection was lost too; 0 otherwise, with no session if it couldn't be served
+ */
+int serve_again(server *server_info)
+{
+	client_command serve;
+	serve.command = SERVE;
+	strcpy(serve.name, server_info->session_name);
+	serve.amount = 0;
+
+	useconds_t backoff = RETRY_MIN_USEC;
+	int i;
+	for(i = 0; i < SERVE_RETRIES; i++) {
+		char frame[sizeof(binary_frame) + 255];
+		size_t frame_size = encode_command(&serve, server_info->next_request_id++, 0, frame);
+
+		binary_frame reply;
+		if(send(server_info->sockfd, frame, frame_size, MSG_NOSIGNAL) != (ssize_t) frame_size) return -1;
+		if(recv(server_info->sockfd, &reply, sizeof(reply), MSG_WAITALL) != sizeof(reply)) return -1;
+		decode_frame(&reply);
+
+		if(reply.opcode == OP_SHUTDOWN) {
+			printf("server has disconnected from client\n");
+			_exit(EXIT_SUCCESS);
+		}
+
+		//the old connection's session is still open
+		if(reply.status == -3) {
+			retry_wait(&backoff);
+			continue;
+		}
+
+		if(reply.status == 0) return 0;
+		break;
+	}
+
+	fprintf(stderr, "could not serve %s again\n", server_info->session_name);
+	server_info->session_name[0] = '\0';
+
+	return 0;
+}
+
+/* @return current monotonic time in seconds */
+double batch_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* pick the connection that carries an account's commands; FNV-1a of the name
+ *
+ * @param1 name the account name
+ * @param2 num_connections connections of the batch
+ *
+ * @return index of the connection
+ */
+int route_account(char *name, int num_connections)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	for(; *name; name++) {
+		hash ^= (unsigned char) *name;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash % num_connections;
+}
+
+/* Run the commands of a file or pipe over num_connections connections to each shard,
+ * pipelined, printing each reply as it arrives and a summary on stderr at the end
+ *
+ * @param1 server_name the domain name for the server
+ * @param2 port_num the string representation of the port number of shard 0
+ * @param3 protocol protocol to speak
+ * @param4 input_path file of commands, one per line; "-" for stdin
+ * @param5 num_shards shards of the server, listening on consecutive ports
+ * @param6 shard_connections connections to each shard
+ * @param7 window requests allowed in flight per connection
+ *
+ * @return exit status: EXIT_SUCCESS if every command was answered; EXIT_FAILURE otherwise
+ */
+int run_batch(char *server_name, char *port_num, wire_protocol protocol, char *input_path, int num_shards, int shard_connections, long window)
+{
+	line_reader *reader = calloc(1, sizeof(line_reader));
+	reader->fd = (strcmp(input_path, "-") == 0) ? STDIN_FILENO : open(input_path, O_RDONLY);
+	if(reader->fd == -1) {
+		perror(input_path);
+		free(reader);
+		return EXIT_FAILURE;
+	}
+
+	int num_connections = num_shards * shard_connections;
+	batch_connection *connections = calloc(num_connections, sizeof(batch_connection));
+
+	int i;
+	for(i = 0; i < num_connections; i++) {
+		//connections of shard s are s * shard_connections onwards
+		char shard_port[16];
+		snprintf(shard_port, sizeof(shard_port), "%d", atoi(port_num) + i / shard_connections);
+
+		batch_connection *conn = &connections[i];
+		conn->sockfd = connect_to_server(server_name, shard_port);
+		if(conn->sockfd == -1) {
+			fprintf(stderr, "failed to connect to server\n");
+			exit(EXIT_FAILURE);
+		}
+
+		//the last frames of a burst shouldn't wait on Nagle
+		int one = 1;
+		setsockopt(conn->sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		conn->protocol = protocol;
+		conn->window = window;
+		conn->lines = malloc(window * sizeof(long));
+		pthread_mutex_init(&conn->lock, NULL);
+		pthread_cond_init(&conn->reply_cond, NULL);
+		pthread_create(&conn->receiver_id, NULL, batch_receiver_runner, conn);
+	}
+
+	double start = batch_now();
+
+	//connection of the session opened by the last serve, if it hasn't been ended
+	batch_connection *session = NULL;
+	long line_num = 0, invalid = 0;
+	char line[263];
+
+	long len;
+	while((len = read_batch_line(reader, line, connections, num_connections)) != -1) {
+		line_num++;
+
+		if(len == 0) continue;
+		if(strcmp(line, "quit") == 0) break;
+
+		client_command parsed;
+		if(len > 262 || !parse_user_input(line, &parsed)) {
+			fprintf(stderr, "%ld: invalid command: %s\n", line_num, line);
+			invalid++;
+			continue;
+		}
+
+		//creating an account and its sessions share a connection to its shard, so they stay in order
+		batch_connection *conn = session;
+		if(!conn) {
+			if(parsed.command == CREATE || parsed.command == SERVE)
+				conn = &connections[account_shard(parsed.name, num_shards) * shard_connections + route_account(parsed.name, shard_connections)];
+			else
+				conn = &connections[0];
+		}
+
+		if(parsed.command == SERVE) session = conn;
+		if(parsed.command == END) session = NULL;
+
+		batch_send(conn, line, &parsed, line_num);
+	}
+
+	if(reader->fd != STDIN_FILENO) close(reader->fd);
+	free(reader);
+
+	//everything is sent; wait for the last replies
+	long sent = 0, unanswered = 0, errors = 0;
+	for(i = 0; i < num_connections; i++) {
+		batch_connection *conn = &connections[i];
+		flush_batch_connection(conn);
+
+		pthread_mutex_lock(&conn->lock);
+		while(conn->replied < conn->sent && !conn->closed) pthread_cond_wait(&conn->reply_cond, &conn->lock);
+		pthread_mutex_unlock(&conn->lock);
+
+		//wakes the receiver out of recv()
+		shutdown(conn->sockfd, SHUT_RDWR);
+		pthread_join(conn->receiver_id, NULL);
+
+		sent += conn->sent;
+		unanswered += conn->sent - conn->replied;
+		errors += conn->errors;
+
+		close(conn->sockfd);
+		free(conn->lines);
+	}
+
+	double seconds = batch_now() - start;
+	fflush(stdout);
+
+	fprintf(stderr, "%ld commands over %d connections in %.3f s (%.0f commands/s): %ld errors, %ld invalid",
+			sent, num_connections, seconds, sent / seconds, errors, invalid);
+	if(unanswered) fprintf(stderr, ", %ld unanswered", unanswered);
+	fprintf(stderr, "\n");
+
+	free(connections);
+
+	return unanswered ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Read the next line of batch input, without its newline; lines too long for a
+ * text frame are cut short, which makes them invalid. Before blocking on the input
+ * everything buffered is sent, so a slow pipe doesn't hold back earlier commands
+ *
+ * @param1 reader the input
+ * @param2 line pointer in which to put the line
+ * @param3 connections connections of the batch
+ * @param4 num_connections number of connections
+ *
+ * @return length of the line; 263 if it was too long; -1 at the end of the input
+ */
+long read_batch_line(line_reader *reader, char line[263], batch_connection *connections, int num_connections)
+{
+	size_t len = 0;
+	int too_long = 0;
+
+	while(1) {
+		if(reader->start == reader->end) {
+			if(reader->eof) return (len || too_long) ? (long) len : -1;
+
+			int i;
+			for(i = 0; i < num_connections; i++) flush_batch_connection(&connections[i]);
+
+			ssize_t ret = read(reader->fd, reader->buffer, BATCH_READ_SIZE);
+			if(ret <= 0) {
+				if(ret == -1) perror("read: ");
+				reader->eof = 1;
+			}
+			reader->start = 0;
+			reader->end = (ret > 0) ? ret : 0;
+			continue;
+		}
+
+		char c = reader->buffer[reader->start++];
+		if(c == '\n') break;
+
+		if(len < 262) line[len++] = c;
+		else too_long = 1;
+	}
+
+	if(len > 0 && line[len - 1] == '\r') len--;
+	line[len] = '\0';
+
+	//a line longer than a frame can't be sent intact
+	return too_long ? 263 : (long) len;
+}
+
+/* send whatever frames a batch connection has buffered */
+void flush_batch_connection(batch_connection *conn)
+{
+	char *ptr = conn->out;
+	while(conn->out_len > 0) {
+		ssize_t ret = send(conn->sockfd, ptr, conn->out_len, MSG_NOSIGNAL);
+		if(ret <= 0) {
+			fprintf(stderr, "failed to send message to server\n");
+			exit(EXIT_FAILURE);
+		}
+		ptr += ret;
+		conn->out_len -= ret;
+	}
+}
+
+/* Queue a request on a batch connection, first waiting for room in its window
+ *
+ * @param1 conn the connection
+ * @param2 line the command line, for the text protocol
+ * @param3 parsed the parsed command, for the binary protocol
+ * @param4 line_num input line of the command
+ */
+void batch_send(batch_connection *conn, char line[263], client_command *parsed, long line_num)
+{
+	pthread_mutex_lock(&conn->lock);
+	while(conn->sent - conn->replied >= conn->window && !conn->closed) {
+		//the replies that would make room may be waiting on frames still buffered
+		if(conn->out_len > 0) {
+			pthread_mutex_unlock(&conn->lock);
+			flush_batch_connection(conn);
+			pthread_mutex_lock(&conn->lock);
+			continue;
+		}
+		pthread_cond_wait(&conn->reply_cond, &conn->lock);
+	}
+
+	int closed = conn->closed;
+	if(!closed) conn->lines[conn->sent++ % conn->window] = line_num;
+	pthread_mutex_unlock(&conn->lock);
+
+	if(closed) return;
+
+	if(conn->out_len + TEXT_FRAME_SIZE > BATCH_SEND_SIZE || conn->out_len + BATCH_FRAME_SIZE > BATCH_SEND_SIZE)
+		flush_batch_connection(conn);
+
+	if(conn->protocol == PROTOCOL_BINARY) {
+		conn->out_len += encode_command(parsed, line_num, 0, conn->out + conn->out_len);
+	} else {
+		memset(conn->out + conn->out_len, 0, TEXT_FRAME_SIZE);
+		strcpy(conn->out + conn->out_len, line);
+		conn->out_len += TEXT_FRAME_SIZE;
+	}
+}
+
+/* Thread runner receiving the replies of a batch connection, matching each to the
+ * request it answers and printing it with the request's input line
+ *
+ * @param1 arg void pointer to batch_connection
+ */
+void * batch_receiver_runner(void *arg)
+{
+	batch_connection *conn = (batch_connection*) arg;
+	size_t reply_size = (conn->protocol == PROTOCOL_BINARY) ? sizeof(binary_frame) : TEXT_REPLY_SIZE;
+
+	char buffer[BATCH_READ_SIZE];
+	size_t len = 0;
+
+	while(1) {
+		ssize_t ret = recv(conn->sockfd, buffer + len, sizeof(buffer) - len, 0);
+		if(ret <= 0) break;
+		len += ret;
+
+		size_t offset;
+		for(offset = 0; offset + reply_size <= len; offset += reply_size) {
+			char message[TEXT_REPLY_SIZE];
+			int failed;
+			uint32_t request_id = 0;
+
+			if(conn->protocol == PROTOCOL_BINARY) {
+				binary_frame reply;
+				memcpy(&reply, buffer + offset, sizeof(reply));
+				decode_frame(&reply);
+
+				if(reply.opcode == OP_SHUTDOWN) {
+					printf("server has disconnected from client\n");
+					fflush(stdout);
+					_exit(EXIT_FAILURE);
+				}
+
+				format_reply(message, reply.opcode - 1, reply.status, reply.amount);
+				failed = reply.status != 0;
+				request_id = reply.request_id;
+			} else {
+				memcpy(message, buffer + offset, TEXT_REPLY_SIZE);
+				message[TEXT_REPLY_SIZE - 1] = '\0';
+
+				if(strcmp(message, "Server has been shutdown") == 0) {
+					printf("server has disconnected from client\n");
+					fflush(stdout);
+					_exit(EXIT_FAILURE);
+				}
+
+				failed = strncmp(message, "ERROR", 5) == 0;
+			}
+
+			//replies come back in the order the requests were sent
+			pthread_mutex_lock(&conn->lock);
+			long line_num = conn->lines[conn->replied % conn->window];
+			conn->replied++;
+			conn->errors += failed;
+			pthread_cond_broadcast(&conn->reply_cond);
+			pthread_mutex_unlock(&conn->lock);
+
+			if(conn->protocol == PROTOCOL_BINARY && request_id != (uint32_t) line_num)
+				fprintf(stderr, "%ld: reply is for request %u\n", line_num, request_id);
+
+			message[strcspn(message, "\n")] = '\0';
+			printf("%ld: %s\n", line_num, message);
+		}
+
+		//keep the start of a reply that has not fully arrived at the front
+		len -= offset;
+		memmove(buffer, buffer + offset, len);
+	}
+
+	pthread_mutex_lock(&conn->lock);
+	conn->closed = 1;
+	pthread_cond_broadcast(&conn->reply_cond);
+	pthread_mutex_unlock(&conn->lock);
+
+	return NULL;
+}
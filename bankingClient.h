@@ -5,8 +5,21 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <time.h>
 #include <pthread.h>
+#include <sys/random.h>
+#include "protocol.h"
+
+/* a command line once parsed */
+typedef struct client_command client_command;
+struct client_command {
+	db_command command;
+	char name[256];			//account of CREATE and SERVE, or the account credited by TRANSFER
+	money amount;			//amount in cents of DEPOSIT, WITHDRAW and TRANSFER
+};
 
 /* structs */
 typedef struct server server;
@@ -14,6 +27,54 @@ struct server {
 	char* server_name;
 	char* port_num;
 	int sockfd;
+	wire_protocol protocol;		//protocol spoken on sockfd
+	uint32_t next_request_id;	//id of the next binary request
+	uint64_t client_id;		//sent with every binary request, so the server can tell a resent one (see protocol.h)
+
+	//binary protocol: what a new connection needs to carry on where a lost one stopped
+	pthread_mutex_t lock;				//guards sockfd and the fields below between the two threads
+	char unanswered[sizeof(binary_frame) + 255];	//last request sent, until its reply arrives
+	size_t unanswered_size;				//0 once the reply has arrived
+	uint32_t unanswered_id;				//its request id
+	client_command unanswered_command;		//its command
+	char session_name[256];				//account being served; "" if none
+};
+
+/* defines */
+#define BATCH_WINDOW 256		//default requests in flight per batch connection
+#define BATCH_SEND_SIZE 65536		//frames buffered per batch connection before a send
+#define BATCH_READ_SIZE 65536		//bytes of batch input read at a time
+#define BATCH_FRAME_SIZE (sizeof(binary_frame) + 255)
+#define RETRY_MIN_USEC 50000		//longest first wait before retrying a connection or a request
+#define RETRY_MAX_USEC 3000000		//longest wait between retries
+#define SERVE_RETRIES 10		//tries at serving the session's account again on a new connection
+
+/* one connection of a batch run */
+typedef struct batch_connection batch_connection;
+struct batch_connection {
+	pthread_t receiver_id;
+	int sockfd;
+	wire_protocol protocol;
+	long window;			//requests allowed in flight
+	long *lines;			//input line of each request in flight, by request number % window
+	long sent;			//requests sent so far
+	long replied;			//replies received so far
+	long errors;			//replies reporting an error
+	int closed;			//the server closed the connection
+	pthread_mutex_t lock;		//guards lines, sent, replied, errors and closed
+	pthread_cond_t reply_cond;	//signalled on every reply and when the connection closes
+	char out[BATCH_SEND_SIZE];	//frames not sent yet; only touched by the reading thread
+	size_t out_len;
+};
+
+/* buffered reader of batch input */
+typedef struct line_reader line_reader;
+struct line_reader {
+	int fd;
+	char buffer[BATCH_READ_SIZE];
+	size_t start;			//first byte not returned yet
+	size_t end;			//one past the last byte read
+	int eof;
 };
 
 /* enums */
@@ -21,8 +82,27 @@ typedef enum _bool{false, true} bool;
 
 /* client functions */
 int connect_to_server(char server_name[256], char port_num[10]);
+uint64_t new_client_id();
+void retry_wait(useconds_t *backoff);
 void * user_input_runner(void* arg);
 void get_user_input(char user_input[263]);
 int input_is_valid(char user_input[263]);
+int parse_user_input(char *user_input, client_command *parsed);
+int parse_transfer_amount(char *argument, money *amount);
 void send_message_to_server(char user_input[263], server *server_info);
+size_t encode_user_input(char user_input[263], server *server_info, char *frame);
+size_t encode_command(client_command *parsed, uint32_t request_id, uint64_t client_id, char *frame);
 void * server_response_runner(void* arg);
+void binary_response_loop(server *server_info);
+void note_reply(server *server_info, binary_frame *reply);
+int reconnect_to_server(server *server_info);
+int serve_again(server *server_info);
+
+/* batch functions */
+double batch_now();
+int route_account(char *name, int num_connections);
+int run_batch(char *server_name, char *port_num, wire_protocol protocol, char *input_path, int num_shards, int shard_connections, long window);
+long read_batch_line(line_reader *reader, char line[263], batch_connection *connections, int num_connections);
+void flush_batch_connection(batch_connection *conn);
+void batch_send(batch_connection *conn, char line[263], client_command *parsed, long line_num);
+void * batch_receiver_runner(void *arg);
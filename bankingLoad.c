@@ -0,0 +1,1400 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <poll.h>
+#include <math.h>
+#include "protocol.h"
+
+/**************************************************************
+ * Banking Load Generator
+ *
+ * drives a running bankingServer over the wire and reports
+ * throughput and bytes on the wire per operation
+ *
+ * usage: bankingLoad [-d depth] <server> <port> [ops]
+ *        bankingLoad -C connections [-j jobs] <server> <port>
+ *        bankingLoad -n connections [-t threads] [-p text|binary] [-x mix]
+ *                    [-d depth | -r rate] [-T seconds] [-s seed] [-f script]
+ *                    [-S shards] [-H] [-I] [-P primary_port] <server> <port>
+ *        bankingLoad -R replica_port [-H] <server> <port> [probes]
+ *
+ * opens one connection per protocol; each creates and serves
+ * its own account, then alternates deposit and query requests,
+ * keeping up to depth requests in flight (default 1, which waits
+ * for every reply before sending the next request)
+ *
+ * with -C, instead opens that many short-lived connections from
+ * jobs threads at once; each sends one request, waits for the
+ * reply and closes, and the time from connect() to the reply is
+ * reported as accept-to-first-response latency
+ *
+ * with -n, instead runs a workload over that many connections
+ * spread across threads (default 1) for seconds (default 10):
+ * 	each connection creates an account of its own, then sends
+ * 	requests picked by a seeded generator (-s, default 1) from
+ * 	the mix (-x, "op:weight,..." over create, serve, deposit,
+ * 	withdraw, query and end); a request the session state would
+ * 	reject is swapped for serve or end, so every request is valid
+ * 	closed loop keeps depth requests in flight per connection;
+ * 	open loop (-r) sends rate requests per second over all
+ * 	connections at exponentially spaced times, and measures
+ * 	latency from when each request was due, so a slow server
+ * 	can't hide its queueing delay by slowing the sender down
+ * 	a script (-f) replaces the generator: every connection sends
+ * 	the script's command lines once, in order, with {c} in a name
+ * 	replaced by the connection number and {r} by a per-run id
+ * 	throughput and p50/p99/p999 latency are reported per op from
+ * 	HdrHistogram-style log-linear histograms; -H also prints the
+ * 	full percentile distribution of every op
+ * 	with -S, the server is sharded (bankingServer -S) with shard i
+ * 	listening on port + i; connection c talks to shard c % shards
+ * 	and only names accounts that shard owns, so running the same
+ * 	workload against 1, 2, 4... shards shows how throughput scales
+ * 	with -I, every binary request carries a client id of its
+ * 	connection, as a client that retries would send, so the server
+ * 	remembers each change in its dedup cache; comparing runs with
+ * 	and without -I shows what the cache costs
+ * 	with -P, the server is a read-only replica (bankingServer -F)
+ * 	of the primary listening on primary_port: each account is
+ * 	created on the primary, and the workload starts once the
+ * 	replica can serve all of them; a mix of serve, query and end
+ * 	(-x) then measures reads off the replica, to compare with the
+ * 	same mix run against the primary
+ *
+ * with -R, instead measures how far a replica listening on
+ * replica_port lags the primary at <server> <port>: each probe
+ * (default 1000) deposits a cent on the primary and, once the
+ * primary has answered, queries the replica until the balance
+ * shows it; the time until it does is reported as replication lag
+ ***************************************************************/
+
+typedef struct load_result load_result;
+struct load_result {
+	double seconds;		//time spent on the timed operations
+	size_t bytes_sent;	//request bytes of the timed operations
+	size_t bytes_received;	//reply bytes of the timed operations
+};
+
+double now();
+int connect_to_server(char *server_name, char *port_num);
+void send_all(int sockfd, void *buffer, size_t size);
+void recv_all(int sockfd, void *buffer, size_t size);
+size_t text_request(int sockfd, char *command);
+size_t binary_request(int sockfd, db_command command, char *name, int64_t amount, uint32_t request_id);
+size_t build_request(wire_protocol protocol, long i, char *buffer);
+void run_load(char *server_name, char *port_num, wire_protocol protocol, long ops, long depth, load_result *result);
+void print_result(char *protocol, long ops, load_result *result);
+void * churn_runner(void *arg);
+void run_churn(char *server_name, char *port_num, long num_connections, int num_jobs);
+int compare_doubles(const void *a, const void *b);
+
+/* ops the workload can send are the db_commands up to END */
+#define NUM_LOAD_OPS (END + 1)
+
+/* requests one connection may have in flight */
+#define MAX_IN_FLIGHT 1024
+
+/* requests built before each send */
+#define SEND_BATCH 64
+
+/* largest request frame of either protocol */
+#define LOAD_FRAME_SIZE (sizeof(binary_frame) + 255)
+
+/* latencies in nanoseconds are kept HdrHistogram style: bucket b > 0 holds values with
+ * b + HISTOGRAM_SUB_BITS significant bits in HISTOGRAM_SUB_BUCKETS / 2 linear steps of 2^b,
+ * so every value is kept to within 1/64 of itself, in fixed memory */
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (64 - HISTOGRAM_SUB_BITS + 1)
+
+typedef struct latency_histogram latency_histogram;
+struct latency_histogram {
+	uint64_t counts[HISTOGRAM_BUCKETS][HISTOGRAM_SUB_BUCKETS];
+	uint64_t total;			//values recorded
+	uint64_t max;			//largest value recorded
+};
+
+/* one command line of a script */
+typedef struct script_line script_line;
+struct script_line {
+	db_command command;
+	char name[256];			//account name for create and serve; may hold {c} and {r}
+	money amount;			//amount in cents for deposit and withdraw
+};
+
+/* what the workload sends and how */
+typedef struct workload workload;
+struct workload {
+	char *server_name;
+	char *port_num;
+	wire_protocol protocol;
+	int mix[NUM_LOAD_OPS];		//relative weight of each op
+	int mix_total;			//sum of the weights
+	long depth;			//closed loop: requests in flight per connection
+	double rate;			//open loop: requests per second over all connections; 0 for closed loop
+	int num_connections;		//connections over all threads
+	int num_shards;			//shards of the server, listening on consecutive ports
+	double seconds;			//how long to send for; a script runs to its end instead
+	unsigned int seed;		//seed of the request generator
+	int run_id;			//makes account names unique to this run
+	int idempotent;			//send client ids with binary requests (see protocol.h)
+	char *primary_port;		//port of the primary the server replicates; NULL unless -P
+	script_line *script;		//NULL unless replaying a script
+	long script_len;
+};
+
+/* one connection of the workload */
+typedef struct load_connection load_connection;
+struct load_connection {
+	int sockfd;
+	int number;				//connection number over all threads
+	int shard;				//shard the connection talks to
+	char own_name[64];			//account the connection serves
+	unsigned int seed;			//rand_r state of the generator
+	int in_session;				//whether the requests sent so far leave it in a session
+	long accounts_created;			//accounts made by create so far
+	long script_pos;			//next script line
+	int done;				//nothing left to send
+	double next_send;			//open loop: when the next request is due
+	uint64_t due[MAX_IN_FLIGHT];		//ns time each request in flight was due, oldest at head
+	db_command ops[MAX_IN_FLIGHT];		//op of each request in flight
+	long head;				//requests answered so far
+	long tail;				//requests sent so far
+	char reply[TEXT_REPLY_SIZE];		//start of a reply that has not fully arrived
+	size_t reply_len;
+};
+
+/* work and results of one workload thread */
+typedef struct load_thread load_thread;
+struct load_thread {
+	pthread_t id;
+	workload *work;
+	load_connection *connections;
+	int num_connections;
+	latency_histogram *histograms;		//one per op, then one over every op
+	long errors[NUM_LOAD_OPS];		//requests the server answered with an error
+};
+
+uint64_t now_ns();
+int find_load_op(char *name, size_t len);
+int parse_mix(char *mix_string, workload *work);
+script_line* load_script(char *path, long *script_len);
+void histogram_record(latency_histogram *histogram, uint64_t value);
+void histogram_add(latency_histogram *to, latency_histogram *from);
+uint64_t highest_equivalent(latency_histogram *histogram, int bucket, int sub);
+uint64_t histogram_percentile(latency_histogram *histogram, double percentile);
+void print_distribution(latency_histogram *histogram);
+size_t encode_load_request(wire_protocol protocol, db_command command, char *name, money amount, uint32_t request_id, uint64_t client_id, char *buffer);
+void expand_name(char name[256], char *pattern, workload *work, load_connection *conn);
+void shard_account_name(char name[64], workload *work, load_connection *conn, char *kind, long *counter);
+int next_request(workload *work, load_connection *conn, db_command *command, char name[256], money *amount);
+double send_due_requests(load_thread *thread, load_connection *conn, double t);
+void take_replies(load_thread *thread, load_connection *conn);
+void * workload_runner(void *arg);
+void print_workload_row(char *name, latency_histogram *histogram, long errors);
+void run_workload(workload *work, int num_threads, int full_distribution);
+int load_request(int sockfd, wire_protocol protocol, db_command command, char *name, money amount, money *balance);
+void wait_for_replica(int sockfd, wire_protocol protocol, char *name);
+void run_lag_probe(char *server_name, char *port_num, char *replica_port, long probes, int full_distribution);
+
+/* work of one churn thread */
+typedef struct churn_args churn_args;
+struct churn_args {
+	pthread_t id;
+	char *server_name;
+	char *port_num;
+	long num_connections;		//connections this thread opens
+	double *latencies;		//seconds from connect() to reply, one per connection
+};
+
+int main(int argc, char **argv)
+{
+	long depth = 1;
+	long churn_connections = 0;
+	int churn_jobs = 1;
+
+	workload work;
+	memset(&work, 0, sizeof(work));
+	work.protocol = PROTOCOL_BINARY;
+	work.seconds = 10;
+	work.seed = 1;
+	work.num_shards = 1;
+	parse_mix("create:1,serve:5,deposit:40,withdraw:20,query:30,end:4", &work);
+	int num_threads = 1;
+	int full_distribution = 0;
+	char *script_path = NULL;
+	char *replica_port = NULL;
+	int usage_error = 0;
+
+	int opt;
+	while((opt = getopt(argc, argv, "d:C:j:n:t:p:x:r:T:s:f:S:HIP:R:")) != -1) {
+		switch(opt) {
+			case 'd':
+				depth = atol(optarg);
+				break;
+			case 'C':
+				churn_connections = atol(optarg);
+				break;
+			case 'j':
+				churn_jobs = atoi(optarg);
+				break;
+			case 'n':
+				work.num_connections = atoi(optarg);
+				break;
+			case 't':
+				num_threads = atoi(optarg);
+				break;
+			case 'p':
+				if(strcmp(optarg, "text") == 0) work.protocol = PROTOCOL_TEXT;
+				else if(strcmp(optarg, "binary") == 0) work.protocol = PROTOCOL_BINARY;
+				else usage_error = 1;
+				break;
+			case 'x':
+				if(parse_mix(optarg, &work) == -1) usage_error = 1;
+				break;
+			case 'r':
+				work.rate = atof(optarg);
+				break;
+			case 'T':
+				work.seconds = atof(optarg);
+				break;
+			case 's':
+				work.seed = strtoul(optarg, NULL, 10);
+				break;
+			case 'f':
+				script_path = optarg;
+				break;
+			case 'S':
+				work.num_shards = atoi(optarg);
+				break;
+			case 'H':
+				full_distribution = 1;
+				break;
+			case 'I':
+				work.idempotent = 1;
+				break;
+			case 'P':
+				work.primary_port = optarg;
+				break;
+			case 'R':
+				replica_port = optarg;
+				break;
+			default:
+				usage_error = 1;
+		}
+	}
+
+	int num_args = argc - optind;
+	if(usage_error || depth < 1 || depth > MAX_IN_FLIGHT || churn_jobs < 1 || num_threads < 1 || work.rate < 0
+			|| work.num_shards < 1 || (work.primary_port && (work.num_shards > 1 || work.script)) || num_args < 2 || num_args > 3) {
+		fprintf(stderr, "usage: %s [-d depth] <server> <port> [ops]\n"
+				"       %s -C connections [-j jobs] <server> <port>\n"
+				"       %s -n connections [-t threads] [-p text|binary] [-x mix]\n"
+				"                   [-d depth | -r rate] [-T seconds] [-s seed] [-f script] [-S shards] [-H] [-I]\n"
+				"                   [-P primary_port] <server> <port>\n"
+				"       %s -R replica_port [-H] <server> <port> [probes]\n",
+				argv[0], argv[0], argv[0], argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	char *server_name = argv[optind];
+	char *port_num = argv[optind + 1];
+
+	if(work.num_connections > 0) {
+		work.server_name = server_name;
+		work.port_num = port_num;
+		work.depth = depth;
+		work.run_id = getpid();
+		if(num_threads > work.num_connections) num_threads = work.num_connections;
+
+		if(script_path) {
+			work.script = load_script(script_path, &work.script_len);
+			if(!work.script) exit(EXIT_FAILURE);
+		}
+
+		run_workload(&work, num_threads, full_distribution);
+		free(work.script);
+		return 0;
+	}
+
+	if(replica_port) {
+		run_lag_probe(server_name, port_num, replica_port, (num_args == 3) ? atol(argv[optind + 2]) : 1000, full_distribution);
+		return 0;
+	}
+
+	if(churn_connections > 0) {
+		run_churn(server_name, port_num, churn_connections, churn_jobs);
+		return 0;
+	}
+	long ops = (num_args == 3) ? atol(argv[optind + 2]) : 100000;
+
+	load_result text, binary;
+	run_load(server_name, port_num, PROTOCOL_TEXT, ops, depth, &text);
+	run_load(server_name, port_num, PROTOCOL_BINARY, ops, depth, &binary);
+
+	printf("pipeline depth %ld\n", depth);
+	printf("%-8s %12s %12s %12s\n", "protocol", "ops/s", "us/op", "bytes/op");
+	print_result("text", ops, &text);
+	print_result("binary", ops, &binary);
+
+	return 0;
+}
+
+/* @return current monotonic time in seconds */
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* connect to the server, exiting on failure
+ *
+ * @param1 server_name the domain name for the server
+ * @param2 port_num the string representation of the port number
+ *
+ * @return file descriptor of the connected socket
+ */
+int connect_to_server(char *server_name, char *port_num)
+{
+	struct addrinfo hints, *server_addr_info;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	int ret = getaddrinfo(server_name, port_num, &hints, &server_addr_info);
+	if(ret != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+
+	int sockfd = socket(server_addr_info->ai_family, server_addr_info->ai_socktype, server_addr_info->ai_protocol);
+	if(sockfd == -1 || connect(sockfd, server_addr_info->ai_addr, server_addr_info->ai_addrlen) == -1) {
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+
+	freeaddrinfo(server_addr_info);
+
+	//requests are small and sent one at a time, so don't let Nagle hold them back
+	int one = 1;
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	return sockfd;
+}
+
+/* send the whole buffer, exiting if the server went away
+ *
+ * @param1 sockfd socket of the server
+ * @param2 buffer bytes to send
+ * @param3 size number of bytes to send
+ */
+void send_all(int sockfd, void *buffer, size_t size)
+{
+	char *ptr = buffer;
+	while(size > 0) {
+		ssize_t ret = send(sockfd, ptr, size, 0);
+		if(ret <= 0) {
+			perror("send");
+			exit(EXIT_FAILURE);
+		}
+		ptr += ret;
+		size -= ret;
+	}
+}
+
+/* receive exactly size bytes, exiting if the server went away
+ *
+ * @param1 sockfd socket of the server
+ * @param2 buffer where to put the bytes
+ * @param3 size number of bytes to receive
+ */
+void recv_all(int sockfd, void *buffer, size_t size)
+{
+	ssize_t ret = recv(sockfd, buffer, size, MSG_WAITALL);
+	if(ret != (ssize_t) size) {
+		fprintf(stderr, "server closed the connection\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* send a text request and wait for its reply
+ *
+ * @param1 sockfd socket of the server
+ * @param2 command the command line to send
+ *
+ * @return bytes sent and received
+ */
+size_t text_request(int sockfd, char *command)
+{
+	char frame[TEXT_FRAME_SIZE] = {'\0'};
+	char reply[TEXT_REPLY_SIZE];
+
+	strncpy(frame, command, sizeof(frame) - 1);
+	send_all(sockfd, frame, sizeof(frame));
+	recv_all(sockfd, reply, sizeof(reply));
+
+	return sizeof(frame) + sizeof(reply);
+}
+
+/* send a binary request and wait for its reply
+ *
+ * @param1 sockfd socket of the server
+ * @param2 command the command to send
+ * @param3 name account name for CREATE and SERVE; NULL otherwise
+ * @param4 amount amount in cents for DEPOSIT and WITHDRAW
+ * @param5 request_id id of the request
+ *
+ * @return bytes sent and received
+ */
+size_t binary_request(int sockfd, db_command command, char *name, int64_t amount, uint32_t request_id)
+{
+	char frame[sizeof(binary_frame) + 255];
+	size_t name_len = name ? strlen(name) : 0;
+
+	binary_frame header;
+	encode_frame(&header, command + 1, 0, name_len, request_id, amount);
+	memcpy(frame, &header, sizeof(header));
+	memcpy(frame + sizeof(header), name, name_len);
+
+	binary_frame reply;
+	send_all(sockfd, frame, sizeof(header) + name_len);
+	recv_all(sockfd, &reply, sizeof(reply));
+
+	return sizeof(header) + name_len + sizeof(reply);
+}
+
+/* put the i-th request of the workload into buffer; even requests deposit, odd ones query
+ *
+ * @param1 protocol protocol of the connection
+ * @param2 i number of the request
+ * @param3 buffer where to put the frame
+ *
+ * @return size of the frame
+ */
+size_t build_request(wire_protocol protocol, long i, char *buffer)
+{
+	if(protocol == PROTOCOL_TEXT) {
+		memset(buffer, 0, TEXT_FRAME_SIZE);
+		strcpy(buffer, (i % 2 == 0) ? "deposit 1.25" : "query");
+		return TEXT_FRAME_SIZE;
+	}
+
+	binary_frame header;
+	encode_frame(&header, ((i % 2 == 0) ? DEPOSIT : QUERY) + 1, 0, 0, i, 125);
+	memcpy(buffer, &header, sizeof(header));
+	return sizeof(header);
+}
+
+/* run the workload over one connection, keeping up to depth requests in flight
+ *
+ * @param1 server_name the domain name for the server
+ * @param2 port_num the string representation of the port number
+ * @param3 protocol protocol to speak
+ * @param4 ops number of timed operations
+ * @param5 depth number of requests sent before waiting for replies
+ * @param6 result where to put the result
+ */
+void run_load(char *server_name, char *port_num, wire_protocol protocol, long ops, long depth, load_result *result)
+{
+	int sockfd = connect_to_server(server_name, port_num);
+
+	//each connection works on its own account
+	char name[64];
+	snprintf(name, sizeof(name), "load_%d_%d", protocol, getpid());
+	char command[TEXT_FRAME_SIZE];
+
+	if(protocol == PROTOCOL_TEXT) {
+		snprintf(command, sizeof(command), "create %s", name);
+		text_request(sockfd, command);
+		snprintf(command, sizeof(command), "serve %s", name);
+		text_request(sockfd, command);
+	} else {
+		binary_request(sockfd, CREATE, name, 0, 0);
+		binary_request(sockfd, SERVE, name, 0, 0);
+	}
+
+	size_t reply_size = (protocol == PROTOCOL_TEXT) ? TEXT_REPLY_SIZE : sizeof(binary_frame);
+	char *requests = malloc(depth * TEXT_FRAME_SIZE);
+	char *replies = malloc(depth * reply_size);
+	size_t replies_len = 0;
+
+	long sent = 0, received = 0;
+	result->bytes_sent = 0;
+
+	double start = now();
+	while(received < ops) {
+		//top the window up with a single send
+		size_t requests_len = 0;
+		while(sent < ops && sent - received < depth)
+			requests_len += build_request(protocol, sent++, requests + requests_len);
+
+		if(requests_len > 0) send_all(sockfd, requests, requests_len);
+		result->bytes_sent += requests_len;
+
+		//take whatever replies have arrived, waiting for at least one
+		ssize_t ret = recv(sockfd, replies + replies_len, depth * reply_size - replies_len, 0);
+		if(ret <= 0) {
+			fprintf(stderr, "server closed the connection\n");
+			exit(EXIT_FAILURE);
+		}
+
+		replies_len += ret;
+		received += replies_len / reply_size;
+		replies_len %= reply_size;
+
+		//keep the start of a reply that has not fully arrived at the front
+		memmove(replies, replies + ret - replies_len, replies_len);
+	}
+	result->seconds = now() - start;
+	result->bytes_received = ops * reply_size;
+
+	if(protocol == PROTOCOL_TEXT) text_request(sockfd, "end");
+	else binary_request(sockfd, END, NULL, 0, 0);
+
+	free(requests);
+	free(replies);
+	close(sockfd);
+}
+
+/* print one row of the comparison
+ *
+ * @param1 protocol name of the protocol
+ * @param2 ops number of timed operations
+ * @param3 result result of the run
+ */
+void print_result(char *protocol, long ops, load_result *result)
+{
+	printf("%-8s %12.0f %12.2f %12.1f\n", protocol, ops / result->seconds,
+			result->seconds * 1e6 / ops,
+			(double) (result->bytes_sent + result->bytes_received) / ops);
+}
+
+/* thread runner opening short-lived connections one after another;
+ * each sends a QUERY outside of a session, which the server answers
+ * with an error without touching the database
+ *
+ * @param1 arg void pointer to churn_args
+ */
+void * churn_runner(void *arg)
+{
+	churn_args *args = (churn_args*) arg;
+
+	binary_frame request, reply;
+	encode_frame(&request, QUERY + 1, 0, 0, 0, 0);
+
+	long i;
+	for(i = 0; i < args->num_connections; i++) {
+		double start = now();
+
+		int sockfd = connect_to_server(args->server_name, args->port_num);
+		send_all(sockfd, &request, sizeof(request));
+		recv_all(sockfd, &reply, sizeof(reply));
+
+		args->latencies[i] = now() - start;
+
+		close(sockfd);
+	}
+
+	return NULL;
+}
+
+/* open num_connections short-lived connections from num_jobs threads and report
+ * connection rate and accept-to-first-response latency
+ *
+ * @param1 server_name the domain name for the server
+ * @param2 port_num the string representation of the port number
+ * @param3 num_connections connections to open in total
+ * @param4 num_jobs threads opening connections at once
+ */
+void run_churn(char *server_name, char *port_num, long num_connections, int num_jobs)
+{
+	double *latencies = malloc(num_connections * sizeof(double));
+	churn_args *args = calloc(num_jobs, sizeof(churn_args));
+
+	double start = now();
+
+	long first = 0;
+	int i;
+	for(i = 0; i < num_jobs; i++) {
+		args[i].server_name = server_name;
+		args[i].port_num = port_num;
+		args[i].num_connections = num_connections / num_jobs + (i < num_connections % num_jobs);
+		args[i].latencies = latencies + first;
+		first += args[i].num_connections;
+		pthread_create(&args[i].id, NULL, churn_runner, &args[i]);
+	}
+
+	for(i = 0; i < num_jobs; i++) {
+		pthread_join(args[i].id, NULL);
+	}
+
+	double seconds = now() - start;
+
+	qsort(latencies, num_connections, sizeof(double), compare_doubles);
+
+	printf("%ld connections from %d jobs\n", num_connections, num_jobs);
+	printf("%12s %12s %12s %12s %12s\n", "conns/s", "p50 us", "p99 us", "p999 us", "max us");
+	printf("%12.0f %12.1f %12.1f %12.1f %12.1f\n", num_connections / seconds,
+			latencies[num_connections / 2] * 1e6,
+			latencies[num_connections * 99 / 100] * 1e6,
+			latencies[num_connections * 999 / 1000] * 1e6,
+			latencies[num_connections - 1] * 1e6);
+
+	free(args);
+	free(latencies);
+}
+
+/* qsort comparison for doubles in ascending order */
+int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double*) a;
+	double y = *(const double*) b;
+
+	return (x > y) - (x < y);
+}
+
+/* @return current monotonic time in nanoseconds */
+uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* names of the workload ops, in db_command order */
+char *load_op_names[NUM_LOAD_OPS] = {"create", "serve", "deposit", "withdraw", "query", "end"};
+
+/* look up a workload op by name
+ *
+ * @param1 name name of the op
+ * @param2 len length of the name
+ *
+ * @return the op; -1 if there is none by that name
+ */
+int find_load_op(char *name, size_t len)
+{
+	int i;
+	for(i = 0; i < NUM_LOAD_OPS; i++) {
+		if(strlen(load_op_names[i]) == len && strncmp(name, load_op_names[i], len) == 0) return i;
+	}
+
+	return -1;
+}
+
+/* parse an op mix such as "deposit:40,withdraw:20,query:40" into the workload;
+ * ops left out get no weight
+ *
+ * @param1 mix_string the mix
+ * @param2 work pointer in which to put the weights
+ *
+ * @return 0 if successful; -1 if the mix is malformed or has no weight at all
+ */
+int parse_mix(char *mix_string, workload *work)
+{
+	memset(work->mix, 0, sizeof(work->mix));
+	work->mix_total = 0;
+
+	char *entry = mix_string;
+	while(*entry) {
+		char *colon = strchr(entry, ':');
+		if(!colon) return -1;
+
+		int op = find_load_op(entry, colon - entry);
+		if(op == -1) return -1;
+
+		char *end;
+		long weight = strtol(colon + 1, &end, 10);
+		if(end == colon + 1 || weight < 0 || (*end != ',' && *end != '\0')) return -1;
+
+		work->mix[op] = weight;
+		entry = (*end == ',') ? end + 1 : end;
+	}
+
+	int i;
+	for(i = 0; i < NUM_LOAD_OPS; i++) work->mix_total += work->mix[i];
+
+	return work->mix_total > 0 ? 0 : -1;
+}
+
+/* read a script of text command lines ("create acct-{c}", "deposit 12.50", ...);
+ * blank lines and lines starting with '#' are skipped
+ *
+ * @param1 path path of the script
+ * @param2 script_len pointer in which to put the number of lines
+ *
+ * @return the script; NULL if it can't be read or has a line that isn't a command
+ */
+script_line* load_script(char *path, long *script_len)
+{
+	FILE *file = fopen(path, "r");
+	if(!file) {
+		perror(path);
+		return NULL;
+	}
+
+	long capacity = 64;
+	script_line *script = malloc(capacity * sizeof(script_line));
+	*script_len = 0;
+
+	char line[TEXT_FRAME_SIZE + 2];
+	long line_num = 0;
+	while(fgets(line, sizeof(line), file)) {
+		line_num++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if(line[0] == '\0' || line[0] == '#') continue;
+
+		if(*script_len == capacity) {
+			capacity *= 2;
+			script = realloc(script, capacity * sizeof(script_line));
+		}
+		script_line *entry = &script[*script_len];
+		memset(entry, 0, sizeof(script_line));
+
+		char *arg = strchr(line, ' ');
+		int op = find_load_op(line, arg ? (size_t) (arg - line) : strlen(line));
+		if(arg) arg++;
+
+		int valid = (op != -1);
+		if(op == CREATE || op == SERVE) valid = arg && *arg && strlen(arg) < sizeof(entry->name);
+		else if(op == DEPOSIT || op == WITHDRAW) valid = arg && parse_money(arg, &entry->amount);
+		else if(op != -1) valid = !arg;
+
+		if(!valid) {
+			fprintf(stderr, "%s:%ld: not a command: %s\n", path, line_num, line);
+			fclose(file);
+			free(script);
+			return NULL;
+		}
+
+		entry->command = op;
+		if(op == CREATE || op == SERVE) strcpy(entry->name, arg);
+		(*script_len)++;
+	}
+
+	fclose(file);
+	return script;
+}
+
+/* record a value in a histogram
+ *
+ * @param1 histogram the histogram
+ * @param2 value value in nanoseconds
+ */
+void histogram_record(latency_histogram *histogram, uint64_t value)
+{
+	int bucket = 0;
+	if(value >= HISTOGRAM_SUB_BUCKETS) bucket = 64 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+
+	histogram->counts[bucket][value >> bucket]++;
+	histogram->total++;
+	if(value > histogram->max) histogram->max = value;
+}
+
+/* add every value recorded in one histogram to another */
+void histogram_add(latency_histogram *to, latency_histogram *from)
+{
+	int bucket, sub;
+	for(bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+		for(sub = 0; sub < HISTOGRAM_SUB_BUCKETS; sub++) to->counts[bucket][sub] += from->counts[bucket][sub];
+	}
+
+	to->total += from->total;
+	if(from->max > to->max) to->max = from->max;
+}
+
+/* @return largest value that could have been recorded in the bucket, capped at the histogram's max */
+uint64_t highest_equivalent(latency_histogram *histogram, int bucket, int sub)
+{
+	uint64_t value = (((uint64_t) sub + 1) << bucket) - 1;
+	return value < histogram->max ? value : histogram->max;
+}
+
+/* find the value below which a percentage of the recorded values fall
+ *
+ * @param1 histogram the histogram
+ * @param2 percentile percentage from 0 to 100
+ *
+ * @return the value in nanoseconds, to within 1/64 of itself; 0 if nothing was recorded
+ */
+uint64_t histogram_percentile(latency_histogram *histogram, double percentile)
+{
+	uint64_t target = ceil(histogram->total * percentile / 100);
+	if(target == 0) target = 1;
+
+	uint64_t seen = 0;
+	int bucket, sub;
+	for(bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+		for(sub = 0; sub < HISTOGRAM_SUB_BUCKETS; sub++) {
+			seen += histogram->counts[bucket][sub];
+			if(seen >= target) return highest_equivalent(histogram, bucket, sub);
+		}
+	}
+
+	return histogram->max;
+}
+
+/* print every non-empty bucket of a histogram in the layout of HdrHistogram's percentile distribution */
+void print_distribution(latency_histogram *histogram)
+{
+	printf("%12s %14s %12s %14s\n", "value us", "percentile", "total count", "1/(1-pct)");
+
+	uint64_t seen = 0;
+	int bucket, sub;
+	for(bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+		for(sub = 0; sub < HISTOGRAM_SUB_BUCKETS; sub++) {
+			if(histogram->counts[bucket][sub] == 0) continue;
+
+			seen += histogram->counts[bucket][sub];
+			double fraction = (double) seen / histogram->total;
+			printf("%12.3f %14.12f %12lu", highest_equivalent(histogram, bucket, sub) / 1e3, fraction, seen);
+			if(seen < histogram->total) printf(" %14.2f", 1 / (1 - fraction));
+			printf("\n");
+		}
+	}
+}
+
+/* put a request into buffer
+ *
+ * @param1 protocol protocol of the connection
+ * @param2 command the command
+ * @param3 name account name for CREATE and SERVE
+ * @param4 amount amount in cents for DEPOSIT and WITHDRAW
+ * @param5 request_id id of a binary request
+ * @param6 client_id client id of a binary request; 0 for none
+ * @param7 buffer where to put the frame; at least LOAD_FRAME_SIZE bytes
+ *
+ * @return size of the frame
+ */
+size_t encode_load_request(wire_protocol protocol, db_command command, char *name, money amount, uint32_t request_id, uint64_t client_id, char *buffer)
+{
+	int has_name = (command == CREATE || command == SERVE);
+
+	if(protocol == PROTOCOL_TEXT) {
+		memset(buffer, 0, TEXT_FRAME_SIZE);
+
+		if(has_name) {
+			snprintf(buffer, TEXT_FRAME_SIZE, "%s %s", load_op_names[command], name);
+		} else if(command == DEPOSIT || command == WITHDRAW) {
+			char amount_string[MONEY_STRING_SIZE];
+			format_money(amount, amount_string);
+			snprintf(buffer, TEXT_FRAME_SIZE, "%s %s", load_op_names[command], amount_string);
+		} else {
+			strcpy(buffer, load_op_names[command]);
+		}
+
+		return TEXT_FRAME_SIZE;
+	}
+
+	size_t name_len = has_name ? strlen(name) : 0;
+
+	binary_frame header;
+	encode_frame(&header, command + 1, 0, name_len, request_id, amount);
+	header.account_id = htobe64(client_id);
+	memcpy(buffer, &header, sizeof(header));
+	memcpy(buffer + sizeof(header), name, name_len);
+
+	return sizeof(header) + name_len;
+}
+
+/* copy a script name, replacing {c} with the connection number and {r} with the run id
+ *
+ * @param1 name pointer in which to put the name
+ * @param2 pattern the name in the script
+ * @param3 work the workload
+ * @param4 conn the connection sending it
+ */
+void expand_name(char name[256], char *pattern, workload *work, load_connection *conn)
+{
+	size_t len = 0;
+	while(*pattern && len < 255) {
+		if(strncmp(pattern, "{c}", 3) == 0 || strncmp(pattern, "{r}", 3) == 0) {
+			int value = (pattern[1] == 'c') ? conn->number : work->run_id;
+			len += snprintf(name + len, 256 - len, "%d", value);
+			if(len > 255) len = 255;
+			pattern += 3;
+		} else {
+			name[len++] = *pattern++;
+		}
+	}
+
+	name[len] = '\0';
+}
+
+/* name an account the connection's shard owns, "load-<run>-<conn>-<kind>-<n>", counting
+ * n up from *counter until account_shard() agrees; with one shard the first name does
+ *
+ * @param1 name pointer in which to put the name
+ * @param2 work the workload
+ * @param3 conn the connection
+ * @param4 kind part of the name telling the connection's accounts apart
+ * @param5 counter where to start n; left one past the n used
+ */
+void shard_account_name(char name[64], workload *work, load_connection *conn, char *kind, long *counter)
+{
+	do {
+		snprintf(name, 64, "load-%d-%d-%s-%ld", work->run_id, conn->number, kind, (*counter)++);
+	} while((int) account_shard(name, work->num_shards) != conn->shard);
+}
+
+/* pick the next request of a connection, from its script or from the mix; a mix op
+ * the session state would reject is swapped: outside a session for SERVE of the
+ * connection's own account, inside one for END
+ *
+ * @param1 work the workload
+ * @param2 conn the connection
+ * @param3 command pointer in which to put the command
+ * @param4 name pointer in which to put the account name of CREATE and SERVE
+ * @param5 amount pointer in which to put the amount of DEPOSIT and WITHDRAW
+ *
+ * @return 1 if there is a request; 0 once a script has run out
+ */
+int next_request(workload *work, load_connection *conn, db_command *command, char name[256], money *amount)
+{
+	if(work->script) {
+		if(conn->script_pos == work->script_len) return 0;
+
+		script_line *line = &work->script[conn->script_pos++];
+		*command = line->command;
+		*amount = line->amount;
+		expand_name(name, line->name, work, conn);
+		return 1;
+	}
+
+	int pick = rand_r(&conn->seed) % work->mix_total;
+	int op = 0;
+	while(pick >= work->mix[op]) pick -= work->mix[op++];
+
+	if(!conn->in_session && op != CREATE && op != SERVE) op = SERVE;
+	else if(conn->in_session && (op == CREATE || op == SERVE)) op = END;
+
+	*command = op;
+	*amount = 0;
+
+	switch(op) {
+		case CREATE:
+			shard_account_name(name, work, conn, "new", &conn->accounts_created);
+			break;
+		case SERVE:
+			strcpy(name, conn->own_name);
+			conn->in_session = 1;
+			break;
+		case DEPOSIT:
+		case WITHDRAW:
+			*amount = 1 + rand_r(&conn->seed) % 10000;
+			break;
+		case END:
+			conn->in_session = 0;
+			break;
+	}
+
+	return 1;
+}
+
+/* send every request of a connection that is due, batched into as few sends as possible;
+ * closed loop tops the connection up to depth requests in flight, open loop sends the
+ * requests whose time has come
+ *
+ * @param1 thread the thread owning the connection
+ * @param2 conn the connection
+ * @param3 t current time in seconds
+ *
+ * @return time the next request is due; 0 if none is waiting on the clock
+ */
+double send_due_requests(load_thread *thread, load_connection *conn, double t)
+{
+	workload *work = thread->work;
+	long limit = (work->rate > 0) ? MAX_IN_FLIGHT : work->depth;
+	double interval = (work->rate > 0) ? work->num_connections / work->rate : 0;
+
+	char frames[SEND_BATCH * LOAD_FRAME_SIZE];
+	char name[256];
+
+	while(!conn->done && conn->tail - conn->head < limit) {
+		size_t len = 0;
+		int batched = 0;
+
+		while(batched < SEND_BATCH && conn->tail - conn->head < limit) {
+			if(work->rate > 0 && conn->next_send > t) break;
+
+			db_command command;
+			money amount;
+			if(!next_request(work, conn, &command, name, &amount)) {
+				conn->done = 1;
+				break;
+			}
+
+			//open loop latency runs from when the request was due, even if it is sent late
+			double due = t;
+			if(work->rate > 0) {
+				due = conn->next_send;
+				conn->next_send -= log(1 - rand_r(&conn->seed) / (RAND_MAX + 1.0)) * interval;
+			}
+
+			long slot = conn->tail % MAX_IN_FLIGHT;
+			conn->due[slot] = due * 1e9;
+			conn->ops[slot] = command;
+			conn->tail++;
+
+			//ids unique to the run and the connection, as each connection stands for a client
+			uint64_t client_id = work->idempotent ? ((uint64_t) work->run_id << 32 | (conn->number + 1)) : 0;
+			len += encode_load_request(work->protocol, command, name, amount, conn->tail, client_id, frames + len);
+			batched++;
+		}
+
+		if(len == 0) break;
+		send_all(conn->sockfd, frames, len);
+	}
+
+	return (work->rate > 0 && !conn->done) ? conn->next_send : 0;
+}
+
+/* take whatever replies have arrived on a connection without waiting, recording their latency
+ *
+ * @param1 thread the thread owning the connection
+ * @param2 conn the connection
+ */
+void take_replies(load_thread *thread, load_connection *conn)
+{
+	size_t reply_size = (thread->work->protocol == PROTOCOL_TEXT) ? TEXT_REPLY_SIZE : sizeof(binary_frame);
+	char buffer[MAX_IN_FLIGHT * sizeof(binary_frame)];
+
+	//finish the reply that had only partly arrived first
+	memcpy(buffer, conn->reply, conn->reply_len);
+
+	ssize_t ret = recv(conn->sockfd, buffer + conn->reply_len, sizeof(buffer) - conn->reply_len, MSG_DONTWAIT);
+	if(ret == 0 || (ret == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+		fprintf(stderr, "server closed the connection\n");
+		exit(EXIT_FAILURE);
+	}
+	if(ret == -1) return;
+
+	size_t len = conn->reply_len + ret;
+	uint64_t t = now_ns();
+
+	size_t offset;
+	for(offset = 0; offset + reply_size <= len; offset += reply_size) {
+		long slot = conn->head % MAX_IN_FLIGHT;
+		db_command command = conn->ops[slot];
+		conn->head++;
+
+		int failed;
+		if(reply_size == TEXT_REPLY_SIZE) {
+			failed = strncmp(buffer + offset, "ERROR", 5) == 0;
+		} else {
+			binary_frame *reply = (binary_frame*) (buffer + offset);
+			failed = reply->status != 0;
+		}
+		thread->errors[command] += failed;
+
+		uint64_t latency = (t > conn->due[slot]) ? t - conn->due[slot] : 0;
+		histogram_record(&thread->histograms[command], latency);
+		histogram_record(&thread->histograms[NUM_LOAD_OPS], latency);
+	}
+
+	conn->reply_len = len - offset;
+	memcpy(conn->reply, buffer + offset, conn->reply_len);
+}
+
+/* thread runner driving its share of the workload's connections until time is up
+ * or, with a script, until every connection has sent the whole script; then waits
+ * for the replies still in flight
+ *
+ * @param1 arg void pointer to load_thread
+ */
+void * workload_runner(void *arg)
+{
+	load_thread *thread = (load_thread*) arg;
+	workload *work = thread->work;
+
+	struct pollfd *polls = calloc(thread->num_connections, sizeof(struct pollfd));
+	double start = now();
+	double stop = start + work->seconds;
+
+	int i;
+	for(i = 0; i < thread->num_connections; i++) {
+		load_connection *conn = &thread->connections[i];
+		if(work->rate > 0) conn->next_send = start - log(1 - rand_r(&conn->seed) / (RAND_MAX + 1.0)) * work->num_connections / work->rate;
+		polls[i].fd = conn->sockfd;
+		polls[i].events = POLLIN;
+	}
+
+	while(1) {
+		double t = now();
+		int sending = work->script || t < stop;
+		double next_due = work->script ? t + 1 : stop;
+		long in_flight = 0;
+		int done = 1;
+
+		for(i = 0; i < thread->num_connections; i++) {
+			load_connection *conn = &thread->connections[i];
+			if(!sending) conn->done = 1;
+
+			double due = send_due_requests(thread, conn, t);
+			if(due > 0 && due < next_due) next_due = due;
+
+			in_flight += conn->tail - conn->head;
+			done = done && conn->done;
+		}
+
+		if(done && in_flight == 0) break;
+
+		//wake for replies, or for the next request due on the clock
+		double wait = (in_flight > 0 && !sending) ? 1 : next_due - now();
+		if(wait < 0) wait = 0;
+
+		struct timespec timeout;
+		timeout.tv_sec = wait;
+		timeout.tv_nsec = (wait - timeout.tv_sec) * 1e9;
+
+		int ret = ppoll(polls, thread->num_connections, &timeout, NULL);
+		if(ret <= 0) continue;
+
+		for(i = 0; i < thread->num_connections; i++) {
+			if(polls[i].revents) take_replies(thread, &thread->connections[i]);
+		}
+	}
+
+	free(polls);
+
+	return NULL;
+}
+
+/* print one row of the workload results
+ *
+ * @param1 name name of the op
+ * @param2 histogram latencies of the op
+ * @param3 errors requests of the op the server answered with an error
+ */
+void print_workload_row(char *name, latency_histogram *histogram, long errors)
+{
+	printf("%-8s %10lu %10ld %10.1f %10.1f %10.1f %10.1f\n", name, histogram->total, errors,
+			histogram_percentile(histogram, 50) / 1e3,
+			histogram_percentile(histogram, 99) / 1e3,
+			histogram_percentile(histogram, 99.9) / 1e3,
+			histogram->max / 1e3);
+}
+
+/* connect the workload's connections, run them from num_threads threads and report
+ * throughput and latency per op
+ *
+ * @param1 work the workload
+ * @param2 num_threads threads sharing the connections
+ * @param3 full_distribution whether to also print the percentile distribution of every op
+ */
+void run_workload(workload *work, int num_threads, int full_distribution)
+{
+	load_connection *connections = calloc(work->num_connections, sizeof(load_connection));
+	load_thread *threads = calloc(num_threads, sizeof(load_thread));
+
+	//against a replica, accounts are made on its primary
+	int primary_sockfd = work->primary_port ? connect_to_server(work->server_name, work->primary_port) : -1;
+
+	//each connection makes its own account before timing starts, so SERVE always finds one
+	int i;
+	for(i = 0; i < work->num_connections; i++) {
+		load_connection *conn = &connections[i];
+		conn->number = i;
+		conn->shard = i % work->num_shards;
+		conn->seed = work->seed * 1000003 + i;
+
+		char shard_port[16];
+		snprintf(shard_port, sizeof(shard_port), "%d", atoi(work->port_num) + conn->shard);
+		conn->sockfd = connect_to_server(work->server_name, shard_port);
+
+		if(work->script) continue;
+
+		long attempts = 0;
+		shard_account_name(conn->own_name, work, conn, "own", &attempts);
+		if(primary_sockfd != -1) {
+			load_request(primary_sockfd, work->protocol, CREATE, conn->own_name, 0, NULL);
+		} else if(work->protocol == PROTOCOL_TEXT) {
+			char command[TEXT_FRAME_SIZE];
+			snprintf(command, sizeof(command), "create %s", conn->own_name);
+			text_request(conn->sockfd, command);
+		} else {
+			binary_request(conn->sockfd, CREATE, conn->own_name, 0, 0);
+		}
+	}
+
+	//the last account made reaches the replica last, but every connection checks its own
+	if(primary_sockfd != -1) {
+		for(i = 0; i < work->num_connections; i++) wait_for_replica(connections[i].sockfd, work->protocol, connections[i].own_name);
+		close(primary_sockfd);
+	}
+
+	double start = now();
+
+	int first = 0;
+	for(i = 0; i < num_threads; i++) {
+		threads[i].work = work;
+		threads[i].num_connections = work->num_connections / num_threads + (i < work->num_connections % num_threads);
+		threads[i].connections = connections + first;
+		threads[i].histograms = calloc(NUM_LOAD_OPS + 1, sizeof(latency_histogram));
+		first += threads[i].num_connections;
+		pthread_create(&threads[i].id, NULL, workload_runner, &threads[i]);
+	}
+
+	latency_histogram *histograms = calloc(NUM_LOAD_OPS + 1, sizeof(latency_histogram));
+	long errors[NUM_LOAD_OPS] = {0};
+
+	int op;
+	for(i = 0; i < num_threads; i++) {
+		pthread_join(threads[i].id, NULL);
+
+		for(op = 0; op <= NUM_LOAD_OPS; op++) histogram_add(&histograms[op], &threads[i].histograms[op]);
+		for(op = 0; op < NUM_LOAD_OPS; op++) errors[op] += threads[i].errors[op];
+		free(threads[i].histograms);
+	}
+
+	double seconds = now() - start;
+
+	printf("%d connections on %d threads to %d shard%s, %s protocol, ", work->num_connections, num_threads,
+			work->num_shards, work->num_shards == 1 ? "" : "s", work->protocol == PROTOCOL_TEXT ? "text" : "binary");
+	if(work->script) printf("script of %ld commands\n", work->script_len);
+	else if(work->rate > 0) printf("open loop at %.0f ops/s, seed %u\n", work->rate, work->seed);
+	else printf("closed loop at depth %ld, seed %u\n", work->depth, work->seed);
+	if(work->idempotent) printf("requests carry client ids\n");
+	if(work->primary_port) printf("replica of the primary on port %s\n", work->primary_port);
+
+	long total_errors = 0;
+	printf("%-8s %10s %10s %10s %10s %10s %10s\n", "op", "count", "errors", "p50 us", "p99 us", "p999 us", "max us");
+	for(op = 0; op < NUM_LOAD_OPS; op++) {
+		if(histograms[op].total == 0) continue;
+		print_workload_row(load_op_names[op], &histograms[op], errors[op]);
+		total_errors += errors[op];
+	}
+	print_workload_row("all", &histograms[NUM_LOAD_OPS], total_errors);
+
+	printf("%.0f ops/s over %.2f s\n", histograms[NUM_LOAD_OPS].total / seconds, seconds);
+
+	if(full_distribution) {
+		for(op = 0; op < NUM_LOAD_OPS; op++) {
+			if(histograms[op].total == 0) continue;
+			printf("\n%s\n", load_op_names[op]);
+			print_distribution(&histograms[op]);
+		}
+	}
+
+	for(i = 0; i < work->num_connections; i++) close(connections[i].sockfd);
+
+	free(histograms);
+	free(threads);
+	free(connections);
+}
+
+/* send one request and wait for its reply
+ *
+ * @param1 sockfd socket of the server
+ * @param2 protocol protocol of the connection
+ * @param3 command the command to send
+ * @param4 name account name for CREATE and SERVE
+ * @param5 amount amount in cents for DEPOSIT and WITHDRAW
+ * @param6 balance pointer in which to put the balance a binary QUERY returns; may be NULL
+ *
+ * @return 0 if the request succeeded; its error code, or -1 for a text error, otherwise
+ */
+int load_request(int sockfd, wire_protocol protocol, db_command command, char *name, money amount, money *balance)
+{
+	char frame[LOAD_FRAME_SIZE];
+	size_t len = encode_load_request(protocol, command, name, amount, 0, 0, frame);
+	send_all(sockfd, frame, len);
+
+	if(protocol == PROTOCOL_TEXT) {
+		char reply[TEXT_REPLY_SIZE];
+		recv_all(sockfd, reply, sizeof(reply));
+		return strncmp(reply, "ERROR", 5) == 0 ? -1 : 0;
+	}
+
+	binary_frame reply;
+	recv_all(sockfd, &reply, sizeof(reply));
+	decode_frame(&reply);
+	if(balance) *balance = reply.amount;
+
+	return reply.status;
+}
+
+/* wait until a replica has an account made on its primary, leaving the connection out of session
+ *
+ * @param1 sockfd socket of the replica
+ * @param2 protocol protocol of the connection
+ * @param3 name the account
+ */
+void wait_for_replica(int sockfd, wire_protocol protocol, char *name)
+{
+	while(load_request(sockfd, protocol, SERVE, name, 0, NULL) != 0) usleep(1000);
+	load_request(sockfd, protocol, END, NULL, 0, NULL);
+}
+
+/* measure how long a change acknowledged by the primary takes to show on its replica
+ *
+ * @param1 server_name the domain name of the primary and the replica
+ * @param2 port_num port of the primary
+ * @param3 replica_port port of the replica
+ * @param4 probes number of changes to time
+ * @param5 full_distribution whether to also print the percentile distribution
+ */
+void run_lag_probe(char *server_name, char *port_num, char *replica_port, long probes, int full_distribution)
+{
+	int primary_sockfd = connect_to_server(server_name, port_num);
+	int replica_sockfd = connect_to_server(server_name, replica_port);
+
+	char name[64];
+	snprintf(name, sizeof(name), "lag-%d", getpid());
+	if(load_request(primary_sockfd, PROTOCOL_BINARY, CREATE, name, 0, NULL) != 0) {
+		fprintf(stderr, "failed to create %s on the primary\n", name);
+		exit(EXIT_FAILURE);
+	}
+	load_request(primary_sockfd, PROTOCOL_BINARY, SERVE, name, 0, NULL);
+
+	wait_for_replica(replica_sockfd, PROTOCOL_BINARY, name);
+	load_request(replica_sockfd, PROTOCOL_BINARY, SERVE, name, 0, NULL);
+
+	latency_histogram *histogram = calloc(1, sizeof(latency_histogram));
+	long queries = 0;
+	long behind = 0;
+
+	long i;
+	for(i = 1; i <= probes; i++) {
+		load_request(primary_sockfd, PROTOCOL_BINARY, DEPOSIT, NULL, 1, NULL);
+		uint64_t start = now_ns();
+
+		//a replica further behind than it promised answers with an error instead of a balance
+		money balance = 0;
+		while(1) {
+			int status = load_request(replica_sockfd, PROTOCOL_BINARY, QUERY, NULL, 0, &balance);
+			queries++;
+			behind += status != 0;
+			if(status == 0 && balance >= i) break;
+		}
+
+		histogram_record(histogram, now_ns() - start);
+	}
+
+	load_request(replica_sockfd, PROTOCOL_BINARY, END, NULL, 0, NULL);
+	load_request(primary_sockfd, PROTOCOL_BINARY, END, NULL, 0, NULL);
+	close(replica_sockfd);
+	close(primary_sockfd);
+
+	printf("replication lag of %ld deposits, %.1f queries each, %ld answered as behind\n", probes, (double) queries / probes, behind);
+	printf("%-8s %10s %10s %10s %10s %10s %10s\n", "op", "count", "errors", "p50 us", "p99 us", "p999 us", "max us");
+	print_workload_row("lag", histogram, 0);
+
+	if(full_distribution) {
+		printf("\nlag\n");
+		print_distribution(histogram);
+	}
+
+	free(histogram);
+}
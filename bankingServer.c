@@ -1,99 +1,392 @@
 #include "bankingServer.h"
+#include <errno.h>
 
 /******************************************************************************
  * Banking Server
  *
  * main:
- * 	set signal handlers for SIGALRM and SIGINT
+ * 	set signal handlers for SIGINT and SIGUSR1
+ * 	open the storage engine keeping the accounts (-E; see storage.c)
+ * 	restore the database from its snapshot and log (-l)
+ * 	change balances with compare-and-swap instead of locks (-a; see database.c)
+ * 	spawn checkpoint_runner to take snapshots (-s; see snapshot.c)
+ * 	spawn report_runner to report every account (-r, -o, -f; see report.c),
+ * 	on a timer and on every SIGUSR1
+ * 	hold only the accounts of one shard of several (-S index/count)
+ * 	spawn metrics_runner to serve counters over HTTP (-m; see metrics.c)
+ * 	remember recent results for clients that retry (-D; see dedup.c)
+ * 	close clients left idle, or holding an account unused, too long (-I, -L;
+ * 	see eventLoop.c)
+ * 	spawn replication_runner to ship the log to read-only replicas (-R),
+ * 	or copy the accounts of a primary and spawn follow_runner to apply
+ * 	its log as a replica (-F; see replication.c)
  * 	bind server to socket
- * 	spawn request_acceptance_runner thread
+ * 	run the epoll event loop until SIGINT
  *
- * request_acceptance_runner:
- * 	listens for new requests coming through the socket
- * 	spawns client_service_runner threads for each request
+ * event loop (see eventLoop.c):
+ * 	a fixed set of reactor threads, one per core by default, accept
+ * 	and serve every client; threads sleep in epoll_wait() until a
+ * 	socket is ready
+ * 	at most max_clients (-c) clients are served at once; further
+ * 	connections wait in the listen backlog (-b) until one leaves
+ * 	in shared-nothing mode (-p) each reactor listens on its own
+ * 	SO_REUSEPORT socket and executes only the requests for its own
+ * 	partition of the accounts, passing the rest to their owners
  *
- * client_service_runner:
+ * serve_client_frames:
  * 	accepts commands from client 
  * 	executes commands on database
  * 	sends error and success messages back to client
  * ****************************************************************************/
 
 /******************************* GLOBALS **************************************/
-sem_t semaphore;
+/* guards num_clients and whether the reactors accept new clients; the database does its own locking */
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
-pthread_mutex_t mutex;
+/* number of clients being served, counting connections a reactor is about to accept */
+int num_clients = 0;
 
-/* this is set to true by handle_sigint(); used to notify threads of a SIGINT */
-bool sig_int_called;
+/* written to by handle_sigint(); wakes the event loop threads on a SIGINT */
+int shutdown_fd;
 
-/* this is set by client_service_runner(); 
- * used to notify request_acceptance_runner() of when services have shut down
- */
-bool services_shut_down;
+/* written to by handle_sigusr1(); wakes report_runner to report the live database */
+int report_fd;
 
-/* this is used to keep track of the number of services running;
- * if there are no services running when a SIGINT is signalled,
- * then request_acceptance_runner() just needs to pthread_exit();
- * otherwise it must wait for its services to shutdown
- */
-int num_clients = 0;
+/* this server's shard and the number of shards accounts are spread over (see protocol.h) */
+uint32_t shard_index = 0;
+uint32_t num_shards = 1;
 
 /******************************************************************************/
 
 int main(int argc, char** argv) 
 {
-	if(argc != 2) {
+	//number of reactor threads for the event loop; defaults to one per core
+	int num_reactors = sysconf(_SC_NPROCESSORS_ONLN);
+
+	//admission control; clients past max_clients wait in a listen backlog of backlog connections
+	int max_clients = DEFAULT_MAX_CLIENTS;
+	int backlog = SOMAXCONN;
+
+	//write-ahead log and snapshots; off unless a prefix is given
+	char *log_prefix = NULL;
+	durability_mode mode = GROUP_COMMIT;
+	int snapshot_interval = 0;
+
+	//change balances by compare-and-swap instead of under the segment locks
+	balance_mode balances = LOCKED_BALANCES;
+
+	//report of every account; every REPORT_INTERVAL seconds to stdout unless told otherwise, 0 for none but on SIGUSR1
+	report_args report_info;
+	report_info.destination = "-";
+	report_info.format = REPORT_TEXT;
+	report_info.interval = REPORT_INTERVAL;
+
+	//metrics endpoint on localhost; off unless a port is given
+	char *metrics_port = NULL;
+
+	//give each reactor its own listening socket and its own partition of the accounts
+	bool shared_nothing = false;
+
+	//storage engine keeping the accounts (see storage.c)
+	char *engine_spec = "hash";
+
+	//results remembered for retrying clients, and for how long
+	long dedup_entries = DEFAULT_DEDUP_ENTRIES;
+	uint32_t dedup_seconds = DEFAULT_DEDUP_SECONDS;
+
+	//seconds a client may sit idle, and hold an account in session without using it; 0 for no limit
+	int idle_seconds = 0;
+	int lease_seconds = 0;
+
+	//ship the log to replicas on this port; off unless a port is given
+	char *replication_port = NULL;
+
+	//follow the primary at this address as a read-only replica, serving QUERY within max_lag_ms of it
+	char *primary_address = NULL;
+	int max_lag_ms = DEFAULT_REPLICA_MAX_LAG_MS;
+
+	int opt;
+	while((opt = getopt(argc, argv, "e:c:b:l:d:s:ar:o:f:S:m:pE:D:I:L:R:F:")) != -1) {
+		switch(opt) {
+			case 'e':
+				num_reactors = atoi(optarg);
+				break;
+			case 'c':
+				max_clients = atoi(optarg);
+				break;
+			case 'b':
+				backlog = atoi(optarg);
+				break;
+			case 'l':
+				log_prefix = optarg;
+				break;
+			case 's':
+				snapshot_interval = atoi(optarg);
+				break;
+			case 'a':
+				balances = ATOMIC_BALANCES;
+				break;
+			case 'r':
+				report_info.interval = atoi(optarg);
+				break;
+			case 'o':
+				report_info.destination = optarg;
+				break;
+			case 'f':
+				if(parse_report_format(optarg, &report_info.format) == 0) break;
+				fprintf(stderr, "report format must be text, csv or binary\n");
+				exit(EXIT_FAILURE);
+			case 'd':
+				if(parse_durability_mode(optarg, &mode) == 0) break;
+				fprintf(stderr, "durability mode must be sync, group or async\n");
+				exit(EXIT_FAILURE);
+			case 'm':
+				metrics_port = optarg;
+				break;
+			case 'p':
+				shared_nothing = true;
+				break;
+			case 'E':
+				engine_spec = optarg;
+				if(select_storage_engine(engine_spec) == 0) break;
+				fprintf(stderr, "storage engine must be hash or mmap[:path]\n");
+				exit(EXIT_FAILURE);
+			case 'D':
+				if(sscanf(optarg, "%ld/%u", &dedup_entries, &dedup_seconds) >= 1 && dedup_entries >= 0) break;
+				fprintf(stderr, "dedup cache must be given as entries[/seconds]\n");
+				exit(EXIT_FAILURE);
+			case 'I':
+				idle_seconds = atoi(optarg);
+				break;
+			case 'L':
+				lease_seconds = atoi(optarg);
+				break;
+			case 'R':
+				replication_port = optarg;
+				break;
+			case 'F': {
+				//the address keeps its last ':' for the port; an optional "/max_lag_ms" follows
+				primary_address = optarg;
+				char *lag = strchr(optarg, '/');
+				if(lag) {
+					*lag = '\0';
+					max_lag_ms = atoi(lag + 1);
+				}
+				if(strchr(primary_address, ':') && max_lag_ms >= 0) break;
+				fprintf(stderr, "primary must be given as host:port[/max_lag_ms]\n");
+				exit(EXIT_FAILURE);
+			}
+			case 'S':
+				if(sscanf(optarg, "%u/%u", &shard_index, &num_shards) == 2 && shard_index < num_shards) break;
+				fprintf(stderr, "shard must be given as index/count, with index below count\n");
+				exit(EXIT_FAILURE);
+			default:
+				fprintf(stderr, "usage: %s <port> [-e num_reactors] [-c max_clients] [-b backlog] [-l log_prefix] [-d sync|group|async] [-s snapshot_secs] [-a] [-r report_secs] [-o -|tcp:host:port|report_path] [-f text|csv|binary] [-S index/count] [-m metrics_port] [-p] [-E hash|mmap[:path]] [-D entries[/seconds]] [-I idle_secs] [-L lease_secs] [-R replication_port] [-F host:port[/max_lag_ms]]\n", argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if(argc - optind != 1) {
 		fprintf(stderr, "wrong number of arguments\n");
 		exit(EXIT_FAILURE);
 	}
+
+	if(num_reactors < 1) num_reactors = 1;
+	if(max_clients < 1) max_clients = 1;
+	if(backlog < 1) backlog = 1;
+	if(idle_seconds < 0) idle_seconds = 0;
+	if(lease_seconds < 0) lease_seconds = 0;
+
+	if(snapshot_interval > 0 && !log_prefix) {
+		fprintf(stderr, "snapshots need a log (-l)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	//replaying a log into an engine that kept its accounts would apply every change twice
+	if(log_prefix && db_engine->persistent) {
+		fprintf(stderr, "the %s engine keeps its accounts itself and takes no log (-l)\n", db_engine->name);
+		exit(EXIT_FAILURE);
+	}
 	
-	sem_init(&semaphore, 0, 1);
+	//replicas are shipped the log files, so the primary must keep them
+	if(replication_port && !log_prefix) {
+		fprintf(stderr, "replication needs a log (-l)\n");
+		exit(EXIT_FAILURE);
+	}
 
-	signal(SIGALRM, handle_sigalrm);
+	//a replica's accounts are its primary's; it keeps no log of its own, starts empty and ships to no one
+	if(primary_address && (log_prefix || db_engine->persistent || replication_port)) {
+		fprintf(stderr, "a replica (-F) takes no log (-l), persistent engine or replicas of its own (-R)\n");
+		exit(EXIT_FAILURE);
+	}
 
-	struct itimerval it_val;
+	if(init_db() == -1) {
+		fprintf(stderr, "failed to open the %s storage engine (%s)\n", db_engine->name, engine_spec);
+		exit(EXIT_FAILURE);
+	}
+	set_balance_mode(balances);
 
-	it_val.it_value.tv_sec = 15;
-	it_val.it_value.tv_usec = 15000;
-	it_val.it_interval = it_val.it_value;
+	if(init_dedup(dedup_entries, dedup_seconds) == -1) {
+		fprintf(stderr, "failed to allocate a dedup cache of %ld entries\n", dedup_entries);
+		exit(EXIT_FAILURE);
+	}
 
-	int ret = setitimer(ITIMER_REAL, &it_val, NULL);
-	if(ret == -1) {
-		perror("error with settititmer\n");
+	//rebuild the database from the latest snapshot and the log after it, then keep logging
+	if(log_prefix) {
+		uint32_t generation;
+		int num_accounts = load_snapshot(log_prefix, &generation);
+		if(num_accounts == -1) {
+			fprintf(stderr, "snapshot of %s is corrupt\n", log_prefix);
+			exit(EXIT_FAILURE);
+		}
+
+		//left behind if the server stopped between writing a snapshot and removing them
+		wal_remove_generations(log_prefix, generation);
+
+		int num_records = wal_replay(log_prefix, generation);
+		if(wal_open(log_prefix, mode) == -1) {
+			fprintf(stderr, "failed to open log %s\n", log_prefix);
+			exit(EXIT_FAILURE);
+		}
+		printf("loaded %d accounts from snapshot and replayed %d log records from %s\n", num_accounts, num_records, log_prefix);
 	}
 
-	
-	int server_sockfd = bind_to_socket(argv[1]);
+	//copy the primary's accounts before serving anyone, so no client sees them half copied
+	if(primary_address) {
+		int num_accounts = follow_primary(primary_address, max_lag_ms);
+		if(num_accounts == -1) {
+			fprintf(stderr, "failed to copy the accounts of the primary at %s\n", primary_address);
+			exit(EXIT_FAILURE);
+		}
+		printf("copied %d accounts from the primary at %s\n", num_accounts, primary_address);
+	}
+
+	shutdown_fd = eventfd(0, EFD_NONBLOCK);
+	report_fd = eventfd(0, EFD_NONBLOCK);
+	if(shutdown_fd == -1 || report_fd == -1) {
+		perror("eventfd: ");
+		exit(EXIT_FAILURE);
+	}
+
+	int server_sockfd = bind_to_socket(argv[optind], shared_nothing);
 
 	sig_t sig_ret = signal(SIGINT, handle_sigint);
 	if(sig_ret == SIG_ERR) {
 		perror("sigint: ");
 	}
 
-	pthread_t request_runner_id;
-	pthread_create(&request_runner_id, NULL, request_acceptance_runner, &server_sockfd);
-	pthread_join(request_runner_id, NULL);
+	sig_ret = signal(SIGUSR1, handle_sigusr1);
+	if(sig_ret == SIG_ERR) {
+		perror("sigusr1: ");
+	}
+
+	pthread_t checkpoint_runner_id;
+	checkpoint_args checkpoint_info;
+	if(snapshot_interval > 0) {
+		checkpoint_info.prefix = log_prefix;
+		checkpoint_info.interval = snapshot_interval;
+		checkpoint_info.shutdown_fd = shutdown_fd;
+
+		sigset_t old_signals;
+		block_server_signals(&old_signals);
+		pthread_create(&checkpoint_runner_id, NULL, checkpoint_runner, &checkpoint_info);
+		pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	}
+
+	pthread_t report_runner_id;
+	report_info.report_fd = report_fd;
+	report_info.shutdown_fd = shutdown_fd;
+
+	sigset_t old_signals;
+	block_server_signals(&old_signals);
+	pthread_create(&report_runner_id, NULL, report_runner, &report_info);
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+	pthread_t metrics_runner_id;
+	metrics_args metrics_info;
+	if(metrics_port) {
+		metrics_info.sockfd = bind_metrics_socket(metrics_port);
+		if(metrics_info.sockfd == -1) {
+			fprintf(stderr, "failed to bind metrics port %s\n", metrics_port);
+			exit(EXIT_FAILURE);
+		}
+		metrics_info.num_clients = &num_clients;
+		metrics_info.shutdown_fd = shutdown_fd;
+		metrics_enabled = 1;
+
+		sigset_t old_signals;
+		block_server_signals(&old_signals);
+		pthread_create(&metrics_runner_id, NULL, metrics_runner, &metrics_info);
+		pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	}
+
+	pthread_t replication_runner_id;
+	replication_args replication_info;
+	if(replication_port) {
+		replication_info.sockfd = bind_replication_socket(replication_port);
+		if(replication_info.sockfd == -1) {
+			fprintf(stderr, "failed to bind replication port %s\n", replication_port);
+			exit(EXIT_FAILURE);
+		}
+		replication_info.prefix = log_prefix;
+		replication_info.shutdown_fd = shutdown_fd;
+
+		sigset_t old_signals;
+		block_server_signals(&old_signals);
+		pthread_create(&replication_runner_id, NULL, replication_runner, &replication_info);
+		pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	}
+
+	pthread_t follow_runner_id;
+	follow_args follow_info;
+	if(primary_address) {
+		follow_info.shutdown_fd = shutdown_fd;
+
+		sigset_t old_signals;
+		block_server_signals(&old_signals);
+		pthread_create(&follow_runner_id, NULL, follow_runner, &follow_info);
+		pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+	}
+
+	run_event_loop(server_sockfd, num_reactors, max_clients, backlog, shutdown_fd, argv[optind], shared_nothing, idle_seconds, lease_seconds);
+
+	if(snapshot_interval > 0) pthread_join(checkpoint_runner_id, NULL);
+	pthread_join(report_runner_id, NULL);
+	if(metrics_port) pthread_join(metrics_runner_id, NULL);
+	if(replication_port) pthread_join(replication_runner_id, NULL);
+	if(primary_address) pthread_join(follow_runner_id, NULL);
+
+	wal_close();
 
 	free_db();
+	free_dedup();
 
 	return 0;
 }
 
-/* prints database every 15 seconds via SIGALRM */
-void handle_sigalrm()
+/* block SIGINT and SIGUSR1 in the calling thread; threads created afterwards inherit the mask,
+ * so the handler always runs on the main thread, which holds no database locks while it
+ * waits in pthread_join()
+ *
+ * @param1 old_signals where to save the previous mask so the caller can restore it
+ */
+void block_server_signals(sigset_t *old_signals)
 {
-	sem_wait(&semaphore);
-	print_db();
-	sem_post(&semaphore);
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &signals, old_signals);
 }
 
 /* bind server to socket
  * 
  * @param1 port_num port number entered by user
+ * @param2 reuse_port let other sockets bind the same port (shared-nothing mode)
  *
  * @return socket file descriptor for the bound server
  */
-int bind_to_socket(char port_num[10]) 
+int bind_to_socket(char port_num[10], bool reuse_port) 
 {
  	int server_sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
@@ -102,6 +395,10 @@ int bind_to_socket(char port_num[10])
 		exit(EXIT_FAILURE);
 	}
 
+	//each reactor of shared-nothing mode binds a socket of its own to the same port
+	int one = 1;
+	if(reuse_port) setsockopt(server_sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
 	struct sockaddr_in server_address;
 	server_address.sin_family = AF_INET;
 	server_address.sin_port = htons(atoi(port_num));
@@ -117,280 +414,547 @@ int bind_to_socket(char port_num[10])
 }
 
 /* handles the SIGINT interupt;
- * stops timer and sets sig_int_called to true to alert other threads of SIGINT
+ * signals shutdown_fd to wake the event loop, checkpoint and report threads
  */
 void handle_sigint()
 {
-	struct itimerval it_val;
-
-	it_val.it_value.tv_sec = 0;
-	it_val.it_value.tv_usec = 0;
-	it_val.it_interval = it_val.it_value;
+	//write() is async-signal-safe; the value only needs to make the eventfd readable
+	uint64_t one = 1;
+	int ret = write(shutdown_fd, &one, sizeof(one));
+	if(ret == -1) {
+		perror("shutdown eventfd: ");
+	}
+}
 
-	int ret = setitimer(ITIMER_REAL, &it_val, NULL);
+/* handles SIGUSR1;
+ * signals report_fd so report_runner reports the live database now
+ */
+void handle_sigusr1()
+{
+	uint64_t one = 1;
+	int ret = write(report_fd, &one, sizeof(one));
 	if(ret == -1) {
-		perror("error with settititmer\n");
+		perror("report eventfd: ");
 	}
+}
 
-	sig_int_called = true;
+/* makes calls to a socket non-blocking so they do not stall loops
+ *
+ * @param1 fd the file descriptor for the socket 
+ */
+void make_calls_to_socket_nonblocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
 }
 
-/* thread runner to accept requests from client 
- * listens on server socket for requests
- * creates a new client_service_runner for each incoming request
+/* initialize the state kept for a newly accepted client
  *
- * @param1 arg void pointer to server_sockfd
+ * @param1 session the session to initialize
+ * @param2 client_sockfd file descriptor of client socket
  */
-void * request_acceptance_runner(void* arg)
+void init_client_session(client_session *session, int client_sockfd)
 {
-	int server_sockfd = *((int*) arg);
-	//if we don't do this, the loop hangs at accept() and we never know if services_shut_down has been set
-	make_calls_to_socket_nonblocking(server_sockfd);
-	
-	//list of pthread_t ids in structs with next nodes
-	service_runner_id_node *service_id_list = NULL;
-
-	listen(server_sockfd, INT_MAX);
-
-	int client_sockfd;
-	while(1) {
-		//if sigint was called and the service runner has finished, join child threads, close server socket,  and exit own thread
-		if(services_shut_down) {
-			int close_ret = close(server_sockfd);
-			if(close_ret == -1) {
-				perror("close service: ");
-			}
+	session->client_sockfd = client_sockfd;
+	session->active_session = false;
+	session->active_session_account_name[0] = '\0';
+	session->active_session_account_id = 0;
+	session->active_session_segment = 0;
+	session->protocol = PROTOCOL_UNKNOWN;
+	session->recv_len = 0;
+	session->send_len = 0;
+	session->send_pos = 0;
+	session->watched_events = EPOLLIN | EPOLLRDHUP;
+	session->prev = NULL;
+	session->next = NULL;
+	session->reactor_index = 0;
+	session->forwarded = false;
+	session->stalled_next = NULL;
+	session->timeout.next = NULL;
+	session->timeout.data = session;
+	session->last_active = 0;
+	session->dropped = false;
+}
 
-			join_threads(service_id_list);
+/* read whatever the client has sent and execute every complete frame in order;
+ * a partial frame is kept until the rest of it arrives. The replies to all
+ * of the frames are sent together once they have been executed
+ *
+ * @param1 session the session of the client
+ *
+ * @return false if the client disconnected or quit; true otherwise
+ */
+bool serve_client_frames(client_session *session)
+{
+	//don't read more requests until the client has taken the replies to the last ones
+	if(!flush_replies(session)) return true;
 
-			free_service_ids(service_id_list);
+	int recv_ret = recv(session->client_sockfd, session->recv_buffer + session->recv_len,
+			sizeof(session->recv_buffer) - session->recv_len, 0);
 
-			pthread_exit(NULL);
+	//no data received yet
+	if(recv_ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
 
-			return;
-		}
+	//client disconnected, or the connection was reset
+	if(recv_ret <= 0) return false;
 
-		//if sigint was called and there are no services running, exit the thread
-		if(sig_int_called && num_clients == 0) {
-			int close_ret = close(server_sockfd);
-			if(close_ret == -1) {
-				perror("close service: ");
-			}
+	session->recv_len += recv_ret;
 
-			pthread_exit(NULL);
-			return;
-		}
+	//the first byte the client sends decides the protocol of the connection
+	if(session->protocol == PROTOCOL_UNKNOWN) {
+		bool binary = (unsigned char) session->recv_buffer[0] == BINARY_MAGIC;
+		session->protocol = binary ? PROTOCOL_BINARY : PROTOCOL_TEXT;
+	}
 
-		int ret_accept = accept(server_sockfd, NULL, NULL);
+	return execute_client_frames(session);
+}
+
+/* execute every complete frame in the session's receive buffer in order, stopping
+ * early if one is forwarded to another reactor, and send the replies
+ *
+ * @param1 session the session of the client
+ *
+ * @return false if the client quit or sent a malformed frame; true otherwise
+ */
+bool execute_client_frames(client_session *session)
+{
+	size_t offset = 0;
+	size_t frame_size;
+	while((frame_size = next_frame_size(session, offset)) > 0) {
+		client_request request;
+		char *frame = session->recv_buffer + offset;
+
+		//text clients quit with a "quit" frame; a malformed binary frame ends the connection
+		bool parsed = (session->protocol == PROTOCOL_BINARY) ?
+			parse_binary_frame(frame, &request) : parse_text_frame(frame, &request);
+		if(!parsed) {
+			flush_replies(session);
+			return false;
+		}
 
-		//if we have a request, set client_sockfd to that file descriptor, print that connection was made
-		//run a service thread, add thread id to list, and set services_running to true.
-		if(ret_accept >= 0) {
-			client_sockfd = ret_accept;
+		exec_client_request(session, &request);
 
-			printf("accepted connection from client #%d\n", client_sockfd);
+		offset += frame_size;
 
-			pthread_t service_runner_id;
-			pthread_create(&service_runner_id, NULL, client_service_runner, &client_sockfd);
-			
-			add_id_to_list(service_runner_id, &service_id_list);
-			
-			pthread_mutex_lock(&mutex);
-			num_clients++;
-			pthread_mutex_unlock(&mutex);
-		}	
+		//the rest wait until the forwarded request's result is back
+		if(session->forwarded) break;
 	}
+
+	//keep the start of a frame that has not fully arrived
+	memmove(session->recv_buffer, session->recv_buffer + offset, session->recv_len - offset);
+	session->recv_len -= offset;
+
+	flush_replies(session);
+
+	return true;
 }
 
-/* makes calls to a socket non-blocking so they do not stall loops
+/* add a reply to the replies waiting to be sent to the client
  *
- * @param1 fd the file descriptor for the socket 
+ * @param1 session the session of the client
+ * @param2 reply the bytes of the reply
+ * @param3 size number of bytes in reply
  */
-void make_calls_to_socket_nonblocking(int fd)
+void queue_reply(client_session *session, void *reply, size_t size)
 {
-	int flags = fcntl(fd, F_GETFL, 0);
-	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	//replies to one receive buffer of requests always fit, so this only happens to a client that stopped reading
+	if(session->send_len + size > sizeof(session->send_buffer)) return;
+
+	memcpy(session->send_buffer + session->send_len, reply, size);
+	session->send_len += size;
 }
 
-/* join service threads 
+/* send as much of the queued replies as the socket will take
  *
- * @param1 pointer to the list of service nodes
+ * @param1 session the session of the client
+ *
+ * @return true if every queued reply has been sent; false if some are still waiting
  */
-void join_threads(service_runner_id_node *service_id_list)
+bool flush_replies(client_session *session)
 {
-	while(service_id_list) {
-		pthread_join(service_id_list->id, NULL);
-		service_id_list = service_id_list->next;
+	while(session->send_pos < session->send_len) {
+		int send_ret = send(session->client_sockfd, session->send_buffer + session->send_pos,
+				session->send_len - session->send_pos, MSG_NOSIGNAL);
+
+		if(send_ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return false;
+
+		//client is gone; the next recv() will report it
+		if(send_ret == -1) break;
+
+		session->send_pos += send_ret;
 	}
+
+	session->send_pos = 0;
+	session->send_len = 0;
+
+	return true;
 }
 
-/* free the list of service_runner_nodes
+/* find the size of the next complete frame in the session's receive buffer
+ *
+ * @param1 session the session of the client
+ * @param2 offset where the next frame starts in the receive buffer
  *
- * @param1 service_id_list pointer to the list of id nodes 
+ * @return size of the frame; 0 if it has not fully arrived
  */
-void free_service_ids(service_runner_id_node *service_id_list)
+size_t next_frame_size(client_session *session, size_t offset)
 {
-	service_runner_id_node *ptr = service_id_list;
-	while(ptr) {
-		service_runner_id_node *tmp = ptr->next;
-		free(ptr);
-		ptr = NULL;
-		ptr = tmp;
+	size_t available = session->recv_len - offset;
+
+	if(session->protocol == PROTOCOL_TEXT)
+		return (available >= TEXT_FRAME_SIZE) ? TEXT_FRAME_SIZE : 0;
+
+	if(available < sizeof(binary_frame)) return 0;
+
+	binary_frame *frame = (binary_frame*) (session->recv_buffer + offset);
+	size_t frame_size = sizeof(binary_frame) + frame->name_len;
+
+	if(frame->opcode != TRANSFER_BATCH + 1) return (available >= frame_size) ? frame_size : 0;
+
+	//a batch runs up to the end of its last leg; a bad leg count is left for parse_binary_frame() to reject
+	uint64_t num_legs = be64toh(frame->amount);
+	if(num_legs < 1 || num_legs > MAX_TRANSFER_LEGS) return frame_size;
+
+	uint64_t i;
+	for(i = 0; i < num_legs; i++) {
+		if(available < frame_size + sizeof(binary_frame)) return 0;
+
+		binary_frame *leg = (binary_frame*) (session->recv_buffer + offset + frame_size);
+		frame_size += sizeof(binary_frame) + leg->name_len;
 	}
+
+	return (available >= frame_size) ? frame_size : 0;
 }
 
-/* add a new id to the list of id nodes
+/* parse a text frame into a request
+ *
+ * @param1 frame TEXT_FRAME_SIZE bytes received from the client
+ * @param2 request pointer in which to put the parsed request
  *
- * @param1 id the id of the thread to be added
- * @param2 service_id_list double pointer to list of id nodes 
+ * @return false if the client sent quit; true otherwise
  */
-void add_id_to_list(pthread_t id, service_runner_id_node **service_id_list) 
+bool parse_text_frame(char *frame, client_request *request)
 {
-	service_runner_id_node *new_node = malloc(sizeof(service_runner_id_node));
-	new_node->id = id;
-	new_node->next = NULL;
+	//the frame is not guaranteed to be terminated, so parse a terminated copy
+	char client_message[300];
+	memcpy(client_message, frame, TEXT_FRAME_SIZE);
+	client_message[TEXT_FRAME_SIZE] = '\0';
 
-	if(!(*service_id_list)) {
-		*service_id_list = new_node;
-		return;
+	if(strcmp(client_message, "quit") == 0) return false;
+
+	request->request_id = 0;
+	request->client_id = 0;
+	request->account_name[0] = '\0';
+	request->amount = 0;
+
+	//parse command from message (CREATE, SERVE, DEPOSIT, WITHDRAW, QUERY, or END)
+	request->command = get_db_command(client_message);
+
+	//get account name if needed
+	if(account_name_needed(request->command))
+		get_account_name(client_message, request->account_name);
+
+	//get amount if needed
+	if(amount_needed(request->command))
+		request->amount = get_amount(client_message);
+
+	//get the amount and the account to credit
+	if(request->command == TRANSFER)
+		get_transfer_leg(client_message, request);
+
+	return true;
+}
+
+/* parse a binary frame into a request
+ *
+ * @param1 frame a complete binary frame and the name that follows it
+ * @param2 request pointer in which to put the parsed request
+ *
+ * @return false if the frame is malformed; true otherwise
+ */
+bool parse_binary_frame(char *frame, client_request *request)
+{
+	binary_frame header;
+	memcpy(&header, frame, sizeof(header));
+	decode_frame(&header);
+
+	if(header.magic != BINARY_MAGIC || header.opcode < CREATE + 1 || header.opcode > TRANSFER_BATCH + 1)
+		return false;
+
+	request->command = header.opcode - 1;
+	request->request_id = header.request_id;
+	request->amount = header.amount;
+
+	//only requests that change the database are worth remembering for a retry
+	request->client_id = retryable_command(request->command) ? header.account_id : 0;
+	request->num_legs = 0;
+
+	if(request->command == TRANSFER) {
+		request->account_name[0] = '\0';
+		return parse_transfer_leg(frame, request) > 0;
 	}
 
-	service_runner_id_node *ptr = *service_id_list;
-	while(ptr->next) {
-		ptr = ptr->next;
+	if(request->command == TRANSFER_BATCH) {
+		if(header.amount < 1 || header.amount > MAX_TRANSFER_LEGS) return false;
+
+		size_t offset = sizeof(header);
+		int i;
+		for(i = 0; i < header.amount; i++) {
+			size_t leg_size = parse_transfer_leg(frame + offset, request);
+			if(leg_size == 0) return false;
+			offset += leg_size;
+		}
+
+		request->account_name[0] = '\0';
+		return true;
 	}
 
-	ptr->next = new_node;
+	memcpy(request->account_name, frame + sizeof(header), header.name_len);
+	request->account_name[header.name_len] = '\0';
+
+	return true;
 }
 
-/* thread runner to handle client sessions
- * accepts commands from client and executes them on database
- * sends error and success messages to client after execution
+/* parse a binary TRANSFER frame into the next leg of a request
+ *
+ * @param1 frame a complete TRANSFER frame and the name that follows it
+ * @param2 request pointer in which to put the leg
  *
- * @param1 void pointer to client_sockfd
+ * @return size of the frame; 0 if it is not a TRANSFER frame
  */
-void * client_service_runner(void* arg)
+size_t parse_transfer_leg(char *frame, client_request *request)
 {
-	int client_sockfd = *((int*) arg);
-	//if we don't do this, the loop hangs and we never know if sig_int_called has been set
-	make_calls_to_socket_nonblocking(client_sockfd);
+	binary_frame header;
+	memcpy(&header, frame, sizeof(header));
+	decode_frame(&header);
 
-	char client_message[300];
-	char account_name[256] = {'\0'};
+	if(header.magic != BINARY_MAGIC || header.opcode != TRANSFER + 1) return 0;
+
+	int leg = request->num_legs++;
+	request->leg_amounts[leg] = header.amount;
+	memcpy(request->leg_accounts[leg], frame + sizeof(header), header.name_len);
+	request->leg_accounts[leg][header.name_len] = '\0';
+
+	return sizeof(header) + header.name_len;
+}
+
+/* end the client's active session if it has one and close the connection
+ *
+ * @param1 session the session of the client that disconnected
+ */
+void close_client_session(client_session *session)
+{
+	//if client was in session, end it
+	if(session->active_session)
+		end_session_by_id(session->active_session_account_id);
+
+	//close the connection
+	disconnect_from_client(session->client_sockfd);
+}
+
+/* execute a single command sent by the client and reply with the result; in
+ * shared-nothing mode a command for an account owned by another reactor is
+ * handed to it instead, and finished once its result comes back
+ *
+ * @param1 session the session of the client that sent the request
+ * @param2 request the parsed request
+ */
+void exec_client_request(client_session *session, client_request *request)
+{
+	money balance = 0;
+	uint64_t start = metrics_start();
+
+	int status = check_client_request(session, request);
+
+	//a request that fails its checks never ran, so a retry of it must run rather than get this result
+	if(status != 0) request->client_id = 0;
 
-	bool active_session = false;
-	char active_session_account_name[256] = {'\0'};
+	//a copy of a request that already ran gets the first result back (see dedup.c)
+	if(request->client_id) {
+		dedup_result seen = dedup_begin(request->client_id, request->request_id, request->command, &status, &request->account_id);
+		if(seen == DEDUP_BUSY) status = -10;
 
-	while(1) {
-		//if sigint was called tell client, close the client socket, and exit the thread
-		if(sig_int_called) {
-			shutdown_service(client_sockfd);
+		if(seen != DEDUP_NEW) {
+			request->client_id = 0;
+			finish_client_request(session, request, status, balance, start);
 			return;
 		}
+	}
 
-		double amount;
-		double balance;
-		int status = 0;
+	if(status == 0 && forward_client_request(session, request, start)) return;
 
-		//get message from client
-		int recv_ret = recv(client_sockfd, client_message, sizeof(client_message), 0);
+	if(status == 0)
+		status = execute_request(request, &balance);
 
-		//no data received; try again
-		if(recv_ret == -1) continue;
+	finish_client_request(session, request, status, balance, start);
+}
 
-		//client disconnected
-		if(recv_ret == 0 || strcmp(client_message, "quit") == 0) {
-			//if client was in session, end it
-			if(active_session)
-				exec_db_command(END, account_name, 0);
+/* check a request against the state of the client's session
+ *
+ * @param1 session the session of the client that sent the request
+ * @param2 request the parsed request; commands without an account name get the session's account
+ *
+ * @return 0 if the request can be executed; its error code otherwise
+ */
+int check_client_request(client_session *session, client_request *request)
+{
+	db_command command = request->command;
+	int status = 0;
 
-			//close the connection
-			disconnect_from_client(client_sockfd);
+	//a text command get_db_command() did not know, or a binary opcode past the last command
+	if((int) command < CREATE || command > TRANSFER_BATCH)
+		return -13;
 
-			pthread_mutex_lock(&mutex);
-			num_clients--;
-			pthread_mutex_unlock(&mutex);
+	//commands without an account name act on the active session's account, by its id;
+	//only a transfer needs the name, to log its legs by
+	if(!account_name_needed(command))
+		request->account_id = session->active_session_account_id;
+	if(is_transfer(command))
+		strcpy(request->account_name, session->active_session_account_name);
 
-			pthread_exit(NULL);
-			break;
-		}
+	//if session needs to be active to execute command and is not active, set error code
+	if(active_session_needed(command) && !session->active_session) 
+		status = -6;
 
-		//parse command from message (CREATE, SERVE, DEPOSIT, WITHDRAW, QUERY, or END)
-		db_command command = get_db_command(client_message);
-
-		//get account name if needed
-		//otherwise use the account name of the active session
-		if(account_name_needed(command))
-			get_account_name(client_message, account_name);
-		else 
-			strcpy(account_name, active_session_account_name);
-
-		//get amount if needed
-		if(amount_needed(command))
-			amount = get_amount(client_message);
-
-		//if session needs to be active to execute command and is not active, set error code
-		if(active_session_needed(command) && !active_session) 
-			status = -6;
-
-		//if session needs to be inactive to execute command and is active, set error code
-		if(!active_session_needed(command) && active_session)
-			status = -7;
-
-		//query returns a value, so we execute it separately if the session is in the correct state
-		if(status == 0 && command == QUERY) {
-			pthread_mutex_lock(&mutex);
-			balance = query_balance(account_name);
-			pthread_mutex_unlock(&mutex);
-		}
+	//if session needs to be inactive to execute command and is active, set error code
+	if(!active_session_needed(command) && session->active_session)
+		status = -7;
 
-		//if the session is in the correct state and the command is not a query, execute the command
-		if(status == 0 && command != QUERY){
-			if(command == CREATE) sem_wait(&semaphore);
+	//amounts are never negative; get_amount() also reports text it cannot parse this way
+	if(status == 0 && amount_needed(command) && request->amount < 0)
+		status = -8;
 
-			pthread_mutex_lock(&mutex);
-			status = exec_db_command(command, account_name, amount);
-			pthread_mutex_unlock(&mutex);
+	//a shard can't touch accounts it doesn't hold; the client sent the request to the wrong shard
+	if(status == 0 && !request_on_this_shard(request))
+		status = -9;
 
-			if(command == CREATE) sem_post(&semaphore);
-		}
+	//a replica's accounts only change as its primary's log says
+	if(status == 0 && replica && retryable_command(command))
+		status = -11;
 
-		//if there was an error, alert the client 
-		if(status != 0) 
-			send_error_to_client(status, client_sockfd);
-		
-		//if execution was successful, send message to client
-		if(status == 0)
-			send_message_to_client(command, balance,  client_sockfd);
-
-		//handle successful execution of the end command
-		if(status == 0 && command == END) {
-			active_session = false;
-			active_session_account_name[0] = '\0';
-		}
+	//a replica that may be further behind than it promised sends readers to the primary
+	if(status == 0 && command == QUERY && replica_behind())
+		status = -12;
 
-		//handle successful execution of the serve command
-		if(status == 0 && command == SERVE) {
-			active_session = true;
-			strcpy(active_session_account_name, account_name);
-		}
+	return status;
+}
+
+/* execute a checked request on the database; touches no session state, so any reactor may run it
+ *
+ * @param1 request the request, with the account name filled in by check_client_request()
+ * @param2 balance pointer in which to put the balance returned by QUERY
+ *
+ * @return 0 if successful; the error code otherwise
+ */
+int execute_request(client_request *request, money *balance)
+{
+	//query returns a value, so we execute it separately
+	if(request->command == QUERY)
+		return query_balance_by_id(request->account_id, balance);
+
+	//transfers move money out of the served account along each leg of the request
+	if(is_transfer(request->command))
+		return exec_transfer(request->account_name, request);
+
+	return exec_db_command(request);
+}
+
+/* reply to an executed request and move the session along with it
+ *
+ * @param1 session the session of the client that sent the request
+ * @param2 request the request
+ * @param3 status 0 if it succeeded; the error code otherwise
+ * @param4 balance the balance returned by QUERY
+ * @param5 start value of metrics_start() when the request started
+ */
+void finish_client_request(client_session *session, client_request *request, int status, money balance, uint64_t start)
+{
+	db_command command = request->command;
+
+	metrics_record(command, status, start);
+
+	//copies of the request sent by a retrying client get this result instead of running
+	if(request->client_id)
+		dedup_finish(request->client_id, request->request_id, command, status, request->account_id);
+
+	send_reply_to_client(session, request, status, balance);
+
+	//handle successful execution of the end command
+	if(status == 0 && command == END) {
+		session->active_session = false;
+		session->active_session_account_name[0] = '\0';
+	}
+
+	//handle successful execution of the serve command; the name is not looked up again until the session ends
+	if(status == 0 && command == SERVE) {
+		session->active_session = true;
+		strcpy(session->active_session_account_name, request->account_name);
+		session->active_session_account_id = request->account_id;
+		session->active_session_segment = account_segment(request->account_name);
+	}
+}
+
+/* send the result of a request to the client in the client's protocol
+ *
+ * @param1 session the session of the client
+ * @param2 request the request that was executed
+ * @param3 status holds the error code of the command; 0 if it succeeded
+ * @param4 balance the current balance in cents returned by QUERY execution (optional)
+ */
+void send_reply_to_client(client_session *session, client_request *request, int status, money balance)
+{
+	if(session->protocol == PROTOCOL_BINARY) {
+		binary_frame reply;
+		encode_frame(&reply, request->command + 1, status, 0, request->request_id, balance);
+
+		//CREATE and SERVE hand the client the account's id
+		if(status == 0 && (request->command == CREATE || request->command == SERVE))
+			reply.account_id = htobe64(request->account_id);
+
+		queue_reply(session, &reply, sizeof(reply));
+		return;
 	}
+
+	//if there was an error, alert the client 
+	if(status != 0) 
+		send_error_to_client(status, session);
+	
+	//if execution was successful, send message to client
+	if(status == 0)
+		send_message_to_client(request->command, balance, session);
 }
 
-/* send shutdown message to client; close socket; set services_shut_down to alert request_acceptance_runner()
- * that services have shutdown; exit thread
+/* tell a client the server is shutting down, in the client's protocol
  *
- * @param1 client_sockfd the file descriptor for the client socket to shutdown
+ * @param1 session the session of the client
  */
-void shutdown_service(int client_sockfd)
+void send_shutdown_to_client(client_session *session)
 {
-	char message[25] =  "Server has been shutdown";
-	send(client_sockfd, message, sizeof(message), 0);
+	if(session->protocol == PROTOCOL_BINARY) {
+		binary_frame message;
+		encode_frame(&message, OP_SHUTDOWN, 0, 0, 0, 0);
+		queue_reply(session, &message, sizeof(message));
+	} else {
+		char message[25] =  "Server has been shutdown";
+		queue_reply(session, message, sizeof(message));
+	}
 
-	disconnect_from_client(client_sockfd);
+	flush_replies(session);
+}
 
-	services_shut_down = true;
-	pthread_exit(NULL);
+/* tell a text client it is being closed for sitting idle; a binary client only sees
+ * the connection close, and connects again if it is still there
+ *
+ * @param1 session the session of the client
+ */
+void send_timeout_to_client(client_session *session)
+{
+	if(session->protocol == PROTOCOL_TEXT) {
+		char message[21] = "Connection timed out";
+		queue_reply(session, message, sizeof(message));
+	}
+
+	flush_replies(session);
 }
 
 /* print that server is disconnecting from client and disconnect from client
@@ -418,10 +982,10 @@ db_command get_db_command(char client_message[300])
 	char command_string[9] = {'\0'};
 	parse_command_from_message(client_message, command_string);
 
-	char *commands[] = {"create", "serve", "deposit", "withdraw", "query", "end"};
+	char *commands[] = {"create", "serve", "deposit", "withdraw", "query", "end", "transfer"};
 
 	int i;
-	for(i = 0; i < 6; i++) {
+	for(i = 0; i < 7; i++) {
 		if(strcmp(command_string, commands[i]) == 0) return i;
 	}
 
@@ -441,12 +1005,16 @@ void parse_command_from_message(char client_message[300], char command_string[9]
 		return;
 	}
 
+	//stop at the end of the message, and at 8 characters, which no command is longer than
 	int i = 0;
-	while(client_message[i] != ' ') {
+	while(client_message[i] != ' ' && client_message[i] != '\0' && i < 8) {
 		command_string[i] = client_message[i];
 		i++;
 	}
 
+	//a longer word matches no command, rather than the command it starts with
+	if(client_message[i] != ' ' && client_message[i] != '\0') i = 0;
+
 	command_string[i] = '\0';
 
 	return;
@@ -471,12 +1039,18 @@ bool account_name_needed(db_command command)
 void get_account_name(char client_message[300], char account_name[256])
 {
 	int i = 0;
-	while(client_message[i] != ' ')	i++;
-	
+	while(client_message[i] != ' ' && client_message[i] != '\0') i++;
+
+	//no name follows the command
+	if(client_message[i] == '\0') {
+		account_name[0] = '\0';
+		return;
+	}
+
 	i++;
 
 	int k = 0;
-	while(client_message[i] != '\0' && k < 256) {
+	while(client_message[i] != '\0' && k < 255) {
 		account_name[k] = client_message[i];
 		i++;
 		k++;
@@ -502,28 +1076,19 @@ bool amount_needed(db_command command)
  *
  * param1 client_message the message from the client
  *
- * @return double value of amount in client message
+ * @return amount in client message in cents; -1 if it is not a valid amount
  */
-double get_amount(char client_message[300])
+money get_amount(char client_message[300])
 {
-	//317 is max chars in dbl on ilabs
-	char dbl_string[317];
-
 	int i = 0;
-	while(client_message[i] != ' ') i++;
-	
-	i++;
+	while(client_message[i] != ' ' && client_message[i] != '\0') i++;
 
-	int k = 0;
-	while(client_message[i] != '\0') {
-		dbl_string[k] = client_message[i];
-		i++;
-		k++;
-	}		
+	if(client_message[i] == '\0') return -1;
 
-	dbl_string[k] = '\0';
+	money amount;
+	if(!parse_money(client_message + i + 1, &amount)) return -1;
 
-	return atof(dbl_string);	
+	return amount;
 }
 
 /* determine if command needs an active session to be executed
@@ -534,15 +1099,113 @@ double get_amount(char client_message[300])
  */
 bool active_session_needed(db_command command) 
 {
-	return command == DEPOSIT || command == WITHDRAW || command == QUERY || command == END;
+	return command == DEPOSIT || command == WITHDRAW || command == QUERY || command == END || is_transfer(command);
+}
+
+/* determine if command moves money between accounts
+ *
+ * @param1 command the command sent by the client
+ *
+ * @return true if command is TRANSFER or TRANSFER_BATCH; false otherwise
+ */
+bool is_transfer(db_command command)
+{
+	return command == TRANSFER || command == TRANSFER_BATCH;
+}
+
+/* determine if a request may carry a client id and be answered from the dedup cache;
+ * SERVE and END change the state of the connection, so a retry on a new connection
+ * must run them again, and QUERY changes nothing
+ *
+ * @param1 command the command sent by the client
+ *
+ * @return true if command changes the database; false otherwise
+ */
+bool retryable_command(db_command command)
+{
+	return command == CREATE || command == DEPOSIT || command == WITHDRAW || is_transfer(command);
+}
+
+/* determine if every account named by a request belongs to this shard; the account
+ * of the active session does, since SERVE checked it
+ *
+ * @param1 request the request
+ *
+ * @return true if this shard holds the accounts; false otherwise
+ */
+bool request_on_this_shard(client_request *request)
+{
+	if(num_shards == 1) return true;
+
+	if(account_name_needed(request->command))
+		return account_shard(request->account_name, num_shards) == shard_index;
+
+	if(is_transfer(request->command)) {
+		int i;
+		for(i = 0; i < request->num_legs; i++) {
+			if(account_shard(request->leg_accounts[i], num_shards) != shard_index) return false;
+		}
+	}
+
+	return true;
+}
+
+/* parse the amount and the account to credit from a transfer message ("transfer <amount> <account>")
+ *
+ * @param1 client_message the message from the client
+ * @param2 request pointer in which to put the leg; an amount of -1 if it is not a valid amount
+ */
+void get_transfer_leg(char client_message[300], client_request *request)
+{
+	request->num_legs = 1;
+	request->leg_amounts[0] = -1;
+	request->leg_accounts[0][0] = '\0';
+
+	//skip the command
+	char *amount = strchr(client_message, ' ');
+	if(!amount) return;
+	amount++;
+
+	char *account = strchr(amount, ' ');
+	if(!account) return;
+
+	//parse_money() wants the amount on its own
+	*account = '\0';
+	if(!parse_money(amount, &request->leg_amounts[0])) request->leg_amounts[0] = -1;
+	*account = ' ';
+
+	strncpy(request->leg_accounts[0], account + 1, 255);
+	request->leg_accounts[0][255] = '\0';
+}
+
+/* move money from the served account along every leg of a transfer request, atomically
+ *
+ * @param1 account_name name of the served account
+ * @param2 request the TRANSFER or TRANSFER_BATCH request
+ *
+ * @return status of transfer_batch(); -8 if any amount is invalid
+ */
+int exec_transfer(char account_name[256], client_request *request)
+{
+	transfer_leg legs[MAX_TRANSFER_LEGS];
+
+	int i;
+	for(i = 0; i < request->num_legs; i++) {
+		if(request->leg_amounts[i] < 0) return -8;
+
+		legs[i].from = account_name;
+		legs[i].to = request->leg_accounts[i];
+		legs[i].amount = request->leg_amounts[i];
+	}
+
+	return transfer_batch(legs, request->num_legs);
 }
 
 /* execute CREATE, SERVE, DEPOSIT, WITHDRAW, and END commands on the database
  * (Note that query commands are executed separately)
  *
- * @param1 command the command sent by the client (required)
- * @param2 name of account to execute command for (optional)
- * @param3 amount value of deposit or withdrawl (optional)
+ * @param1 request the request; CREATE and SERVE go by account name and put the
+ *        account's id in account_id, the others go straight to the account in account_id
  *
  *@return status 
  * 	-1 account already exists
@@ -550,29 +1213,33 @@ bool active_session_needed(db_command command)
  *	-3 account already in session 
  *	-4 account not in session 
  *	-5 insufficient funds 
+ *	-8 invalid amount
  *       0 success 
 */
-int exec_db_command(db_command command, char account_name[256], double amount)
+int exec_db_command(client_request *request)
 {
 	int status = 0;
-	switch(command) {
+	switch(request->command) {
 		case CREATE:
-			status = create_account(account_name);
+			status = create_account_with_id(request->account_name, &request->account_id);
 			break;
 		case SERVE:
-			status = start_session(account_name);
+			status = start_session_with_id(request->account_name, &request->account_id);
 			break;
 		case DEPOSIT:
-			status = deposit(account_name, amount);
+			status = deposit_by_id(request->account_id, request->amount);
 			break;
 		case WITHDRAW:
-			status = withdraw(account_name, amount);
+			status = withdraw_by_id(request->account_id, request->amount);
 			break;
 		case QUERY:
-			status = query_balance(account_name);
+			{
+				money balance;
+				status = query_balance_by_id(request->account_id, &balance);
+			}
 			break;
 		case END: 
-			status = end_session(account_name);
+			status = end_session_by_id(request->account_id);
 			break;
 		default:
 			break;
@@ -584,38 +1251,14 @@ int exec_db_command(db_command command, char account_name[256], double amount)
 /* send an error message to the client
  *
  * @param1 status holds the error code of the falied command
- * @param2 client_sockfd file descriptor of client socket
+ * @param2 session the session of the client
  */
-void send_error_to_client(int status, int client_sockfd)
+void send_error_to_client(int status, client_session *session)
 {
-	char message[40] = {'\0'};
-	switch(status) {
-		case -1:
-			strcpy(message, "ERROR: Account already exists\n");
-			break;
-		case -2:
-			strcpy(message, "ERROR: Account does not exist\n");
-			break;
-		case -3:
-			strcpy(message, "ERROR: Account already in session\n");
-			break;
-		case -4:
-			strcpy(message, "ERROR: Account not in session\n");
-			break;
-		case -5:
-			strcpy(message, "ERROR: Insufficient funds\n");
-			break;
-		case -6:
-			strcpy(message, "ERROR: Must be in active session\n");
-			break;
-		case -7:
-			strcpy(message, "ERROR: Must not be in active session\n");
-			break;
-		default:
-			break;
-	}
+	char message[TEXT_REPLY_SIZE];
+	format_reply(message, 0, status, 0);
 
-	send(client_sockfd, message, sizeof(message), 0);
+	queue_reply(session, message, sizeof(message));
 	
 	return;
 }
@@ -623,35 +1266,13 @@ void send_error_to_client(int status, int client_sockfd)
 /* send success message to the client
  *
  * @param1 command the command that was executed (required)
- * @param2 balance the current balance returned by QUERY execution (optional)
- * param3 client_sockfd file descriptor of client socket (required)
+ * @param2 balance the current balance in cents returned by QUERY execution (optional)
+ * param3 session the session of the client (required)
  */
-void send_message_to_client(db_command command, double balance, int client_sockfd)
+void send_message_to_client(db_command command, money balance, client_session *session)
 {
-	char message[40] = {'\0'};
-	switch(command) {
-		case CREATE:
-			strcpy(message, "SUCCESS: New account created\n");
-			break;
-		case SERVE:
-			strcpy(message, "SUCCESS: New session started\n");
-			break;
-		case DEPOSIT:
-			strcpy(message, "SUCCESS: Deposit made\n");
-			break;
-		case WITHDRAW:
-			strcpy(message, "SUCCESS: Withdrawl made\n");
-			break;
-		case QUERY:
-			//357 because a double can be 317 chars
-			snprintf(message, 357, "Your current balance is: %f\n", balance);
-			break;
-		case END: 
-			strcpy(message, "SUCCESS: Session ended\n");
-			break;
-		default:
-			break;
-	}
+	char message[TEXT_REPLY_SIZE];
+	format_reply(message, command, 0, balance);
 
-	send(client_sockfd, message, sizeof(message), 0);
+	queue_reply(session, message, sizeof(message));
 }
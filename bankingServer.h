@@ -13,39 +13,120 @@
 #include <sys/time.h>
 #include <fcntl.h>
 #include <semaphore.h>
+#include <sys/eventfd.h>
 
 #include "database.h"
-
-/* node for linked list of service threads */
-typedef struct service_runner_id_node service_runner_id_node;
-struct service_runner_id_node {
-	pthread_t id; 			//thread id
-	service_runner_id_node *next; 	//next node
-};
+#include "protocol.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "report.h"
+#include "metrics.h"
+#include "dedup.h"
+#include "eventLoop.h"
+#include "timerWheel.h"
+#include "replication.h"
 
 /* enums */
-typedef enum _db_command{CREATE, SERVE, DEPOSIT, WITHDRAW, QUERY, END} db_command;
 typedef enum _bool{false, true} bool;
 
+/* seconds between reports of every account unless -r says otherwise */
+#define REPORT_INTERVAL 15
+
+/* clients served at once unless -c says otherwise */
+#define DEFAULT_MAX_CLIENTS 10000
+
+/* size of a client's receive buffer; holds several of the largest frame */
+#define RECV_BUFFER_SIZE 4096
+
+/* size of a client's reply buffer; no reply is larger than the request it answers,
+ * so the replies to a full receive buffer always fit, with room for the shutdown message */
+#define SEND_BUFFER_SIZE (RECV_BUFFER_SIZE + TEXT_REPLY_SIZE)
+
+/* a request parsed from either protocol */
+typedef struct client_request client_request;
+struct client_request {
+	db_command command;		//command to execute
+	char account_name[256];		//account to create or serve
+	uint32_t account_id;		//id of the session's account; set by CREATE and SERVE from the name
+	money amount;			//amount to deposit or withdraw in cents
+	uint32_t request_id;		//echoed back to binary clients
+	uint64_t client_id;		//id of a client that may retry the request (see dedup.c); 0 otherwise
+	int num_legs;					//legs of a TRANSFER or TRANSFER_BATCH
+	money leg_amounts[MAX_TRANSFER_LEGS];		//amount moved by each leg
+	char leg_accounts[MAX_TRANSFER_LEGS][256];	//account credited by each leg
+};
+
+/* state kept for each connected client */
+typedef struct client_session client_session;
+struct client_session {
+	int client_sockfd;				//client socket
+	bool active_session;				//true while an account is being served
+	char active_session_account_name[256];		//name of the account being served
+	uint32_t active_session_account_id;		//its id, which in-session commands use instead of the name
+	int active_session_segment;			//its database segment
+	wire_protocol protocol;				//decided by the first byte the client sends
+	char recv_buffer[RECV_BUFFER_SIZE];		//received bytes not yet executed
+	size_t recv_len;				//bytes in recv_buffer
+	char send_buffer[SEND_BUFFER_SIZE];		//replies not yet sent
+	size_t send_len;				//bytes in send_buffer
+	size_t send_pos;				//bytes of send_buffer already sent
+	uint32_t watched_events;			//events the reactor's epoll instance waits for on the client
+	client_session *prev;				//previous session owned by the same reactor
+	client_session *next;				//next session owned by the same reactor
+	wheel_timer timeout;				//closes the client once it has been idle or held its account too long
+	uint64_t last_active;				//tick the client last sent or took anything (see eventLoop.c)
+	bool dropped;					//closed; freed once the reactor has handled every event it was woken for
+
+	//shared-nothing mode (see eventLoop.c)
+	int reactor_index;				//reactor that accepted the client
+	bool forwarded;					//forward_request is out at another reactor; later frames wait
+	client_request forward_request;			//request executed by the reactor owning its account
+	int forward_owner;				//that reactor
+	int forward_status;				//its result
+	money forward_balance;				//balance returned by a forwarded QUERY
+	uint64_t forward_start;				//metrics_start() of the forwarded request
+	client_session *stalled_next;			//next session waiting for room in a full queue
+};
+
 /* server functions */
-int bind_to_socket(char port_num[10]);
-void * request_acceptance_runner(void* arg);
-void * client_service_runner(void* arg);
+int bind_to_socket(char port_num[10], bool reuse_port);
+void init_client_session(client_session *session, int client_sockfd);
+bool serve_client_frames(client_session *session);
+bool execute_client_frames(client_session *session);
+size_t next_frame_size(client_session *session, size_t offset);
+bool parse_text_frame(char *frame, client_request *request);
+bool parse_binary_frame(char *frame, client_request *request);
+size_t parse_transfer_leg(char *frame, client_request *request);
+void exec_client_request(client_session *session, client_request *request);
+int check_client_request(client_session *session, client_request *request);
+int execute_request(client_request *request, money *balance);
+void finish_client_request(client_session *session, client_request *request, int status, money balance, uint64_t start);
+void queue_reply(client_session *session, void *reply, size_t size);
+bool flush_replies(client_session *session);
+void send_reply_to_client(client_session *session, client_request *request, int status, money balance);
+void send_shutdown_to_client(client_session *session);
+void send_timeout_to_client(client_session *session);
+void close_client_session(client_session *session);
 db_command get_db_command(char client_message[300]);
 void parse_command_from_message(char client_message[300], char command_string[9]);
 bool account_name_needed(db_command command);
 void get_account_name(char client_message[300], char account_name[256]);
 bool amount_needed(db_command command);
-double get_amount(char client_message[300]);
+money get_amount(char client_message[300]);
 bool active_session_needed(db_command command);
-int exec_db_command(db_command command, char account_name[256], double amount);
-void send_error_to_client(int status, int client_sockfd);
-void send_message_to_client(db_command command, double balance, int client_sockfd);
-void handle_sigalrm();
-void add_id_to_list(pthread_t id, service_runner_id_node **service_id_list);
-void join_threads(service_runner_id_node *service_id_list);
-void free_service_ids(service_runner_id_node *service_id_list);
+int exec_db_command(client_request *request);
+bool is_transfer(db_command command);
+bool retryable_command(db_command command);
+bool request_on_this_shard(client_request *request);
+void get_transfer_leg(char client_message[300], client_request *request);
+int exec_transfer(char account_name[256], client_request *request);
+void send_error_to_client(int status, client_session *session);
+void send_message_to_client(db_command command, money balance, client_session *session);
+void block_server_signals(sigset_t *old_signals);
 void handle_sigint();
+void handle_sigusr1();
 void make_calls_to_socket_nonblocking(int fd);
-void shutdown_service(int client_sockfd);
 void disconnect_from_client(int client_sockfd);
+
+/* event loop functions that take a session (see eventLoop.c) */
+bool forward_client_request(client_session *session, client_request *request, uint64_t start);
@@ -1,5 +1,6 @@
 /*************************************************************************
-  This file handles all of the database operations for the banking server 
+  This file is the in-memory hash storage engine of the banking server,
+  the default engine behind database.h (see storage.c)
                                                                
    Error codes:
  	-1 account already exists
@@ -7,144 +8,837 @@
  	-3 account already in session 
  	-4 account not in session 
  	-5 insufficient funds 
+ 	-8 invalid amount (deposit would overflow the balance, or too many transfer legs)
          0 success 
+
+   Layout:
+   	accounts are split by FNV-1a hash across NUM_SEGMENTS segments;
+   	each segment has its own open addressed index that doubles when
+   	it gets MAX_LOAD_PERCENT full, migrating the old slots a few at a
+   	time on later inserts so no operation rehashes a whole table
+
+   Memory:
+   	account records are allocated in order from large slabs, and names
+   	are copied into a per-segment arena, so hash_free releases everything
+   	a slab or arena chunk at a time
+
+   Durability:
+   	when the write-ahead log is open (see wal.c), every change is
+   	applied and logged between wal_begin() and wal_end(), and waits
+   	for wal_commit() once the segment lock is released
+
+   Concurrency:
+   	every segment is guarded by its own mutex, so operations on
+   	accounts in different segments run in parallel; callers do not
+   	need any locking of their own
+   	a transfer locks only the segments of the accounts it moves money
+   	between, in ascending segment order, so transfers can't deadlock
+   	segment locks are taken with metrics_lock(), which times the wait
+   	only when a lock is already held (see metrics.c)
+   	queries never lock: the index is read under epoch protection (see
+   	epoch.c), slots are published with release stores, and replaced
+   	tables are retired rather than freed; a query retries if its
+   	segment's sequence counter shows a balance changed under it, so
+   	it never sees part of a transfer
+   	deleting an account leaves a tombstone in its slot; a slot is only
+   	reused once a resize copies the live slots into a new table
+
+   Balance modes:
+   	LOCKED_BALANCES (the default) changes a balance while holding its
+   	segment lock
+   	ATOMIC_BALANCES finds the account without any lock; records never
+   	move, so the balance is then changed by compare-and-swap, and
+   	deposits and withdrawals of one account no longer queue behind
+   	each other. A transfer still locks its segments, then flags them
+   	and waits for the deposits and withdrawals already changing them
+   	without the lock to finish; later ones see the flag and queue for
+   	the segment lock instead, so the transfer applies and checks its
+   	legs as in LOCKED_BALANCES and nobody sees or spends part of it
  **************************************************************************/
 #include "database.h"
+#include "wal.h"
+#include "epoch.h"
+#include "metrics.h"
+#include <sched.h>
 
+/* account records are packed into slabs; the name is interned in its segment's name arena
+ * so the fields touched by every operation fit two records to a cache line
+ */
 typedef struct account account;
 struct account {
-	char name[256];
-	double balance;
+	money balance;		//in cents
 	int in_session;
-	int hash;
-	account *next;
+	uint64_t hash;		//full hash of the account name
+	char *name;		//name in the segment's name arena; NULL once deleted
+};
+
+/* chunk of a segment's name arena; names are bump allocated and only freed with the arena */
+typedef struct name_chunk name_chunk;
+struct name_chunk {
+	name_chunk *next;	//previously filled chunk
+	size_t used;		//bytes of names in use
+	char names[];
 };
 
-#define SIZE_OF_DB 256
+/* slot of an index table; empty while name is NULL, deleted once name is TOMBSTONE
+ * name is stored last, with release, so a lock-free reader that sees it also sees tag and id
+ * the slot carries both the name and the record id, so the name compare and
+ * the record load of a lookup can miss the cache in parallel
+ */
+typedef struct index_slot index_slot;
+struct index_slot {
+	uint32_t tag;		//high bits of the account hash; compared before the name
+	uint32_t id;		//slab index of the account record
+	char *name;		//name of the account in the name arena
+};
+
+/* open addressed (linear probing) table of accounts */
+typedef struct index_table index_table;
+struct index_table {
+	size_t size;		//number of slots; always a power of two
+	size_t used;		//slots holding an account or a tombstone
+	index_slot slots[];
+};
+
+/* every account whose hash maps to a segment lives in that segment's index;
+ * the segment lock guards changes to the index and the accounts in it
+ */
+typedef struct segment segment;
+struct segment {
+	pthread_mutex_t lock;
+	uint32_t seq;			//odd while a balance in the segment is being changed under the lock
+	uint32_t atomic_writers;	//ATOMIC_BALANCES deposits and withdrawals changing a balance without the lock
+	uint32_t transfer_active;	//set by a transfer holding the lock; deposits and withdrawals then take the lock
+	index_table *table;		//table that new accounts are inserted into
+	index_table *old_table;		//table being migrated into table; NULL unless resizing
+	size_t migrate_pos;		//slots of old_table below this have been copied into table
+	size_t num_accounts;		//accounts in the segment
+	name_chunk *names;		//name arena; the newest chunk is first
+};
 
-account* database[SIZE_OF_DB] = {NULL};
+/* low bits of the hash pick the segment (SEGMENT_BITS, in database.h); the rest pick the slot */
+
+#define INITIAL_TABLE_SIZE 16
+
+/* a table grows once more than this percentage of its slots is used */
+#define MAX_LOAD_PERCENT 75
+
+/* slots of old_table migrated by each insert; a table is replaced when 3/4 of its slots
+ * are used, by one that the live accounts fill at most 3/8, so migrating at least
+ * 2 slots per insert always finishes before the next resize
+ */
+#define MIGRATE_SLOTS_PER_INSERT 8
+
+/* accounts are allocated in order from slabs of ACCOUNTS_PER_SLAB records */
+#define SLAB_BITS 16
+#define ACCOUNTS_PER_SLAB (1 << SLAB_BITS)
+#define MAX_SLABS (1 << 16)	//slab indexes are 32 bits
+
+#define NAME_CHUNK_SIZE 65536
+
+/* name of a deleted slot; never compared, only its address */
+char tombstone_name[] = "";
+#define TOMBSTONE tombstone_name
+
+segment database[NUM_SEGMENTS];
+
+account *slabs[MAX_SLABS];
+
+/* number of account records handed out from the slabs */
+uint32_t num_slab_accounts;
+
+/* guards allocating a new slab */
+pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* how balances are changed; see Balance modes above */
+balance_mode balances = LOCKED_BALANCES;
+
+/* allocate an empty index table
+ *
+ * @param1 size number of slots; must be a power of two
+ *
+ * @return pointer to the new table
+ */
+index_table* new_index_table(size_t size)
+{
+	index_table *table = calloc(1, sizeof(index_table) + size * sizeof(index_slot));
+	table->size = size;
+	return table;
+}
+
+/* initialize the segments
+ *
+ * @param1 option unused; the hash engine takes no options
+ *
+ * @return 0
+ */
+int hash_init(char *option)
+{
+	(void)option;
+
+	int i;
+	for(i = 0; i < NUM_SEGMENTS; i++) {
+		pthread_mutex_init(&database[i].lock, NULL);
+		database[i].seq = 0;
+		database[i].atomic_writers = 0;
+		database[i].transfer_active = 0;
+		database[i].table = new_index_table(INITIAL_TABLE_SIZE);
+		database[i].old_table = NULL;
+		database[i].migrate_pos = 0;
+		database[i].num_accounts = 0;
+		database[i].names = NULL;
+	}
+
+	return 0;
+}
+
+/* choose how balances are changed; must not be called while other threads use the database
+ * only the hash engine has balance modes; the others ignore it
+ *
+ * @param1 mode LOCKED_BALANCES or ATOMIC_BALANCES
+ */
+void set_balance_mode(balance_mode mode)
+{
+	balances = mode;
+}
+
+/* get the record with a given slab index, allocating its slab if needed;
+ * safe to call from any segment without holding another lock
+ *
+ * @param1 id slab index of the record
+ *
+ * @return pointer to the record
+ */
+account* get_slab_record(uint32_t id)
+{
+	size_t slab = id >> SLAB_BITS;
+
+	account *records = __atomic_load_n(&slabs[slab], __ATOMIC_ACQUIRE);
+	if(!records) {
+		pthread_mutex_lock(&slab_lock);
+		records = slabs[slab];
+		if(!records) {
+			records = calloc(ACCOUNTS_PER_SLAB, sizeof(account));
+			__atomic_store_n(&slabs[slab], records, __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&slab_lock);
+	}
+
+	return &records[id & (ACCOUNTS_PER_SLAB - 1)];
+}
+
+/* take the next free record from the slabs
+ *
+ * @param1 id pointer in which to put the slab index of the record
+ *
+ * @return pointer to the record
+ */
+account* alloc_account(uint32_t *id)
+{
+	*id = __atomic_fetch_add(&num_slab_accounts, 1, __ATOMIC_RELAXED);
+	return get_slab_record(*id);
+}
+
+/* get an account record from its slab index
+ *
+ * @param1 id slab index of the record
+ *
+ * @return pointer to the record
+ */
+account* get_account_by_id(uint32_t id)
+{
+	return &slabs[id >> SLAB_BITS][id & (ACCOUNTS_PER_SLAB - 1)];
+}
+
+/* copy a name into the segment's name arena;
+ * caller must hold the segment lock
+ *
+ * @param1 seg the segment the account belongs to
+ * @param2 account_name name to copy
+ *
+ * @return pointer to the copy
+ */
+char* intern_name(segment *seg, char account_name[256])
+{
+	size_t len = strlen(account_name) + 1;
+
+	if(!seg->names || seg->names->used + len > NAME_CHUNK_SIZE) {
+		name_chunk *chunk = malloc(sizeof(name_chunk) + NAME_CHUNK_SIZE);
+		chunk->next = seg->names;
+		chunk->used = 0;
+		seg->names = chunk;
+	}
+
+	char *name = seg->names->names + seg->names->used;
+	memcpy(name, account_name, len);
+	seg->names->used += len;
+
+	return name;
+}
 
 /*
- * hash an account name 
+ * hash an account name with 64 bit FNV-1a
  *
  * @param1 account_name name of the account 
  *
- * return int the hash value
+ * return uint64_t the hash value
  */
-int hash_account_name(char account_name[256]) 
+uint64_t hash_account_name(char account_name[256]) 
 {
-	int i;
-	int sum = 0;
-	for(i = 0; i < strlen(account_name); i++) {
-		sum += account_name[i];
+	uint64_t hash = 14695981039346656037ULL;
+	unsigned char *ptr = (unsigned char*) account_name;
+	while(*ptr) {
+		hash ^= *ptr;
+		hash *= 1099511628211ULL;
+		ptr++;
 	}
-	return sum % SIZE_OF_DB;
+	return hash;
 }
 
-/* insert into linked list of database;
- * helper function for insert_into_db to resolve collisions
+/* get the segment an account belongs to
  *
- * @param1 new_account the account to be inserted
+ * @param1 hash hash of the account name
  *
- * @return -1 if account already exists 
- *          0 if successful
+ * @return pointer to the segment
+ */
+segment* get_segment(uint64_t hash)
+{
+	return &database[hash & (NUM_SEGMENTS - 1)];
+}
+
+/* get the number of the segment an account belongs to, so callers can
+ * split accounts between threads along segment lines
+ *
+ * @param1 account_name name of the account
+ *
+ * @return the segment number, below NUM_SEGMENTS
+ */
+int account_segment(char account_name[256])
+{
+	return hash_account_name(account_name) & (NUM_SEGMENTS - 1);
+}
+
+/* find the slot of an account in a single index table; safe without the segment lock
+ * inside epoch_enter() and epoch_exit()
+ *
+ * @param1 table the table to search
+ * @param2 account_name name of account
+ * @param3 hash hash of the account name
+ *
+ * @return pointer to the slot if found 
+ *         NULL if account not found
  */
-int insert_into_list(account* new_account)
+index_slot* find_slot(index_table *table, char account_name[256], uint64_t hash)
 {
-	account *ptr = database[new_account->hash];
-	account *prev = NULL;
-	while(ptr) {
-		//account already exists
-		if(strcmp(ptr->name, new_account->name) == 0) return -1;
+	uint32_t tag = hash >> 32;
+	size_t mask = table->size - 1;
+	size_t i = (hash >> SEGMENT_BITS) & mask;
 
-		prev = ptr;
-		ptr = ptr->next;
+	char *name;
+	while((name = __atomic_load_n(&table->slots[i].name, __ATOMIC_ACQUIRE))) {
+		//compare the tag first so most mismatches skip the strcmp
+		if(name != TOMBSTONE && table->slots[i].tag == tag && strcmp(name, account_name) == 0) {
+			return &table->slots[i];
+		}
+		i = (i + 1) & mask;
 	}
 
-	prev->next = new_account;
+	return NULL;
+}
+
+/* find an account in a single index table
+ *
+ * @param1 table the table to search
+ * @param2 account_name name of account
+ * @param3 hash hash of the account name
+ *
+ * @return pointer to account if found 
+ *         NULL if account not found
+ */
+account* find_in_table(index_table *table, char account_name[256], uint64_t hash)
+{
+	index_slot *slot = find_slot(table, account_name, hash);
 
-	return 0;
+	return slot ? get_account_by_id(slot->id) : NULL;
 }
 
-/* insert account into database 
+/* put an account into the first free slot of its probe sequence;
+ * the caller has already checked that the account is not in the table
  *
- * @param1 the account to be inserted 
+ * @param1 table the table to insert into
+ * @param2 hash hash of the account name
+ * @param3 id slab index of the account record
+ * @param4 name name of the account in the name arena
+ */
+void insert_into_table(index_table *table, uint64_t hash, uint32_t id, char *name)
+{
+	size_t mask = table->size - 1;
+	size_t i = (hash >> SEGMENT_BITS) & mask;
+	while(table->slots[i].name) {
+		i = (i + 1) & mask;
+	}
+
+	table->slots[i].tag = hash >> 32;
+	table->slots[i].id = id;
+	__atomic_store_n(&table->slots[i].name, name, __ATOMIC_RELEASE);
+	table->used++;
+}
+
+/* copy the next few live slots of old_table into table; retires old_table once every slot is copied
+ * caller must hold the segment lock
  *
- * @return -1 if account already exists 
- *          0 if successful 
+ * @param1 seg the segment being resized
+ * @param2 num_slots number of old slots to migrate
  */
-int insert_into_db(account *new_account)
+void migrate_slots(segment *seg, size_t num_slots)
 {
-	if(database[new_account->hash]) {
-		//returns -1 if account exists; 0 if successful
-		return insert_into_list(new_account);
+	index_table *old_table = seg->old_table;
+	if(!old_table) return;
+
+	while(num_slots > 0 && seg->migrate_pos < old_table->size) {
+		index_slot *slot = &old_table->slots[seg->migrate_pos];
+		if(slot->name && slot->name != TOMBSTONE)
+			insert_into_table(seg->table, get_account_by_id(slot->id)->hash, slot->id, slot->name);
+
+		seg->migrate_pos++;
+		num_slots--;
+	}
+
+	//lock-free readers may still be probing the old table, so it is freed once they have left
+	if(seg->migrate_pos == old_table->size) {
+		__atomic_store_n(&seg->old_table, NULL, __ATOMIC_RELEASE);
+		seg->migrate_pos = 0;
+		epoch_retire(old_table);
 	}
+}
 
-	database[new_account->hash] = new_account;
+/* replace the segment's table if one more account would exceed the load factor;
+ * the new table is doubled unless dropping tombstones leaves the live accounts enough room
+ * only allocates the new table, the slots are migrated a few at a time by later inserts
+ * caller must hold the segment lock
+ *
+ * @param1 seg the segment an account is about to be inserted into
+ */
+void grow_if_needed(segment *seg)
+{
+	size_t size = seg->table->size;
+	if((seg->table->used + 1) * 100 <= size * MAX_LOAD_PERCENT) return;
 
-	return 0;
+	//previous resize has not finished; finish it before starting another
+	if(seg->old_table) migrate_slots(seg, seg->old_table->size);
+
+	if((seg->num_accounts + 1) * 200 > size * MAX_LOAD_PERCENT) size *= 2;
+
+	//old_table is published first, so a reader that sees the new table also finds the old one
+	__atomic_store_n(&seg->old_table, seg->table, __ATOMIC_RELEASE);
+	__atomic_store_n(&seg->table, new_index_table(size), __ATOMIC_RELEASE);
+	seg->migrate_pos = 0;
+}
+
+/* find the slot of an account in its segment;
+ * caller must hold the lock of the account's segment
+ *
+ * @param1 seg the segment of the account
+ * @param2 account_name name of account 
+ * @param3 hash hash of the account name
+ *
+ * @return pointer to the slot, which holds the account's slab index, if found 
+ *         NULL if account not found
+ */
+index_slot* get_account_slot(segment *seg, char account_name[256], uint64_t hash)
+{
+	index_slot *slot = find_slot(seg->table, account_name, hash);
+
+	//slots not yet migrated are only in the old table
+	if(!slot && seg->old_table)
+		slot = find_slot(seg->old_table, account_name, hash);
+
+	return slot;
+}
+
+/* retrieve account from database;
+ * caller must hold the lock of the account's segment
+ *
+ * @param1 seg the segment of the account
+ * @param2 account_name name of account 
+ * @param3 hash hash of the account name
+ *
+ * @return pointer to account if found 
+ *         NULL if account not found
+ */
+account* get_account(segment *seg, char account_name[256], uint64_t hash)
+{
+	index_slot *slot = get_account_slot(seg, account_name, hash);
+
+	return slot ? get_account_by_id(slot->id) : NULL;
+}
+
+/* retrieve account from database without taking the segment lock;
+ * caller must be between epoch_enter() and epoch_exit()
+ *
+ * @param1 seg the segment of the account
+ * @param2 account_name name of account 
+ * @param3 hash hash of the account name
+ *
+ * @return pointer to account if found 
+ *         NULL if account not found
+ */
+account* find_account(segment *seg, char account_name[256], uint64_t hash)
+{
+	//both tables are loaded before either is searched: if the old table has gone by the
+	//time it is loaded, its last slots were copied into the new one before the search
+	index_table *table = __atomic_load_n(&seg->table, __ATOMIC_ACQUIRE);
+	index_table *old_table = __atomic_load_n(&seg->old_table, __ATOMIC_ACQUIRE);
+
+	account *account = find_in_table(table, account_name, hash);
+	if(!account && old_table) account = find_in_table(old_table, account_name, hash);
+
+	return account;
 }
 
-/* retrieve account from database 
+/* find an account without taking any lock;
+ * the record stays valid afterwards because records never move and are never freed
  *
  * @param1 account_name name of account 
  *
  * @return pointer to account if found 
  *         NULL if account not found
  */
-account* get_account(char account_name[256])
+account* lookup_account(char account_name[256])
 {
-	account *ptr = database[hash_account_name(account_name)];
-	while(ptr) {
-		//found account
-		if(strcmp(ptr->name, account_name) == 0) {
-			return ptr;
-		}
-		ptr = ptr->next;
+	uint64_t hash = hash_account_name(account_name);
+
+	epoch_enter();
+	account *account = find_account(get_segment(hash), account_name, hash);
+	epoch_exit();
+
+	return account;
+}
+
+/* mark the start of a balance change for lock-free readers;
+ * caller must hold the segment lock
+ *
+ * @param1 seg the segment of the account about to change
+ */
+void begin_balance_change(segment *seg)
+{
+	__atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* mark the end of a balance change started with begin_balance_change() */
+void end_balance_change(segment *seg)
+{
+	__atomic_store_n(&seg->seq, seg->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* read a balance without the segment lock, retrying if a change was under way
+ *
+ * @param1 seg the segment of the account
+ * @param2 account the account to read
+ *
+ * @return the balance in cents
+ */
+money read_balance(segment *seg, account *account)
+{
+	while(1) {
+		uint32_t seq = __atomic_load_n(&seg->seq, __ATOMIC_ACQUIRE);
+		money balance = __atomic_load_n(&account->balance, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if(!(seq & 1) && seq == __atomic_load_n(&seg->seq, __ATOMIC_RELAXED)) return balance;
+
+		//the writer holds the segment lock; let it finish rather than spin against it
+		if(seq & 1) sched_yield();
 	}
+}
 
-	//account not found
-	return NULL;
+/* add to a balance with compare-and-swap unless the result would leave [0, MONEY_MAX]
+ *
+ * @param1 account the account to change
+ * @param2 lowest the balance must be at least -lowest
+ * @param3 highest the balance must be at most MONEY_MAX - highest
+ * @param4 change amount to add to the balance in cents; between lowest and highest
+ *
+ * @return -5 if the balance is below -lowest
+ *         -8 if the balance is above MONEY_MAX - highest
+ *          0 if successful
+ */
+int add_to_balance(account *account, money lowest, money highest, money change)
+{
+	money balance = __atomic_load_n(&account->balance, __ATOMIC_RELAXED);
+	do {
+		//not enough money
+		if(balance < -lowest) return -5;
+
+		//balance would not fit a money
+		if(balance > MONEY_MAX - highest) return -8;
+
+	} while(!__atomic_compare_exchange_n(&account->balance, &balance, balance + change, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return 0;
+}
+
+/* deposit or withdraw in ATOMIC_BALANCES mode
+ * with the log open the change is applied and logged under the log lock, so
+ * the log still sees changes in the order they were applied
+ *
+ * @param1 account the account, found without a lock; NULL if it was not found
+ * @param2 type WAL_DEPOSIT or WAL_WITHDRAW
+ * @param3 amount amount to be deposited or withdrawn in cents
+ *
+ * @return see hash_deposit() and hash_withdraw()
+ */
+int change_balance_atomically(account *account, wal_record_type type, money amount)
+{
+	//account does not exist
+	if(!account) return -2;
+
+	//a transfer in the segment must see no change but its own; wait behind its lock if one is under way
+	segment *seg = get_segment(account->hash);
+	int locked = 0;
+	__atomic_add_fetch(&seg->atomic_writers, 1, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&seg->transfer_active, __ATOMIC_SEQ_CST)) {
+		__atomic_sub_fetch(&seg->atomic_writers, 1, __ATOMIC_RELEASE);
+		metrics_lock(&seg->lock, SEGMENT_LOCK);
+		locked = 1;
+	}
+
+	uint64_t lsn = 0;
+	wal_begin();
+
+	int status;
+
+	//deleted since it was found; checked under the log lock so the log never has a change after a delete
+	char *name = __atomic_load_n(&account->name, __ATOMIC_ACQUIRE);
+	if(!name) status = -2;
+
+	else if(type == WAL_DEPOSIT) status = add_to_balance(account, 0, amount, amount);
+	else status = add_to_balance(account, -amount, 0, -amount);
+
+	if(status == 0) lsn = wal_append(type, name, amount);
+
+	wal_end();
+
+	if(locked) pthread_mutex_unlock(&seg->lock);
+	else __atomic_sub_fetch(&seg->atomic_writers, 1, __ATOMIC_RELEASE);
+
+	wal_commit(lsn);
+
+	return status;
+}
+
+/* keep ATOMIC_BALANCES deposits and withdrawals out of segments a transfer has locked,
+ * waiting for those already changing a balance without the lock to finish;
+ * caller must hold the lock of every segment, and must not hold the log lock
+ *
+ * @param1 segs the segments
+ * @param2 num_segs number of segments
+ */
+void exclude_atomic_writers(segment **segs, int num_segs)
+{
+	int i;
+	for(i = 0; i < num_segs; i++) {
+		__atomic_store_n(&segs[i]->transfer_active, 1, __ATOMIC_SEQ_CST);
+	}
+
+	for(i = 0; i < num_segs; i++) {
+		while(__atomic_load_n(&segs[i]->atomic_writers, __ATOMIC_ACQUIRE) != 0) sched_yield();
+	}
+}
+
+/* let ATOMIC_BALANCES deposits and withdrawals change the segments without the lock again
+ *
+ * @param1 segs the segments
+ * @param2 num_segs number of segments
+ */
+void admit_atomic_writers(segment **segs, int num_segs)
+{
+	int i;
+	for(i = 0; i < num_segs; i++) {
+		__atomic_store_n(&segs[i]->transfer_active, 0, __ATOMIC_RELEASE);
+	}
+}
+
+/* insert account into database;
+ * caller must hold the lock of the account's segment
+ * and has already checked that the account does not exist
+ *
+ * @param1 seg the segment of the account
+ * @param2 id slab index of the new account
+ * @param3 new_account the account to be inserted 
+ */
+void insert_into_db(segment *seg, uint32_t id, account *new_account)
+{
+	grow_if_needed(seg);
+	migrate_slots(seg, MIGRATE_SLOTS_PER_INSERT);
+
+	insert_into_table(seg->table, new_account->hash, id, new_account->name);
+	seg->num_accounts++;
 }
 
 /* create a new account 
  *
  * @param1 account_name name of account 
+ * @param2 account_id pointer in which to put the new account's slab index; may be NULL
  *
  * @return -1 if account already exists 
  *          0 if successful
  */
-int create_account(char account_name[256]) 
+int hash_create_account(char account_name[256], uint32_t *account_id)
+{
+	uint64_t hash = hash_account_name(account_name);
+	segment *seg = get_segment(hash);
+	metrics_lock(&seg->lock, SEGMENT_LOCK);
+
+	int status = 0;
+	uint64_t lsn = 0;
+
+	//account already exists
+	if(get_account(seg, account_name, hash)) {
+		status = -1;
+	} else {
+		wal_begin();
+
+		uint32_t id;
+		account *new_account = alloc_account(&id);
+		new_account->name = intern_name(seg, account_name);
+		new_account->balance = 0;
+		new_account->in_session = 0;
+		new_account->hash = hash;
+
+		insert_into_db(seg, id, new_account);
+		if(account_id) *account_id = id;
+
+		lsn = wal_append(WAL_CREATE, account_name, 0);
+		wal_end();
+	}
+
+	pthread_mutex_unlock(&seg->lock);
+
+	wal_commit(lsn);
+
+	return status;
+}
+
+/* size every segment's table for a number of accounts so loading them never resizes;
+ * only valid on an empty database
+ *
+ * @param1 num_accounts number of accounts about to be loaded
+ */
+void hash_reserve(size_t num_accounts)
+{
+	size_t per_segment = num_accounts / NUM_SEGMENTS + 1;
+
+	size_t size = INITIAL_TABLE_SIZE;
+	while(per_segment * 100 > size * MAX_LOAD_PERCENT) size *= 2;
+
+	int i;
+	for(i = 0; i < NUM_SEGMENTS; i++) {
+		if(database[i].num_accounts != 0 || database[i].table->size >= size) continue;
+
+		free(database[i].table);
+		database[i].table = new_index_table(size);
+	}
+}
+
+/* put an account from a snapshot back into the database at its original slab index;
+ * the change is not logged
+ * safe to call from several threads at once
+ *
+ * @param1 id slab index the account had when the snapshot was taken
+ * @param2 account_name name of account 
+ * @param3 hash hash of the account name
+ * @param4 balance balance of the account in cents
+ *
+ * @return -1 if the account already exists
+ *          0 if successful
+ */
+int hash_load_account(uint32_t id, char account_name[256], uint64_t hash, money balance)
 {
-	account *new_account = malloc(sizeof(account));
-	strcpy(new_account->name, account_name);
-	new_account-> balance = 0.0;
+	segment *seg = get_segment(hash);
+	metrics_lock(&seg->lock, SEGMENT_LOCK);
+
+	//a snapshot never holds a name twice, but a bulk import may (see bankingBulk.c)
+	if(get_account(seg, account_name, hash)) {
+		pthread_mutex_unlock(&seg->lock);
+		return -1;
+	}
+
+	account *new_account = get_slab_record(id);
+	new_account->name = intern_name(seg, account_name);
+	new_account->balance = balance;
 	new_account->in_session = 0;
-	new_account->hash = hash_account_name(account_name);
+	new_account->hash = hash;
+
+	insert_into_db(seg, id, new_account);
+
+	pthread_mutex_unlock(&seg->lock);
+
+	return 0;
+}
 
-	return insert_into_db(new_account);
+/* finish loading a snapshot; new accounts are given slab indexes after the loaded ones
+ *
+ * @param1 num_records number of slab indexes used by the snapshot
+ */
+void hash_finish_load(uint32_t num_records)
+{
+	if(num_records > num_slab_accounts) num_slab_accounts = num_records;
 }
 
-/* start new session 
+/* start new session; the only lookup by name a session makes, as the session
+ * goes on to use the slab index
  *
  * @param1 account_name name of account
+ * @param2 account_id pointer in which to put the account's slab index; may be NULL
  *
  * @return -2 if account does not exist 
  *         -3 if account is already in session 
  *          0 if successful
  */
-int start_session(char account_name[256]) 
+int hash_start_session(char account_name[256], uint32_t *account_id)
 {
-	account *account = get_account(account_name);
+	uint64_t hash = hash_account_name(account_name);
+	segment *seg = get_segment(hash);
+	metrics_lock(&seg->lock, SEGMENT_LOCK);
+
+	int status = 0;
+	index_slot *slot = get_account_slot(seg, account_name, hash);
+	account *account = slot ? get_account_by_id(slot->id) : NULL;
 
 	//account does not exist 
-	if(!account) return -2;
+	if(!account) status = -2;
 
 	//already in session
-	if(account->in_session) return -3;
+	else if(account->in_session) status = -3;
+
+	else {
+		account->in_session = 1;
+		if(account_id) *account_id = slot->id;
+	}
 
-	account->in_session = 1;
+	pthread_mutex_unlock(&seg->lock);
 
+	return status;
+}
+
+/* end the session of a locked account
+ * caller must hold the lock of the account's segment
+ *
+ * @param1 account the account; NULL if it was not found
+ *
+ * @return see hash_end_session()
+ */
+int end_session_locked(account *account)
+{
+	//account does not exist 
+	if(!account || !account->name) return -2;
+
+	//account not in session
+	if(!account->in_session) return -4;
+
+	account->in_session = 0;
 	return 0;
 }
 
@@ -156,114 +850,497 @@ int start_session(char account_name[256])
  *         -4 if account is already not in session 
  *          0 if successful
  */
-int end_session(char account_name[256])
+int hash_end_session(char account_name[256])
 {
-	account *account = get_account(account_name);
+	uint64_t hash = hash_account_name(account_name);
+	segment *seg = get_segment(hash);
+	metrics_lock(&seg->lock, SEGMENT_LOCK);
 
-	//account does not exist 
-	if(!account) return -2;
+	int status = end_session_locked(get_account(seg, account_name, hash));
 
-	//account not in session
-	if(!account->in_session) return -4;
+	pthread_mutex_unlock(&seg->lock);
 
-	account->in_session = 0;
+	return status;
+}
 
-	return 0;
+/* end session of an account given by the slab index hash_start_session() returned
+ *
+ * @param1 account_id slab index of the account
+ *
+ * @return see hash_end_session()
+ */
+int hash_end_session_by_id(uint32_t account_id)
+{
+	account *account = get_account_by_id(account_id);
+	segment *seg = get_segment(account->hash);
+	metrics_lock(&seg->lock, SEGMENT_LOCK);
+
+	int status = end_session_locked(account);
+
+	pthread_mutex_unlock(&seg->lock);
+
+	return status;
 }
 
-/* deposit into account 
+/* delete an account; its slab index is never reused
  *
- * @param1 account_name name of account 
- * @param2 amount double value of amount to be deposited
+ * @param1 account_name name of account
  *
  * @return -2 if account does not exist 
+ *         -3 if account is in session 
  *          0 if successful
  */
-int deposit(char account_name[256], double amount)
+int hash_delete_account(char account_name[256])
+{
+	uint64_t hash = hash_account_name(account_name);
+	segment *seg = get_segment(hash);
+	metrics_lock(&seg->lock, SEGMENT_LOCK);
+
+	int status = 0;
+	uint64_t lsn = 0;
+	account *account = get_account(seg, account_name, hash);
+
+	//account does not exist 
+	if(!account) status = -2;
+
+	//in use by a client
+	else if(account->in_session) status = -3;
+
+	else {
+		wal_begin();
+
+		//a migrated account has a slot in both tables
+		index_slot *slot = find_slot(seg->table, account_name, hash);
+		if(slot) __atomic_store_n(&slot->name, TOMBSTONE, __ATOMIC_RELEASE);
+
+		if(seg->old_table && (slot = find_slot(seg->old_table, account_name, hash)))
+			__atomic_store_n(&slot->name, TOMBSTONE, __ATOMIC_RELEASE);
+
+		//lock-free readers that found the record before the tombstones may still use it,
+		//so the record is only marked deleted; snapshots and reports skip it from now on
+		__atomic_store_n(&account->name, NULL, __ATOMIC_RELEASE);
+		seg->num_accounts--;
+
+		lsn = wal_append(WAL_DELETE, account_name, 0);
+		wal_end();
+	}
+
+	pthread_mutex_unlock(&seg->lock);
+
+	wal_commit(lsn);
+
+	return status;
+}
+
+/* deposit or withdraw in LOCKED_BALANCES mode
+ * caller must hold the lock of the account's segment, and commits lsn once it is released
+ *
+ * @param1 seg the segment of the account
+ * @param2 account the account; NULL if it was not found
+ * @param3 type WAL_DEPOSIT or WAL_WITHDRAW
+ * @param4 amount amount to be deposited or withdrawn in cents
+ * @param5 lsn pointer in which to put the log sequence number of the change
+ *
+ * @return see hash_deposit() and hash_withdraw()
+ */
+int change_balance_locked(segment *seg, account *account, wal_record_type type, money amount, uint64_t *lsn)
 {
-	account *account = get_account(account_name);
-	
 	//account does not exist
-	if(!account) return -2;
+	if(!account || !account->name) return -2;
 
-	account->balance += amount;
+	//balance would not fit a money
+	if(type == WAL_DEPOSIT && account->balance > MONEY_MAX - amount) return -8;
+
+	//not enough money
+	if(type == WAL_WITHDRAW && account->balance < amount) return -5;
+
+	wal_begin();
+	begin_balance_change(seg);
+	account->balance += (type == WAL_DEPOSIT) ? amount : -amount;
+	end_balance_change(seg);
+	*lsn = wal_append(type, account->name, amount);
+	wal_end();
 
 	return 0;
 }
 
+/* deposit into or withdraw from an account found by name
+ *
+ * @param1 account_name name of account 
+ * @param2 type WAL_DEPOSIT or WAL_WITHDRAW
+ * @param3 amount amount to be deposited or withdrawn in cents
+ *
+ * @return see hash_deposit() and hash_withdraw()
+ */
+int change_balance(char account_name[256], wal_record_type type, money amount)
+{
+	if(balances == ATOMIC_BALANCES) return change_balance_atomically(lookup_account(account_name), type, amount);
+
+	uint64_t hash = hash_account_name(account_name);
+	segment *seg = get_segment(hash);
+	metrics_lock(&seg->lock, SEGMENT_LOCK);
+
+	uint64_t lsn = 0;
+	int status = change_balance_locked(seg, get_account(seg, account_name, hash), type, amount, &lsn);
+
+	pthread_mutex_unlock(&seg->lock);
+
+	wal_commit(lsn);
+
+	return status;
+}
+
+/* deposit into or withdraw from an account given by its slab index; no name is hashed or compared
+ *
+ * @param1 account_id slab index of the account
+ * @param2 type WAL_DEPOSIT or WAL_WITHDRAW
+ * @param3 amount amount to be deposited or withdrawn in cents
+ *
+ * @return see hash_deposit() and hash_withdraw()
+ */
+int change_balance_by_id(uint32_t account_id, wal_record_type type, money amount)
+{
+	account *account = get_account_by_id(account_id);
+
+	if(balances == ATOMIC_BALANCES) return change_balance_atomically(account, type, amount);
+
+	segment *seg = get_segment(account->hash);
+	metrics_lock(&seg->lock, SEGMENT_LOCK);
+
+	uint64_t lsn = 0;
+	int status = change_balance_locked(seg, account, type, amount, &lsn);
+
+	pthread_mutex_unlock(&seg->lock);
+
+	wal_commit(lsn);
+
+	return status;
+}
+
+/* deposit into account 
+ *
+ * @param1 account_name name of account 
+ * @param2 amount amount to be deposited in cents
+ *
+ * @return -2 if account does not exist 
+ *         -8 if the balance would overflow
+ *          0 if successful
+ */
+int hash_deposit(char account_name[256], money amount)
+{
+	return change_balance(account_name, WAL_DEPOSIT, amount);
+}
+
 /* withdraw from account 
  *
  * @param1 account_name name of account 
- * @param2 amount double value of amount to be withdrawn 
+ * @param2 amount amount to be withdrawn in cents
  *
  * @return -2 if account does not exist 
  *         -5 if insufficient funds 
  *          0 if successful 
  */
-int withdraw(char account_name[255], double amount) 
+int hash_withdraw(char account_name[256], money amount) 
 {
-	account *account = get_account(account_name);
-
-	//account does not exist 
-	if(!account) return -2;
-
-	//not enough money
-	if(account->balance - amount < 0) return -5;
+	return change_balance(account_name, WAL_WITHDRAW, amount);
+}
 
-	account->balance -= amount;
+/* deposit into account given by its slab index; see hash_deposit() */
+int hash_deposit_by_id(uint32_t account_id, money amount)
+{
+	return change_balance_by_id(account_id, WAL_DEPOSIT, amount);
+}
 
-	return 0;
+/* withdraw from account given by its slab index; see hash_withdraw() */
+int hash_withdraw_by_id(uint32_t account_id, money amount)
+{
+	return change_balance_by_id(account_id, WAL_WITHDRAW, amount);
 }
 
 /* retrieve account balance 
  *
  * @param1 account_name name of account
+ * @param2 balance pointer in which to put the balance in cents
  *
  * @return -2 if account does not exist 
- *          account balance if successful
+ *          0 if successful
  */
-double query_balance(char account_name[255])
+int hash_query_balance(char account_name[256], money *balance)
 {
-	account *account = get_account(account_name);
+	uint64_t hash = hash_account_name(account_name);
+	segment *seg = get_segment(hash);
+
+	epoch_enter();
+	account *account = find_account(seg, account_name, hash);
+	epoch_exit();
 
 	//account does not exist 
 	if(!account) return -2;
 
-	return account->balance;
+	*balance = read_balance(seg, account);
+
+	return 0;
+}
+
+/* retrieve balance of an account given by its slab index; records never move, so no lock or epoch is needed
+ *
+ * @param1 account_id slab index of the account
+ * @param2 balance pointer in which to put the balance in cents
+ *
+ * @return see hash_query_balance()
+ */
+int hash_query_balance_by_id(uint32_t account_id, money *balance)
+{
+	account *account = get_account_by_id(account_id);
+
+	//deleted
+	if(!__atomic_load_n(&account->name, __ATOMIC_ACQUIRE)) return -2;
+
+	*balance = read_balance(get_segment(account->hash), account);
+
+	return 0;
+}
+
+/* apply a transfer: the legs are applied in order, undoing the ones already applied if one fails
+ * caller must hold the segment lock of every account involved, and in ATOMIC_BALANCES mode
+ * have kept out the deposits and withdrawals that take no lock (see exclude_atomic_writers())
+ *
+ * @param1 from debited account of each leg
+ * @param2 to credited account of each leg
+ * @param3 legs the legs of the transfer
+ * @param4 num_legs number of legs
+ *
+ * @return see hash_transfer_batch()
+ */
+int apply_transfer_locked(account **from, account **to, transfer_leg *legs, int num_legs)
+{
+	int status = 0;
+	int applied = 0;
+	while(status == 0 && applied < num_legs) {
+		transfer_leg *leg = &legs[applied];
+
+		//not enough money
+		if(from[applied]->balance < leg->amount) status = -5;
+
+		//balance would not fit a money
+		else if(from[applied] != to[applied] && to[applied]->balance > MONEY_MAX - leg->amount) status = -8;
+
+		else {
+			from[applied]->balance -= leg->amount;
+			to[applied]->balance += leg->amount;
+			applied++;
+		}
+	}
+
+	int i;
+	if(status != 0) {
+		for(i = applied - 1; i >= 0; i--) {
+			to[i]->balance -= legs[i].amount;
+			from[i]->balance += legs[i].amount;
+		}
+	}
+
+	return status;
 }
 
-/* print account information for single account */
-void print_account_info(account* account) 
+/* order segments by address, which is their index in database */
+int compare_segments(const void *a, const void *b)
 {
-	char* in_session = (account->in_session) ? "IN SERVICE" : "";
+	segment *x = *(segment* const*) a;
+	segment *y = *(segment* const*) b;
 
-	printf("%s\t%f\t%s\n\n", account->name, account->balance, in_session);
+	return (x > y) - (x < y);
 }
 
-/* print the database */
-void print_db()
+/* move money along every leg, in order, as one change: either every leg is applied
+ * and logged together or none is; a leg may spend money credited by an earlier one
+ *
+ * @param1 legs the legs of the transfer
+ * @param2 num_legs number of legs; at most MAX_TRANSFER_LEGS
+ *
+ * @return -2 if any account does not exist 
+ *         -5 if a leg would overdraw its account
+ *         -8 if a leg would overflow its account, or there are too many legs
+ *          0 if successful
+ */
+int hash_transfer_batch(transfer_leg *legs, int num_legs)
 {
+	if(num_legs < 1 || num_legs > MAX_TRANSFER_LEGS) return -8;
+
+	uint64_t from_hash[MAX_TRANSFER_LEGS], to_hash[MAX_TRANSFER_LEGS];
+	segment *segs[2 * MAX_TRANSFER_LEGS];
+
 	int i;
-	for(i = 0; i < SIZE_OF_DB; i++) {
-		account *ptr = database[i];
-		while(ptr) {
-			print_account_info(ptr);
-			ptr = ptr->next;
+	for(i = 0; i < num_legs; i++) {
+		from_hash[i] = hash_account_name(legs[i].from);
+		to_hash[i] = hash_account_name(legs[i].to);
+		segs[2 * i] = get_segment(from_hash[i]);
+		segs[2 * i + 1] = get_segment(to_hash[i]);
+	}
+
+	//lock each segment involved once, always in the same order
+	qsort(segs, 2 * num_legs, sizeof(segment*), compare_segments);
+
+	int num_segs = 0;
+	for(i = 0; i < 2 * num_legs; i++) {
+		if(num_segs > 0 && segs[num_segs - 1] == segs[i]) continue;
+		segs[num_segs++] = segs[i];
+		metrics_lock(&segs[num_segs - 1]->lock, SEGMENT_LOCK);
+	}
+
+	int status = 0;
+	uint64_t lsn = 0;
+	account *from[MAX_TRANSFER_LEGS], *to[MAX_TRANSFER_LEGS];
+
+	for(i = 0; i < num_legs && status == 0; i++) {
+		from[i] = get_account(get_segment(from_hash[i]), legs[i].from, from_hash[i]);
+		to[i] = get_account(get_segment(to_hash[i]), legs[i].to, to_hash[i]);
+
+		//account does not exist
+		if(!from[i] || !to[i]) status = -2;
+	}
+
+	if(status == 0) {
+		//in ATOMIC_BALANCES mode nothing else may change the balances until every leg is in
+		if(balances == ATOMIC_BALANCES) exclude_atomic_writers(segs, num_segs);
+
+		//queries of any account involved wait until every leg has been applied or undone
+		for(i = 0; i < num_segs; i++) {
+			begin_balance_change(segs[i]);
 		}
+
+		//the balances change under the log lock, so the log sees them in the order they were
+		//applied and a checkpoint never snapshots a transfer whose record is in a later generation
+		wal_begin();
+		status = apply_transfer_locked(from, to, legs, num_legs);
+		if(status == 0) lsn = wal_append_transfer(legs, num_legs);
+		wal_end();
+
+		for(i = 0; i < num_segs; i++) {
+			end_balance_change(segs[i]);
+		}
+
+		if(balances == ATOMIC_BALANCES) admit_atomic_writers(segs, num_segs);
+	}
+
+	for(i = num_segs - 1; i >= 0; i--) {
+		pthread_mutex_unlock(&segs[i]->lock);
+	}
+
+	wal_commit(lsn);
+
+	return status;
+}
+
+/* call a function on every account record in slab order without taking any lock;
+ * used by a forked snapshot or report child, which has a frozen copy of the database
+ *
+ * @param1 func function to call for each record
+ * @param2 arg passed through to func
+ */
+void hash_for_each_record(record_callback func, void *arg)
+{
+	uint32_t num_records = num_slab_accounts;
+
+	uint32_t id;
+	for(id = 0; id < num_records; id++) {
+		//slab index handed out but its slab or record not filled in yet
+		if(!__atomic_load_n(&slabs[id >> SLAB_BITS], __ATOMIC_ACQUIRE)) continue;
+
+		account *account = get_account_by_id(id);
+		if(!account->name) continue;
+
+		func(id, account->name, account->hash, account->balance, account->in_session, arg);
+	}
+}
+
+/* count the slab indexes handed out so far
+ *
+ * @return one more than the highest slab index in use
+ */
+uint32_t hash_num_records()
+{
+	return __atomic_load_n(&num_slab_accounts, __ATOMIC_RELAXED);
+}
+
+/* fork with every segment locked, so the child gets a copy of the database that no
+ * change is part way through; other threads are only held up for the fork itself
+ * the child must not call any other database function, as its copies of the locks are held
+ *
+ * @return as fork()
+ */
+pid_t hash_fork()
+{
+	int i;
+	for(i = 0; i < NUM_SEGMENTS; i++) {
+		pthread_mutex_lock(&database[i].lock);
 	}
+
+	//ATOMIC_BALANCES deposits and withdrawals change a balance under the log lock while it is open
+	wal_begin();
+	pid_t pid = fork();
+	wal_end();
+
+	for(i = NUM_SEGMENTS - 1; i >= 0; i--) {
+		pthread_mutex_unlock(&database[i].lock);
+	}
+
+	return pid;
 }
 
-/* free the database */
-void free_db()
+/* free the database; records and names are released a slab or chunk at a time */
+void hash_free()
 {
 	int i;
-	for(i = 0; i < SIZE_OF_DB; i++) {
-		account *ptr = database[i];
-		while(ptr) {
-			account* tmp = ptr->next;
-			free(ptr);
-			ptr = NULL;
-			ptr = tmp;
+	epoch_free_retired();
+
+	for(i = 0; i < NUM_SEGMENTS; i++) {
+		name_chunk *chunk = database[i].names;
+		while(chunk) {
+			name_chunk *tmp = chunk->next;
+			free(chunk);
+			chunk = tmp;
 		}
+
+		free(database[i].old_table);
+		free(database[i].table);
+		database[i].old_table = NULL;
+		database[i].table = NULL;
+		database[i].num_accounts = 0;
+		database[i].names = NULL;
+	}
+
+	size_t slab;
+	for(slab = 0; slab < MAX_SLABS && slabs[slab]; slab++) {
+		free(slabs[slab]);
+		slabs[slab] = NULL;
 	}
+
+	num_slab_accounts = 0;
 }
+
+/* in-memory hash engine; the default */
+storage_engine hash_engine = {
+	"hash",
+	0,
+	hash_init,
+	hash_create_account,
+	hash_start_session,
+	hash_end_session,
+	hash_deposit,
+	hash_withdraw,
+	hash_query_balance,
+	hash_end_session_by_id,
+	hash_deposit_by_id,
+	hash_withdraw_by_id,
+	hash_query_balance_by_id,
+	hash_transfer_batch,
+	hash_delete_account,
+	hash_reserve,
+	hash_load_account,
+	hash_finish_load,
+	hash_num_records,
+	hash_for_each_record,
+	hash_fork,
+	hash_free,
+};
@@ -8,12 +8,94 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <limits.h>
+#include <stdint.h>
+#include "money.h"
 
+/* enums */
+typedef enum _balance_mode{LOCKED_BALANCES, ATOMIC_BALANCES} balance_mode;
+
+/* accounts are split across NUM_SEGMENTS segments by the low bits of their hash */
+#define SEGMENT_BITS 6
+#define NUM_SEGMENTS (1 << SEGMENT_BITS)
+
+/* most legs a single transfer_batch() may move */
+#define MAX_TRANSFER_LEGS 8
+
+/* one leg of a transfer: amount moves from one account to another */
+typedef struct transfer_leg transfer_leg;
+struct transfer_leg {
+	char *from;		//account debited
+	char *to;		//account credited
+	money amount;		//amount in cents
+};
+
+/* called by for_each_record() with every live account */
+typedef void (*record_callback)(uint32_t id, char *name, uint64_t hash, money balance, int in_session, void *arg);
+
+/* a storage engine keeps the accounts behind the database functions below; every
+ * engine returns the same error codes and must be safe to call from many threads
+ * (see storage.c, and the engines benchmark of databaseBench.c)
+ * an account id is the index of the account's record, given out by create_account
+ * and start_session; it stays the account's for as long as the account exists, and
+ * the _by_id functions go straight to the record without looking up the name
+ */
+typedef struct storage_engine storage_engine;
+struct storage_engine {
+	char *name;					//name given to select_storage_engine()
+	int persistent;					//keeps its accounts across restarts itself, so takes no log or snapshots
+	int (*init)(char *option);			//returns -1 if the engine could not be opened
+	int (*create_account)(char account_name[256], uint32_t *account_id);
+	int (*start_session)(char account_name[256], uint32_t *account_id);
+	int (*end_session)(char account_name[256]);
+	int (*deposit)(char account_name[256], money amount);
+	int (*withdraw)(char account_name[256], money amount);
+	int (*query_balance)(char account_name[256], money *balance);
+	int (*end_session_by_id)(uint32_t account_id);
+	int (*deposit_by_id)(uint32_t account_id, money amount);
+	int (*withdraw_by_id)(uint32_t account_id, money amount);
+	int (*query_balance_by_id)(uint32_t account_id, money *balance);
+	int (*transfer_batch)(transfer_leg *legs, int num_legs);
+	int (*delete_account)(char account_name[256]);
+	void (*reserve)(size_t num_accounts);
+	int (*load_account)(uint32_t id, char account_name[256], uint64_t hash, money balance);
+	void (*finish_load)(uint32_t num_records);
+	uint32_t (*num_records)();
+	void (*for_each_record)(record_callback func, void *arg);
+	pid_t (*fork)();
+	void (*free)();
+};
+
+/* the engines; hash_engine is in database.c and mmap_engine in mmapEngine.c */
+extern storage_engine hash_engine;
+extern storage_engine mmap_engine;
+
+/* engine in use; hash_engine unless select_storage_engine() picks another */
+extern storage_engine *db_engine;
+
+int select_storage_engine(char *spec);
+int init_db();
+void set_balance_mode(balance_mode mode);
 int create_account(char account_name[256]); 
+int create_account_with_id(char account_name[256], uint32_t *account_id);
 int start_session(char account_name[256]); 
-int deposit(char account_name[256], double amount);
-int withdraw(char account_name[255], double amount);
-double query_balance(char account_name[255]);
+int start_session_with_id(char account_name[256], uint32_t *account_id);
+int deposit(char account_name[256], money amount);
+int withdraw(char account_name[255], money amount);
+int query_balance(char account_name[255], money *balance);
+int deposit_by_id(uint32_t account_id, money amount);
+int withdraw_by_id(uint32_t account_id, money amount);
+int query_balance_by_id(uint32_t account_id, money *balance);
+int end_session_by_id(uint32_t account_id);
+int transfer(char from[256], char to[256], money amount);
+int transfer_batch(transfer_leg *legs, int num_legs);
 int end_session(char account_name[256]);
-void print_db();
+int delete_account(char account_name[256]);
+uint64_t hash_account_name(char account_name[256]);
+int account_segment(char account_name[256]);
+void reserve_db(size_t num_accounts);
+int load_account(uint32_t id, char account_name[256], uint64_t hash, money balance);
+void finish_load(uint32_t num_records);
+uint32_t num_account_records();
+void for_each_record(record_callback func, void *arg);
+pid_t fork_db();
 void free_db();
@@ -0,0 +1,1395 @@
+#include "database.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "report.h"
+#include "dedup.h"
+#include "timerWheel.h"
+#include "protocol.h"
+#include <time.h>
+
+/**************************************************************
+ * Database Benchmark
+ *
+ * main:
+ * 	run the benchmark named on the command line
+ *
+ * scaling:
+ * 	every thread works on its own accounts; reports throughput
+ * 	as the thread count grows, once with each operation behind
+ * 	one global mutex (how the server used to call the database)
+ * 	and once relying on the database's segment locks
+ *
+ * lookup [max_accounts]:
+ * 	average cost of a balance query as the number of accounts
+ * 	grows by 10x from 100 up to max_accounts (default 1M)
+ *
+ * memory [num_accounts]:
+ * 	resident memory per account and query latency once
+ * 	num_accounts (default 1M) accounts exist
+ *
+ * wal [log_path]:
+ * 	deposit/withdraw/query throughput with the write-ahead log off and in each
+ * 	durability mode, with WAL_THREADS threads depositing at once
+ *
+ * startup [num_accounts] [prefix]:
+ * 	time to rebuild num_accounts (default 1M) accounts from a
+ * 	snapshot and from replaying the full log
+ *
+ * checkpoint [prefix]:
+ * 	transfers on CHECKPOINT_THREADS threads while another thread
+ * 	takes snapshots back to back, once with LOCKED_BALANCES and
+ * 	once with ATOMIC_BALANCES; then rebuilds the database from the
+ * 	last snapshot and the log after it, as the server does at
+ * 	startup, and checks that every balance came back as it was
+ * 	and no money was created or lost
+ *
+ * transfer [hot_percent]:
+ * 	throughput of transfers between TRANSFER_ACCOUNTS accounts as
+ * 	threads are added, where hot_percent (default 90) of transfers
+ * 	are between the TRANSFER_HOT_ACCOUNTS busiest accounts; once
+ * 	as a withdraw and a deposit behind one global mutex (the only
+ * 	way to make them atomic without transfer()) and once with
+ * 	transfer(); checks that no money was created or lost
+ *
+ * contention:
+ * 	every thread deposits, withdraws and queries the same account;
+ * 	reports throughput as the thread count grows, once with
+ * 	LOCKED_BALANCES and once with ATOMIC_BALANCES, and checks
+ * 	that the final balance is right
+ *
+ * reads:
+ * 	query throughput of READ_ACCOUNTS accounts as reader threads are
+ * 	added, once alone and once while READ_WRITERS threads deposit,
+ * 	withdraw and create and delete accounts in the same segments
+ *
+ * report [num_accounts] [path]:
+ * 	time to write a report of num_accounts (default 1M) accounts
+ * 	to path, and the slowest account creation by another thread
+ * 	while it is written, against the slowest creation without one
+ *
+ * ids [num_accounts]:
+ * 	cost of deposit, withdraw and query on random accounts of
+ * 	num_accounts (default 100K), going by name and going by the
+ * 	id start_session_with_id() gives, for short and long names
+ *
+ * engines [spec ...]:
+ * 	runs the same conformance checks and workload against each
+ * 	storage engine (default hash and mmap:databaseBench.mmap; see
+ * 	storage.c): error codes of every operation, atomic transfers,
+ * 	record iteration and, for persistent engines, reopening; then
+ * 	create and query cost with ENGINE_ACCOUNTS accounts, the
+ * 	scaling mix and transfers on ENGINE_THREADS threads, and
+ * 	whether the transfers conserved money
+ *
+ * dedup [num_clients]:
+ * 	cost of remembering a request in the dedup cache (see dedup.c)
+ * 	and of answering a retry from it, with num_clients (default
+ * 	1000) clients taking turns, for caches of 16K to 4M entries;
+ * 	then retries of each of the last DEDUP_RETRIES requests, to
+ * 	show how many of them a cache of that size still remembers
+ *
+ * timers [num_timers]:
+ * 	cost of the timer wheel eventLoop.c times clients out with (see
+ * 	timerWheel.c), for up to num_timers (default 1M) timers due over
+ * 	TIMER_SPAN one second ticks: setting a timer, moving one to
+ * 	another tick, and running every tick until all have fired, each
+ * 	on its own tick, against scanning every timer on each tick
+ ***************************************************************/
+
+#define ACCOUNTS_PER_THREAD 64
+#define OPS_PER_THREAD 200000
+#define NUM_LOOKUPS 1000000
+#define LOOKUP_NAMES 65536
+#define WAL_THREADS 8
+#define TRANSFER_ACCOUNTS 10000
+#define TRANSFER_HOT_ACCOUNTS 8
+#define TRANSFER_OPENING_BALANCE 100000
+#define HOT_ACCOUNT "hot-account"
+#define CHECKPOINT_THREADS 4
+#define READ_ACCOUNTS 100000
+#define READ_WRITERS 2
+#define HOT_OPENING_BALANCE 100000000
+#define ENGINE_ACCOUNTS 100000
+#define ENGINE_THREADS 4
+#define DEDUP_REQUESTS 4000000
+#define DEDUP_RETRIES 100000
+#define TIMER_SPAN 86400
+#define TIMER_SCAN_TICKS 100
+
+/* arguments for a benchmark thread */
+typedef struct bench_args bench_args;
+struct bench_args {
+	int thread_num;			//index of the thread
+	int use_global_mutex;		//1 to serialize every operation on global_mutex
+	int num_ops;			//operations to run
+	int hot_percent;		//transfers only: percent between hot accounts
+};
+
+pthread_mutex_t global_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* get the current time in seconds
+ *
+ * @return monotonic clock reading in seconds
+ */
+double now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* build the name of a benchmark account
+ *
+ * @param1 account_name pointer in which to put the name
+ * @param2 thread_num the thread that owns the account
+ * @param3 i index of the account within the thread
+ */
+void bench_account_name(char account_name[256], int thread_num, int i)
+{
+	snprintf(account_name, 256, "bench-%d-%d", thread_num, i);
+}
+
+/* thread runner for the scaling benchmark;
+ * deposits, withdraws and queries round robin over the thread's accounts
+ *
+ * @param1 arg void pointer to the thread's bench_args
+ */
+void * scaling_runner(void* arg)
+{
+	bench_args *args = (bench_args*) arg;
+	char names[ACCOUNTS_PER_THREAD][256];
+
+	int i;
+	for(i = 0; i < ACCOUNTS_PER_THREAD; i++) {
+		bench_account_name(names[i], args->thread_num, i);
+	}
+
+	money balance;
+	for(i = 0; i < args->num_ops; i++) {
+		char *account_name = names[i % ACCOUNTS_PER_THREAD];
+
+		if(args->use_global_mutex) pthread_mutex_lock(&global_mutex);
+
+		switch(i % 3) {
+			case 0:
+				deposit(account_name, 10);
+				break;
+			case 1:
+				withdraw(account_name, 5);
+				break;
+			default:
+				query_balance(account_name, &balance);
+				break;
+		}
+
+		if(args->use_global_mutex) pthread_mutex_unlock(&global_mutex);
+	}
+
+	return NULL;
+}
+
+/* create the accounts used by scaling_runner threads
+ *
+ * @param1 num_threads number of threads that will run
+ */
+void create_thread_accounts(int num_threads)
+{
+	char account_name[256];
+	int t, i;
+	for(t = 0; t < num_threads; t++) {
+		for(i = 0; i < ACCOUNTS_PER_THREAD; i++) {
+			bench_account_name(account_name, t, i);
+			create_account(account_name);
+		}
+	}
+}
+
+/* run scaling_runner threads once
+ *
+ * @param1 num_threads number of threads to run
+ * @param2 use_global_mutex 1 to serialize every operation on global_mutex
+ * @param3 num_ops operations per thread
+ *
+ * @return operations per second over all threads
+ */
+double run_threads(int num_threads, int use_global_mutex, int num_ops)
+{
+	pthread_t ids[num_threads];
+	bench_args args[num_threads];
+
+	double start = now();
+
+	int i;
+	for(i = 0; i < num_threads; i++) {
+		args[i].thread_num = i;
+		args[i].use_global_mutex = use_global_mutex;
+		args[i].num_ops = num_ops;
+		pthread_create(&ids[i], NULL, scaling_runner, &args[i]);
+	}
+
+	for(i = 0; i < num_threads; i++) {
+		pthread_join(ids[i], NULL);
+	}
+
+	return (double) num_threads * num_ops / (now() - start);
+}
+
+/* benchmark throughput as threads are added */
+void bench_scaling()
+{
+	int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_threads = (num_cores * 2 < 4) ? 4 : num_cores * 2;
+
+	create_thread_accounts(max_threads);
+
+	printf("scaling (%d cores, %d ops per thread)\n", num_cores, OPS_PER_THREAD);
+	printf("threads\tglobal mutex ops/s\tsegment locks ops/s\n");
+
+	int t;
+	for(t = 1; t <= max_threads; t *= 2) {
+		double global_ops = run_threads(t, 1, OPS_PER_THREAD);
+		double segment_ops = run_threads(t, 0, OPS_PER_THREAD);
+		printf("%d\t%.0f\t\t%.0f\n", t, global_ops, segment_ops);
+	}
+}
+
+/* get the resident set size of the process
+ *
+ * @return resident memory in bytes
+ */
+long resident_bytes()
+{
+	long pages = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if(statm) {
+		if(fscanf(statm, "%*s %ld", &pages) != 1) pages = 0;
+		fclose(statm);
+	}
+	return pages * sysconf(_SC_PAGESIZE);
+}
+
+/* time random balance queries against the accounts named account-0 .. account-<num_accounts - 1>
+ *
+ * @param1 num_accounts number of accounts in the database
+ *
+ * @return average nanoseconds per query
+ */
+double time_queries(long num_accounts)
+{
+	//names are built up front so snprintf is not part of the measured lookups
+	char (*names)[32] = malloc(LOOKUP_NAMES * sizeof(*names));
+
+	unsigned int seed = 1;
+	long i;
+	for(i = 0; i < LOOKUP_NAMES; i++) {
+		snprintf(names[i], sizeof(names[i]), "account-%ld", (long) (rand_r(&seed) % num_accounts));
+	}
+
+	//best of a few passes, to keep other load on the machine out of the result
+	double query_ns = 0;
+	money balance;
+	int pass;
+	for(pass = 0; pass < 3; pass++) {
+		double start = now();
+		for(i = 0; i < NUM_LOOKUPS; i++) {
+			query_balance(names[i % LOOKUP_NAMES], &balance);
+		}
+		double pass_ns = (now() - start) * 1e9 / NUM_LOOKUPS;
+		if(pass == 0 || pass_ns < query_ns) query_ns = pass_ns;
+	}
+
+	free(names);
+
+	return query_ns;
+}
+
+/* create accounts named account-0 .. account-<num_accounts - 1>
+ *
+ * @param1 num_accounts number of accounts to create
+ */
+void create_numbered_accounts(long num_accounts)
+{
+	char account_name[256];
+	long i;
+	for(i = 0; i < num_accounts; i++) {
+		snprintf(account_name, sizeof(account_name), "account-%ld", i);
+		create_account(account_name);
+	}
+}
+
+/* benchmark memory footprint and query latency of a large database
+ *
+ * @param1 num_accounts number of accounts to create
+ */
+void bench_memory(long num_accounts)
+{
+	long before = resident_bytes();
+	create_numbered_accounts(num_accounts);
+	long after = resident_bytes();
+
+	printf("memory (%ld accounts)\n", num_accounts);
+	printf("resident MB\tbytes/account\tquery ns/op\n");
+	printf("%.1f\t\t%.1f\t\t%.1f\n", (after - before) / 1e6, (double) (after - before) / num_accounts,
+			time_queries(num_accounts));
+}
+
+/* benchmark lookup cost as the database grows
+ *
+ * @param1 max_accounts largest number of accounts to test
+ */
+void bench_lookup(long max_accounts)
+{
+	printf("lookup (%d queries per size)\n", NUM_LOOKUPS);
+	printf("accounts\tcreate ns/op\tquery ns/op\n");
+
+	long num_accounts;
+	for(num_accounts = 100; num_accounts <= max_accounts; num_accounts *= 10) {
+		free_db();
+		init_db();
+
+		double start = now();
+		create_numbered_accounts(num_accounts);
+		double create_ns = (now() - start) * 1e9 / num_accounts;
+
+		printf("%ld\t\t%.1f\t\t%.1f\n", num_accounts, create_ns, time_queries(num_accounts));
+	}
+}
+
+/* benchmark the write-ahead log in each durability mode
+ *
+ * @param1 log_prefix prefix of the log files; removed before each run
+ */
+void bench_wal(char *log_prefix)
+{
+	char *mode_names[] = {"sync", "group", "async"};
+
+	printf("wal (%d threads, %s)\n", WAL_THREADS, log_prefix);
+	printf("mode\tops/s\n");
+
+	//fsync per op is slow enough that it gets fewer operations
+	int ops_per_mode[] = {500, 20000, OPS_PER_THREAD};
+
+	create_thread_accounts(WAL_THREADS);
+	printf("off\t%.0f\n", run_threads(WAL_THREADS, 0, OPS_PER_THREAD));
+
+	int mode;
+	for(mode = SYNC_COMMIT; mode <= ASYNC_COMMIT; mode++) {
+		free_db();
+		init_db();
+		create_thread_accounts(WAL_THREADS);
+
+		wal_remove_generations(log_prefix, 1);
+		wal_open(log_prefix, mode);
+		double ops = run_threads(WAL_THREADS, 0, ops_per_mode[mode]);
+		wal_close();
+
+		printf("%s\t%.0f\n", mode_names[mode], ops);
+	}
+
+	wal_remove_generations(log_prefix, 1);
+}
+
+/* benchmark startup from a snapshot against replaying the whole log
+ *
+ * @param1 num_accounts number of accounts to restore
+ * @param2 prefix prefix of the log and snapshot files; removed afterwards
+ */
+void bench_startup(long num_accounts, char *prefix)
+{
+	char snapshot_file[4096];
+	snprintf(snapshot_file, sizeof(snapshot_file), "%s.snapshot", prefix);
+
+	//log every account's creation and a deposit, then snapshot the same state
+	wal_remove_generations(prefix, 1);
+	wal_open(prefix, ASYNC_COMMIT);
+
+	char account_name[256];
+	long i;
+	for(i = 0; i < num_accounts; i++) {
+		snprintf(account_name, sizeof(account_name), "account-%ld", i);
+		create_account(account_name);
+		deposit(account_name, i);
+	}
+
+	wal_close();
+	write_snapshot(snapshot_file, 1);
+
+	printf("startup (%ld accounts)\n", num_accounts);
+	printf("source\t\tseconds\n");
+
+	free_db();
+	init_db();
+	double start = now();
+	wal_replay(prefix, 0);
+	printf("log replay\t%.2f\n", now() - start);
+
+	free_db();
+	init_db();
+	uint32_t generation;
+	start = now();
+	load_snapshot(prefix, &generation);
+	printf("snapshot\t%.2f\n", now() - start);
+
+	wal_remove_generations(prefix, 1);
+	unlink(snapshot_file);
+}
+
+/* thread runner for the transfer benchmark; moves a cent at a time between random accounts
+ *
+ * @param1 arg void pointer to the thread's bench_args
+ */
+void * transfer_runner(void* arg)
+{
+	bench_args *args = (bench_args*) arg;
+	unsigned int seed = args->thread_num + 1;
+
+	char from[256], to[256];
+	int i;
+	for(i = 0; i < args->num_ops; i++) {
+		int num_accounts = (rand_r(&seed) % 100 < args->hot_percent) ? TRANSFER_HOT_ACCOUNTS : TRANSFER_ACCOUNTS;
+		snprintf(from, sizeof(from), "account-%d", rand_r(&seed) % num_accounts);
+		snprintf(to, sizeof(to), "account-%d", rand_r(&seed) % num_accounts);
+
+		if(args->use_global_mutex) {
+			pthread_mutex_lock(&global_mutex);
+			if(withdraw(from, 1) == 0) deposit(to, 1);
+			pthread_mutex_unlock(&global_mutex);
+		} else {
+			transfer(from, to, 1);
+		}
+	}
+
+	return NULL;
+}
+
+/* run transfer_runner threads once
+ *
+ * @param1 num_threads number of threads to run
+ * @param2 use_global_mutex 1 to make each transfer a withdraw and deposit under global_mutex
+ * @param3 hot_percent percent of transfers between hot accounts
+ *
+ * @return transfers per second over all threads
+ */
+double run_transfer_threads(int num_threads, int use_global_mutex, int hot_percent)
+{
+	pthread_t ids[num_threads];
+	bench_args args[num_threads];
+
+	double start = now();
+
+	int i;
+	for(i = 0; i < num_threads; i++) {
+		args[i].thread_num = i;
+		args[i].use_global_mutex = use_global_mutex;
+		args[i].num_ops = OPS_PER_THREAD;
+		args[i].hot_percent = hot_percent;
+		pthread_create(&ids[i], NULL, transfer_runner, &args[i]);
+	}
+
+	for(i = 0; i < num_threads; i++) {
+		pthread_join(ids[i], NULL);
+	}
+
+	return (double) num_threads * OPS_PER_THREAD / (now() - start);
+}
+
+/* newest log generation; see wal.c */
+extern uint32_t wal_generation;
+
+/* remove every log generation and the snapshot a checkpoint run left behind,
+ * and start the next run's log from generation 0
+ *
+ * @param1 prefix prefix of the log and snapshot files
+ * @param2 snapshot_file path of the snapshot
+ */
+void remove_checkpoint_files(char *prefix, char *snapshot_file)
+{
+	wal_remove_generations(prefix, wal_generation + 1);
+	unlink(snapshot_file);
+	wal_generation = 0;
+}
+
+/* set to stop checkpoint_loop */
+int stop_checkpointing = 0;
+
+/* thread runner taking snapshots back to back until stop_checkpointing is set
+ *
+ * @param1 arg void pointer to the prefix of the log and snapshot files
+ *
+ * @return number of snapshots taken, cast to a void pointer
+ */
+void * checkpoint_loop(void* arg)
+{
+	char *prefix = (char*) arg;
+	long num_snapshots = 0;
+
+	while(!__atomic_load_n(&stop_checkpointing, __ATOMIC_RELAXED)) {
+		if(checkpoint(prefix) == 0) num_snapshots++;
+	}
+
+	return (void*) num_snapshots;
+}
+
+/* check that transfers racing snapshots are neither lost nor applied twice on recovery
+ *
+ * @param1 prefix prefix of the log and snapshot files; removed before each run and afterwards
+ */
+void bench_checkpoint(char *prefix)
+{
+	char *mode_names[] = {"locked", "atomic"};
+	char snapshot_file[4096];
+	snprintf(snapshot_file, sizeof(snapshot_file), "%s.snapshot", prefix);
+
+	printf("checkpoint (%d threads, %d ops per thread, %s)\n", CHECKPOINT_THREADS, OPS_PER_THREAD, prefix);
+	printf("mode\tsnapshots\ttransfer ops/s\tbalances changed by recovery\tmoney conserved\n");
+
+	int mode;
+	for(mode = LOCKED_BALANCES; mode <= ATOMIC_BALANCES; mode++) {
+		free_db();
+		init_db();
+		set_balance_mode(mode);
+
+		remove_checkpoint_files(prefix, snapshot_file);
+		wal_open(prefix, ASYNC_COMMIT);
+
+		create_numbered_accounts(TRANSFER_ACCOUNTS);
+
+		char account_name[256];
+		long i;
+		for(i = 0; i < TRANSFER_ACCOUNTS; i++) {
+			snprintf(account_name, sizeof(account_name), "account-%ld", i);
+			deposit(account_name, TRANSFER_OPENING_BALANCE);
+		}
+
+		pthread_t checkpoint_id;
+		stop_checkpointing = 0;
+		pthread_create(&checkpoint_id, NULL, checkpoint_loop, prefix);
+
+		double transfer_ops = run_transfer_threads(CHECKPOINT_THREADS, 0, 90);
+
+		__atomic_store_n(&stop_checkpointing, 1, __ATOMIC_RELAXED);
+		void *num_snapshots;
+		pthread_join(checkpoint_id, &num_snapshots);
+		wal_close();
+
+		money *before = malloc(TRANSFER_ACCOUNTS * sizeof(money));
+		for(i = 0; i < TRANSFER_ACCOUNTS; i++) {
+			snprintf(account_name, sizeof(account_name), "account-%ld", i);
+			query_balance(account_name, &before[i]);
+		}
+
+		//recover the way bankingServer does at startup
+		free_db();
+		init_db();
+		uint32_t generation = 0;
+		load_snapshot(prefix, &generation);
+		wal_replay(prefix, generation);
+
+		//a transfer both in the snapshot and in the log after it moves its money twice
+		money total = 0, balance;
+		long num_differing = 0;
+		for(i = 0; i < TRANSFER_ACCOUNTS; i++) {
+			snprintf(account_name, sizeof(account_name), "account-%ld", i);
+			if(query_balance(account_name, &balance) != 0 || balance != before[i]) num_differing++;
+			else total += balance;
+		}
+		int conserved = total == (money) TRANSFER_ACCOUNTS * TRANSFER_OPENING_BALANCE;
+		free(before);
+
+		printf("%s\t%ld\t\t%.0f\t\t%ld\t\t%s\n", mode_names[mode], (long) num_snapshots, transfer_ops,
+				num_differing, (conserved && num_differing == 0) ? "yes" : "NO");
+	}
+
+	set_balance_mode(LOCKED_BALANCES);
+	remove_checkpoint_files(prefix, snapshot_file);
+}
+
+/* benchmark transfers as threads are added
+ *
+ * @param1 hot_percent percent of transfers between hot accounts
+ */
+void bench_transfer(int hot_percent)
+{
+	int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_threads = (num_cores * 2 < 4) ? 4 : num_cores * 2;
+
+	create_numbered_accounts(TRANSFER_ACCOUNTS);
+
+	char account_name[256];
+	long i;
+	for(i = 0; i < TRANSFER_ACCOUNTS; i++) {
+		snprintf(account_name, sizeof(account_name), "account-%ld", i);
+		deposit(account_name, TRANSFER_OPENING_BALANCE);
+	}
+
+	printf("transfer (%d cores, %d ops per thread, %d%% between %d hot accounts)\n",
+			num_cores, OPS_PER_THREAD, hot_percent, TRANSFER_HOT_ACCOUNTS);
+	printf("threads\tglobal mutex ops/s\ttransfer() ops/s\n");
+
+	int t;
+	for(t = 1; t <= max_threads; t *= 2) {
+		double global_ops = run_transfer_threads(t, 1, hot_percent);
+		double transfer_ops = run_transfer_threads(t, 0, hot_percent);
+		printf("%d\t%.0f\t\t%.0f\n", t, global_ops, transfer_ops);
+	}
+
+	money total = 0, balance;
+	for(i = 0; i < TRANSFER_ACCOUNTS; i++) {
+		snprintf(account_name, sizeof(account_name), "account-%ld", i);
+		query_balance(account_name, &balance);
+		total += balance;
+	}
+
+	printf("money conserved: %s\n", (total == (money) TRANSFER_ACCOUNTS * TRANSFER_OPENING_BALANCE) ? "yes" : "NO");
+}
+
+/* thread runner for the contention benchmark; deposits, withdraws and queries
+ * HOT_ACCOUNT in turn, so every deposit is matched by a withdrawal
+ *
+ * @param1 arg void pointer to the thread's bench_args
+ */
+void * contention_runner(void* arg)
+{
+	bench_args *args = (bench_args*) arg;
+	char account_name[256] = HOT_ACCOUNT;
+
+	money balance;
+	int i;
+	for(i = 0; i < args->num_ops; i++) {
+		switch(i % 3) {
+			case 0:
+				deposit(account_name, 10);
+				break;
+			case 1:
+				withdraw(account_name, 10);
+				break;
+			default:
+				query_balance(account_name, &balance);
+				break;
+		}
+	}
+
+	return NULL;
+}
+
+/* run contention_runner threads once
+ *
+ * @param1 num_threads number of threads to run
+ * @param2 mode how the database changes balances
+ *
+ * @return operations per second over all threads
+ */
+double run_contention_threads(int num_threads, balance_mode mode)
+{
+	pthread_t ids[num_threads];
+	bench_args args[num_threads];
+
+	set_balance_mode(mode);
+
+	double start = now();
+
+	int i;
+	for(i = 0; i < num_threads; i++) {
+		args[i].thread_num = i;
+		args[i].num_ops = OPS_PER_THREAD;
+		pthread_create(&ids[i], NULL, contention_runner, &args[i]);
+	}
+
+	for(i = 0; i < num_threads; i++) {
+		pthread_join(ids[i], NULL);
+	}
+
+	return (double) num_threads * OPS_PER_THREAD / (now() - start);
+}
+
+/* benchmark many threads changing one account as threads are added */
+void bench_contention()
+{
+	int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_threads = (num_cores * 2 < 8) ? 8 : num_cores * 2;
+
+	char account_name[256] = HOT_ACCOUNT;
+	create_account(account_name);
+	deposit(account_name, HOT_OPENING_BALANCE);
+
+	printf("contention (%d cores, %d ops per thread on one account)\n", num_cores, OPS_PER_THREAD);
+	printf("threads\tlocked ops/s\tatomic ops/s\n");
+
+	int t;
+	for(t = 1; t <= max_threads; t *= 2) {
+		double locked_ops = run_contention_threads(t, LOCKED_BALANCES);
+		double atomic_ops = run_contention_threads(t, ATOMIC_BALANCES);
+		printf("%d\t%.0f\t\t%.0f\n", t, locked_ops, atomic_ops);
+	}
+
+	money balance;
+	query_balance(account_name, &balance);
+	printf("balance correct: %s\n", (balance == HOT_OPENING_BALANCE) ? "yes" : "NO");
+}
+
+/* set to stop the writers of the reads benchmark */
+int stop_writing;
+
+/* thread runner for the reads benchmark; queries random accounts
+ *
+ * @param1 arg void pointer to the thread's bench_args
+ */
+void * reader_runner(void* arg)
+{
+	bench_args *args = (bench_args*) arg;
+	unsigned int seed = args->thread_num + 1;
+
+	char account_name[256];
+	money balance;
+	int i;
+	for(i = 0; i < args->num_ops; i++) {
+		snprintf(account_name, sizeof(account_name), "account-%d", rand_r(&seed) % READ_ACCOUNTS);
+		if(query_balance(account_name, &balance) != 0) fprintf(stderr, "%s went missing\n", account_name);
+	}
+
+	return NULL;
+}
+
+/* thread runner for the writers of the reads benchmark; deposits and withdraws on random
+ * accounts, and creates and deletes accounts of its own, until stop_writing is set
+ *
+ * @param1 arg void pointer to the thread's bench_args
+ */
+void * writer_runner(void* arg)
+{
+	bench_args *args = (bench_args*) arg;
+	unsigned int seed = args->thread_num + 1;
+
+	char account_name[256];
+	long i;
+	for(i = 0; !__atomic_load_n(&stop_writing, __ATOMIC_RELAXED); i++) {
+		snprintf(account_name, sizeof(account_name), "account-%d", rand_r(&seed) % READ_ACCOUNTS);
+		if(i % 2 == 0) deposit(account_name, 10);
+		else withdraw(account_name, 10);
+
+		//keep the account count steady so the tables resize and fill with tombstones
+		snprintf(account_name, sizeof(account_name), "churn-%d-%ld", args->thread_num, i);
+		create_account(account_name);
+		if(i >= 1000) {
+			snprintf(account_name, sizeof(account_name), "churn-%d-%ld", args->thread_num, i - 1000);
+			delete_account(account_name);
+		}
+	}
+
+	return NULL;
+}
+
+/* run reader_runner threads once, with writer_runner threads alongside if asked
+ *
+ * @param1 num_readers number of reader threads
+ * @param2 num_writers number of writer threads
+ *
+ * @return queries per second over all readers
+ */
+double run_reader_threads(int num_readers, int num_writers)
+{
+	pthread_t reader_ids[num_readers], writer_ids[num_writers + 1];
+	bench_args reader_args[num_readers], writer_args[num_writers + 1];
+
+	stop_writing = 0;
+
+	int i;
+	for(i = 0; i < num_writers; i++) {
+		writer_args[i].thread_num = i;
+		pthread_create(&writer_ids[i], NULL, writer_runner, &writer_args[i]);
+	}
+
+	double start = now();
+
+	for(i = 0; i < num_readers; i++) {
+		reader_args[i].thread_num = i;
+		reader_args[i].num_ops = OPS_PER_THREAD * 5;
+		pthread_create(&reader_ids[i], NULL, reader_runner, &reader_args[i]);
+	}
+
+	for(i = 0; i < num_readers; i++) {
+		pthread_join(reader_ids[i], NULL);
+	}
+
+	double elapsed = now() - start;
+
+	__atomic_store_n(&stop_writing, 1, __ATOMIC_RELAXED);
+	for(i = 0; i < num_writers; i++) {
+		pthread_join(writer_ids[i], NULL);
+	}
+
+	//churn accounts are made again by the next run
+	free_db();
+	init_db();
+	create_numbered_accounts(READ_ACCOUNTS);
+
+	return (double) num_readers * OPS_PER_THREAD * 5 / elapsed;
+}
+
+/* benchmark lock-free queries as readers are added, with and without writers */
+void bench_reads()
+{
+	int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+	int max_threads = (num_cores * 2 < 8) ? 8 : num_cores * 2;
+
+	create_numbered_accounts(READ_ACCOUNTS);
+
+	printf("reads (%d cores, %d queries per reader over %d accounts)\n", num_cores, OPS_PER_THREAD * 5, READ_ACCOUNTS);
+	printf("readers\tqueries/s alone\tqueries/s with %d writers\n", READ_WRITERS);
+
+	int t;
+	for(t = 1; t <= max_threads; t *= 2) {
+		double alone = run_reader_threads(t, 0);
+		double with_writers = run_reader_threads(t, READ_WRITERS);
+		printf("%d\t%.0f\t\t%.0f\n", t, alone, with_writers);
+	}
+}
+
+/* set to stop creator_runner */
+int stop_creating;
+
+/* thread runner creating new accounts until stop_creating is set
+ *
+ * @param1 arg pointer to a double in which to put the slowest creation in seconds
+ */
+void * creator_runner(void* arg)
+{
+	double *slowest = (double*) arg;
+	*slowest = 0;
+
+	char account_name[256];
+	long i;
+	for(i = 0; !__atomic_load_n(&stop_creating, __ATOMIC_RELAXED); i++) {
+		snprintf(account_name, sizeof(account_name), "late-%ld", i);
+
+		double start = now();
+		create_account(account_name);
+		double elapsed = now() - start;
+
+		if(elapsed > *slowest) *slowest = elapsed;
+
+		//leave the core to the report now and then, as a client between requests would
+		if(i % 1000 == 0) usleep(100);
+	}
+
+	return NULL;
+}
+
+/* run creator_runner for a while, reporting the database meanwhile if asked
+ *
+ * @param1 path where to write the report; NULL for none
+ * @param2 seconds how long to create accounts if there is no report
+ * @param3 report_seconds pointer in which to put how long the report took
+ *
+ * @return slowest creation in seconds
+ */
+double time_creates(char *path, double seconds, double *report_seconds)
+{
+	pthread_t id;
+	double slowest;
+
+	stop_creating = 0;
+	pthread_create(&id, NULL, creator_runner, &slowest);
+
+	double start = now();
+	if(path) report(path, REPORT_TEXT);
+	else usleep(seconds * 1e6);
+	*report_seconds = now() - start;
+
+	__atomic_store_n(&stop_creating, 1, __ATOMIC_RELAXED);
+	pthread_join(id, NULL);
+
+	return slowest;
+}
+
+/* benchmark how long a report takes and how much it holds up account creation
+ *
+ * @param1 num_accounts number of accounts in the database
+ * @param2 path where to write the report
+ */
+void bench_report(long num_accounts, char *path)
+{
+	create_numbered_accounts(num_accounts);
+
+	double report_seconds, idle_seconds;
+	double slowest_with_report = time_creates(path, 0, &report_seconds);
+	double slowest_without = time_creates(NULL, report_seconds, &idle_seconds);
+
+	printf("report (%ld accounts to %s)\n", num_accounts, path);
+	printf("report ms\tslowest create us (reporting)\tslowest create us (idle)\n");
+	printf("%.1f\t\t%.1f\t\t\t\t%.1f\n", report_seconds * 1e3, slowest_with_report * 1e6, slowest_without * 1e6);
+
+	unlink(path);
+}
+
+/* time deposits, withdrawals and queries in turn on random accounts
+ *
+ * @param1 names names of the accounts
+ * @param2 ids ids of the accounts; NULL to go by name
+ * @param3 num_accounts number of accounts
+ *
+ * @return average nanoseconds per operation, best of a few passes
+ */
+double time_account_ops(char (*names)[256], uint32_t *ids, long num_accounts)
+{
+	//accounts are picked up front so rand_r is not part of the measured operations
+	long *picks = malloc(LOOKUP_NAMES * sizeof(long));
+	unsigned int seed = 1;
+	long i;
+	for(i = 0; i < LOOKUP_NAMES; i++) picks[i] = rand_r(&seed) % num_accounts;
+
+	double best_ns = 0;
+	money balance;
+	int pass;
+	for(pass = 0; pass < 3; pass++) {
+		double start = now();
+		for(i = 0; i < NUM_LOOKUPS; i++) {
+			long pick = picks[i % LOOKUP_NAMES];
+			switch(i % 3) {
+				case 0:
+					if(ids) deposit_by_id(ids[pick], 10);
+					else deposit(names[pick], 10);
+					break;
+				case 1:
+					if(ids) withdraw_by_id(ids[pick], 10);
+					else withdraw(names[pick], 10);
+					break;
+				default:
+					if(ids) query_balance_by_id(ids[pick], &balance);
+					else query_balance(names[pick], &balance);
+					break;
+			}
+		}
+		double pass_ns = (now() - start) * 1e9 / NUM_LOOKUPS;
+		if(pass == 0 || pass_ns < best_ns) best_ns = pass_ns;
+	}
+
+	free(picks);
+
+	return best_ns;
+}
+
+/* benchmark in-session operations going by name against going by account id
+ *
+ * @param1 num_accounts number of accounts to create
+ */
+void bench_ids(long num_accounts)
+{
+	int name_lengths[] = {16, 64, 240};
+
+	printf("ids (%ld accounts, %d ops, deposit/withdraw/query in turn)\n", num_accounts, NUM_LOOKUPS);
+	printf("name bytes\tby name ns/op\tby id ns/op\n");
+
+	char (*names)[256] = malloc(num_accounts * sizeof(*names));
+	uint32_t *ids = malloc(num_accounts * sizeof(uint32_t));
+
+	int n;
+	for(n = 0; n < (int) (sizeof(name_lengths) / sizeof(name_lengths[0])); n++) {
+		free_db();
+		init_db();
+
+		//names share a long prefix, as generated names do, so each compare reads the whole name
+		long i;
+		for(i = 0; i < num_accounts; i++) {
+			snprintf(names[i], 256, "%0*ld", name_lengths[n], i);
+			create_account(names[i]);
+			deposit(names[i], HOT_OPENING_BALANCE);
+			start_session_with_id(names[i], &ids[i]);
+		}
+
+		double by_name = time_account_ops(names, NULL, num_accounts);
+		double by_id = time_account_ops(names, ids, num_accounts);
+		printf("%d\t\t%.1f\t\t%.1f\n", name_lengths[n], by_name, by_id);
+	}
+
+	free(names);
+	free(ids);
+}
+
+/* compare an operation's status with the one every engine must return
+ *
+ * @param1 what description of the operation
+ * @param2 status status it returned
+ * @param3 expected status it should have returned
+ * @param4 num_checks counter of checks made
+ *
+ * @return 1 if it differs; 0 otherwise
+ */
+int check_status(char *what, int status, int expected, int *num_checks)
+{
+	(*num_checks)++;
+	if(status == expected) return 0;
+
+	printf("  %s: returned %d, expected %d\n", what, status, expected);
+	return 1;
+}
+
+/* for_each_record callback counting live accounts and their money */
+void sum_record(uint32_t id, char *name, uint64_t hash, money balance, int in_session, void *arg)
+{
+	(void)id;
+	(void)name;
+	(void)hash;
+	(void)in_session;
+
+	money *sums = (money*) arg;
+	sums[0]++;
+	sums[1] += balance;
+}
+
+/* run the checks every storage engine must pass on an empty database
+ *
+ * @param1 num_checks pointer in which to put the number of checks made
+ *
+ * @return number of checks failed
+ */
+int check_engine(int *num_checks)
+{
+	char a[256] = "conform-a", b[256] = "conform-b", c[256] = "conform-c", missing[256] = "conform-missing";
+	int failed = 0;
+	money balance = 0;
+	*num_checks = 0;
+
+	failed += check_status("create", create_account(a), 0, num_checks);
+	failed += check_status("create existing", create_account(a), -1, num_checks);
+	failed += check_status("deposit missing", deposit(missing, 1), -2, num_checks);
+	failed += check_status("withdraw missing", withdraw(missing, 1), -2, num_checks);
+	failed += check_status("query missing", query_balance(missing, &balance), -2, num_checks);
+	failed += check_status("serve missing", start_session(missing), -2, num_checks);
+	failed += check_status("end missing", end_session(missing), -2, num_checks);
+	failed += check_status("delete missing", delete_account(missing), -2, num_checks);
+
+	failed += check_status("serve", start_session(a), 0, num_checks);
+	failed += check_status("serve served", start_session(a), -3, num_checks);
+	failed += check_status("end", end_session(a), 0, num_checks);
+	failed += check_status("end ended", end_session(a), -4, num_checks);
+
+	//ids given out at create and serve reach the same record as the name
+	char d[256] = "conform-d";
+	uint32_t created_id = 0, served_id = 0;
+	failed += check_status("create with id", create_account_with_id(d, &created_id), 0, num_checks);
+	failed += check_status("serve with id", start_session_with_id(d, &served_id), 0, num_checks);
+	failed += check_status("same id from create and serve", created_id == served_id, 1, num_checks);
+	failed += check_status("deposit by id", deposit_by_id(served_id, 70), 0, num_checks);
+	failed += check_status("overdraw by id", withdraw_by_id(served_id, 71), -5, num_checks);
+	failed += check_status("overflow by id", deposit_by_id(served_id, MONEY_MAX), -8, num_checks);
+	query_balance(d, &balance);
+	failed += check_status("balance by name after deposit by id", balance == 70, 1, num_checks);
+	failed += check_status("withdraw by id", withdraw_by_id(served_id, 20), 0, num_checks);
+	balance = 0;
+	failed += check_status("query by id", query_balance_by_id(served_id, &balance), 0, num_checks);
+	failed += check_status("balance by id", balance == 50, 1, num_checks);
+	failed += check_status("end by id", end_session_by_id(served_id), 0, num_checks);
+	failed += check_status("end ended by id", end_session_by_id(served_id), -4, num_checks);
+	failed += check_status("delete", delete_account(d), 0, num_checks);
+	failed += check_status("query deleted by id", query_balance_by_id(served_id, &balance), -2, num_checks);
+	failed += check_status("deposit deleted by id", deposit_by_id(served_id, 1), -2, num_checks);
+
+	failed += check_status("deposit", deposit(a, 500), 0, num_checks);
+	failed += check_status("overdraw", withdraw(a, 501), -5, num_checks);
+	failed += check_status("withdraw", withdraw(a, 200), 0, num_checks);
+	failed += check_status("overflow", deposit(a, MONEY_MAX), -8, num_checks);
+	query_balance(a, &balance);
+	failed += check_status("balance after deposit and withdraw", balance == 300, 1, num_checks);
+
+	create_account(b);
+	failed += check_status("transfer", transfer(a, b, 100), 0, num_checks);
+	failed += check_status("transfer from missing", transfer(missing, b, 1), -2, num_checks);
+
+	//the second leg overdraws, so the first must be undone
+	transfer_leg legs[MAX_TRANSFER_LEGS + 1];
+	legs[0] = (transfer_leg) {a, b, 150};
+	legs[1] = (transfer_leg) {b, a, 400};
+	failed += check_status("transfer batch overdrawing", transfer_batch(legs, 2), -5, num_checks);
+
+	legs[1] = (transfer_leg) {b, c, 1};
+	failed += check_status("transfer batch to missing", transfer_batch(legs, 2), -2, num_checks);
+
+	//a later leg may spend what an earlier one credited
+	legs[1] = (transfer_leg) {b, a, 250};
+	failed += check_status("transfer batch", transfer_batch(legs, 2), 0, num_checks);
+
+	int i;
+	for(i = 0; i <= MAX_TRANSFER_LEGS; i++) legs[i] = (transfer_leg) {a, b, 1};
+	failed += check_status("transfer batch too long", transfer_batch(legs, MAX_TRANSFER_LEGS + 1), -8, num_checks);
+
+	money balance_b = 0;
+	query_balance(a, &balance);
+	query_balance(b, &balance_b);
+	failed += check_status("balances after transfers", balance == 300 && balance_b == 0, 1, num_checks);
+
+	start_session(b);
+	failed += check_status("delete served", delete_account(b), -3, num_checks);
+	end_session(b);
+	failed += check_status("delete", delete_account(b), 0, num_checks);
+	failed += check_status("query deleted", query_balance(b, &balance), -2, num_checks);
+	failed += check_status("create deleted", create_account(b), 0, num_checks);
+	query_balance(b, &balance);
+	failed += check_status("balance of recreated account", balance == 0, 1, num_checks);
+	failed += check_status("load existing", load_account(num_account_records(), a, hash_account_name(a), 1), -1, num_checks);
+
+	money sums[2] = {0, 0};
+	pid_t pid = fork_db();
+	if(pid == 0) _exit(0);
+	waitpid(pid, NULL, 0);
+	for_each_record(sum_record, sums);
+	failed += check_status("records seen", sums[0] == 2 && sums[1] == 300, 1, num_checks);
+
+	//a persistent engine must give the accounts back when it is opened again, out of session
+	if(db_engine->persistent) {
+		start_session(a);
+		free_db();
+		init_db();
+		failed += check_status("query after reopening", query_balance(a, &balance), 0, num_checks);
+		failed += check_status("balance after reopening", balance == 300, 1, num_checks);
+		failed += check_status("serve after reopening", start_session(a), 0, num_checks);
+		end_session(a);
+	}
+
+	delete_account(a);
+	delete_account(b);
+
+	return failed;
+}
+
+/* benchmark and check each storage engine with the same workload
+ *
+ * @param1 num_specs number of engine specs
+ * @param2 specs engine specs, as taken by select_storage_engine()
+ */
+void bench_engines(int num_specs, char **specs)
+{
+	char *default_specs[] = {"hash", "mmap:databaseBench.mmap"};
+	if(num_specs == 0) {
+		num_specs = 2;
+		specs = default_specs;
+	}
+
+	//main opened the default engine
+	free_db();
+
+	printf("engines (%d accounts, %d threads, %d ops per thread)\n", ENGINE_ACCOUNTS, ENGINE_THREADS, OPS_PER_THREAD);
+	printf("engine\tchecks\tcreate ns/op\tquery ns/op\tmix ops/s\ttransfer ops/s\tmoney conserved\n");
+
+	int s;
+	for(s = 0; s < num_specs; s++) {
+		if(select_storage_engine(specs[s]) == -1) {
+			printf("%s\tunknown engine\n", specs[s]);
+			continue;
+		}
+
+		//every run starts from an empty file
+		char *path = strchr(specs[s], ':');
+		if(db_engine->persistent && path) unlink(path + 1);
+
+		if(init_db() == -1) {
+			printf("%s\tfailed to open\n", specs[s]);
+			continue;
+		}
+
+		int num_checks;
+		int failed = check_engine(&num_checks);
+
+		double start = now();
+		create_numbered_accounts(ENGINE_ACCOUNTS);
+		double create_ns = (now() - start) * 1e9 / ENGINE_ACCOUNTS;
+		double query_ns = time_queries(ENGINE_ACCOUNTS);
+
+		create_thread_accounts(ENGINE_THREADS);
+		double mix_ops = run_threads(ENGINE_THREADS, 0, OPS_PER_THREAD);
+
+		char account_name[256];
+		long i;
+		for(i = 0; i < TRANSFER_ACCOUNTS; i++) {
+			snprintf(account_name, sizeof(account_name), "account-%ld", i);
+			deposit(account_name, TRANSFER_OPENING_BALANCE);
+		}
+		double transfer_ops = run_transfer_threads(ENGINE_THREADS, 0, 0);
+
+		money total = 0, balance;
+		for(i = 0; i < TRANSFER_ACCOUNTS; i++) {
+			snprintf(account_name, sizeof(account_name), "account-%ld", i);
+			query_balance(account_name, &balance);
+			total += balance;
+		}
+		int conserved = total == (money) TRANSFER_ACCOUNTS * TRANSFER_OPENING_BALANCE;
+
+		printf("%s\t%d/%d\t%.1f\t\t%.1f\t\t%.0f\t\t%.0f\t\t%s\n", db_engine->name, num_checks - failed, num_checks,
+				create_ns, query_ns, mix_ops, transfer_ops, conserved ? "yes" : "NO");
+
+		free_db();
+		if(db_engine->persistent && path) unlink(path + 1);
+	}
+
+	//main closes the default engine
+	select_storage_engine("hash");
+	init_db();
+}
+
+/* benchmark the dedup cache at several sizes
+ *
+ * @param1 num_clients clients sending requests in turn
+ */
+void bench_dedup(int num_clients)
+{
+	size_t sizes[] = {16384, 262144, 4194304};
+
+	printf("dedup (%d requests from %d clients, then retries of the last %d)\n", DEDUP_REQUESTS, num_clients, DEDUP_RETRIES);
+	printf("entries\t\tMB\tnew ns/op\tretry ns/op\tretries remembered\n");
+
+	int n;
+	for(n = 0; n < (int) (sizeof(sizes) / sizeof(sizes[0])); n++) {
+		init_dedup(sizes[n], DEFAULT_DEDUP_SECONDS);
+
+		int status;
+		uint32_t account_id;
+
+		//each client numbers its requests from 0, as bankingClient does from 1
+		double start = now();
+		long i;
+		for(i = 0; i < DEDUP_REQUESTS; i++) {
+			uint64_t client_id = 1 + i % num_clients;
+			uint32_t request_id = i / num_clients;
+			dedup_begin(client_id, request_id, DEPOSIT, &status, &account_id);
+			dedup_finish(client_id, request_id, DEPOSIT, 0, 0);
+		}
+		double new_ns = (now() - start) * 1e9 / DEDUP_REQUESTS;
+
+		long remembered = 0;
+		start = now();
+		for(i = DEDUP_REQUESTS - DEDUP_RETRIES; i < DEDUP_REQUESTS; i++) {
+			uint64_t client_id = 1 + i % num_clients;
+			uint32_t request_id = i / num_clients;
+			if(dedup_begin(client_id, request_id, DEPOSIT, &status, &account_id) == DEDUP_REPLAY) remembered++;
+			else dedup_finish(client_id, request_id, DEPOSIT, 0, 0);
+		}
+		double retry_ns = (now() - start) * 1e9 / DEDUP_RETRIES;
+
+		printf("%zu\t\t%.1f\t%.1f\t\t%.1f\t\t%.1f%%\n", sizes[n], sizes[n] * 24 / 1048576.0,
+				new_ns, retry_ns, remembered * 100.0 / DEDUP_RETRIES);
+
+		free_dedup();
+	}
+}
+
+/* timers fired by the wheel in bench_timers */
+typedef struct timer_count timer_count;
+struct timer_count {
+	uint64_t tick;		//tick being run
+	long on_time;		//timers fired on the tick they were set for
+	long sampled;		//of them, the ones due in the ticks the scan is timed over
+	long wrong_tick;	//timers fired early or late
+};
+
+/* timer_callback counting the timers that fire, and whether each fired on its tick */
+void count_expired(wheel_timer *timer, void *arg)
+{
+	timer_count *count = (timer_count*) arg;
+
+	if(timer->expires == count->tick) count->on_time++;
+	else count->wrong_tick++;
+
+	if(count->tick <= TIMER_SCAN_TICKS) count->sampled++;
+}
+
+/* benchmark the timer wheel with a growing number of timers
+ *
+ * @param1 num_timers timers in the last round
+ */
+void bench_timers(long num_timers)
+{
+	printf("timers (due over %d ticks)\n", TIMER_SPAN);
+	printf("timers\t\tset ns/op\tmove ns/op\twheel ns/tick\tscan ns/tick\tfired on time\n");
+
+	wheel_timer *timers = malloc(num_timers * sizeof(wheel_timer));
+	uint64_t *deadlines = malloc(num_timers * sizeof(uint64_t));
+	timer_wheel *wheel = malloc(sizeof(timer_wheel));
+
+	long count;
+	for(count = num_timers / 100; count <= num_timers; count *= 10) {
+		if(count == 0) continue;
+
+		init_timer_wheel(wheel, 0);
+		srand(1);
+
+		long i;
+		for(i = 0; i < count; i++) deadlines[i] = 1 + rand() % TIMER_SPAN;
+
+		double start = now();
+		for(i = 0; i < count; i++) set_timer(wheel, &timers[i], deadlines[i]);
+		double set_ns = (now() - start) * 1e9 / count;
+
+		//what setting a client's timer again on every request would cost
+		start = now();
+		for(i = 0; i < count; i++) {
+			cancel_timer(wheel, &timers[i]);
+			set_timer(wheel, &timers[i], deadlines[i]);
+		}
+		double move_ns = (now() - start) * 1e9 / count;
+
+		timer_count fired = {0, 0, 0, 0};
+		start = now();
+		for(fired.tick = 1; fired.tick <= TIMER_SPAN; fired.tick++) advance_timer_wheel(wheel, fired.tick, count_expired, &fired);
+		double wheel_ns = (now() - start) * 1e9 / TIMER_SPAN;
+
+		//what a reactor looking at every client each tick would cost; a sample of ticks is enough
+		long scanned = 0;
+		start = now();
+		uint64_t tick;
+		for(tick = 1; tick <= TIMER_SCAN_TICKS; tick++) {
+			for(i = 0; i < count; i++) scanned += deadlines[i] == tick;
+		}
+		double scan_ns = (now() - start) * 1e9 / TIMER_SCAN_TICKS;
+
+		printf("%ld\t\t%.1f\t\t%.1f\t\t%.0f\t\t%.0f\t\t%ld/%ld%s\n", count, set_ns, move_ns, wheel_ns, scan_ns,
+				fired.on_time, count, (fired.wrong_tick || wheel->num_timers || scanned != fired.sampled) ? " WRONG" : "");
+	}
+
+	free(timers);
+	free(deadlines);
+	free(wheel);
+}
+
+int main(int argc, char** argv)
+{
+	char *benchmark = (argc > 1) ? argv[1] : "scaling";
+
+	init_db();
+
+	if(strcmp(benchmark, "scaling") == 0) {
+		bench_scaling();
+	} else if(strcmp(benchmark, "lookup") == 0) {
+		bench_lookup((argc > 2) ? atol(argv[2]) : 1000000);
+	} else if(strcmp(benchmark, "memory") == 0) {
+		bench_memory((argc > 2) ? atol(argv[2]) : 1000000);
+	} else if(strcmp(benchmark, "wal") == 0) {
+		bench_wal((argc > 2) ? argv[2] : "databaseBench.log");
+	} else if(strcmp(benchmark, "checkpoint") == 0) {
+		bench_checkpoint((argc > 2) ? argv[2] : "databaseBench.log");
+	} else if(strcmp(benchmark, "transfer") == 0) {
+		bench_transfer((argc > 2) ? atoi(argv[2]) : 90);
+	} else if(strcmp(benchmark, "contention") == 0) {
+		bench_contention();
+	} else if(strcmp(benchmark, "reads") == 0) {
+		bench_reads();
+	} else if(strcmp(benchmark, "report") == 0) {
+		bench_report((argc > 2) ? atol(argv[2]) : 1000000, (argc > 3) ? argv[3] : "databaseBench.report");
+	} else if(strcmp(benchmark, "ids") == 0) {
+		bench_ids((argc > 2) ? atol(argv[2]) : 100000);
+	} else if(strcmp(benchmark, "engines") == 0) {
+		bench_engines(argc - 2, argv + 2);
+	} else if(strcmp(benchmark, "dedup") == 0) {
+		bench_dedup((argc > 2) ? atoi(argv[2]) : 1000);
+	} else if(strcmp(benchmark, "timers") == 0) {
+		bench_timers((argc > 2) ? atol(argv[2]) : 1000000);
+	} else if(strcmp(benchmark, "startup") == 0) {
+		bench_startup((argc > 2) ? atol(argv[2]) : 1000000, (argc > 3) ? argv[3] : "databaseBench.log");
+	} else {
+		fprintf(stderr, "unknown benchmark: %s\n", benchmark);
+		exit(EXIT_FAILURE);
+	}
+
+	free_db();
+
+	return 0;
+}
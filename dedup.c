@@ -0,0 +1,272 @@
+/*************************************************************************
+  This file remembers the results of recent requests, so a client that
+  retries a request whose reply it lost gets the first result back
+  instead of having the request run twice
+
+   A binary request that carries a client id (see protocol.h) is known
+   by its client id and request id. dedup_begin() is called before the
+   request runs: the first time, it reserves an entry and the request
+   runs; while that entry is pending, copies of the request are turned
+   away with -10; once dedup_finish() has stored the result, copies get
+   that result back without running.
+
+   Layout:
+   	entries are split by a hash of the ids across DEDUP_SHARDS shards,
+   	each with its own mutex, so reactors seldom wait on each other;
+   	within a shard the hash picks a set of DEDUP_WAYS entries, which
+   	fill three cache lines and are searched together
+
+   Bounds:
+   	the cache never grows: each set keeps its entries newest first,
+   	and a new entry goes in at the front while the oldest one that
+   	is not still pending drops off, so the cache costs 24 bytes an
+   	entry however many clients come and go. A result is forgotten
+   	after dedup_seconds, or sooner once newer requests push it out,
+   	so a client must retry within that time; -D should give at least
+   	as many entries as the server takes changes in that time. A
+   	cache much larger than the CPU caches misses on nearly every
+   	request, which is most of what it costs (see databaseBench dedup)
+
+   The cache lives in memory: it covers replies lost with a connection,
+   not a restart of the server.
+ **************************************************************************/
+#include "dedup.h"
+
+#define DEDUP_SHARD_BITS 6
+#define DEDUP_SHARDS (1 << DEDUP_SHARD_BITS)
+#define DEDUP_WAYS 8
+
+/* result of one request */
+typedef struct dedup_entry dedup_entry;
+struct dedup_entry {
+	uint64_t client_id;	//0 while the entry is free
+	uint32_t request_id;
+	uint32_t account_id;	//id of the account the request acted on; a CREATE reply hands it back
+	uint32_t stamp;		//second the entry was made or finished, on the coarse monotonic clock; too coarse to order entries by
+	uint8_t command;
+	int8_t status;		//result of the request, once it has finished
+	uint8_t pending;	//the request is still running
+};
+
+/* a lock and the sets it guards; one to a cache line so shards don't share lines */
+typedef struct dedup_shard dedup_shard;
+struct dedup_shard {
+	pthread_mutex_t lock;
+	dedup_entry *entries;		//sets of DEDUP_WAYS entries
+} __attribute__((aligned(64)));
+
+/******************************* GLOBALS **************************************/
+dedup_shard dedup_shards[DEDUP_SHARDS];
+
+/* entries of every shard; NULL while the cache is off */
+dedup_entry *dedup_entries = NULL;
+
+/* sets in each shard, less one; the number of sets is a power of two */
+size_t dedup_set_mask;
+
+/* seconds a result is remembered */
+uint32_t dedup_seconds;
+
+/******************************************************************************/
+
+/* set up the cache; must be called before any other dedup function
+ *
+ * @param1 num_entries results to remember at most; rounded up to fill the sets, and 0 turns the cache off
+ * @param2 seconds how long a result is remembered
+ *
+ * @return -1 if the cache could not be allocated
+ *          0 if successful
+ */
+int init_dedup(size_t num_entries, uint32_t seconds)
+{
+	dedup_seconds = seconds;
+
+	if(num_entries == 0) return 0;
+
+	size_t sets = 1;
+	while(sets * DEDUP_WAYS * DEDUP_SHARDS < num_entries) sets <<= 1;
+	dedup_set_mask = sets - 1;
+
+	//sets start on a cache line
+	size_t size = sets * DEDUP_WAYS * DEDUP_SHARDS * sizeof(dedup_entry);
+	dedup_entries = aligned_alloc(64, size);
+	if(!dedup_entries) return -1;
+	memset(dedup_entries, 0, size);
+
+	int i;
+	for(i = 0; i < DEDUP_SHARDS; i++) {
+		pthread_mutex_init(&dedup_shards[i].lock, NULL);
+		dedup_shards[i].entries = dedup_entries + i * sets * DEDUP_WAYS;
+	}
+
+	return 0;
+}
+
+/* @return seconds on the coarse monotonic clock, which is read without a system call */
+uint32_t dedup_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec;
+}
+
+/* mix the ids of a request so both spread over every shard and set; client ids are
+ * often sequential and request ids always are
+ *
+ * @param1 client_id id of the client
+ * @param2 request_id id of the request
+ *
+ * @return the hash; the low bits pick the shard and the next ones the set
+ */
+uint64_t dedup_hash(uint64_t client_id, uint32_t request_id)
+{
+	uint64_t hash = client_id ^ (request_id * 0x9E3779B97F4A7C15ULL);
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+/* lock the shard of a request and find the set its entry belongs in
+ *
+ * @param1 client_id id of the client
+ * @param2 request_id id of the request
+ * @param3 shard pointer in which to put the locked shard
+ *
+ * @return first entry of the set
+ */
+dedup_entry* lock_dedup_set(uint64_t client_id, uint32_t request_id, dedup_shard **shard)
+{
+	uint64_t hash = dedup_hash(client_id, request_id);
+
+	*shard = &dedup_shards[hash & (DEDUP_SHARDS - 1)];
+	pthread_mutex_lock(&(*shard)->lock);
+
+	return (*shard)->entries + ((hash >> DEDUP_SHARD_BITS) & dedup_set_mask) * DEDUP_WAYS;
+}
+
+/* find the unexpired entry of a request in its set
+ *
+ * @return the entry; NULL if the request is not remembered
+ */
+dedup_entry* find_dedup_entry(dedup_entry *set, uint64_t client_id, uint32_t request_id, uint32_t now)
+{
+	int i;
+	for(i = 0; i < DEDUP_WAYS; i++) {
+		if(set[i].client_id == client_id && set[i].request_id == request_id && now - set[i].stamp < dedup_seconds)
+			return &set[i];
+	}
+
+	return NULL;
+}
+
+/* make room for a new request at the front of a set, whose entries are kept newest
+ * first: the oldest entry that is free, expired or finished is dropped, or the
+ * oldest of all if every entry is pending
+ *
+ * @return the first entry of the set, for the new request
+ */
+dedup_entry* push_dedup_entry(dedup_entry *set, uint32_t now)
+{
+	int victim;
+	for(victim = DEDUP_WAYS - 1; victim > 0; victim--) {
+		dedup_entry *entry = &set[victim];
+		if(entry->client_id == 0 || now - entry->stamp >= dedup_seconds || !entry->pending) break;
+	}
+
+	if(victim == 0 && set[0].client_id != 0 && now - set[0].stamp < dedup_seconds && set[0].pending)
+		victim = DEDUP_WAYS - 1;
+
+	memmove(set + 1, set, victim * sizeof(dedup_entry));
+
+	return set;
+}
+
+/* look a request up before running it
+ *
+ * @param1 client_id id of the client; never 0
+ * @param2 request_id id of the request
+ * @param3 command db_command of the request; the same ids on another command are another request
+ * @param4 status pointer in which to put the result of a finished request
+ * @param5 account_id pointer in which to put the account id of a finished request
+ *
+ * @return DEDUP_NEW if the request has not been seen, and is now pending, so it must be run and finished
+ *         DEDUP_REPLAY if it has finished, with its result in status and account_id
+ *         DEDUP_BUSY if a copy of it is still running
+ */
+dedup_result dedup_begin(uint64_t client_id, uint32_t request_id, int command, int *status, uint32_t *account_id)
+{
+	if(!dedup_entries) return DEDUP_NEW;
+
+	uint32_t now = dedup_now();
+	dedup_shard *shard;
+	dedup_entry *set = lock_dedup_set(client_id, request_id, &shard);
+
+	dedup_entry *entry = find_dedup_entry(set, client_id, request_id, now);
+	if(entry && entry->command == command) {
+		dedup_result result = entry->pending ? DEDUP_BUSY : DEDUP_REPLAY;
+		*status = entry->status;
+		*account_id = entry->account_id;
+
+		pthread_mutex_unlock(&shard->lock);
+		return result;
+	}
+
+	if(!entry) entry = push_dedup_entry(set, now);
+
+	entry->client_id = client_id;
+	entry->request_id = request_id;
+	entry->command = command;
+	entry->status = 0;
+	entry->account_id = 0;
+	entry->stamp = now;
+	entry->pending = 1;
+
+	pthread_mutex_unlock(&shard->lock);
+
+	return DEDUP_NEW;
+}
+
+/* store the result of a request dedup_begin() found new, for copies of it to get back
+ *
+ * @param1 client_id id of the client
+ * @param2 request_id id of the request
+ * @param3 command db_command of the request
+ * @param4 status result of the request
+ * @param5 account_id id of the account the request acted on
+ */
+void dedup_finish(uint64_t client_id, uint32_t request_id, int command, int status, uint32_t account_id)
+{
+	if(!dedup_entries) return;
+
+	uint32_t now = dedup_now();
+	dedup_shard *shard;
+	dedup_entry *set = lock_dedup_set(client_id, request_id, &shard);
+
+	//the pending entry may have been pushed out while the request ran
+	dedup_entry *entry = find_dedup_entry(set, client_id, request_id, now);
+	if(!entry) entry = push_dedup_entry(set, now);
+
+	entry->client_id = client_id;
+	entry->request_id = request_id;
+	entry->command = command;
+	entry->status = status;
+	entry->account_id = account_id;
+	entry->stamp = now;
+	entry->pending = 0;
+
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* free the cache */
+void free_dedup()
+{
+	if(!dedup_entries) return;
+
+	int i;
+	for(i = 0; i < DEDUP_SHARDS; i++) pthread_mutex_destroy(&dedup_shards[i].lock);
+
+	free(dedup_entries);
+	dedup_entries = NULL;
+}
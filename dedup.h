@@ -0,0 +1,21 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+/* enums */
+typedef enum _dedup_result{DEDUP_NEW, DEDUP_REPLAY, DEDUP_BUSY} dedup_result;
+
+/* results remembered unless -D says otherwise */
+#define DEFAULT_DEDUP_ENTRIES 262144
+
+/* seconds a result is remembered unless -D says otherwise */
+#define DEFAULT_DEDUP_SECONDS 300
+
+/* dedup functions */
+int init_dedup(size_t num_entries, uint32_t seconds);
+dedup_result dedup_begin(uint64_t client_id, uint32_t request_id, int command, int *status, uint32_t *account_id);
+void dedup_finish(uint64_t client_id, uint32_t request_id, int command, int status, uint32_t account_id);
+void free_dedup();
@@ -0,0 +1,186 @@
+/*************************************************************************
+  This file handles epoch-based reclamation of memory read without locks
+
+   A thread reading shared memory without a lock does so between
+   epoch_enter() and epoch_exit(). A writer that unlinks memory such a
+   reader may still be looking at hands it to epoch_retire() instead of
+   free(); it is freed once every reader active when it was unlinked
+   has left.
+
+   Readers only publish the global epoch they entered in, so entering
+   and leaving never take a lock and never write shared memory other
+   than the reader's own record. Writers advance the global epoch once
+   every active reader has seen it; memory retired in epoch e is freed
+   by a later epoch_retire() once the global epoch reaches e + 2, by
+   which time every reader that entered in e or earlier has left.
+ **************************************************************************/
+#include "epoch.h"
+
+/* per-thread record of the epoch a reader is in; one cache line each so readers don't share lines */
+typedef struct epoch_reader epoch_reader;
+struct epoch_reader {
+	uint64_t epoch;			//global epoch when the reader entered; 0 while outside
+	int in_use;			//owned by a running thread
+	epoch_reader *next;		//next record in epoch_readers
+	char padding[64 - 2 * sizeof(uint64_t) - sizeof(epoch_reader*)];
+};
+
+/* memory waiting until no reader can see it */
+typedef struct retired_block retired_block;
+struct retired_block {
+	void *ptr;
+	uint64_t epoch;			//global epoch when it was retired
+	retired_block *next;
+};
+
+/******************************* GLOBALS **************************************/
+/* starts at 1 so 0 can mean a reader is outside */
+uint64_t global_epoch = 1;
+
+/* every reader record ever made; records are reused, never freed */
+epoch_reader *epoch_readers;
+
+/* guards adding to epoch_readers, the retired list and advancing global_epoch; never taken by readers */
+pthread_mutex_t epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* retired blocks, newest first */
+retired_block *retired;
+
+/* record of the calling thread; NULL until it first enters */
+__thread epoch_reader *this_reader;
+
+/* gives reader records back when their thread exits */
+pthread_key_t reader_key;
+pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+
+/******************************************************************************/
+
+/* destructor of reader_key; lets another thread take the exiting thread's record */
+void release_reader(void *arg)
+{
+	epoch_reader *reader = (epoch_reader*) arg;
+	__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&reader->in_use, 0, __ATOMIC_RELEASE);
+}
+
+void make_reader_key()
+{
+	pthread_key_create(&reader_key, release_reader);
+}
+
+/* find a free reader record for the calling thread, or add one
+ *
+ * @return the thread's record
+ */
+epoch_reader* register_reader()
+{
+	pthread_once(&reader_key_once, make_reader_key);
+
+	pthread_mutex_lock(&epoch_lock);
+
+	epoch_reader *reader = epoch_readers;
+	while(reader && reader->in_use) reader = reader->next;
+
+	if(!reader) {
+		reader = calloc(1, sizeof(epoch_reader));
+		reader->next = epoch_readers;
+		__atomic_store_n(&epoch_readers, reader, __ATOMIC_RELEASE);
+	}
+	reader->in_use = 1;
+
+	pthread_mutex_unlock(&epoch_lock);
+
+	pthread_setspecific(reader_key, reader);
+	this_reader = reader;
+
+	return reader;
+}
+
+/* start reading shared memory without a lock; must not be nested */
+void epoch_enter()
+{
+	epoch_reader *reader = this_reader ? this_reader : register_reader();
+
+	__atomic_store_n(&reader->epoch, __atomic_load_n(&global_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+
+	//the store must be visible to writers before any shared pointer is loaded
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* stop reading shared memory; nothing loaded since epoch_enter() may be used afterwards */
+void epoch_exit()
+{
+	__atomic_store_n(&this_reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* advance the global epoch if every active reader has entered in it;
+ * caller must hold epoch_lock
+ */
+void try_advance_epoch()
+{
+	uint64_t epoch = global_epoch;
+
+	epoch_reader *reader;
+	for(reader = epoch_readers; reader; reader = reader->next) {
+		uint64_t reader_epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+		if(reader_epoch != 0 && reader_epoch != epoch) return;
+	}
+
+	__atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+/* free memory once no reader can still see it; the caller must already have
+ * unlinked it so readers entering from now on can't find it
+ *
+ * @param1 ptr block from malloc()
+ */
+void epoch_retire(void *ptr)
+{
+	retired_block *block = malloc(sizeof(retired_block));
+	block->ptr = ptr;
+
+	//the unlink must be visible before readers are checked
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&epoch_lock);
+
+	block->epoch = global_epoch;
+	block->next = retired;
+	retired = block;
+
+	//twice, so with no reader in the way the block can be freed right away
+	try_advance_epoch();
+	try_advance_epoch();
+
+	//blocks are newest first, so free the tail once it is old enough
+	retired_block **link = &retired;
+	while(*link && (*link)->epoch + 2 > global_epoch) link = &(*link)->next;
+
+	retired_block *old = *link;
+	*link = NULL;
+
+	pthread_mutex_unlock(&epoch_lock);
+
+	while(old) {
+		retired_block *next = old->next;
+		free(old->ptr);
+		free(old);
+		old = next;
+	}
+}
+
+/* free every retired block; only valid when no reader is active */
+void epoch_free_retired()
+{
+	pthread_mutex_lock(&epoch_lock);
+	retired_block *block = retired;
+	retired = NULL;
+	pthread_mutex_unlock(&epoch_lock);
+
+	while(block) {
+		retired_block *next = block->next;
+		free(block->ptr);
+		free(block);
+		block = next;
+	}
+}
@@ -0,0 +1,11 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+
+/* epoch functions */
+void epoch_enter();
+void epoch_exit();
+void epoch_retire(void *ptr);
+void epoch_free_retired();
@@ -0,0 +1,835 @@
+#include "bankingServer.h"
+#include <errno.h>
+
+/******************************************************************************
+ * Event Loop
+ *
+ * run_event_loop:
+ * 	spawns a fixed number of reactor_runner threads and waits for them
+ *
+ * reactor_runner:
+ * 	owns an epoll instance watching the server socket, the shutdown
+ * 	eventfd, and every client it has accepted
+ * 	sleeps in epoll_wait() until one of them is ready, so idle clients
+ * 	cost no cpu
+ * 	exits after telling its clients the server has shut down once
+ * 	the shutdown eventfd becomes readable
+ *
+ * admission control:
+ * 	a reactor reserves a slot in num_clients before every accept();
+ * 	once max_clients are connected the server socket is taken out of
+ * 	every reactor's epoll instance, so new connections queue in the
+ * 	kernel's listen backlog instead of being accepted, and it is put
+ * 	back when a client leaves
+ * 	when accept() fails for want of descriptors or memory the pending
+ * 	connection keeps the socket readable, so the reactor that hit it
+ * 	takes the socket out of its epoll instance until the next tick
+ * 	rather than spin on it
+ *
+ * shared-nothing mode (-p):
+ * 	every reactor binds a listening socket of its own with SO_REUSEPORT,
+ * 	so the kernel spreads connections over them, and owns the accounts
+ * 	of every segment s with s % num_reactors equal to its index
+ * 	a request for an account another reactor owns is pushed onto a
+ * 	single-producer single-consumer queue to the owner, which executes
+ * 	it and pushes the session back on a queue of its own; the session
+ * 	reads nothing more until the result is back, so its replies stay
+ * 	in order
+ * 	a reactor rings the eventfd doorbell of each reactor it pushed to
+ * 	once per pass of its loop rather than once per request
+ * 	the legs of a transfer crediting other reactors' accounts, and the
+ * 	END run when a client disconnects, still go through the database's
+ * 	own locks
+ *
+ * timeouts (-I, -L):
+ * 	a client that sends and takes nothing for idle_secs is closed, and
+ * 	so is one that holds an account in session for lease_secs without
+ * 	using it; closing it ends the session, so a hung client can't keep
+ * 	an account from everyone else
+ * 	each reactor keeps a timer for each of its clients on a timer wheel
+ * 	of one second ticks (see timerWheel.c) and runs the wheel after
+ * 	every pass of its loop; while it has timers, epoll_wait() returns
+ * 	by the next tick
+ * 	a request only stamps the tick on its session: the timer is left
+ * 	where it is, and when it fires early it is set again for the
+ * 	session's real deadline, so busy clients cost the wheel nothing
+ * ****************************************************************************/
+
+#define MAX_EVENTS 64
+
+/* entries in each queue between two reactors */
+#define QUEUE_SIZE 256
+
+/* defined in bankingServer.c */
+extern pthread_mutex_t mutex;
+extern int num_clients;
+
+/* state owned by a single reactor thread */
+typedef struct reactor reactor;
+struct reactor {
+	pthread_t id;			//thread id
+	int index;			//position in reactors
+	int epoll_fd;			//epoll instance of this reactor
+	int server_sockfd;		//listening socket; shared by all reactors unless in shared-nothing mode
+	int shutdown_fd;		//eventfd signalled by handle_sigint()
+	client_session *sessions;	//clients accepted by this reactor
+	client_session *dropped;	//clients closed during the current pass of its loop, linked by next
+
+	//shared-nothing mode
+	int doorbell_fd;		//eventfd other reactors write to after pushing onto its queues
+	bool *ring;			//reactors pushed to since the doorbells were last rung
+	bool ring_any;			//any entry of ring is set
+	client_session *stalled;	//sessions waiting for room in a full queue, oldest first
+	client_session *stalled_tail;	//last of them
+
+	//timeouts
+	timer_wheel timers;		//timeout of every client this reactor accepted
+	uint64_t tick;			//tick when epoll_wait() last returned
+
+	//admission control; guarded by mutex
+	bool accept_paused;		//server socket left out of epoll_fd after accept() ran out of descriptors or memory
+	uint64_t accept_resume_tick;	//tick to put it back at
+};
+
+/* ring of sessions handed from one reactor to another; only the producer writes tail
+ * and only the consumer writes head, each on a cache line of its own
+ */
+typedef struct spsc_queue spsc_queue;
+struct spsc_queue {
+	size_t head __attribute__((aligned(64)));	//next entry to pop
+	size_t tail __attribute__((aligned(64)));	//next entry to push
+	client_session *entries[QUEUE_SIZE];
+};
+
+/* epoll_event.data.ptr of the shutdown eventfd; sessions and NULL (the server socket) are the other values */
+static char shutdown_marker;
+
+/* epoll_event.data.ptr of a reactor's doorbell eventfd */
+static char doorbell_marker;
+
+/* every reactor, so whichever one fills or frees the last client slot can pause or resume accepting */
+static reactor *reactors;
+static int num_reactors;
+
+/* admission control; guarded by mutex, like num_clients */
+static int max_clients;
+static bool accepting;
+
+/* seconds a client may sit idle, and hold an account in session without using it; 0 for no limit */
+static uint32_t idle_seconds;
+static uint32_t lease_seconds;
+
+/* shared-nothing mode; requests from reactor i to reactor j are in request_queues[i * num_reactors + j]
+ * and their results go back through result_queues[j * num_reactors + i]
+ */
+static bool shared_nothing;
+static spsc_queue *request_queues;
+static spsc_queue *result_queues;
+
+/* reactor of the calling thread */
+static __thread reactor *this_reactor;
+
+static void free_sessions();
+
+/* read the clock in the one second ticks of the reactors' timer wheels
+ *
+ * @param1 until_next pointer in which to put the milliseconds left until the next tick; may be NULL
+ *
+ * @return seconds on the coarse monotonic clock, which is read without a system call
+ */
+static uint64_t session_tick(int *until_next)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+	if(until_next) *until_next = 1000 - ts.tv_nsec / 1000000;
+
+	return ts.tv_sec;
+}
+
+/* spawn the reactor threads and wait for all of them to shut down
+ *
+ * @param1 server_sockfd the bound server socket
+ * @param2 reactor_count number of reactor threads to run
+ * @param3 client_limit number of clients served at once
+ * @param4 backlog number of connections the kernel queues while the server is full
+ * @param5 shutdown_fd eventfd that becomes readable on SIGINT
+ * @param6 port_num port server_sockfd is bound to
+ * @param7 partitioned run in shared-nothing mode; server_sockfd must have been bound with SO_REUSEPORT
+ * @param8 idle_secs seconds a client may send and take nothing before it is closed; 0 for no limit
+ * @param9 lease_secs seconds a client may hold an account in session without using it; 0 for no limit
+ */
+void run_event_loop(int server_sockfd, int reactor_count, int client_limit, int backlog, int shutdown_fd, char *port_num, int partitioned,
+		int idle_secs, int lease_secs)
+{
+	num_reactors = reactor_count;
+	idle_seconds = idle_secs;
+	lease_seconds = lease_secs;
+	max_clients = client_limit;
+	accepting = true;
+	shared_nothing = partitioned;
+	reactors = calloc(num_reactors, sizeof(reactor));
+
+	if(shared_nothing) {
+		request_queues = aligned_alloc(64, (size_t) num_reactors * num_reactors * sizeof(spsc_queue));
+		result_queues = aligned_alloc(64, (size_t) num_reactors * num_reactors * sizeof(spsc_queue));
+		memset(request_queues, 0, (size_t) num_reactors * num_reactors * sizeof(spsc_queue));
+		memset(result_queues, 0, (size_t) num_reactors * num_reactors * sizeof(spsc_queue));
+	}
+
+	sigset_t old_signals;
+	block_server_signals(&old_signals);
+
+	int i;
+	for(i = 0; i < num_reactors; i++) {
+		//in shared-nothing mode every reactor after the first listens on a socket of its own
+		reactors[i].server_sockfd = (shared_nothing && i > 0) ? bind_to_socket(port_num, true) : server_sockfd;
+		make_calls_to_socket_nonblocking(reactors[i].server_sockfd);
+		if(i == 0 || shared_nothing) listen(reactors[i].server_sockfd, backlog);
+
+		reactors[i].index = i;
+		reactors[i].shutdown_fd = shutdown_fd;
+		reactors[i].sessions = NULL;
+		reactors[i].dropped = NULL;
+		reactors[i].tick = session_tick(NULL);
+		reactors[i].accept_paused = false;
+		init_timer_wheel(&reactors[i].timers, reactors[i].tick);
+		reactors[i].epoll_fd = epoll_create1(0);
+		if(reactors[i].epoll_fd == -1) {
+			perror("epoll_create1: ");
+			exit(EXIT_FAILURE);
+		}
+
+		//every reactor waits on the server socket; EPOLLEXCLUSIVE wakes only one of them per connection
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLEXCLUSIVE;
+		event.data.ptr = NULL;
+		epoll_ctl(reactors[i].epoll_fd, EPOLL_CTL_ADD, reactors[i].server_sockfd, &event);
+
+		//the shutdown eventfd is never read, so it stays readable and wakes every reactor
+		event.events = EPOLLIN;
+		event.data.ptr = &shutdown_marker;
+		epoll_ctl(reactors[i].epoll_fd, EPOLL_CTL_ADD, shutdown_fd, &event);
+
+		if(shared_nothing) {
+			reactors[i].doorbell_fd = eventfd(0, EFD_NONBLOCK);
+			reactors[i].ring = calloc(num_reactors, sizeof(bool));
+			reactors[i].ring_any = false;
+			reactors[i].stalled = NULL;
+			reactors[i].stalled_tail = NULL;
+
+			event.events = EPOLLIN;
+			event.data.ptr = &doorbell_marker;
+			epoll_ctl(reactors[i].epoll_fd, EPOLL_CTL_ADD, reactors[i].doorbell_fd, &event);
+		}
+	}
+
+	//start the threads only once every doorbell exists
+	for(i = 0; i < num_reactors; i++)
+		pthread_create(&reactors[i].id, NULL, reactor_runner, &reactors[i]);
+
+	pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+
+	for(i = 0; i < num_reactors; i++) {
+		pthread_join(reactors[i].id, NULL);
+		close(reactors[i].epoll_fd);
+
+		if(shared_nothing) {
+			close(reactors[i].doorbell_fd);
+			free(reactors[i].ring);
+			if(i > 0) close(reactors[i].server_sockfd);
+		}
+	}
+
+	int close_ret = close(server_sockfd);
+	if(close_ret == -1) {
+		perror("close service: ");
+	}
+
+	free_sessions();
+	free(request_queues);
+	free(result_queues);
+	free(reactors);
+}
+
+/* push a session onto a queue; only the reactor producing for the queue may call it
+ *
+ * @param1 queue the queue
+ * @param2 session the session to hand over
+ *
+ * @return true if pushed; false if the queue is full
+ */
+static bool spsc_push(spsc_queue *queue, client_session *session)
+{
+	size_t tail = queue->tail;
+	if(tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == QUEUE_SIZE) return false;
+
+	queue->entries[tail % QUEUE_SIZE] = session;
+
+	//the session, and the entry, must be visible before the consumer sees the new tail
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/* pop a session from a queue; only the reactor consuming from the queue may call it
+ *
+ * @param1 queue the queue
+ *
+ * @return the oldest session in the queue; NULL if it is empty
+ */
+static client_session* spsc_pop(spsc_queue *queue)
+{
+	size_t head = queue->head;
+	if(head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) return NULL;
+
+	client_session *session = queue->entries[head % QUEUE_SIZE];
+
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+	return session;
+}
+
+/* reactor owning the account a request acts on in shared-nothing mode
+ *
+ * @param1 session the session of the client that sent the request
+ * @param2 request the checked request
+ *
+ * @return index of the reactor
+ */
+static int account_owner(client_session *session, client_request *request)
+{
+	//in-session commands carry the account's id rather than its name
+	int segment = account_name_needed(request->command) ? account_segment(request->account_name) : session->active_session_segment;
+
+	return segment % num_reactors;
+}
+
+/* hand a forwarded session to the next reactor it is waiting for: the owner of its
+ * request's account if it is this reactor's client, otherwise the reactor that accepted it
+ *
+ * @param1 self the reactor holding the session
+ * @param2 session the session
+ *
+ * @return true if pushed; false if the queue is full
+ */
+static bool hand_off_session(reactor *self, client_session *session)
+{
+	bool to_owner = session->reactor_index == self->index;
+	int target = to_owner ? session->forward_owner : session->reactor_index;
+
+	spsc_queue *queues = to_owner ? request_queues : result_queues;
+	if(!spsc_push(&queues[self->index * num_reactors + target], session)) return false;
+
+	self->ring[target] = true;
+	self->ring_any = true;
+
+	return true;
+}
+
+/* hand a forwarded session over, or queue it behind the sessions already waiting for room
+ *
+ * @param1 self the reactor holding the session
+ * @param2 session the session
+ */
+static void hand_off_or_stall(reactor *self, client_session *session)
+{
+	if(!self->stalled && hand_off_session(self, session)) return;
+
+	session->stalled_next = NULL;
+	if(self->stalled_tail) self->stalled_tail->stalled_next = session;
+	else self->stalled = session;
+	self->stalled_tail = session;
+}
+
+/* retry handing over the stalled sessions, oldest first, until a queue is still full
+ *
+ * @param1 self the reactor holding them
+ */
+static void retry_stalled(reactor *self)
+{
+	while(self->stalled && hand_off_session(self, self->stalled)) {
+		self->stalled = self->stalled->stalled_next;
+		if(!self->stalled) self->stalled_tail = NULL;
+	}
+}
+
+/* hand a request to the reactor owning its account if that is not the calling reactor;
+ * the session reads nothing more until finish_client_request() has run for it
+ *
+ * @param1 session the session of the client that sent the request
+ * @param2 request the checked request
+ * @param3 start value of metrics_start() when the request started
+ *
+ * @return true if forwarded; false if the calling reactor should execute it
+ */
+bool forward_client_request(client_session *session, client_request *request, uint64_t start)
+{
+	if(!shared_nothing) return false;
+
+	int owner = account_owner(session, request);
+	if(owner == this_reactor->index) return false;
+
+	session->forward_request = *request;
+	session->forward_owner = owner;
+	session->forward_status = 0;
+	session->forward_balance = 0;
+	session->forward_start = start;
+	session->forwarded = true;
+
+	hand_off_or_stall(this_reactor, session);
+
+	return true;
+}
+
+/* write the doorbell of every reactor pushed to since they were last rung
+ *
+ * @param1 self the reactor that pushed
+ */
+static void ring_doorbells(reactor *self)
+{
+	if(!self->ring_any) return;
+	self->ring_any = false;
+
+	uint64_t one = 1;
+	int i;
+	for(i = 0; i < num_reactors; i++) {
+		if(!self->ring[i]) continue;
+		self->ring[i] = false;
+
+		if(write(reactors[i].doorbell_fd, &one, sizeof(one)) == -1) {
+			perror("write doorbell: ");
+		}
+	}
+}
+
+/* add a session to the front of the reactor's session list
+ *
+ * @param1 self the reactor that accepted the client
+ * @param2 session the session of the new client
+ */
+static void add_session_to_reactor(reactor *self, client_session *session)
+{
+	session->prev = NULL;
+	session->next = self->sessions;
+	if(self->sessions) self->sessions->prev = session;
+	self->sessions = session;
+}
+
+/* remove a session from the reactor's session list
+ *
+ * @param1 self the reactor that owns the session
+ * @param2 session the session to remove
+ */
+static void remove_session_from_reactor(reactor *self, client_session *session)
+{
+	if(session->prev) session->prev->next = session->next;
+	else self->sessions = session->next;
+
+	if(session->next) session->next->prev = session->prev;
+}
+
+/* add the server socket to, or remove it from, a reactor's epoll instance
+ * as run_event_loop() first registered it
+ *
+ * @param1 r the reactor
+ * @param2 on true to watch the server socket; false to stop
+ */
+static void watch_server_socket(reactor *r, bool on)
+{
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLEXCLUSIVE;
+	event.data.ptr = NULL;
+	epoll_ctl(r->epoll_fd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, r->server_sockfd, &event);
+}
+
+/* add the server socket to, or remove it from, every reactor's epoll instance,
+ * leaving out reactors that paused accepting; caller must hold mutex
+ *
+ * @param1 on true to accept new clients; false to leave them in the listen backlog
+ */
+static void set_accepting(bool on)
+{
+	if(accepting == on) return;
+	accepting = on;
+
+	int i;
+	for(i = 0; i < num_reactors; i++) {
+		if(!reactors[i].accept_paused) watch_server_socket(&reactors[i], on);
+	}
+}
+
+/* stop a reactor watching the server socket until the next tick, after accept()
+ * failed in a way the pending connection will keep failing until something is freed
+ *
+ * @param1 self the reactor whose accept() failed
+ */
+static void pause_accepting(reactor *self)
+{
+	perror("accept: ");
+
+	pthread_mutex_lock(&mutex);
+
+	if(accepting) watch_server_socket(self, false);
+	self->accept_paused = true;
+	self->accept_resume_tick = self->tick + 1;
+
+	pthread_mutex_unlock(&mutex);
+}
+
+/* watch the server socket again once a paused reactor's tick has come
+ *
+ * @param1 self the reactor
+ */
+static void resume_accepting(reactor *self)
+{
+	if(!self->accept_paused || self->tick < self->accept_resume_tick) return;
+
+	pthread_mutex_lock(&mutex);
+
+	self->accept_paused = false;
+	if(accepting) watch_server_socket(self, true);
+
+	pthread_mutex_unlock(&mutex);
+}
+
+/* reserve a slot for a client about to be accepted
+ *
+ * @return true if there was a free slot; false if the server is full,
+ *         in which case it stops accepting
+ */
+static bool reserve_client_slot()
+{
+	pthread_mutex_lock(&mutex);
+
+	bool reserved = num_clients < max_clients;
+	if(reserved) num_clients++;
+	else set_accepting(false);
+
+	pthread_mutex_unlock(&mutex);
+
+	return reserved;
+}
+
+/* give back the slot of a client that left, or was never accepted,
+ * and resume accepting if the server was full
+ */
+static void release_client_slot()
+{
+	pthread_mutex_lock(&mutex);
+
+	num_clients--;
+	set_accepting(true);
+
+	pthread_mutex_unlock(&mutex);
+}
+
+/* accept every pending connection on the server socket, up to max_clients, and watch the new clients
+ *
+ * @param1 self the reactor that was woken for the server socket
+ */
+static void accept_clients(reactor *self)
+{
+	while(reserve_client_slot()) {
+		int client_sockfd = accept(self->server_sockfd, NULL, NULL);
+
+		if(client_sockfd == -1) {
+			release_client_slot();
+
+			//the connection was gone before it was taken; try the next one
+			if(errno == ECONNABORTED || errno == EPROTO || errno == EINTR) continue;
+
+			//out of descriptors or memory (EMFILE, ENFILE, ENOBUFS, ENOMEM): the connection stays
+			//pending and the socket readable, so back off instead of being woken for it again at once
+			if(errno != EAGAIN && errno != EWOULDBLOCK) pause_accepting(self);
+
+			//otherwise no more pending connections (or another reactor took them)
+			return;
+		}
+
+		printf("accepted connection from client #%d\n", client_sockfd);
+
+		make_calls_to_socket_nonblocking(client_sockfd);
+
+		client_session *session = malloc(sizeof(client_session));
+		init_client_session(session, client_sockfd);
+		session->reactor_index = self->index;
+		session->last_active = self->tick;
+		add_session_to_reactor(self, session);
+		if(idle_seconds || lease_seconds) set_timer(&self->timers, &session->timeout, self->tick + (idle_seconds ? idle_seconds : lease_seconds) + 1);
+
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLRDHUP;
+		event.data.ptr = session;
+		epoll_ctl(self->epoll_fd, EPOLL_CTL_ADD, client_sockfd, &event);
+	}
+}
+
+/* change what the reactor waits for on a client to suit the state of its session
+ *
+ * @param1 self the reactor that owns the client
+ * @param2 session the session of the client
+ */
+static void watch_client(reactor *self, client_session *session)
+{
+	//while replies are waiting, wait for the client to take them instead of reading more requests;
+	//while a request is forwarded, wait for nothing (EPOLLONESHOT stops a hangup from being reported over and over)
+	uint32_t events = EPOLLONESHOT;
+	if(!session->forwarded) events = (session->send_len > 0 ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP;
+
+	if(events == session->watched_events) return;
+
+	struct epoll_event event;
+	event.events = events;
+	event.data.ptr = session;
+	epoll_ctl(self->epoll_fd, EPOLL_CTL_MOD, session->client_sockfd, &event);
+	session->watched_events = events;
+}
+
+/* close a client that disconnected or quit; closing the socket also removes it from the epoll instance
+ * later events of the same epoll_wait() may still point to the session, so it is only marked dropped
+ * here and freed by free_dropped_clients() once the pass is over
+ *
+ * @param1 self the reactor that owns the client
+ * @param2 session the session of the client
+ */
+static void drop_client(reactor *self, client_session *session)
+{
+	cancel_timer(&self->timers, &session->timeout);
+	remove_session_from_reactor(self, session);
+	close_client_session(session);
+
+	session->dropped = true;
+	session->next = self->dropped;
+	self->dropped = session;
+
+	release_client_slot();
+}
+
+/* free the clients dropped during the pass of the reactor's loop that just ended
+ *
+ * @param1 self the reactor that dropped them
+ */
+static void free_dropped_clients(reactor *self)
+{
+	while(self->dropped) {
+		client_session *next = self->dropped->next;
+		free(self->dropped);
+		self->dropped = next;
+	}
+}
+
+/* read and execute the messages of a client that epoll reported as ready,
+ * or send the replies it was waiting to take
+ *
+ * @param1 self the reactor that owns the client
+ * @param2 session the session of the ready client
+ */
+static void serve_client(reactor *self, client_session *session)
+{
+	//closed by an earlier event of this pass
+	if(session->dropped) return;
+
+	//anything the client did while a request was out is seen once it is back
+	if(session->forwarded) return;
+
+	session->last_active = self->tick;
+
+	if(serve_client_frames(session)) watch_client(self, session);
+	else drop_client(self, session);
+}
+
+/* seconds of inactivity the client is allowed in the state its session is in
+ *
+ * @param1 session the session of the client
+ * @param2 kind pointer in which to put the timeout that applies; may be NULL
+ *
+ * @return the seconds; 0 for no limit
+ */
+static uint32_t client_timeout(client_session *session, timeout_kind *kind)
+{
+	uint32_t timeout = idle_seconds;
+	if(kind) *kind = IDLE_TIMEOUT;
+
+	if(session->active_session && lease_seconds && (!timeout || lease_seconds < timeout)) {
+		timeout = lease_seconds;
+		if(kind) *kind = LEASE_TIMEOUT;
+	}
+
+	return timeout;
+}
+
+/* timer_callback closing a client that has been inactive too long; a timer that fires
+ * before the session's deadline, which later activity or a new session moved, is set
+ * again for it
+ *
+ * @param1 timer timeout of the session
+ * @param2 arg the reactor owning the session
+ */
+static void expire_client(wheel_timer *timer, void *arg)
+{
+	reactor *self = (reactor*) arg;
+	client_session *session = (client_session*) timer->data;
+
+	timeout_kind kind;
+	uint32_t timeout = client_timeout(session, &kind);
+
+	//ticks are whole seconds, so the last one stamped may have had all but a moment left: a client
+	//gets one tick over its timeout, never less than its timeout;
+	//a client with no limit now may serve an account later, so look again once a lease would run out;
+	//one whose request is out at another reactor is looked at again when the next tick is run
+	if(timeout == 0 || session->forwarded || session->last_active + timeout >= self->tick) {
+		set_timer(&self->timers, timer, timeout ? session->last_active + timeout + 1 : self->tick + lease_seconds);
+		return;
+	}
+
+	printf("client #%d timed out after %u idle seconds%s\n", session->client_sockfd, timeout, kind == LEASE_TIMEOUT ? " in session" : "");
+	metrics_timeout(kind);
+
+	send_timeout_to_client(session);
+	drop_client(self, session);
+}
+
+/* execute the requests other reactors forwarded to this one and finish the
+ * forwarded requests of this reactor's clients that have come back
+ *
+ * @param1 self the reactor whose doorbell rang
+ */
+static void answer_doorbell(reactor *self)
+{
+	//read before draining, so a push after the drain rings again
+	uint64_t count;
+	if(read(self->doorbell_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+		perror("read doorbell: ");
+	}
+
+	int i;
+	client_session *session;
+	for(i = 0; i < num_reactors; i++) {
+		while((session = spsc_pop(&request_queues[i * num_reactors + self->index]))) {
+			session->forward_status = execute_request(&session->forward_request, &session->forward_balance);
+			hand_off_or_stall(self, session);
+		}
+	}
+
+	for(i = 0; i < num_reactors; i++) {
+		while((session = spsc_pop(&result_queues[i * num_reactors + self->index]))) {
+			finish_client_request(session, &session->forward_request, session->forward_status, session->forward_balance, session->forward_start);
+			session->forwarded = false;
+			session->last_active = self->tick;
+
+			//carry on with the frames that arrived behind it
+			if(execute_client_frames(session)) watch_client(self, session);
+			else drop_client(self, session);
+		}
+	}
+}
+
+/* tell every client of the reactor that the server is shutting down and close them;
+ * the sessions stay in its list, since another reactor may still be executing a forwarded
+ * request and hand the session back, and are freed by free_sessions() once every reactor stops
+ *
+ * @param1 self the reactor that is shutting down
+ */
+static void shutdown_reactor(reactor *self)
+{
+	client_session *ptr;
+	for(ptr = self->sessions; ptr; ptr = ptr->next) {
+		send_shutdown_to_client(ptr);
+		disconnect_from_client(ptr->client_sockfd);
+	}
+}
+
+/* once every reactor has stopped, take back the sessions still out in the queues
+ * and stalled lists, then free every session; each is in the list of the reactor
+ * that accepted it wherever else it is, so each is freed exactly once
+ */
+static void free_sessions()
+{
+	int i;
+	client_session *session;
+	if(shared_nothing) {
+		for(i = 0; i < num_reactors * num_reactors; i++) {
+			while((session = spsc_pop(&request_queues[i]))) session->forwarded = false;
+			while((session = spsc_pop(&result_queues[i]))) session->forwarded = false;
+		}
+
+		for(i = 0; i < num_reactors; i++) {
+			for(session = reactors[i].stalled; session; session = session->stalled_next) session->forwarded = false;
+			reactors[i].stalled = reactors[i].stalled_tail = NULL;
+		}
+	}
+
+	for(i = 0; i < num_reactors; i++) {
+		while(reactors[i].sessions) {
+			session = reactors[i].sessions;
+			reactors[i].sessions = session->next;
+			free(session);
+		}
+	}
+}
+
+/* thread runner for a single reactor
+ * waits for readiness on the server socket, the shutdown eventfd, and its clients
+ *
+ * @param1 arg void pointer to the reactor owned by this thread
+ */
+void * reactor_runner(void* arg)
+{
+	reactor *self = (reactor*) arg;
+	struct epoll_event events[MAX_EVENTS];
+
+	this_reactor = self;
+
+	while(1) {
+		//sessions stalled on a full queue are retried on every pass, so don't sleep while there are any;
+		//while any client has a timeout, or accepting is paused, wake for the next tick
+		int until_tick;
+		session_tick(&until_tick);
+		int timeout = self->stalled ? 0 : ((self->timers.num_timers || self->accept_paused) ? until_tick : -1);
+		int num_events = epoll_wait(self->epoll_fd, events, MAX_EVENTS, timeout);
+
+		self->tick = session_tick(NULL);
+
+		resume_accepting(self);
+
+		if(shared_nothing) {
+			retry_stalled(self);
+			ring_doorbells(self);
+		}
+
+		if(num_events == -1) continue;
+
+		int i;
+		for(i = 0; i < num_events; i++) {
+			void *ptr = events[i].data.ptr;
+
+			if(ptr == &shutdown_marker) {
+				shutdown_reactor(self);
+				free_dropped_clients(self);
+				return NULL;
+			}
+
+			if(ptr == NULL) {
+				accept_clients(self);
+				continue;
+			}
+
+			if(ptr == &doorbell_marker) {
+				answer_doorbell(self);
+				continue;
+			}
+
+			serve_client(self, (client_session*) ptr);
+		}
+
+		//one doorbell per reactor for everything pushed this pass
+		if(shared_nothing) ring_doorbells(self);
+
+		advance_timer_wheel(&self->timers, self->tick, expire_client, self);
+
+		free_dropped_clients(self);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,7 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* event loop functions */
+void run_event_loop(int server_sockfd, int reactor_count, int client_limit, int backlog, int shutdown_fd, char *port_num, int partitioned,
+		int idle_secs, int lease_secs);
+void * reactor_runner(void* arg);
@@ -0,0 +1,412 @@
+/*************************************************************************
+  This file handles the server's metrics and the endpoint exposing them
+
+   Every thread that executes requests counts into a record of its own,
+   so counting never shares a cache line or takes a lock: the owner
+   adds with plain relaxed stores and only the endpoint reads the
+   records, summing them when it is scraped.
+
+   Counted, once metrics_enabled is set:
+
+   	requests by command, and failed requests by command and status
+   	request latency by command, in power of two buckets; reading the
+   	clock costs about as much as a small request, so each thread only
+   	times a randomly spaced one in LATENCY_SAMPLE_INTERVAL requests
+   	waits for a segment or log lock; an uncontended lock is taken
+   	with a single trylock and costs no clock read
+   	clients closed for sitting idle or holding a session too long
+
+   A replica also shows the log records it has applied and how long ago
+   it was last caught up with its primary (see replication.c).
+
+   The endpoint listens on localhost only and answers every GET of
+   /metrics (or /) with the counts in the Prometheus text format.
+ **************************************************************************/
+#include "metrics.h"
+#include <poll.h>
+
+#define METRICS_REQUEST_SIZE 4096
+
+/* counts of one thread; a cache line multiple so neighbours don't share lines */
+typedef struct thread_metrics thread_metrics;
+struct thread_metrics {
+	uint64_t requests[METRICS_COMMANDS];				//requests executed
+	uint64_t errors[METRICS_COMMANDS][METRICS_STATUSES];		//requests failed, by -status
+	uint64_t latency[METRICS_COMMANDS][LATENCY_BUCKETS];		//requests by latency bucket
+	uint64_t latency_ns[METRICS_COMMANDS];				//total latency
+	uint64_t lock_waits[NUM_LOCK_KINDS];				//locks found taken
+	uint64_t lock_wait_ns[NUM_LOCK_KINDS];				//time spent waiting for them
+	uint64_t timeouts[NUM_TIMEOUT_KINDS];				//clients closed by a timeout
+	thread_metrics *next;						//next record in all_metrics; counters all come before it
+	uint32_t until_sample;						//requests left before the next one is timed
+	uint32_t sample_state;						//xorshift state spacing the timed requests
+} __attribute__((aligned(64)));
+
+/* text of a scrape, grown as it is written */
+typedef struct metrics_text metrics_text;
+struct metrics_text {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+/******************************* GLOBALS **************************************/
+int metrics_enabled = 0;
+
+/* record of every thread that ever counted; records outlive their threads so totals never drop */
+thread_metrics *all_metrics;
+
+/* guards adding to all_metrics */
+pthread_mutex_t metrics_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* record of the calling thread; NULL until it first counts */
+__thread thread_metrics *this_metrics;
+
+/* label values, in db_command order */
+char *metrics_command_names[METRICS_COMMANDS] = {"create", "serve", "deposit", "withdraw", "query", "end", "transfer", "transfer_batch"};
+char *metrics_lock_names[NUM_LOCK_KINDS] = {"segment", "wal"};
+char *metrics_timeout_names[NUM_TIMEOUT_KINDS] = {"idle", "lease"};
+
+/* set by the replica's one follower thread; replica_caught_up stays 0 on a primary */
+uint64_t replica_records;
+uint64_t replica_caught_up;
+
+/******************************************************************************/
+
+/* @return current monotonic time in nanoseconds */
+uint64_t metrics_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* @return the calling thread's record, made on first use */
+thread_metrics* get_thread_metrics()
+{
+	if(this_metrics) return this_metrics;
+
+	thread_metrics *metrics = aligned_alloc(64, sizeof(thread_metrics));
+	memset(metrics, 0, sizeof(thread_metrics));
+	metrics->sample_state = (uint32_t) (uintptr_t) metrics | 1;
+
+	pthread_mutex_lock(&metrics_list_lock);
+	metrics->next = all_metrics;
+	__atomic_store_n(&all_metrics, metrics, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&metrics_list_lock);
+
+	this_metrics = metrics;
+	return metrics;
+}
+
+/* add to a counter of the calling thread's record; only the owner writes it */
+static inline void count(uint64_t *counter, uint64_t value)
+{
+	__atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+/* @return time a request starts if it is to be timed, for metrics_record(); 0 otherwise */
+uint64_t metrics_start()
+{
+	if(!metrics_enabled) return 0;
+
+	thread_metrics *metrics = get_thread_metrics();
+	if(metrics->until_sample > 0) {
+		metrics->until_sample--;
+		return 0;
+	}
+
+	//random gaps averaging LATENCY_SAMPLE_INTERVAL, so a workload repeating with the same period is still sampled evenly
+	uint32_t x = metrics->sample_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	metrics->sample_state = x;
+	metrics->until_sample = x % (2 * LATENCY_SAMPLE_INTERVAL - 1);
+
+	return metrics_now();
+}
+
+/* count an executed request
+ *
+ * @param1 command the db_command of the request
+ * @param2 status 0 or the error code it failed with
+ * @param3 start value of metrics_start() when the request started; 0 if it isn't timed
+ */
+void metrics_record(int command, int status, uint64_t start)
+{
+	if(!metrics_enabled || command < 0 || command >= METRICS_COMMANDS) return;
+
+	thread_metrics *metrics = get_thread_metrics();
+
+	count(&metrics->requests[command], 1);
+	if(status < 0 && status > -METRICS_STATUSES) count(&metrics->errors[command][-status], 1);
+
+	if(start == 0) return;
+
+	uint64_t ns = metrics_now() - start;
+
+	//smallest b with ns <= 2^(b + 10)
+	int bucket = (ns <= 1024) ? 0 : 64 - __builtin_clzll(ns - 1) - 10;
+	if(bucket >= LATENCY_BUCKETS) bucket = LATENCY_BUCKETS - 1;
+
+	count(&metrics->latency[command][bucket], 1);
+	count(&metrics->latency_ns[command], ns);
+}
+
+/* lock a mutex, counting the wait if it was already taken
+ *
+ * @param1 lock the mutex
+ * @param2 kind what the mutex guards
+ */
+void metrics_lock(pthread_mutex_t *lock, lock_kind kind)
+{
+	if(pthread_mutex_trylock(lock) == 0) return;
+
+	if(!metrics_enabled) {
+		pthread_mutex_lock(lock);
+		return;
+	}
+
+	uint64_t start = metrics_now();
+	pthread_mutex_lock(lock);
+
+	thread_metrics *metrics = get_thread_metrics();
+	count(&metrics->lock_waits[kind], 1);
+	count(&metrics->lock_wait_ns[kind], metrics_now() - start);
+}
+
+/* count a client closed by a timeout (see eventLoop.c)
+ *
+ * @param1 kind the timeout that closed it
+ */
+void metrics_timeout(timeout_kind kind)
+{
+	if(!metrics_enabled) return;
+
+	count(&get_thread_metrics()->timeouts[kind], 1);
+}
+
+/* show how far a replica has got applying its primary's log (see replication.c)
+ *
+ * @param1 records log records applied so far
+ * @param2 caught_up metrics_now() when it last had every record the primary had; 0 if it never has
+ */
+void metrics_replica(uint64_t records, uint64_t caught_up)
+{
+	__atomic_store_n(&replica_records, records, __ATOMIC_RELAXED);
+	__atomic_store_n(&replica_caught_up, caught_up, __ATOMIC_RELAXED);
+}
+
+/* append printf-style text to a scrape */
+void metrics_printf(metrics_text *text, const char *format, ...)
+{
+	while(1) {
+		va_list args;
+		va_start(args, format);
+		int len = vsnprintf(text->data + text->len, text->size - text->len, format, args);
+		va_end(args);
+
+		if(text->len + len < text->size) {
+			text->len += len;
+			return;
+		}
+
+		text->size *= 2;
+		text->data = realloc(text->data, text->size);
+	}
+}
+
+/* sum every thread's record
+ *
+ * @param1 totals pointer in which to put the sums
+ */
+void sum_metrics(thread_metrics *totals)
+{
+	memset(totals, 0, sizeof(thread_metrics));
+
+	uint64_t *sum = (uint64_t*) totals;
+	size_t num_counters = offsetof(thread_metrics, next) / sizeof(uint64_t);
+
+	thread_metrics *metrics;
+	for(metrics = __atomic_load_n(&all_metrics, __ATOMIC_ACQUIRE); metrics; metrics = metrics->next) {
+		uint64_t *counters = (uint64_t*) metrics;
+		size_t i;
+		for(i = 0; i < num_counters; i++) sum[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+	}
+}
+
+/* write the current counts in the Prometheus text format
+ *
+ * @param1 active_connections clients being served
+ * @param2 len pointer in which to put the length of the text
+ *
+ * @return the text; freed by the caller
+ */
+char* format_metrics(int active_connections, size_t *len)
+{
+	thread_metrics *totals = aligned_alloc(64, sizeof(thread_metrics));
+	sum_metrics(totals);
+
+	metrics_text text;
+	text.size = 16384;
+	text.len = 0;
+	text.data = malloc(text.size);
+
+	int command, i;
+
+	metrics_printf(&text, "# HELP banking_requests_total Requests executed, by command.\n# TYPE banking_requests_total counter\n");
+	for(command = 0; command < METRICS_COMMANDS; command++)
+		metrics_printf(&text, "banking_requests_total{command=\"%s\"} %lu\n", metrics_command_names[command], totals->requests[command]);
+
+	metrics_printf(&text, "# HELP banking_request_errors_total Requests that failed, by command and status.\n# TYPE banking_request_errors_total counter\n");
+	for(command = 0; command < METRICS_COMMANDS; command++) {
+		for(i = 1; i < METRICS_STATUSES; i++) {
+			if(totals->errors[command][i] == 0) continue;
+			metrics_printf(&text, "banking_request_errors_total{command=\"%s\",status=\"%d\"} %lu\n",
+					metrics_command_names[command], -i, totals->errors[command][i]);
+		}
+	}
+
+	metrics_printf(&text, "# HELP banking_request_duration_seconds Time to execute a request, by command; about one request in %d is timed.\n"
+			"# TYPE banking_request_duration_seconds histogram\n", LATENCY_SAMPLE_INTERVAL);
+	for(command = 0; command < METRICS_COMMANDS; command++) {
+		if(totals->requests[command] == 0) continue;
+
+		uint64_t seen = 0;
+		for(i = 0; i < LATENCY_BUCKETS - 1; i++) {
+			seen += totals->latency[command][i];
+			metrics_printf(&text, "banking_request_duration_seconds_bucket{command=\"%s\",le=\"%.9g\"} %lu\n",
+					metrics_command_names[command], (double) (1ULL << (i + 10)) / 1e9, seen);
+		}
+		seen += totals->latency[command][LATENCY_BUCKETS - 1];
+		metrics_printf(&text, "banking_request_duration_seconds_bucket{command=\"%s\",le=\"+Inf\"} %lu\n", metrics_command_names[command], seen);
+		metrics_printf(&text, "banking_request_duration_seconds_sum{command=\"%s\"} %.9f\n", metrics_command_names[command], totals->latency_ns[command] / 1e9);
+		metrics_printf(&text, "banking_request_duration_seconds_count{command=\"%s\"} %lu\n", metrics_command_names[command], seen);
+	}
+
+	metrics_printf(&text, "# HELP banking_lock_waits_total Locks found already taken, by lock.\n# TYPE banking_lock_waits_total counter\n");
+	for(i = 0; i < NUM_LOCK_KINDS; i++)
+		metrics_printf(&text, "banking_lock_waits_total{lock=\"%s\"} %lu\n", metrics_lock_names[i], totals->lock_waits[i]);
+
+	metrics_printf(&text, "# HELP banking_lock_wait_seconds_total Time spent waiting for locks, by lock.\n# TYPE banking_lock_wait_seconds_total counter\n");
+	for(i = 0; i < NUM_LOCK_KINDS; i++)
+		metrics_printf(&text, "banking_lock_wait_seconds_total{lock=\"%s\"} %.9f\n", metrics_lock_names[i], totals->lock_wait_ns[i] / 1e9);
+
+	metrics_printf(&text, "# HELP banking_timeouts_total Clients closed for sitting idle or holding a session too long, by timeout.\n# TYPE banking_timeouts_total counter\n");
+	for(i = 0; i < NUM_TIMEOUT_KINDS; i++)
+		metrics_printf(&text, "banking_timeouts_total{timeout=\"%s\"} %lu\n", metrics_timeout_names[i], totals->timeouts[i]);
+
+	uint64_t caught_up = __atomic_load_n(&replica_caught_up, __ATOMIC_RELAXED);
+	if(caught_up) {
+		metrics_printf(&text, "# HELP banking_replica_records_total Log records applied from the primary.\n# TYPE banking_replica_records_total counter\n");
+		metrics_printf(&text, "banking_replica_records_total %lu\n", __atomic_load_n(&replica_records, __ATOMIC_RELAXED));
+		metrics_printf(&text, "# HELP banking_replica_staleness_seconds Time since the replica last had every change the primary had.\n# TYPE banking_replica_staleness_seconds gauge\n");
+		metrics_printf(&text, "banking_replica_staleness_seconds %.3f\n", (metrics_now() - caught_up) / 1e9);
+	}
+
+	metrics_printf(&text, "# HELP banking_active_connections Clients being served.\n# TYPE banking_active_connections gauge\n");
+	metrics_printf(&text, "banking_active_connections %d\n", active_connections);
+
+	free(totals);
+
+	*len = text.len;
+	return text.data;
+}
+
+/* listen for scrapes on localhost
+ *
+ * @param1 port_num the string representation of the port number
+ *
+ * @return listening socket; -1 if it can't be bound
+ */
+int bind_metrics_socket(char *port_num)
+{
+	struct addrinfo hints, *result;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if(getaddrinfo("127.0.0.1", port_num, &hints, &result) != 0) return -1;
+
+	int sockfd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+	int one = 1;
+	if(sockfd != -1) setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if(sockfd != -1 && (bind(sockfd, result->ai_addr, result->ai_addrlen) == -1 || listen(sockfd, 16) == -1)) {
+		close(sockfd);
+		sockfd = -1;
+	}
+
+	freeaddrinfo(result);
+
+	return sockfd;
+}
+
+/* answer one scrape; a client that sends nothing for a second is dropped
+ *
+ * @param1 fd socket of the client
+ * @param2 args the endpoint's arguments
+ */
+void answer_scrape(int fd, metrics_args *args)
+{
+	struct timeval timeout = {1, 0};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	char request[METRICS_REQUEST_SIZE];
+	ssize_t ret = recv(fd, request, sizeof(request) - 1, 0);
+	if(ret <= 0) return;
+	request[ret] = '\0';
+
+	char header[128];
+	char *body;
+	size_t body_len;
+
+	if(strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0) {
+		body = format_metrics(__atomic_load_n(args->num_clients, __ATOMIC_RELAXED), &body_len);
+		snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_len);
+	} else {
+		body = strdup("not found\n");
+		body_len = strlen(body);
+		snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n\r\n", body_len);
+	}
+
+	send(fd, header, strlen(header), MSG_NOSIGNAL);
+	send(fd, body, body_len, MSG_NOSIGNAL);
+
+	free(body);
+}
+
+/* thread runner answering scrapes until the server shuts down
+ *
+ * @param1 arg void pointer to metrics_args
+ */
+void * metrics_runner(void* arg)
+{
+	metrics_args *args = (metrics_args*) arg;
+
+	struct pollfd polls[2];
+	polls[0].fd = args->shutdown_fd;
+	polls[0].events = POLLIN;
+	polls[1].fd = args->sockfd;
+	polls[1].events = POLLIN;
+
+	while(1) {
+		int ret = poll(polls, 2, -1);
+
+		//interrupted
+		if(ret == -1) continue;
+
+		//shutdown eventfd is readable
+		if(polls[0].revents) break;
+
+		int fd = accept(args->sockfd, NULL, NULL);
+		if(fd == -1) continue;
+
+		answer_scrape(fd, args);
+		close(fd);
+	}
+
+	close(args->sockfd);
+	return NULL;
+}
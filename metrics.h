@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+/* enums */
+typedef enum _lock_kind{SEGMENT_LOCK, WAL_LOCK, NUM_LOCK_KINDS} lock_kind;
+typedef enum _timeout_kind{IDLE_TIMEOUT, LEASE_TIMEOUT, NUM_TIMEOUT_KINDS} timeout_kind;
+
+/* commands counted: CREATE through TRANSFER_BATCH of db_command */
+#define METRICS_COMMANDS 8
+
+/* statuses counted: 0 and the error codes down to -12 */
+#define METRICS_STATUSES 13
+
+/* latency bucket b counts requests taking up to 2^(b + 10) ns; the last is +Inf */
+#define LATENCY_BUCKETS 24
+
+/* one request in this many, on average, has its latency timed */
+#define LATENCY_SAMPLE_INTERVAL 16
+
+/* set once the metrics endpoint is started; nothing is recorded before */
+extern int metrics_enabled;
+
+/* metrics functions */
+uint64_t metrics_now();
+uint64_t metrics_start();
+void metrics_record(int command, int status, uint64_t start);
+void metrics_lock(pthread_mutex_t *lock, lock_kind kind);
+void metrics_timeout(timeout_kind kind);
+void metrics_replica(uint64_t records, uint64_t caught_up);
+char* format_metrics(int active_connections, size_t *len);
+int bind_metrics_socket(char *port_num);
+void * metrics_runner(void* arg);
+
+/* arguments for metrics_runner */
+typedef struct metrics_args metrics_args;
+struct metrics_args {
+	int sockfd;		//listening socket of the endpoint
+	int *num_clients;	//clients being served, shown as active connections
+	int shutdown_fd;	//eventfd that becomes readable on SIGINT
+};
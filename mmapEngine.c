@@ -0,0 +1,830 @@
+/*************************************************************************
+  This file is the mmap storage engine of the banking server
+
+   Layout:
+   	the accounts live in a file of fixed-size records, indexed by
+   	record number, after a one page header; the file is mapped into
+   	memory and grown by doubling it, so balances are changed in
+   	place in the page cache and outlive the server process
+   	names are found through a per-segment open addressed index of
+   	record numbers kept in memory and rebuilt from the records when
+   	the file is opened
+
+   Durability:
+   	a change reaches the page cache as soon as it is made, so it
+   	survives the server crashing; the file is msync()ed when the
+   	engine is closed. There is no log, so a machine crash can lose
+   	changes the kernel had not yet written back, or tear a transfer.
+   	Sessions are not kept: every account starts out of session
+
+   Concurrency:
+   	every operation holds map_lock for reading and the locks of the
+   	segments it touches, in ascending order, like database.c; growing
+   	the file moves the mapping, so it holds map_lock for writing
+ **************************************************************************/
+#define _GNU_SOURCE
+#include "database.h"
+#include "metrics.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* fixed-size account record of the file; live is set last so a torn create is never seen */
+typedef struct mmap_record mmap_record;
+struct mmap_record {
+	money balance;		//in cents
+	uint64_t hash;		//full hash of the account name
+	int32_t in_session;
+	uint32_t live;		//1 once created; 0 if never created or deleted
+	char name[256];
+};
+
+/* first page of the file */
+typedef struct mmap_header mmap_header;
+struct mmap_header {
+	char magic[8];		//MMAP_MAGIC
+	uint32_t version;
+	uint32_t record_size;	//sizeof(mmap_record) when the file was made
+	uint64_t capacity;	//records the file has room for
+	uint32_t num_records;	//record numbers handed out
+};
+
+/* slot of a segment index; empty while id is MMAP_EMPTY, deleted once MMAP_TOMBSTONE */
+typedef struct mmap_slot mmap_slot;
+struct mmap_slot {
+	uint32_t tag;		//high bits of the account hash; compared before the name
+	uint32_t id;		//record number
+};
+
+/* index of the accounts whose hash maps to the segment; guarded by lock */
+typedef struct mmap_segment mmap_segment;
+struct mmap_segment {
+	pthread_mutex_t lock;
+	mmap_slot *slots;
+	size_t size;		//number of slots; always a power of two
+	size_t used;		//slots holding an account or a tombstone
+};
+
+#define MMAP_MAGIC "BANKMMAP"
+#define MMAP_VERSION 1
+#define MMAP_HEADER_SIZE 4096
+#define MMAP_INITIAL_CAPACITY 1024
+#define MMAP_INITIAL_SLOTS 16
+#define MMAP_MAX_LOAD_PERCENT 75
+#define MMAP_EMPTY UINT32_MAX
+#define MMAP_TOMBSTONE (UINT32_MAX - 1)
+#define MMAP_DEFAULT_PATH "accounts.mmap"
+
+int mmap_fd = -1;
+char *mmap_base;		//start of the mapping; moves when the file grows
+size_t mmap_length;
+mmap_header *mmap_head;
+mmap_record *mmap_records;
+
+mmap_segment mmap_segments[NUM_SEGMENTS];
+
+/* read for every operation; written while the file grows or the process forks */
+pthread_rwlock_t map_lock;
+
+/* point the header and record pointers at a new mapping
+ *
+ * @param1 base start of the mapping
+ * @param2 length length of the mapping in bytes
+ */
+void set_mapping(char *base, size_t length)
+{
+	mmap_base = base;
+	mmap_length = length;
+	mmap_head = (mmap_header*) base;
+	mmap_records = (mmap_record*) (base + MMAP_HEADER_SIZE);
+}
+
+/* grow the file until it has room for a number of records;
+ * caller must hold map_lock for writing
+ *
+ * @param1 num_records records the file must have room for
+ *
+ * @return -1 if the file could not be grown
+ *          0 if successful
+ */
+int grow_file(uint64_t num_records)
+{
+	uint64_t capacity = mmap_head->capacity;
+	if(num_records <= capacity) return 0;
+
+	while(capacity < num_records) capacity *= 2;
+
+	size_t length = MMAP_HEADER_SIZE + capacity * sizeof(mmap_record);
+	if(ftruncate(mmap_fd, length) == -1) return -1;
+
+	char *base = mremap(mmap_base, mmap_length, length, MREMAP_MAYMOVE);
+	if(base == MAP_FAILED) return -1;
+
+	set_mapping(base, length);
+	mmap_head->capacity = capacity;
+
+	return 0;
+}
+
+/* make sure a record number fits the file, growing it if needed;
+ * caller must hold map_lock for reading, and no segment lock, as it may be dropped and taken again
+ *
+ * @param1 id record number
+ *
+ * @return -1 if the file could not be grown
+ *          0 if successful
+ */
+int ensure_record(uint32_t id)
+{
+	if(id < __atomic_load_n(&mmap_head->capacity, __ATOMIC_RELAXED)) return 0;
+
+	pthread_rwlock_unlock(&map_lock);
+	pthread_rwlock_wrlock(&map_lock);
+	int status = grow_file((uint64_t) id + 1);
+	pthread_rwlock_unlock(&map_lock);
+	pthread_rwlock_rdlock(&map_lock);
+
+	return status;
+}
+
+/* get the segment an account belongs to
+ *
+ * @param1 hash hash of the account name
+ *
+ * @return pointer to the segment
+ */
+mmap_segment* mmap_get_segment(uint64_t hash)
+{
+	return &mmap_segments[hash & (NUM_SEGMENTS - 1)];
+}
+
+/* find the slot of an account in its segment's index; caller must hold the segment lock
+ *
+ * @param1 seg the segment of the account
+ * @param2 account_name name of account
+ * @param3 hash hash of the account name
+ *
+ * @return pointer to the slot if found
+ *         NULL if account not found
+ */
+mmap_slot* mmap_find_slot(mmap_segment *seg, char account_name[256], uint64_t hash)
+{
+	uint32_t tag = hash >> 32;
+	size_t mask = seg->size - 1;
+	size_t i = (hash >> SEGMENT_BITS) & mask;
+
+	while(seg->slots[i].id != MMAP_EMPTY) {
+		mmap_slot *slot = &seg->slots[i];
+		if(slot->id != MMAP_TOMBSTONE && slot->tag == tag && strcmp(mmap_records[slot->id].name, account_name) == 0)
+			return slot;
+		i = (i + 1) & mask;
+	}
+
+	return NULL;
+}
+
+/* find an account record; caller must hold the segment lock
+ *
+ * @param1 seg the segment of the account
+ * @param2 account_name name of account
+ * @param3 hash hash of the account name
+ *
+ * @return pointer to the record if found
+ *         NULL if account not found
+ */
+mmap_record* mmap_get_account(mmap_segment *seg, char account_name[256], uint64_t hash)
+{
+	mmap_slot *slot = mmap_find_slot(seg, account_name, hash);
+
+	return slot ? &mmap_records[slot->id] : NULL;
+}
+
+/* allocate an empty index for a segment
+ *
+ * @param1 seg the segment
+ * @param2 size number of slots; must be a power of two
+ */
+void new_segment_index(mmap_segment *seg, size_t size)
+{
+	seg->slots = malloc(size * sizeof(mmap_slot));
+	seg->size = size;
+	seg->used = 0;
+
+	size_t i;
+	for(i = 0; i < size; i++) seg->slots[i].id = MMAP_EMPTY;
+}
+
+/* put a record number into the first free slot of its probe sequence
+ *
+ * @param1 seg the segment of the account
+ * @param2 hash hash of the account name
+ * @param3 id record number of the account
+ */
+void mmap_insert_slot(mmap_segment *seg, uint64_t hash, uint32_t id)
+{
+	size_t mask = seg->size - 1;
+	size_t i = (hash >> SEGMENT_BITS) & mask;
+	while(seg->slots[i].id != MMAP_EMPTY) i = (i + 1) & mask;
+
+	seg->slots[i].tag = hash >> 32;
+	seg->slots[i].id = id;
+	seg->used++;
+}
+
+/* index an account, first rehashing the segment into a bigger index if it would get too full;
+ * the engine is simpler than database.c, so the whole index is rehashed at once
+ * caller must hold the segment lock
+ *
+ * @param1 seg the segment of the account
+ * @param2 hash hash of the account name
+ * @param3 id record number of the account
+ */
+void mmap_index_account(mmap_segment *seg, uint64_t hash, uint32_t id)
+{
+	if((seg->used + 1) * 100 > seg->size * MMAP_MAX_LOAD_PERCENT) {
+		mmap_slot *old_slots = seg->slots;
+		size_t old_size = seg->size;
+
+		new_segment_index(seg, old_size * 2);
+
+		size_t i;
+		for(i = 0; i < old_size; i++) {
+			uint32_t old_id = old_slots[i].id;
+			if(old_id != MMAP_EMPTY && old_id != MMAP_TOMBSTONE)
+				mmap_insert_slot(seg, mmap_records[old_id].hash, old_id);
+		}
+		free(old_slots);
+	}
+
+	mmap_insert_slot(seg, hash, id);
+}
+
+/* open the file, creating it if needed, and index the accounts in it
+ *
+ * @param1 option path of the file; MMAP_DEFAULT_PATH if NULL
+ *
+ * @return -1 if the file could not be opened or is not an account file
+ *          0 if successful
+ */
+int mmap_init(char *option)
+{
+	char *path = option ? option : MMAP_DEFAULT_PATH;
+
+	mmap_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if(mmap_fd == -1) return -1;
+
+	struct stat st;
+	if(fstat(mmap_fd, &st) == -1) return -1;
+
+	size_t length = st.st_size;
+	int fresh = length == 0;
+	if(fresh) {
+		length = MMAP_HEADER_SIZE + MMAP_INITIAL_CAPACITY * sizeof(mmap_record);
+		if(ftruncate(mmap_fd, length) == -1) return -1;
+	}
+
+	if(length < MMAP_HEADER_SIZE) return -1;
+
+	char *base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, mmap_fd, 0);
+	if(base == MAP_FAILED) return -1;
+	set_mapping(base, length);
+
+	if(fresh) {
+		memcpy(mmap_head->magic, MMAP_MAGIC, 8);
+		mmap_head->version = MMAP_VERSION;
+		mmap_head->record_size = sizeof(mmap_record);
+		mmap_head->capacity = MMAP_INITIAL_CAPACITY;
+		mmap_head->num_records = 0;
+	}
+
+	if(memcmp(mmap_head->magic, MMAP_MAGIC, 8) != 0 || mmap_head->version != MMAP_VERSION
+			|| mmap_head->record_size != sizeof(mmap_record)
+			|| MMAP_HEADER_SIZE + mmap_head->capacity * sizeof(mmap_record) > length) {
+		munmap(base, length);
+		close(mmap_fd);
+		mmap_fd = -1;
+		return -1;
+	}
+
+	//writers first, so growing the file is not held off by a steady stream of operations
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&map_lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	int i;
+	for(i = 0; i < NUM_SEGMENTS; i++) {
+		pthread_mutex_init(&mmap_segments[i].lock, NULL);
+		new_segment_index(&mmap_segments[i], MMAP_INITIAL_SLOTS);
+	}
+
+	uint32_t id;
+	for(id = 0; id < mmap_head->num_records; id++) {
+		mmap_record *record = &mmap_records[id];
+		if(!record->live) continue;
+
+		//sessions belong to clients of the previous server
+		record->in_session = 0;
+		mmap_index_account(mmap_get_segment(record->hash), record->hash, id);
+	}
+
+	return 0;
+}
+
+/* create a new account
+ *
+ * @param1 account_name name of account
+ * @param2 account_id pointer in which to put the record number of the new account; may be NULL
+ *
+ * @return -1 if account already exists
+ *         -8 if the file could not be grown
+ *          0 if successful
+ */
+int mmap_create_account(char account_name[256], uint32_t *account_id)
+{
+	uint64_t hash = hash_account_name(account_name);
+	mmap_segment *seg = mmap_get_segment(hash);
+
+	pthread_rwlock_rdlock(&map_lock);
+
+	//numbers are handed out before the segment is locked, as the file may have to grow first
+	uint32_t id = __atomic_fetch_add(&mmap_head->num_records, 1, __ATOMIC_RELAXED);
+	if(ensure_record(id) == -1) {
+		pthread_rwlock_unlock(&map_lock);
+		return -8;
+	}
+
+	metrics_lock(&seg->lock, SEGMENT_LOCK);
+
+	int status = 0;
+
+	//account already exists; the record number is left unused
+	if(mmap_get_account(seg, account_name, hash)) {
+		status = -1;
+	} else {
+		mmap_record *record = &mmap_records[id];
+		strncpy(record->name, account_name, 255);
+		record->name[255] = '\0';
+		record->balance = 0;
+		record->in_session = 0;
+		record->hash = hash;
+		__atomic_store_n(&record->live, 1, __ATOMIC_RELEASE);
+
+		mmap_index_account(seg, hash, id);
+		if(account_id) *account_id = id;
+	}
+
+	pthread_mutex_unlock(&seg->lock);
+	pthread_rwlock_unlock(&map_lock);
+
+	return status;
+}
+
+/* lock an account's segment under map_lock and find the account; undo with mmap_unlock_account()
+ *
+ * @param1 account_name name of account
+ * @param2 seg pointer in which to put the segment, which is left locked
+ *
+ * @return pointer to the record if found
+ *         NULL if account not found
+ */
+mmap_record* mmap_lock_account(char account_name[256], mmap_segment **seg)
+{
+	uint64_t hash = hash_account_name(account_name);
+	*seg = mmap_get_segment(hash);
+
+	pthread_rwlock_rdlock(&map_lock);
+	metrics_lock(&(*seg)->lock, SEGMENT_LOCK);
+
+	return mmap_get_account(*seg, account_name, hash);
+}
+
+/* release the locks taken by mmap_lock_account()
+ *
+ * @param1 seg the segment it locked
+ */
+void mmap_unlock_account(mmap_segment *seg)
+{
+	pthread_mutex_unlock(&seg->lock);
+	pthread_rwlock_unlock(&map_lock);
+}
+
+/* lock the segment of an account given by its record number under map_lock;
+ * undo with mmap_unlock_account()
+ *
+ * @param1 account_id record number of the account
+ * @param2 seg pointer in which to put the segment, which is left locked
+ *
+ * @return pointer to the record if it is live
+ *         NULL if the account was deleted
+ */
+mmap_record* mmap_lock_account_by_id(uint32_t account_id, mmap_segment **seg)
+{
+	pthread_rwlock_rdlock(&map_lock);
+
+	//the hash never changes once the record is created, so it is safe to read before the lock
+	*seg = mmap_get_segment(mmap_records[account_id].hash);
+	metrics_lock(&(*seg)->lock, SEGMENT_LOCK);
+
+	mmap_record *record = &mmap_records[account_id];
+	return record->live ? record : NULL;
+}
+
+/* start new session; see hash_start_session() for the error codes
+ *
+ * @param1 account_name name of account
+ * @param2 account_id pointer in which to put the record number of the account; may be NULL
+ */
+int mmap_start_session(char account_name[256], uint32_t *account_id)
+{
+	mmap_segment *seg;
+	mmap_record *record = mmap_lock_account(account_name, &seg);
+
+	int status = 0;
+	if(!record) status = -2;
+	else if(record->in_session) status = -3;
+	else {
+		record->in_session = 1;
+		if(account_id) *account_id = record - mmap_records;
+	}
+
+	mmap_unlock_account(seg);
+
+	return status;
+}
+
+/* end the session of a locked record; see hash_end_session() for the error codes */
+int mmap_end_session_locked(mmap_record *record)
+{
+	if(!record) return -2;
+	if(!record->in_session) return -4;
+
+	record->in_session = 0;
+	return 0;
+}
+
+/* deposit into or withdraw from a locked record; see hash_deposit() and hash_withdraw() for the error codes
+ *
+ * @param1 record the record; NULL if the account was not found
+ * @param2 change amount to add to the balance in cents; negative to withdraw
+ */
+int mmap_change_balance_locked(mmap_record *record, money change)
+{
+	if(!record) return -2;
+	if(change > 0 && record->balance > MONEY_MAX - change) return -8;
+	if(change < 0 && record->balance < -change) return -5;
+
+	record->balance += change;
+	return 0;
+}
+
+/* end session; see hash_end_session() for the error codes */
+int mmap_end_session(char account_name[256])
+{
+	mmap_segment *seg;
+	int status = mmap_end_session_locked(mmap_lock_account(account_name, &seg));
+	mmap_unlock_account(seg);
+
+	return status;
+}
+
+/* deposit into account; see hash_deposit() for the error codes */
+int mmap_deposit(char account_name[256], money amount)
+{
+	mmap_segment *seg;
+	int status = mmap_change_balance_locked(mmap_lock_account(account_name, &seg), amount);
+	mmap_unlock_account(seg);
+
+	return status;
+}
+
+/* withdraw from account; see hash_withdraw() for the error codes */
+int mmap_withdraw(char account_name[256], money amount)
+{
+	mmap_segment *seg;
+	int status = mmap_change_balance_locked(mmap_lock_account(account_name, &seg), -amount);
+	mmap_unlock_account(seg);
+
+	return status;
+}
+
+/* retrieve account balance; see hash_query_balance() for the error codes */
+int mmap_query_balance(char account_name[256], money *balance)
+{
+	mmap_segment *seg;
+	mmap_record *record = mmap_lock_account(account_name, &seg);
+
+	int status = 0;
+	if(!record) status = -2;
+	else *balance = record->balance;
+
+	mmap_unlock_account(seg);
+
+	return status;
+}
+
+/* end session of an account given by its record number */
+int mmap_end_session_by_id(uint32_t account_id)
+{
+	mmap_segment *seg;
+	int status = mmap_end_session_locked(mmap_lock_account_by_id(account_id, &seg));
+	mmap_unlock_account(seg);
+
+	return status;
+}
+
+/* deposit into account given by its record number */
+int mmap_deposit_by_id(uint32_t account_id, money amount)
+{
+	mmap_segment *seg;
+	int status = mmap_change_balance_locked(mmap_lock_account_by_id(account_id, &seg), amount);
+	mmap_unlock_account(seg);
+
+	return status;
+}
+
+/* withdraw from account given by its record number */
+int mmap_withdraw_by_id(uint32_t account_id, money amount)
+{
+	mmap_segment *seg;
+	int status = mmap_change_balance_locked(mmap_lock_account_by_id(account_id, &seg), -amount);
+	mmap_unlock_account(seg);
+
+	return status;
+}
+
+/* retrieve balance of an account given by its record number */
+int mmap_query_balance_by_id(uint32_t account_id, money *balance)
+{
+	mmap_segment *seg;
+	mmap_record *record = mmap_lock_account_by_id(account_id, &seg);
+
+	int status = 0;
+	if(!record) status = -2;
+	else *balance = record->balance;
+
+	mmap_unlock_account(seg);
+
+	return status;
+}
+
+/* delete an account; its record number is never reused
+ * see hash_delete_account() for the error codes
+ */
+int mmap_delete_account(char account_name[256])
+{
+	uint64_t hash = hash_account_name(account_name);
+	mmap_segment *seg = mmap_get_segment(hash);
+
+	pthread_rwlock_rdlock(&map_lock);
+	metrics_lock(&seg->lock, SEGMENT_LOCK);
+
+	int status = 0;
+	mmap_slot *slot = mmap_find_slot(seg, account_name, hash);
+
+	if(!slot) status = -2;
+	else if(mmap_records[slot->id].in_session) status = -3;
+	else {
+		mmap_records[slot->id].live = 0;
+		slot->id = MMAP_TOMBSTONE;
+	}
+
+	mmap_unlock_account(seg);
+
+	return status;
+}
+
+/* order segments by address, which is their index in mmap_segments */
+int compare_mmap_segments(const void *a, const void *b)
+{
+	mmap_segment *x = *(mmap_segment* const*) a;
+	mmap_segment *y = *(mmap_segment* const*) b;
+
+	return (x > y) - (x < y);
+}
+
+/* move money along every leg, in order, as one change; the legs are applied in order,
+ * undoing the ones already applied if one fails
+ * see transfer_batch() for the error codes
+ */
+int mmap_transfer_batch(transfer_leg *legs, int num_legs)
+{
+	if(num_legs < 1 || num_legs > MAX_TRANSFER_LEGS) return -8;
+
+	uint64_t from_hash[MAX_TRANSFER_LEGS], to_hash[MAX_TRANSFER_LEGS];
+	mmap_segment *segs[2 * MAX_TRANSFER_LEGS];
+
+	int i;
+	for(i = 0; i < num_legs; i++) {
+		from_hash[i] = hash_account_name(legs[i].from);
+		to_hash[i] = hash_account_name(legs[i].to);
+		segs[2 * i] = mmap_get_segment(from_hash[i]);
+		segs[2 * i + 1] = mmap_get_segment(to_hash[i]);
+	}
+
+	pthread_rwlock_rdlock(&map_lock);
+
+	//lock each segment involved once, always in the same order
+	qsort(segs, 2 * num_legs, sizeof(mmap_segment*), compare_mmap_segments);
+
+	int num_segs = 0;
+	for(i = 0; i < 2 * num_legs; i++) {
+		if(num_segs > 0 && segs[num_segs - 1] == segs[i]) continue;
+		segs[num_segs++] = segs[i];
+		metrics_lock(&segs[num_segs - 1]->lock, SEGMENT_LOCK);
+	}
+
+	int status = 0;
+	mmap_record *from[MAX_TRANSFER_LEGS], *to[MAX_TRANSFER_LEGS];
+
+	for(i = 0; i < num_legs && status == 0; i++) {
+		from[i] = mmap_get_account(mmap_get_segment(from_hash[i]), legs[i].from, from_hash[i]);
+		to[i] = mmap_get_account(mmap_get_segment(to_hash[i]), legs[i].to, to_hash[i]);
+
+		//account does not exist
+		if(!from[i] || !to[i]) status = -2;
+	}
+
+	int applied = 0;
+	while(status == 0 && applied < num_legs) {
+		transfer_leg *leg = &legs[applied];
+
+		//not enough money
+		if(from[applied]->balance < leg->amount) status = -5;
+
+		//balance would not fit a money
+		else if(from[applied] != to[applied] && to[applied]->balance > MONEY_MAX - leg->amount) status = -8;
+
+		else {
+			from[applied]->balance -= leg->amount;
+			to[applied]->balance += leg->amount;
+			applied++;
+		}
+	}
+
+	if(status != 0) {
+		for(i = applied - 1; i >= 0; i--) {
+			to[i]->balance -= legs[i].amount;
+			from[i]->balance += legs[i].amount;
+		}
+	}
+
+	for(i = num_segs - 1; i >= 0; i--) {
+		pthread_mutex_unlock(&segs[i]->lock);
+	}
+	pthread_rwlock_unlock(&map_lock);
+
+	return status;
+}
+
+/* size the file for a number of accounts so loading them never grows it
+ *
+ * @param1 num_accounts number of accounts about to be loaded
+ */
+void mmap_reserve(size_t num_accounts)
+{
+	pthread_rwlock_wrlock(&map_lock);
+	grow_file(num_accounts);
+	pthread_rwlock_unlock(&map_lock);
+}
+
+/* put an account back at a given record number
+ * safe to call from several threads at once
+ *
+ * @param1 id record number
+ * @param2 account_name name of account
+ * @param3 hash hash of the account name
+ * @param4 balance balance of the account in cents
+ *
+ * @return -1 if the account already exists
+ *         -8 if the file could not grow to hold the record
+ *          0 if successful
+ */
+int mmap_load_account(uint32_t id, char account_name[256], uint64_t hash, money balance)
+{
+	mmap_segment *seg = mmap_get_segment(hash);
+
+	pthread_rwlock_rdlock(&map_lock);
+	if(ensure_record(id) == -1) {
+		pthread_rwlock_unlock(&map_lock);
+		return -8;
+	}
+	metrics_lock(&seg->lock, SEGMENT_LOCK);
+
+	if(mmap_get_account(seg, account_name, hash)) {
+		mmap_unlock_account(seg);
+		return -1;
+	}
+
+	mmap_record *record = &mmap_records[id];
+	strncpy(record->name, account_name, 255);
+	record->name[255] = '\0';
+	record->balance = balance;
+	record->in_session = 0;
+	record->hash = hash;
+	record->live = 1;
+
+	mmap_index_account(seg, hash, id);
+
+	mmap_unlock_account(seg);
+
+	return 0;
+}
+
+/* finish loading; new accounts get record numbers after the loaded ones
+ *
+ * @param1 num_records number of record numbers used by the load
+ */
+void mmap_finish_load(uint32_t num_records)
+{
+	if(num_records > mmap_head->num_records) mmap_head->num_records = num_records;
+}
+
+/* count the record numbers handed out so far
+ *
+ * @return one more than the highest record number in use
+ */
+uint32_t mmap_num_records()
+{
+	return __atomic_load_n(&mmap_head->num_records, __ATOMIC_RELAXED);
+}
+
+/* call a function on every live record in order without taking any lock;
+ * used by a forked child, which has a frozen copy of the mapping
+ *
+ * @param1 func function to call for each record
+ * @param2 arg passed through to func
+ */
+void mmap_for_each_record(record_callback func, void *arg)
+{
+	uint32_t num_records = mmap_head->num_records;
+	if(num_records > mmap_head->capacity) num_records = mmap_head->capacity;
+
+	uint32_t id;
+	for(id = 0; id < num_records; id++) {
+		mmap_record *record = &mmap_records[id];
+		if(!record->live) continue;
+
+		func(id, record->name, record->hash, record->balance, record->in_session, arg);
+	}
+}
+
+/* fork while no operation is running; the child shares the file, so it must only read
+ *
+ * @return as fork()
+ */
+pid_t mmap_fork()
+{
+	pthread_rwlock_wrlock(&map_lock);
+	pid_t pid = fork();
+	pthread_rwlock_unlock(&map_lock);
+
+	return pid;
+}
+
+/* write the file back and close it, freeing the indexes */
+void mmap_free()
+{
+	if(mmap_fd == -1) return;
+
+	int i;
+	for(i = 0; i < NUM_SEGMENTS; i++) {
+		free(mmap_segments[i].slots);
+		mmap_segments[i].slots = NULL;
+		pthread_mutex_destroy(&mmap_segments[i].lock);
+	}
+
+	msync(mmap_base, mmap_length, MS_SYNC);
+	munmap(mmap_base, mmap_length);
+	close(mmap_fd);
+	mmap_fd = -1;
+
+	pthread_rwlock_destroy(&map_lock);
+}
+
+/* file-backed engine; see the top of this file */
+storage_engine mmap_engine = {
+	"mmap",
+	1,
+	mmap_init,
+	mmap_create_account,
+	mmap_start_session,
+	mmap_end_session,
+	mmap_deposit,
+	mmap_withdraw,
+	mmap_query_balance,
+	mmap_end_session_by_id,
+	mmap_deposit_by_id,
+	mmap_withdraw_by_id,
+	mmap_query_balance_by_id,
+	mmap_transfer_batch,
+	mmap_delete_account,
+	mmap_reserve,
+	mmap_load_account,
+	mmap_finish_load,
+	mmap_num_records,
+	mmap_for_each_record,
+	mmap_fork,
+	mmap_free,
+};
@@ -0,0 +1,87 @@
+#include "money.h"
+
+/* parse a non-negative decimal amount such as "12", "12.5", "12.50" or ".5";
+ * digits past the cents are only accepted if they are zeros
+ *
+ * @param1 string the amount, terminated by '\0'
+ * @param2 amount pointer in which to put the amount in cents
+ *
+ * @return 1 if string is a valid amount that fits a money; 0 otherwise
+ */
+int parse_money(const char *string, money *amount)
+{
+	const char *ptr = string;
+	money whole = 0;
+	int num_digits = 0;
+
+	while(*ptr >= '0' && *ptr <= '9') {
+		int digit = *ptr - '0';
+
+		//whole * MONEY_SCALE must still fit once the cents are added
+		if(whole > (MONEY_MAX / MONEY_SCALE - digit) / 10) return 0;
+
+		whole = whole * 10 + digit;
+		num_digits++;
+		ptr++;
+	}
+
+	money cents = 0;
+	if(*ptr == '.') {
+		ptr++;
+
+		int place;
+		for(place = 10; *ptr >= '0' && *ptr <= '9'; ptr++, num_digits++) {
+			//fractions of a cent are only allowed if they are 0
+			if(place == 0 && *ptr != '0') return 0;
+
+			cents += (*ptr - '0') * place;
+			place /= 10;
+		}
+	}
+
+	//nothing but digits and a single point, and at least one digit
+	if(*ptr != '\0' || num_digits == 0) return 0;
+
+	if(whole * MONEY_SCALE > MONEY_MAX - cents) return 0;
+
+	*amount = whole * MONEY_SCALE + cents;
+
+	return 1;
+}
+
+/* format an amount as dollars and two places of cents, e.g. 1250 as "12.50"
+ *
+ * @param1 amount the amount in cents
+ * @param2 string pointer in which to put the terminated text
+ *
+ * @return length of the text, not counting the terminator
+ */
+size_t format_money(money amount, char string[MONEY_STRING_SIZE])
+{
+	//work on the magnitude as unsigned so INT64_MIN does not overflow
+	uint64_t magnitude = (amount < 0) ? -(uint64_t) amount : (uint64_t) amount;
+
+	//write the digits backwards from the end of a scratch buffer
+	char digits[MONEY_STRING_SIZE];
+	char *ptr = digits + sizeof(digits);
+
+	*--ptr = '0' + magnitude % 10;
+	magnitude /= 10;
+	*--ptr = '0' + magnitude % 10;
+	magnitude /= 10;
+	*--ptr = '.';
+
+	do {
+		*--ptr = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while(magnitude > 0);
+
+	if(amount < 0) *--ptr = '-';
+
+	size_t len = digits + sizeof(digits) - ptr;
+	size_t i;
+	for(i = 0; i < len; i++) string[i] = ptr[i];
+	string[len] = '\0';
+
+	return len;
+}
@@ -0,0 +1,24 @@
+#include <stdint.h>
+#include <stddef.h>
+
+/*************************************************************************
+  Fixed-point money shared by the server, the database and the clients
+
+   Every balance and amount is a whole number of cents in a money, so
+   deposits and withdrawals add and subtract exactly. Conversion to and
+   from text is done by hand, without the C library's locale-dependent
+   number parsing and formatting and without allocating.
+ **************************************************************************/
+
+/* amount of money in cents */
+typedef int64_t money;
+
+#define MONEY_SCALE 100
+#define MONEY_MAX INT64_MAX
+
+/* longest formatted money ("-92233720368547758.08") plus the terminator */
+#define MONEY_STRING_SIZE 22
+
+/* money functions */
+int parse_money(const char *string, money *amount);
+size_t format_money(money amount, char string[MONEY_STRING_SIZE]);
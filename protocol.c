@@ -0,0 +1,166 @@
+#include "protocol.h"
+
+/* fill in a binary frame in network byte order
+ *
+ * @param1 frame the frame to fill in
+ * @param2 opcode db_command + 1, or OP_SHUTDOWN
+ * @param3 status 0 or an error code (replies only)
+ * @param4 name_len bytes of account name that follow the frame (requests only)
+ * @param5 request_id id chosen by the client
+ * @param6 amount amount or balance in cents
+ */
+void encode_frame(binary_frame *frame, uint8_t opcode, int8_t status, uint8_t name_len, uint32_t request_id, int64_t amount)
+{
+	frame->magic = BINARY_MAGIC;
+	frame->opcode = opcode;
+	frame->status = status;
+	frame->name_len = name_len;
+	frame->request_id = htobe32(request_id);
+	frame->account_id = 0;
+	frame->amount = htobe64(amount);
+}
+
+/* convert a received binary frame to host byte order in place
+ *
+ * @param1 frame the frame as received
+ */
+void decode_frame(binary_frame *frame)
+{
+	frame->request_id = be32toh(frame->request_id);
+	frame->account_id = be64toh(frame->account_id);
+	frame->amount = be64toh(frame->amount);
+}
+
+/* build the message shown to the user for the result of a command
+ *
+ * @param1 message pointer in which to put the message
+ * @param2 command the command that was executed
+ * @param3 status the error code of the command; 0 if it succeeded
+ * @param4 balance the current balance in cents returned by QUERY execution (optional)
+ */
+void format_reply(char message[TEXT_REPLY_SIZE], db_command command, int status, money balance)
+{
+	memset(message, 0, TEXT_REPLY_SIZE);
+
+	switch(status) {
+		case 0:
+			break;
+		case -1:
+			strcpy(message, "ERROR: Account already exists\n");
+			return;
+		case -2:
+			strcpy(message, "ERROR: Account does not exist\n");
+			return;
+		case -3:
+			strcpy(message, "ERROR: Account already in session\n");
+			return;
+		case -4:
+			strcpy(message, "ERROR: Account not in session\n");
+			return;
+		case -5:
+			strcpy(message, "ERROR: Insufficient funds\n");
+			return;
+		case -6:
+			strcpy(message, "ERROR: Must be in active session\n");
+			return;
+		case -7:
+			strcpy(message, "ERROR: Must not be in active session\n");
+			return;
+		case -8:
+			strcpy(message, "ERROR: Invalid amount\n");
+			return;
+		case -9:
+			strcpy(message, "ERROR: Account is on another shard\n");
+			return;
+		case -10:
+			strcpy(message, "ERROR: Request still in progress\n");
+			return;
+		case -11:
+			strcpy(message, "ERROR: Replica is read-only\n");
+			return;
+		case -12:
+			strcpy(message, "ERROR: Replica is behind\n");
+			return;
+		case -13:
+			strcpy(message, "ERROR: Unknown command\n");
+			return;
+		default:
+			return;
+	}
+
+	switch(command) {
+		case CREATE:
+			strcpy(message, "SUCCESS: New account created\n");
+			break;
+		case SERVE:
+			strcpy(message, "SUCCESS: New session started\n");
+			break;
+		case DEPOSIT:
+			strcpy(message, "SUCCESS: Deposit made\n");
+			break;
+		case WITHDRAW:
+			strcpy(message, "SUCCESS: Withdrawl made\n");
+			break;
+		case QUERY:
+			format_balance_reply(message, balance);
+			break;
+		case END: 
+			strcpy(message, "SUCCESS: Session ended\n");
+			break;
+		case TRANSFER:
+		case TRANSFER_BATCH:
+			strcpy(message, "SUCCESS: Transfer made\n");
+			break;
+		default:
+			break;
+	}
+}
+
+/* build the reply to a QUERY without going through printf
+ *
+ * @param1 message pointer in which to put the message
+ * @param2 balance the balance in cents
+ */
+void format_balance_reply(char message[TEXT_REPLY_SIZE], money balance)
+{
+	char amount[MONEY_STRING_SIZE];
+	size_t amount_len = format_money(balance, amount);
+
+	//balances of ten billion and up only fit the reply with a shorter prefix
+	char *prefix = "Your current balance is: ";
+	if(strlen(prefix) + amount_len + 2 > TEXT_REPLY_SIZE) prefix = "Balance: ";
+
+	size_t prefix_len = strlen(prefix);
+	memcpy(message, prefix, prefix_len);
+	memcpy(message + prefix_len, amount, amount_len);
+	message[prefix_len + amount_len] = '\n';
+	message[prefix_len + amount_len + 1] = '\0';
+}
+
+/* pick the shard that owns an account: the name's 64 bit FNV-1a hash, as the
+ * database computes it, is mixed further and its top half split into num_shards
+ * equal ranges. FNV-1a alone barely spreads the last bytes of a name into its top
+ * bits, so names that differ only at the end would land on one shard
+ *
+ * @param1 account_name name of the account
+ * @param2 num_shards number of shards
+ *
+ * @return the shard, from 0 to num_shards - 1
+ */
+uint32_t account_shard(const char *account_name, uint32_t num_shards)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	const unsigned char *ptr = (const unsigned char*) account_name;
+	while(*ptr) {
+		hash ^= *ptr;
+		hash *= 1099511628211ULL;
+		ptr++;
+	}
+
+	//the finalizer of MurmurHash3
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+
+	return ((hash >> 32) * num_shards) >> 32;
+}
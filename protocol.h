@@ -0,0 +1,82 @@
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <endian.h>
+#include "money.h"
+
+/*************************************************************************
+  Wire protocols spoken between bankingClient and bankingServer
+
+   text:
+   	every request is a TEXT_FRAME_SIZE byte frame holding a NUL padded
+   	command line ("deposit 12.50"); every reply is a TEXT_REPLY_SIZE
+   	byte NUL padded message. A command the server does not know, in
+   	either protocol, gets error -13
+
+   binary:
+   	every request and reply is a binary_frame, with multi-byte fields
+   	in network byte order; a request is followed by name_len bytes of
+   	account name (CREATE and SERVE; the account credited by TRANSFER).
+   	A TRANSFER_BATCH request carries its number of legs in amount and
+   	is followed by that many TRANSFER requests, which are executed as
+   	one transfer and answered with one reply. The first byte of a frame is
+   	always BINARY_MAGIC, which no text command starts with, so the server
+   	tells the protocols apart by the first byte a client sends.
+   	A successful CREATE or SERVE reply carries the account's id, the
+   	server's handle for the account; the session keeps it, so later
+   	commands of the session never have the server look the name up
+
+   retries:
+   	a CREATE, DEPOSIT, WITHDRAW, TRANSFER or TRANSFER_BATCH request
+   	whose account_id holds a client id (any number other than 0 that
+   	no other client uses) runs at most once: a copy with the same
+   	client id and request id, sent over any connection, gets the
+   	first result back (see dedup.c), or error -10 while the first is
+   	still running. A client that loses a connection before the reply
+   	can reconnect, serve its account again and resend the request
+
+   sharding:
+   	a server started as shard i of N (-S i/N) only holds the accounts
+   	account_shard() gives to shard i and answers CREATE, SERVE and
+   	TRANSFER naming any other account with error -9; clients send an
+   	account's commands to the shard that owns it
+
+   replicas:
+   	a server following a primary (-F; see replication.c) holds a copy
+   	of the primary's accounts and answers CREATE, DEPOSIT, WITHDRAW,
+   	TRANSFER and TRANSFER_BATCH with error -11; SERVE, QUERY and END
+   	work as on the primary, against the copy. A QUERY gets error -12
+   	while the copy may be older than the replica's bound on staleness,
+   	and should then go to the primary
+ **************************************************************************/
+
+/* enums */
+typedef enum _db_command{CREATE, SERVE, DEPOSIT, WITHDRAW, QUERY, END, TRANSFER, TRANSFER_BATCH} db_command;
+typedef enum _wire_protocol{PROTOCOL_UNKNOWN, PROTOCOL_TEXT, PROTOCOL_BINARY} wire_protocol;
+
+#define TEXT_FRAME_SIZE 263
+#define TEXT_REPLY_SIZE 40
+
+#define BINARY_MAGIC 0xB5
+
+/* opcode of a request is its db_command + 1; OP_SHUTDOWN is only sent by the server */
+#define OP_SHUTDOWN 0xFF
+
+/* header of every binary request and reply */
+typedef struct binary_frame binary_frame;
+struct binary_frame {
+	uint8_t magic;		//BINARY_MAGIC
+	uint8_t opcode;		//db_command + 1 of the request; echoed in the reply
+	int8_t status;		//0 or an error code; replies only
+	uint8_t name_len;	//bytes of account name following the frame; requests only
+	uint32_t request_id;	//chosen by the client; echoed in the reply
+	uint64_t account_id;	//id of the account in a CREATE or SERVE reply; the client's id in a request that may be retried; 0 otherwise
+	int64_t amount;		//amount in cents; balance in cents in a QUERY reply
+};
+
+/* protocol functions */
+void encode_frame(binary_frame *frame, uint8_t opcode, int8_t status, uint8_t name_len, uint32_t request_id, int64_t amount);
+void decode_frame(binary_frame *frame);
+void format_reply(char message[TEXT_REPLY_SIZE], db_command command, int status, money balance);
+void format_balance_reply(char message[TEXT_REPLY_SIZE], money balance);
+uint32_t account_shard(const char *account_name, uint32_t num_shards);
@@ -0,0 +1,685 @@
+/*************************************************************************
+  This file ships the write-ahead log from a primary to read-only replicas
+
+   A primary started with -R listens on localhost for replicas; a
+   replica started with -F connects to it, copies its accounts and then
+   applies every change the primary logs, while its own clients SERVE
+   and QUERY the copy (see protocol.h) and its reports (-r, SIGUSR1;
+   see report.c) list the copy. Reads move off the primary, and off the
+   locks its writers take, for answers up to max_lag_ms old.
+
+   Shipping:
+   	the primary ships the files it already keeps: its snapshot, then
+   	each log generation from the one the snapshot ends at, read with
+   	pread() rather than taken from the log's buffers, so a replica
+   	never holds up a writer. A shipper thread per replica sleeps in
+   	wal_wait_for_flush() until the flusher has written more and sends
+   	what was added to the file; a snapshot or generation a checkpoint
+   	removes while it is being shipped stays readable through the
+   	descriptor the shipper holds
+   	each piece goes out behind a repl_message: the snapshot
+   	(REPL_SNAPSHOT), bytes of a log generation (REPL_LOG), or
+   	REPL_RESYNC when the primary no longer has what a reconnecting
+   	replica asks for. A REPL_LOG that reaches the end of the newest
+   	generation is flagged REPL_CAUGHT_UP, and with nothing new the
+   	shipper sends an empty one every REPL_HEARTBEAT_MS
+
+   Applying:
+   	the replica loads the snapshot before it serves anyone, then its
+   	follower thread applies the log with wal_apply(), a transfer at a
+   	time through transfer_batch(), so readers never see half of one;
+   	the bytes of a change not yet whole wait for the rest
+   	a record failing its checksum is read again once, in case the
+   	primary was still writing it; the follower stops if it fails again
+   	the replica is as fresh as the last REPL_CAUGHT_UP it applied; a
+   	QUERY more than max_lag_ms after that gets error -12 rather than a
+   	balance older than promised
+   	if the connection drops, the follower reconnects and goes on from
+   	the generation and offset it has applied up to. A replica whose
+   	primary has since removed that generation gets REPL_RESYNC and
+   	must be restarted to copy the accounts again
+
+   Bytes are shipped once they are in the log file, which can be just
+   before the flusher's fdatasync() returns, so a replica may hold a
+   change its primary then loses in a power failure.
+ **************************************************************************/
+#include "replication.h"
+#include "database.h"
+#include "wal.h"
+#include "snapshot.h"
+#include "report.h"
+#include "metrics.h"
+
+#define REPL_MAGIC "BANKREPL"
+
+/* most log bytes sent in one piece */
+#define REPL_CHUNK_SIZE (1 << 20)
+
+/* a replica that takes nothing for this long is dropped, and a primary that sends
+ * nothing for this long (ten missed heartbeats) is given up on and reconnected to */
+#define REPL_SEND_TIMEOUT_S 5
+#define REPL_RECEIVE_TIMEOUT_MS (10 * REPL_HEARTBEAT_MS)
+
+/* milliseconds between attempts to reconnect to a lost primary */
+#define REPL_RETRY_MS 1000
+
+/* times a shipper looks for a snapshot and the generation after it before giving up;
+ * each miss means a checkpoint replaced the snapshot meanwhile */
+#define REPL_SNAPSHOT_ATTEMPTS 5
+
+/* kinds of repl_message */
+typedef enum _repl_message_type{REPL_SNAPSHOT = 1, REPL_LOG, REPL_RESYNC} repl_message_type;
+
+/* repl_message flag: the primary had nothing newer than this piece when it sent it */
+#define REPL_CAUGHT_UP 1
+
+/* repl_hello flag: the replica has no accounts yet and needs the snapshot */
+#define REPL_FRESH 1
+
+/* what a replica sends once connected, in network byte order */
+typedef struct repl_hello repl_hello;
+struct repl_hello {
+	char magic[8];		//REPL_MAGIC
+	uint32_t flags;		//REPL_FRESH
+	uint32_t generation;	//generation to go on from, unless fresh
+	uint64_t offset;	//bytes of it already applied
+};
+
+/* header of each piece the primary sends, in network byte order */
+typedef struct repl_message repl_message;
+struct repl_message {
+	uint8_t type;		//repl_message_type
+	uint8_t flags;		//REPL_CAUGHT_UP
+	uint16_t reserved;
+	uint32_t generation;	//generation the log bytes belong to; after REPL_SNAPSHOT, the first one it does not cover
+	uint64_t length;	//bytes following the header
+};
+
+/* a replica being shipped the log */
+typedef struct shipper shipper;
+struct shipper {
+	pthread_t id;
+	int sockfd;		//connection to the replica
+	int started;		//the thread has been created and not yet joined
+	int running;		//the thread has not finished
+	char *prefix;		//prefix of the log and snapshot files
+	int shutdown_fd;	//eventfd that becomes readable on SIGINT
+};
+
+/******************************* GLOBALS **************************************/
+int replica = 0;
+
+/* the follower's connection to its primary; -1 while it is lost */
+char *primary_address;
+int primary_fd = -1;
+
+/* generation being applied and the bytes of it applied */
+uint32_t follow_generation;
+uint64_t follow_offset;
+
+/* log bytes received but not yet applied, the start of a change not yet whole */
+unsigned char *pending;
+size_t pending_len;
+
+/* where a record last failed its checksum; the first failure at a place may be a record read
+ * while the primary was still writing it, so the follower reconnects and reads it again */
+uint32_t corrupt_generation;
+uint64_t corrupt_offset = UINT64_MAX;
+
+/* records applied so far */
+uint64_t records_applied;
+
+/* staleness QUERY is served within; 0 for no bound */
+uint64_t max_lag_ns;
+
+/* metrics_now() when the last REPL_CAUGHT_UP arrived; 0 until the first */
+uint64_t caught_up_ns;
+
+/******************************************************************************/
+
+/* send a whole buffer
+ *
+ * @return 0 if successful; -1 if the connection failed or timed out
+ */
+int repl_send(int fd, void *data, size_t len)
+{
+	char *ptr = data;
+	while(len > 0) {
+		ssize_t ret = send(fd, ptr, len, MSG_NOSIGNAL);
+		if(ret == -1 && errno == EINTR) continue;
+		if(ret <= 0) return -1;
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* receive a whole buffer
+ *
+ * @return 0 if successful; -1 if the connection closed, failed or timed out
+ */
+int repl_receive(int fd, void *data, size_t len)
+{
+	char *ptr = data;
+	while(len > 0) {
+		ssize_t ret = recv(fd, ptr, len, 0);
+		if(ret == -1 && errno == EINTR) continue;
+		if(ret <= 0) return -1;
+		ptr += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* send the header of a piece
+ *
+ * @return 0 if successful; -1 otherwise
+ */
+int send_repl_message(int fd, repl_message_type type, int flags, uint32_t generation, uint64_t length)
+{
+	repl_message message;
+	message.type = type;
+	message.flags = flags;
+	message.reserved = 0;
+	message.generation = htobe32(generation);
+	message.length = htobe64(length);
+
+	return repl_send(fd, &message, sizeof(message));
+}
+
+/* @return whether the shutdown eventfd is readable */
+int shutting_down(int shutdown_fd)
+{
+	struct pollfd shutdown_poll;
+	shutdown_poll.fd = shutdown_fd;
+	shutdown_poll.events = POLLIN;
+
+	return poll(&shutdown_poll, 1, 0) > 0;
+}
+
+/* listen for replicas on localhost
+ *
+ * @param1 port_num the string representation of the port number
+ *
+ * @return listening socket; -1 if it can't be bound
+ */
+int bind_replication_socket(char *port_num)
+{
+	struct addrinfo hints, *result;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if(getaddrinfo("127.0.0.1", port_num, &hints, &result) != 0) return -1;
+
+	int sockfd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+	int one = 1;
+	if(sockfd != -1) setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if(sockfd != -1 && (bind(sockfd, result->ai_addr, result->ai_addrlen) == -1 || listen(sockfd, REPL_MAX_REPLICAS) == -1)) {
+		close(sockfd);
+		sockfd = -1;
+	}
+
+	freeaddrinfo(result);
+
+	return sockfd;
+}
+
+/* open a log generation for shipping
+ *
+ * @return file descriptor; -1 if the generation does not exist
+ */
+int open_generation(char *prefix, uint32_t generation)
+{
+	char path[WAL_PATH_SIZE];
+	log_file_path(path, prefix, generation);
+
+	return open(path, O_RDONLY);
+}
+
+/* send a fresh replica the snapshot, and open the generation it is followed by
+ *
+ * @param1 self the shipper
+ * @param2 generation pointer in which to put the generation opened
+ *
+ * @return file descriptor of the generation; -1 if the snapshot could not be sent
+ */
+int ship_snapshot(shipper *self, uint32_t *generation)
+{
+	int attempt;
+	for(attempt = 0; attempt < REPL_SNAPSHOT_ATTEMPTS; attempt++) {
+		//with no snapshot, the log goes back to generation 0
+		size_t size = 0;
+		uint32_t first = 0;
+		int snapshot_fd = open_snapshot(self->prefix, &first, &size);
+
+		//a checkpoint removed the generation after the snapshot was opened; the new snapshot covers it
+		int log_fd = open_generation(self->prefix, first);
+		if(log_fd == -1) {
+			if(snapshot_fd != -1) close(snapshot_fd);
+			continue;
+		}
+
+		int failed = send_repl_message(self->sockfd, REPL_SNAPSHOT, 0, first, snapshot_fd == -1 ? 0 : size);
+
+		off_t offset = 0;
+		while(!failed && snapshot_fd != -1 && (size_t) offset < size) {
+			ssize_t ret = sendfile(self->sockfd, snapshot_fd, &offset, size - offset);
+			if(ret == -1 && errno == EINTR) continue;
+			if(ret <= 0) failed = -1;
+		}
+
+		if(snapshot_fd != -1) close(snapshot_fd);
+
+		if(failed) {
+			close(log_fd);
+			return -1;
+		}
+
+		printf("shipped %zu byte snapshot to replica #%d\n", size, self->sockfd);
+		*generation = first;
+		return log_fd;
+	}
+
+	return -1;
+}
+
+/* ship a replica the log from a point in a generation until it goes or the server shuts down
+ *
+ * @param1 self the shipper
+ * @param2 log_fd the generation, opened; closed before returning
+ * @param3 generation its generation
+ * @param4 offset bytes of it the replica already has
+ */
+void ship_log(shipper *self, int log_fd, uint32_t generation, uint64_t offset)
+{
+	char path[WAL_PATH_SIZE];
+	char *buffer = malloc(REPL_CHUNK_SIZE);
+	int next_fd = -1;
+
+	uint64_t flushed = wal_wait_for_flush(0, 0);
+	uint64_t last_sent = metrics_now();
+
+	while(!shutting_down(self->shutdown_fd)) {
+		ssize_t len = pread(log_fd, buffer, REPL_CHUNK_SIZE, offset);
+		if(len == -1) break;
+
+		if(len > 0) {
+			//this is everything the primary has if the read stopped short in the newest generation
+			log_file_path(path, self->prefix, generation + 1);
+			int caught_up = len < REPL_CHUNK_SIZE && next_fd == -1 && access(path, F_OK) == -1;
+
+			if(send_repl_message(self->sockfd, REPL_LOG, caught_up ? REPL_CAUGHT_UP : 0, generation, len) == -1
+					|| repl_send(self->sockfd, buffer, len) == -1) break;
+
+			offset += len;
+			last_sent = metrics_now();
+			continue;
+		}
+
+		//a generation is finished before the file of the next one is made, so once the
+		//next one exists this one is read to its end once more and left behind
+		if(next_fd == -1) {
+			next_fd = open_generation(self->prefix, generation + 1);
+			if(next_fd != -1) continue;
+		} else {
+			close(log_fd);
+			log_fd = next_fd;
+			next_fd = -1;
+			generation++;
+			offset = 0;
+			continue;
+		}
+
+		if(metrics_now() - last_sent >= REPL_HEARTBEAT_MS * 1000000ULL) {
+			if(send_repl_message(self->sockfd, REPL_LOG, REPL_CAUGHT_UP, generation, 0) == -1) break;
+			last_sent = metrics_now();
+		}
+
+		flushed = wal_wait_for_flush(flushed, REPL_HEARTBEAT_MS);
+	}
+
+	if(next_fd != -1) close(next_fd);
+	close(log_fd);
+	free(buffer);
+}
+
+/* thread runner shipping the log to one replica
+ *
+ * @param1 arg void pointer to the replica's shipper
+ */
+void * ship_runner(void* arg)
+{
+	shipper *self = (shipper*) arg;
+
+	struct timeval timeout = {REPL_SEND_TIMEOUT_S, 0};
+	setsockopt(self->sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	setsockopt(self->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	repl_hello hello;
+	uint32_t generation = 0;
+	uint64_t offset = 0;
+	int log_fd = -1;
+
+	if(repl_receive(self->sockfd, &hello, sizeof(hello)) == 0 && memcmp(hello.magic, REPL_MAGIC, sizeof(hello.magic)) == 0) {
+		if(be32toh(hello.flags) & REPL_FRESH) {
+			log_fd = ship_snapshot(self, &generation);
+		} else {
+			generation = be32toh(hello.generation);
+			offset = be64toh(hello.offset);
+
+			//the generation is gone, or lost the end the replica has in a crash
+			struct stat st;
+			log_fd = open_generation(self->prefix, generation);
+			if(log_fd != -1 && (fstat(log_fd, &st) == -1 || (uint64_t) st.st_size < offset)) {
+				close(log_fd);
+				log_fd = -1;
+			}
+
+			if(log_fd == -1) {
+				fprintf(stderr, "replica #%d asked for log generation %u from offset %lu, which is gone\n", self->sockfd, generation, offset);
+				send_repl_message(self->sockfd, REPL_RESYNC, 0, generation, 0);
+			}
+		}
+	}
+
+	if(log_fd != -1) {
+		printf("shipping log generation %u from offset %lu to replica #%d\n", generation, offset, self->sockfd);
+		ship_log(self, log_fd, generation, offset);
+	}
+
+	printf("disconnecting from replica #%d\n", self->sockfd);
+	close(self->sockfd);
+
+	__atomic_store_n(&self->running, 0, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/* thread runner accepting replicas and starting a shipper for each, until the server shuts down
+ *
+ * @param1 arg void pointer to replication_args
+ */
+void * replication_runner(void* arg)
+{
+	replication_args *args = (replication_args*) arg;
+	shipper shippers[REPL_MAX_REPLICAS];
+	memset(shippers, 0, sizeof(shippers));
+
+	struct pollfd polls[2];
+	polls[0].fd = args->shutdown_fd;
+	polls[0].events = POLLIN;
+	polls[1].fd = args->sockfd;
+	polls[1].events = POLLIN;
+
+	int i;
+	while(1) {
+		int ret = poll(polls, 2, -1);
+
+		//shutdown eventfd is readable
+		if(ret > 0 && polls[0].revents) break;
+
+		//interrupted
+		if(ret <= 0) continue;
+
+		int fd = accept(args->sockfd, NULL, NULL);
+		if(fd == -1) continue;
+
+		//reuse the slot of a shipper whose replica has gone
+		shipper *slot = NULL;
+		for(i = 0; i < REPL_MAX_REPLICAS && !slot; i++) {
+			if(shippers[i].started && __atomic_load_n(&shippers[i].running, __ATOMIC_ACQUIRE)) continue;
+			if(shippers[i].started) pthread_join(shippers[i].id, NULL);
+			slot = &shippers[i];
+		}
+
+		if(!slot) {
+			fprintf(stderr, "refusing replica: already shipping to %d\n", REPL_MAX_REPLICAS);
+			close(fd);
+			continue;
+		}
+
+		printf("accepted connection from replica #%d\n", fd);
+
+		slot->sockfd = fd;
+		slot->prefix = args->prefix;
+		slot->shutdown_fd = args->shutdown_fd;
+		slot->started = 1;
+		slot->running = 1;
+		pthread_create(&slot->id, NULL, ship_runner, slot);
+	}
+
+	//shippers notice the shutdown within a heartbeat, or a send timeout if a replica stopped reading
+	for(i = 0; i < REPL_MAX_REPLICAS; i++) {
+		if(shippers[i].started) pthread_join(shippers[i].id, NULL);
+	}
+
+	close(args->sockfd);
+
+	return NULL;
+}
+
+/* connect to the primary and say where to start
+ *
+ * @param1 fresh nonzero to ask for the snapshot; otherwise go on from follow_generation and follow_offset
+ *
+ * @return connected socket; -1 if the primary can't be reached
+ */
+int connect_to_primary(int fresh)
+{
+	int fd = connect_to_listener(primary_address);
+	if(fd == -1) return -1;
+
+	//a primary that goes quiet is given up on rather than waited for forever
+	struct timeval timeout = {REPL_RECEIVE_TIMEOUT_MS / 1000, (REPL_RECEIVE_TIMEOUT_MS % 1000) * 1000};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	repl_hello hello;
+	memcpy(hello.magic, REPL_MAGIC, sizeof(hello.magic));
+	hello.flags = htobe32(fresh ? REPL_FRESH : 0);
+	hello.generation = htobe32(follow_generation);
+	hello.offset = htobe64(follow_offset);
+
+	if(repl_send(fd, &hello, sizeof(hello)) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* receive the header of a piece from the primary
+ *
+ * @return 0 if successful; -1 if the connection closed, failed or timed out
+ */
+int receive_repl_message(repl_message *message)
+{
+	if(repl_receive(primary_fd, message, sizeof(*message)) == -1) return -1;
+
+	message->generation = be32toh(message->generation);
+	message->length = be64toh(message->length);
+
+	return 0;
+}
+
+/* start following a primary: connect, and copy its accounts from its snapshot into the
+ * empty database; must be called before the server serves anyone
+ *
+ * @param1 address "<host>:<port>" of the primary's replication socket (-R)
+ * @param2 max_lag_ms staleness QUERY is served within; 0 for no bound
+ *
+ * @return number of accounts copied; -1 if the primary could not be reached or sent a bad snapshot
+ */
+int follow_primary(char *address, int max_lag_ms)
+{
+	primary_address = address;
+	max_lag_ns = (uint64_t) max_lag_ms * 1000000;
+
+	primary_fd = connect_to_primary(1);
+	if(primary_fd == -1) return -1;
+
+	//the snapshot may take a while to arrive whole
+	struct timeval timeout = {0, 0};
+	setsockopt(primary_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	repl_message message;
+	int num_accounts = 0;
+	if(receive_repl_message(&message) == -1 || message.type != REPL_SNAPSHOT) num_accounts = -1;
+
+	if(num_accounts == 0 && message.length > 0) {
+		char *snapshot = malloc(message.length);
+		if(!snapshot || repl_receive(primary_fd, snapshot, message.length) == -1) num_accounts = -1;
+		else num_accounts = load_snapshot_image(snapshot, message.length, &follow_generation);
+		free(snapshot);
+	}
+
+	if(num_accounts == -1) {
+		close(primary_fd);
+		primary_fd = -1;
+		return -1;
+	}
+
+	timeout.tv_sec = REPL_RECEIVE_TIMEOUT_MS / 1000;
+	timeout.tv_usec = (REPL_RECEIVE_TIMEOUT_MS % 1000) * 1000;
+	setsockopt(primary_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	follow_generation = message.generation;
+	follow_offset = 0;
+
+	//a piece, plus the start of a change it ended in the middle of
+	pending = malloc(2 * REPL_CHUNK_SIZE);
+	pending_len = 0;
+
+	replica = 1;
+	metrics_replica(0, 0);
+
+	return num_accounts;
+}
+
+/* receive a piece of the log from the primary and apply the changes it completes
+ *
+ * @return 0 if successful
+ *        -1 if the connection was lost, or the piece must be read again
+ *        -2 if the replica can't go on following the primary
+ */
+int apply_repl_message()
+{
+	uint64_t received = metrics_now();
+
+	repl_message message;
+	if(receive_repl_message(&message) == -1) return -1;
+
+	if(message.type == REPL_RESYNC) {
+		fprintf(stderr, "the primary no longer has log generation %u from offset %lu; restart the replica to copy its accounts again\n",
+				follow_generation, follow_offset);
+		return -2;
+	}
+
+	if(message.type != REPL_LOG || message.length > REPL_CHUNK_SIZE) return -1;
+
+	//the next generation starts where this one ended, after a whole change
+	if(message.generation != follow_generation) {
+		if(message.generation != follow_generation + 1 || pending_len != 0) {
+			fprintf(stderr, "log from the primary skips from generation %u offset %lu to generation %u\n",
+					follow_generation, follow_offset + pending_len, message.generation);
+			return -2;
+		}
+
+		follow_generation++;
+		follow_offset = 0;
+	}
+
+	if(repl_receive(primary_fd, pending + pending_len, message.length) == -1) return -1;
+	pending_len += message.length;
+
+	int num_records, corrupt;
+	size_t applied = wal_apply("replication", pending, pending_len, &num_records, &corrupt);
+	if(corrupt) {
+		int again = corrupt_generation == follow_generation && corrupt_offset == follow_offset + applied;
+		corrupt_generation = follow_generation;
+		corrupt_offset = follow_offset + applied;
+
+		fprintf(stderr, "corrupt log record from the primary in generation %u at offset %lu%s\n", follow_generation,
+				corrupt_offset, again ? "" : "; reading it again");
+		return again ? -2 : -1;
+	}
+
+	memmove(pending, pending + applied, pending_len - applied);
+	pending_len -= applied;
+	follow_offset += applied;
+	records_applied += num_records;
+
+	if(message.flags & REPL_CAUGHT_UP) __atomic_store_n(&caught_up_ns, received, __ATOMIC_RELEASE);
+	metrics_replica(records_applied, caught_up_ns);
+
+	return 0;
+}
+
+/* thread runner applying the primary's log until the server shuts down; reconnects
+ * to a lost primary and goes on where it left off
+ *
+ * @param1 arg void pointer to follow_args
+ */
+void * follow_runner(void* arg)
+{
+	follow_args *args = (follow_args*) arg;
+	int following = 1;
+
+	struct pollfd polls[2];
+	polls[0].fd = args->shutdown_fd;
+	polls[0].events = POLLIN;
+	polls[1].events = POLLIN;
+
+	while(1) {
+		//only the shutdown eventfd is polled while the primary is lost; a connected primary
+		//sends at least a heartbeat every REPL_HEARTBEAT_MS, so it is waited for no longer
+		//than REPL_RECEIVE_TIMEOUT_MS
+		polls[1].fd = primary_fd;
+		int ret = poll(polls, 2, primary_fd == -1 ? REPL_RETRY_MS : REPL_RECEIVE_TIMEOUT_MS);
+
+		//shutdown eventfd is readable
+		if(ret > 0 && polls[0].revents) break;
+
+		//interrupted
+		if(ret == -1) continue;
+
+		if(primary_fd == -1) {
+			if(!following) continue;
+
+			primary_fd = connect_to_primary(0);
+			if(primary_fd != -1) printf("reconnected to the primary at %s\n", primary_address);
+			continue;
+		}
+
+		//a primary that sent nothing, not even a heartbeat, is as good as lost
+		ret = (ret == 0) ? -1 : apply_repl_message();
+		if(ret == 0) continue;
+
+		if(ret == -1) fprintf(stderr, "lost the primary at %s; reconnecting\n", primary_address);
+		if(ret == -2) following = 0;
+
+		close(primary_fd);
+		primary_fd = -1;
+		pending_len = 0;
+	}
+
+	if(primary_fd != -1) close(primary_fd);
+	free(pending);
+
+	return NULL;
+}
+
+/* @return whether the replica may be further behind its primary than it promised,
+ *         so QUERY should go to the primary; always false on a primary
+ */
+int replica_behind()
+{
+	if(!replica || max_lag_ns == 0) return 0;
+
+	uint64_t caught_up = __atomic_load_n(&caught_up_ns, __ATOMIC_ACQUIRE);
+
+	return caught_up == 0 || metrics_now() - caught_up > max_lag_ns;
+}
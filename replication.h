@@ -0,0 +1,48 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <netdb.h>
+
+/* a primary that has sent nothing for this long tells its replicas it has nothing new */
+#define REPL_HEARTBEAT_MS 100
+
+/* staleness a replica serves QUERY within unless told otherwise (-F host:port/ms) */
+#define DEFAULT_REPLICA_MAX_LAG_MS 1000
+
+/* replicas a primary ships its log to at once */
+#define REPL_MAX_REPLICAS 16
+
+/* set once this server follows a primary; its clients may only read */
+extern int replica;
+
+/* replication functions */
+int bind_replication_socket(char *port_num);
+void * replication_runner(void* arg);
+int follow_primary(char *address, int max_lag_ms);
+void * follow_runner(void* arg);
+int replica_behind();
+
+/* arguments for replication_runner */
+typedef struct replication_args replication_args;
+struct replication_args {
+	char *prefix;		//prefix of the log and snapshot files shipped
+	int sockfd;		//listening socket replicas connect to
+	int shutdown_fd;	//eventfd that becomes readable on SIGINT
+};
+
+/* arguments for follow_runner */
+typedef struct follow_args follow_args;
+struct follow_args {
+	int shutdown_fd;	//eventfd that becomes readable on SIGINT
+};
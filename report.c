@@ -0,0 +1,361 @@
+/*************************************************************************
+  This file handles the periodic report of every account
+
+   report() takes a consistent view of the database with fork_db(),
+   which only holds writers up for the fork itself; the child walks its
+   copy of the database without taking any lock and streams the report
+   through a buffer with write() while the parent keeps serving.
+
+   A report lists every account followed by summary statistics, either
+
+   	text  "<name>\t<balance>\t<IN SERVICE>" lines
+   	csv   "name,balance,in_session" rows; the summary is in "#" lines
+
+   or as a binary report (see report.h), which has no summary and is
+   what bankingBulk imports fastest.
+
+   and goes to stdout ("-"), a TCP listener ("tcp:<host>:<port>"), or a
+   file, which is replaced once the whole report is written.
+ **************************************************************************/
+#include "report.h"
+#include "database.h"
+#include <poll.h>
+
+#define REPORT_BUFFER_SIZE 65536
+#define REPORT_PATH_SIZE 4096
+#define REPORT_LINE_SIZE 600
+
+/* longest formatted total of every balance (up to 2^32 accounts of MONEY_MAX) plus the terminator */
+#define REPORT_TOTAL_SIZE 44
+
+/* buffered writer used by the report child, which only uses write() */
+typedef struct report_writer report_writer;
+struct report_writer {
+	int fd;
+	report_format format;
+	char buffer[REPORT_BUFFER_SIZE];
+	size_t used;
+	int failed;			//set once a write fails
+	uint32_t num_accounts;		//accounts written so far
+	uint32_t num_in_session;	//of those, accounts in session
+	__int128 total;			//sum of the balances written; wider than a money so it can't overflow
+	money lowest;			//smallest balance written
+	money highest;			//largest balance written
+};
+
+/* parse the name of a report format
+ *
+ * @param1 format_name "text", "csv" or "binary"
+ * @param2 format pointer in which to put the format
+ *
+ * @return 0 if the name is known; -1 otherwise
+ */
+int parse_report_format(char *format_name, report_format *format)
+{
+	if(strcmp(format_name, "text") == 0) *format = REPORT_TEXT;
+	else if(strcmp(format_name, "csv") == 0) *format = REPORT_CSV;
+	else if(strcmp(format_name, "binary") == 0) *format = REPORT_BINARY;
+	else return -1;
+
+	return 0;
+}
+
+/* write out whatever the writer has buffered */
+void flush_report_writer(report_writer *writer)
+{
+	char *data = writer->buffer;
+	size_t len = writer->used;
+	while(len > 0 && !writer->failed) {
+		ssize_t ret = write(writer->fd, data, len);
+		if(ret == -1) {
+			writer->failed = 1;
+			break;
+		}
+		data += ret;
+		len -= ret;
+	}
+	writer->used = 0;
+}
+
+/* buffer bytes of the report
+ *
+ * @param1 writer the report writer
+ * @param2 data bytes to write
+ * @param3 len number of bytes
+ */
+void report_write(report_writer *writer, char *data, size_t len)
+{
+	if(writer->used + len > REPORT_BUFFER_SIZE) flush_report_writer(writer);
+
+	memcpy(writer->buffer + writer->used, data, len);
+	writer->used += len;
+}
+
+/* copy an account name into a csv line, quoting it if it has a comma or quote
+ *
+ * @param1 line pointer in which to put the field
+ * @param2 name the account name
+ *
+ * @return length of the field
+ */
+size_t csv_field(char *line, char *name)
+{
+	if(!strpbrk(name, ",\"")) {
+		size_t len = strlen(name);
+		memcpy(line, name, len);
+		return len;
+	}
+
+	size_t len = 0;
+	line[len++] = '"';
+	for(; *name; name++) {
+		if(*name == '"') line[len++] = '"';
+		line[len++] = *name;
+	}
+	line[len++] = '"';
+
+	return len;
+}
+
+/* for_each_record callback writing one account and adding it to the summary */
+void write_report_account(uint32_t id, char *name, uint64_t hash, money balance, int in_session, void *arg)
+{
+	(void)id;
+	(void)hash;
+
+	report_writer *writer = (report_writer*) arg;
+
+	//quoting can at most double a 255 byte name
+	char line[REPORT_LINE_SIZE];
+	char amount[MONEY_STRING_SIZE];
+	size_t amount_len = format_money(balance, amount);
+	size_t len;
+
+	if(writer->format == REPORT_CSV) {
+		len = csv_field(line, name);
+		line[len++] = ',';
+		memcpy(line + len, amount, amount_len);
+		len += amount_len;
+		len += sprintf(line + len, ",%d\n", in_session);
+	} else if(writer->format == REPORT_BINARY) {
+		uint64_t be_balance = htobe64(balance);
+		memcpy(line, &be_balance, sizeof(be_balance));
+		len = strlen(name);
+		line[sizeof(be_balance)] = len;
+		memcpy(line + sizeof(be_balance) + 1, name, len);
+		len += sizeof(be_balance) + 1;
+	} else {
+		len = sprintf(line, "%s\t%s\t%s\n\n", name, amount, in_session ? "IN SERVICE" : "");
+	}
+
+	report_write(writer, line, len);
+
+	if(writer->num_accounts == 0 || balance < writer->lowest) writer->lowest = balance;
+	if(writer->num_accounts == 0 || balance > writer->highest) writer->highest = balance;
+	writer->num_accounts++;
+	writer->num_in_session += in_session;
+	writer->total += balance;
+}
+
+/* format the total of every balance as format_money() would, though it may not fit a money
+ *
+ * @param1 total the total in cents
+ * @param2 string pointer in which to put the terminated text
+ */
+void format_total(__int128 total, char string[REPORT_TOTAL_SIZE])
+{
+	if(total >= -MONEY_MAX && total <= MONEY_MAX) {
+		format_money((money) total, string);
+		return;
+	}
+
+	unsigned __int128 magnitude = (total < 0) ? -(unsigned __int128) total : (unsigned __int128) total;
+
+	//write the digits backwards from the end of a scratch buffer
+	char digits[REPORT_TOTAL_SIZE];
+	char *ptr = digits + sizeof(digits);
+
+	int places = 0;
+	do {
+		if(places == 2) *--ptr = '.';
+		*--ptr = '0' + (int) (magnitude % 10);
+		magnitude /= 10;
+		places++;
+	} while(magnitude > 0 || places < 3);
+
+	if(total < 0) *--ptr = '-';
+
+	size_t len = digits + sizeof(digits) - ptr;
+	memcpy(string, ptr, len);
+	string[len] = '\0';
+}
+
+/* write the summary statistics once every account has been written; a binary report has none */
+void write_report_summary(report_writer *writer)
+{
+	if(writer->format == REPORT_BINARY) return;
+
+	//the mean lies between the lowest and highest balance, so it fits a money
+	char total[REPORT_TOTAL_SIZE], lowest[MONEY_STRING_SIZE], highest[MONEY_STRING_SIZE], mean[MONEY_STRING_SIZE];
+	format_total(writer->total, total);
+	format_money(writer->lowest, lowest);
+	format_money(writer->highest, highest);
+	format_money(writer->num_accounts ? (money) (writer->total / writer->num_accounts) : 0, mean);
+
+	char *prefix = (writer->format == REPORT_CSV) ? "# " : "";
+
+	char line[REPORT_LINE_SIZE];
+	size_t len = snprintf(line, sizeof(line), "%saccounts: %u\tin session: %u\n%stotal: %s\tmean: %s\tlowest: %s\thighest: %s\n",
+			prefix, writer->num_accounts, writer->num_in_session, prefix, total, mean, lowest, highest);
+
+	report_write(writer, line, len);
+}
+
+/* connect to a "<host>:<port>" TCP listener
+ *
+ * @param1 address host and port, separated by the last ':'
+ *
+ * @return connected socket; -1 if the connection failed
+ */
+int connect_to_listener(char *address)
+{
+	char host[REPORT_PATH_SIZE];
+	char *port = strrchr(address, ':');
+	if(!port || (size_t) (port - address) >= sizeof(host)) return -1;
+
+	memcpy(host, address, port - address);
+	host[port - address] = '\0';
+	port++;
+
+	struct addrinfo hints, *results;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host, port, &hints, &results) != 0) return -1;
+
+	int fd = -1;
+	struct addrinfo *result;
+	for(result = results; result && fd == -1; result = result->ai_next) {
+		fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+		if(fd != -1 && connect(fd, result->ai_addr, result->ai_addrlen) == -1) {
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	freeaddrinfo(results);
+
+	return fd;
+}
+
+/* write the report of a frozen database; runs in the child forked by report()
+ *
+ * @param1 destination "-" for stdout, "tcp:<host>:<port>", or a file path
+ * @param2 format how accounts are written
+ *
+ * @return 0 if successful; -1 otherwise
+ */
+int write_report(char *destination, report_format format)
+{
+	//a file is written next to its final path and renamed over it once complete
+	char tmp_path[REPORT_PATH_SIZE + 4] = "";
+
+	report_writer *writer = calloc(1, sizeof(report_writer));
+	writer->format = format;
+
+	if(strcmp(destination, "-") == 0) {
+		writer->fd = STDOUT_FILENO;
+	} else if(strncmp(destination, "tcp:", 4) == 0) {
+		writer->fd = connect_to_listener(destination + 4);
+	} else {
+		snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", destination);
+		writer->fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+
+	if(writer->fd == -1) {
+		free(writer);
+		return -1;
+	}
+
+	if(format == REPORT_CSV) report_write(writer, "name,balance,in_session\n", 24);
+	if(format == REPORT_BINARY) report_write(writer, REPORT_BINARY_MAGIC, REPORT_BINARY_MAGIC_SIZE);
+
+	for_each_record(write_report_account, writer);
+	write_report_summary(writer);
+	flush_report_writer(writer);
+
+	int failed = writer->failed;
+	if(writer->fd != STDOUT_FILENO) close(writer->fd);
+	free(writer);
+
+	if(tmp_path[0]) {
+		if(failed || rename(tmp_path, destination) == -1) {
+			unlink(tmp_path);
+			return -1;
+		}
+	}
+
+	return failed ? -1 : 0;
+}
+
+/* report every account without stopping other threads for longer than a fork()
+ *
+ * @param1 destination "-" for stdout, "tcp:<host>:<port>", or a file path
+ * @param2 format how accounts are written
+ *
+ * @return 0 if successful; -1 otherwise
+ */
+int report(char *destination, report_format format)
+{
+	pid_t pid = fork_db();
+
+	if(pid == -1) {
+		perror("fork: ");
+		return -1;
+	}
+
+	//child: the database is frozen here, so write it out and leave without running atexit handlers
+	if(pid == 0) _exit(write_report(destination, format) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	int status;
+	waitpid(pid, &status, 0);
+
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "failed to write report to %s\n", destination);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* thread runner reporting every interval, and whenever a report is asked for,
+ * until the server shuts down
+ *
+ * @param1 arg void pointer to report_args
+ */
+void * report_runner(void* arg)
+{
+	report_args *args = (report_args*) arg;
+
+	struct pollfd polls[2];
+	polls[0].fd = args->shutdown_fd;
+	polls[0].events = POLLIN;
+	polls[1].fd = args->report_fd;
+	polls[1].events = POLLIN;
+
+	while(1) {
+		int ret = poll(polls, 2, args->interval > 0 ? args->interval * 1000 : -1);
+
+		//shutdown eventfd is readable
+		if(ret > 0 && polls[0].revents) return NULL;
+
+		//interrupted
+		if(ret == -1) continue;
+
+		//asked for a report; requests made while it runs are served by the next one
+		uint64_t requests;
+		if(ret > 0 && read(args->report_fd, &requests, sizeof(requests)) == -1) continue;
+
+		report(args->destination, args->format);
+	}
+}
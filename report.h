@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netdb.h>
+
+/* enums */
+typedef enum _report_format{REPORT_TEXT, REPORT_CSV, REPORT_BINARY} report_format;
+
+/* first bytes of a binary report; each account follows as an 8 byte big-endian balance
+ * in cents, a byte giving the length of the name, and the name without a terminator
+ */
+#define REPORT_BINARY_MAGIC "BANKBULK"
+#define REPORT_BINARY_MAGIC_SIZE 8
+
+/* report functions */
+int parse_report_format(char *format_name, report_format *format);
+int report(char *destination, report_format format);
+void * report_runner(void* arg);
+int connect_to_listener(char *address);
+
+/* arguments for report_runner */
+typedef struct report_args report_args;
+struct report_args {
+	char *destination;	//"-" for stdout, "tcp:<host>:<port>", or a file path
+	report_format format;	//how accounts are written
+	int interval;		//seconds between reports; 0 to report only when asked
+	int report_fd;		//eventfd that becomes readable when a report is asked for (SIGUSR1)
+	int shutdown_fd;	//eventfd that becomes readable on SIGINT
+};
@@ -0,0 +1,469 @@
+/*************************************************************************
+  This file handles snapshots of the account database
+
+   A snapshot is written to <prefix>.snapshot and laid out so it can be
+   mapped and read in place:
+
+   	header   snapshot_header
+   	records  num_records snapshot_records, indexed by slab index
+   	names    names_size bytes of account names, each NUL terminated
+
+   checkpoint() forks while holding the write-ahead log lock, so the
+   child sees the database exactly as of a log rotation and writes it
+   out while the parent keeps serving; once the snapshot is on disk the
+   log generations it covers are removed. At startup load_snapshot()
+   restores the snapshot and the log tail is replayed on top of it.
+
+   Version 1 snapshots hold balances as doubles; they are still loaded,
+   converted to cents.
+ **************************************************************************/
+#include "snapshot.h"
+#include "database.h"
+#include "wal.h"
+#include <poll.h>
+#include <math.h>
+
+#define SNAPSHOT_MAGIC "BANKSNAP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_VERSION_DOUBLE_BALANCES 1
+#define SNAPSHOT_PATH_SIZE 4096
+#define SNAPSHOT_BUFFER_SIZE (1 << 20)
+
+/* first bytes of a snapshot file */
+typedef struct snapshot_header snapshot_header;
+struct snapshot_header {
+	char magic[8];			//SNAPSHOT_MAGIC
+	uint32_t version;		//SNAPSHOT_VERSION
+	uint32_t generation;		//first log generation not covered by the snapshot
+	uint32_t num_records;		//slab indexes covered; unused ones have name_len 0
+	uint32_t reserved;
+	uint64_t names_size;		//bytes in the names section
+};
+
+/* one account of a snapshot */
+typedef struct snapshot_record snapshot_record;
+struct snapshot_record {
+	money balance;			//in cents; the bits of a double in version 1
+	uint64_t hash;			//hash of the account name
+	uint64_t name_offset;		//offset of the name in the names section
+	uint32_t name_len;		//bytes of the name without the terminator; 0 if unused
+	uint32_t reserved;
+};
+
+/* buffered writer used by the snapshot child, which only uses write() */
+typedef struct snapshot_writer snapshot_writer;
+struct snapshot_writer {
+	int fd;
+	char *buffer;
+	size_t used;
+	int failed;			//set once a write fails
+	uint32_t next_id;		//slab index of the next record to write
+	uint64_t names_size;		//bytes of names written or accounted for so far
+};
+
+/* build the path of the snapshot file
+ *
+ * @param1 path pointer in which to put the path; SNAPSHOT_PATH_SIZE bytes
+ * @param2 prefix prefix of the log and snapshot files
+ */
+void snapshot_path(char path[SNAPSHOT_PATH_SIZE], char *prefix)
+{
+	snprintf(path, SNAPSHOT_PATH_SIZE, "%s.snapshot", prefix);
+}
+
+/* write out whatever the writer has buffered */
+void flush_snapshot_writer(snapshot_writer *writer)
+{
+	char *data = writer->buffer;
+	size_t len = writer->used;
+	while(len > 0 && !writer->failed) {
+		ssize_t ret = write(writer->fd, data, len);
+		if(ret == -1) {
+			writer->failed = 1;
+			break;
+		}
+		data += ret;
+		len -= ret;
+	}
+	writer->used = 0;
+}
+
+/* buffer bytes for the snapshot file
+ *
+ * @param1 writer the snapshot writer
+ * @param2 data bytes to write
+ * @param3 len number of bytes
+ */
+void snapshot_write(snapshot_writer *writer, void *data, size_t len)
+{
+	if(writer->used + len > SNAPSHOT_BUFFER_SIZE) flush_snapshot_writer(writer);
+
+	memcpy(writer->buffer + writer->used, data, len);
+	writer->used += len;
+}
+
+/* for_each_record callback writing a snapshot_record;
+ * unused slab indexes before the record are written as empty records
+ */
+void write_snapshot_record(uint32_t id, char *name, uint64_t hash, money balance, int in_session, void *arg)
+{
+	(void)in_session;
+
+	snapshot_writer *writer = (snapshot_writer*) arg;
+	snapshot_record record;
+	memset(&record, 0, sizeof(record));
+
+	while(writer->next_id < id) {
+		snapshot_write(writer, &record, sizeof(record));
+		writer->next_id++;
+	}
+
+	record.balance = balance;
+	record.hash = hash;
+	record.name_offset = writer->names_size;
+	record.name_len = strlen(name);
+	snapshot_write(writer, &record, sizeof(record));
+
+	writer->names_size += record.name_len + 1;
+	writer->next_id++;
+}
+
+/* for_each_record callback writing an account name */
+void write_snapshot_name(uint32_t id, char *name, uint64_t hash, money balance, int in_session, void *arg)
+{
+	(void)id;
+	(void)hash;
+	(void)balance;
+	(void)in_session;
+
+	snapshot_write((snapshot_writer*) arg, name, strlen(name) + 1);
+}
+
+/* write the database to a snapshot file; takes no locks, so the database must not change
+ * while it runs (it runs in a forked child, or on a database nobody else is using)
+ *
+ * @param1 path path of the snapshot file; written to <path>.tmp and renamed once on disk
+ * @param2 generation first log generation not covered by the snapshot
+ *
+ * @return 0 if successful; -1 otherwise
+ */
+int write_snapshot(char *path, uint32_t generation)
+{
+	char tmp_path[SNAPSHOT_PATH_SIZE + 4];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+	snapshot_writer writer;
+	writer.fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(writer.fd == -1) return -1;
+
+	writer.buffer = malloc(SNAPSHOT_BUFFER_SIZE);
+	writer.used = 0;
+	writer.failed = 0;
+	writer.next_id = 0;
+	writer.names_size = 0;
+
+	//the header is rewritten once the sizes are known
+	snapshot_header header;
+	memset(&header, 0, sizeof(header));
+	snapshot_write(&writer, &header, sizeof(header));
+
+	for_each_record(write_snapshot_record, &writer);
+	for_each_record(write_snapshot_name, &writer);
+	flush_snapshot_writer(&writer);
+
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.generation = generation;
+	header.num_records = writer.next_id;
+	header.names_size = writer.names_size;
+	if(pwrite(writer.fd, &header, sizeof(header), 0) != sizeof(header)) writer.failed = 1;
+
+	if(fsync(writer.fd) == -1) writer.failed = 1;
+	close(writer.fd);
+	free(writer.buffer);
+
+	if(writer.failed || rename(tmp_path, path) == -1) {
+		unlink(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* write the snapshot of a database that nobody else is using and that no log
+ * generation follows, so a server started with the prefix loads it as it is
+ * (see bankingBulk.c)
+ *
+ * @param1 prefix prefix of the log and snapshot files
+ *
+ * @return 0 if successful; -1 otherwise
+ */
+int save_snapshot(char *prefix)
+{
+	char path[SNAPSHOT_PATH_SIZE];
+	snapshot_path(path, prefix);
+
+	return write_snapshot(path, 0);
+}
+
+/* arguments for a snapshot loading thread */
+typedef struct load_args load_args;
+struct load_args {
+	snapshot_record *records;	//records of the mapped snapshot
+	char *names;			//names section of the mapped snapshot
+	uint32_t first;			//first slab index to load
+	uint32_t last;			//one past the last slab index to load
+	int double_balances;		//balances are doubles (version 1)
+};
+
+/* thread runner loading a range of snapshot records into the database
+ *
+ * @param1 arg void pointer to load_args
+ */
+void * load_snapshot_runner(void* arg)
+{
+	load_args *args = (load_args*) arg;
+
+	uint32_t id;
+	for(id = args->first; id < args->last; id++) {
+		snapshot_record *record = &args->records[id];
+		if(record->name_len == 0) continue;
+
+		money balance = record->balance;
+		if(args->double_balances) {
+			double old_balance;
+			memcpy(&old_balance, &record->balance, sizeof(old_balance));
+			balance = llround(old_balance * MONEY_SCALE);
+		}
+
+		load_account(id, args->names + record->name_offset, record->hash, balance);
+	}
+
+	return NULL;
+}
+
+/* check that every used record of a snapshot names a NUL terminated name that lies
+ * inside the names section, so a corrupt or truncated snapshot is refused before any
+ * of it is loaded
+ *
+ * @param1 records the records
+ * @param2 num_records number of records
+ * @param3 names the names section
+ * @param4 names_size bytes in the names section
+ *
+ * @return 1 if every record is sound; 0 otherwise
+ */
+int check_snapshot_records(snapshot_record *records, uint32_t num_records, char *names, uint64_t names_size)
+{
+	uint32_t id;
+	for(id = 0; id < num_records; id++) {
+		snapshot_record *record = &records[id];
+		if(record->name_len == 0) continue;
+
+		//names are at most 255 bytes, and the terminator must be inside the section too
+		if(record->name_len > 255 || record->name_offset >= names_size
+				|| record->name_len >= names_size - record->name_offset
+				|| names[record->name_offset + record->name_len] != '\0') {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* restore the database from a snapshot held in memory; records are loaded in
+ * parallel straight from the image once every one has been checked
+ *
+ * @param1 snapshot the whole snapshot, mapped from its file or received from a primary (see replication.c)
+ * @param2 size bytes in the snapshot
+ * @param3 generation pointer in which to put the first log generation to replay
+ *
+ * @return number of accounts loaded; -1 if the snapshot is unreadable
+ */
+int load_snapshot_image(char *snapshot, size_t size, uint32_t *generation)
+{
+	snapshot_header *header = (snapshot_header*) snapshot;
+	if(size < sizeof(snapshot_header) || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0
+			|| (header->version != SNAPSHOT_VERSION && header->version != SNAPSHOT_VERSION_DOUBLE_BALANCES)) {
+		return -1;
+	}
+
+	//the sections must fill the rest exactly; compared by subtraction so no size can overflow
+	size_t body_size = size - sizeof(snapshot_header);
+	if(header->num_records > body_size / sizeof(snapshot_record)) return -1;
+
+	size_t records_size = (size_t) header->num_records * sizeof(snapshot_record);
+	if(header->names_size != body_size - records_size) return -1;
+
+	snapshot_record *records = (snapshot_record*) (snapshot + sizeof(snapshot_header));
+	char *names = snapshot + sizeof(snapshot_header) + records_size;
+
+	if(!check_snapshot_records(records, header->num_records, names, header->names_size)) return -1;
+
+	reserve_db(header->num_records);
+
+	int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(num_threads < 1) num_threads = 1;
+
+	pthread_t ids[num_threads];
+	load_args args[num_threads];
+	uint32_t per_thread = header->num_records / num_threads + 1;
+
+	int i;
+	for(i = 0; i < num_threads; i++) {
+		args[i].records = records;
+		args[i].names = names;
+		args[i].double_balances = header->version == SNAPSHOT_VERSION_DOUBLE_BALANCES;
+		args[i].first = (i * per_thread < header->num_records) ? i * per_thread : header->num_records;
+		args[i].last = (args[i].first + per_thread < header->num_records) ? args[i].first + per_thread : header->num_records;
+		pthread_create(&ids[i], NULL, load_snapshot_runner, &args[i]);
+	}
+
+	for(i = 0; i < num_threads; i++) {
+		pthread_join(ids[i], NULL);
+	}
+
+	finish_load(header->num_records);
+
+	int num_loaded = 0;
+	uint32_t id;
+	for(id = 0; id < header->num_records; id++) {
+		if(records[id].name_len) num_loaded++;
+	}
+
+	*generation = header->generation;
+
+	return num_loaded;
+}
+
+/* restore the database from the snapshot file, if there is one
+ *
+ * @param1 prefix prefix of the log and snapshot files
+ * @param2 generation pointer in which to put the first log generation to replay
+ *
+ * @return number of accounts loaded; -1 if the snapshot is unreadable
+ */
+int load_snapshot(char *prefix, uint32_t *generation)
+{
+	char path[SNAPSHOT_PATH_SIZE];
+	snapshot_path(path, prefix);
+
+	*generation = 0;
+
+	int fd = open(path, O_RDONLY);
+	if(fd == -1) return 0;
+
+	struct stat st;
+	fstat(fd, &st);
+
+	char *snapshot = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(snapshot == MAP_FAILED) return -1;
+
+	madvise(snapshot, st.st_size, MADV_SEQUENTIAL);
+
+	int num_loaded = load_snapshot_image(snapshot, st.st_size, generation);
+
+	munmap(snapshot, st.st_size);
+
+	return num_loaded;
+}
+
+/* open the snapshot file to read it whole; a snapshot taken meanwhile replaces the
+ * file, so the one opened stays readable and consistent with its generation
+ *
+ * @param1 prefix prefix of the log and snapshot files
+ * @param2 generation pointer in which to put the first log generation the snapshot does not cover
+ * @param3 size pointer in which to put the size of the snapshot
+ *
+ * @return file descriptor at the start of the snapshot; -1 if there is none or it is unreadable
+ */
+int open_snapshot(char *prefix, uint32_t *generation, size_t *size)
+{
+	char path[SNAPSHOT_PATH_SIZE];
+	snapshot_path(path, prefix);
+
+	int fd = open(path, O_RDONLY);
+	if(fd == -1) return -1;
+
+	struct stat st;
+	snapshot_header header;
+	if(fstat(fd, &st) == -1 || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+			|| memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	*generation = header.generation;
+	*size = st.st_size;
+
+	return fd;
+}
+
+/* take a snapshot without stopping other threads for longer than a fork();
+ * the log lock is held across the rotation and the fork, so the child sees every
+ * change in the old generations and none in the new one
+ *
+ * @param1 prefix prefix of the log and snapshot files
+ *
+ * @return 0 if successful; -1 otherwise
+ */
+int checkpoint(char *prefix)
+{
+	char path[SNAPSHOT_PATH_SIZE];
+	snapshot_path(path, prefix);
+
+	wal_begin();
+
+	uint32_t generation = wal_rotate();
+	pid_t pid = fork();
+
+	wal_end();
+
+	if(pid == -1) {
+		perror("fork: ");
+		return -1;
+	}
+
+	//child: the database is frozen here, so write it out and leave without running atexit handlers
+	if(pid == 0) _exit(write_snapshot(path, generation) == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+	int status;
+	waitpid(pid, &status, 0);
+
+	if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+		fprintf(stderr, "failed to write snapshot %s\n", path);
+		return -1;
+	}
+
+	//the old generations may still be being written; wait before removing them
+	wal_wait_for_rotation(generation);
+	wal_remove_generations(prefix, generation);
+
+	return 0;
+}
+
+/* thread runner taking a snapshot every interval until the server shuts down
+ *
+ * @param1 arg void pointer to checkpoint_args
+ */
+void * checkpoint_runner(void* arg)
+{
+	checkpoint_args *args = (checkpoint_args*) arg;
+
+	struct pollfd shutdown_poll;
+	shutdown_poll.fd = args->shutdown_fd;
+	shutdown_poll.events = POLLIN;
+
+	while(1) {
+		int ret = poll(&shutdown_poll, 1, args->interval * 1000);
+
+		//shutdown eventfd is readable
+		if(ret > 0) return NULL;
+
+		//interrupted
+		if(ret == -1) continue;
+
+		checkpoint(args->prefix);
+	}
+}
@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/* snapshot functions */
+int write_snapshot(char *path, uint32_t generation);
+int save_snapshot(char *prefix);
+int load_snapshot_image(char *snapshot, size_t size, uint32_t *generation);
+int load_snapshot(char *prefix, uint32_t *generation);
+int open_snapshot(char *prefix, uint32_t *generation, size_t *size);
+int checkpoint(char *prefix);
+void * checkpoint_runner(void* arg);
+
+/* arguments for checkpoint_runner */
+typedef struct checkpoint_args checkpoint_args;
+struct checkpoint_args {
+	char *prefix;		//prefix of the log and snapshot files
+	int interval;		//seconds between snapshots
+	int shutdown_fd;	//eventfd that becomes readable on SIGINT
+};
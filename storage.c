@@ -0,0 +1,237 @@
+/*************************************************************************
+  This file picks the storage engine behind the database functions
+
+   The functions of database.h pass straight through to the engine in
+   db_engine, so the server, the log, snapshots and reports work the
+   same whichever engine keeps the accounts.
+
+   Engines:
+   	hash		the in-memory hash table of database.c; with the
+   			write-ahead log (see wal.c) and snapshots it is
+   			persistent and log structured
+   	mmap[:path]	a table of fixed-size records in a file mapped
+   			into memory (see mmapEngine.c); persistent by
+   			itself, so it takes no log
+
+   Error codes are those of database.c.
+ **************************************************************************/
+#include "database.h"
+
+/******************************* GLOBALS **************************************/
+storage_engine *db_engine = &hash_engine;
+
+/* option after the ':' of the engine spec; NULL if none was given */
+char *db_engine_option = NULL;
+
+/******************************************************************************/
+
+/* choose the engine init_db() opens; must be called before it
+ *
+ * @param1 spec engine name, optionally followed by ':' and an option, such as mmap:accounts.mmap
+ *
+ * @return -1 if there is no engine of that name
+ *          0 if successful
+ */
+int select_storage_engine(char *spec)
+{
+	storage_engine *engines[] = {&hash_engine, &mmap_engine};
+
+	char *colon = strchr(spec, ':');
+	size_t name_len = colon ? (size_t) (colon - spec) : strlen(spec);
+
+	size_t i;
+	for(i = 0; i < sizeof(engines) / sizeof(engines[0]); i++) {
+		if(strlen(engines[i]->name) != name_len || strncmp(engines[i]->name, spec, name_len) != 0) continue;
+
+		db_engine = engines[i];
+		db_engine_option = colon ? colon + 1 : NULL;
+		return 0;
+	}
+
+	return -1;
+}
+
+/* open the selected engine; must be called before any other database function
+ *
+ * @return -1 if the engine could not be opened
+ *          0 if successful
+ */
+int init_db()
+{
+	return db_engine->init(db_engine_option);
+}
+
+int create_account(char account_name[256])
+{
+	return db_engine->create_account(account_name, NULL);
+}
+
+/* create a new account and get its id
+ *
+ * @param1 account_name name of account
+ * @param2 account_id pointer in which to put the id of the new account
+ *
+ * @return see create_account()
+ */
+int create_account_with_id(char account_name[256], uint32_t *account_id)
+{
+	return db_engine->create_account(account_name, account_id);
+}
+
+int start_session(char account_name[256])
+{
+	return db_engine->start_session(account_name, NULL);
+}
+
+/* start new session and get the id of the account, for the _by_id functions
+ * to use for the rest of the session
+ *
+ * @param1 account_name name of account
+ * @param2 account_id pointer in which to put the id of the account
+ *
+ * @return see start_session()
+ */
+int start_session_with_id(char account_name[256], uint32_t *account_id)
+{
+	return db_engine->start_session(account_name, account_id);
+}
+
+int end_session(char account_name[256])
+{
+	return db_engine->end_session(account_name);
+}
+
+int deposit(char account_name[256], money amount)
+{
+	return db_engine->deposit(account_name, amount);
+}
+
+int withdraw(char account_name[255], money amount)
+{
+	return db_engine->withdraw(account_name, amount);
+}
+
+int query_balance(char account_name[255], money *balance)
+{
+	return db_engine->query_balance(account_name, balance);
+}
+
+/* the functions taking an id must only be given ids from create_account_with_id()
+ * or start_session_with_id(); they return -2 once the account is deleted
+ */
+int end_session_by_id(uint32_t account_id)
+{
+	return db_engine->end_session_by_id(account_id);
+}
+
+int deposit_by_id(uint32_t account_id, money amount)
+{
+	return db_engine->deposit_by_id(account_id, amount);
+}
+
+int withdraw_by_id(uint32_t account_id, money amount)
+{
+	return db_engine->withdraw_by_id(account_id, amount);
+}
+
+int query_balance_by_id(uint32_t account_id, money *balance)
+{
+	return db_engine->query_balance_by_id(account_id, balance);
+}
+
+/* move money from one account to another atomically
+ *
+ * @param1 from name of the account debited
+ * @param2 to name of the account credited
+ * @param3 amount amount to move in cents
+ *
+ * @return see transfer_batch()
+ */
+int transfer(char from[256], char to[256], money amount)
+{
+	transfer_leg leg = {from, to, amount};
+
+	return transfer_batch(&leg, 1);
+}
+
+/* move money along every leg, in order, as one change: either every leg is applied
+ * and logged together or none is; a leg may spend money credited by an earlier one
+ *
+ * @param1 legs the legs of the transfer
+ * @param2 num_legs number of legs; at most MAX_TRANSFER_LEGS
+ *
+ * @return -2 if any account does not exist
+ *         -5 if a leg would overdraw its account
+ *         -8 if a leg would overflow its account, or there are too many legs
+ *          0 if successful
+ */
+int transfer_batch(transfer_leg *legs, int num_legs)
+{
+	if(num_legs < 1 || num_legs > MAX_TRANSFER_LEGS) return -8;
+
+	return db_engine->transfer_batch(legs, num_legs);
+}
+
+int delete_account(char account_name[256])
+{
+	return db_engine->delete_account(account_name);
+}
+
+/* size the engine for a number of accounts about to be loaded from a snapshot */
+void reserve_db(size_t num_accounts)
+{
+	db_engine->reserve(num_accounts);
+}
+
+/* put an account from a snapshot back at the record index it had; not logged
+ *
+ * @return -1 if an account of that name exists already, and nothing is loaded
+ *         -8 if the engine has no room for the record
+ *          0 if successful
+ */
+int load_account(uint32_t id, char account_name[256], uint64_t hash, money balance)
+{
+	return db_engine->load_account(id, account_name, hash, balance);
+}
+
+/* finish loading a snapshot; new accounts get record indexes after the loaded ones */
+void finish_load(uint32_t num_records)
+{
+	db_engine->finish_load(num_records);
+}
+
+/* count the record indexes handed out so far
+ *
+ * @return one more than the highest record index in use
+ */
+uint32_t num_account_records()
+{
+	return db_engine->num_records();
+}
+
+/* call a function on every live account in record order without taking any lock;
+ * only for a forked child of fork_db(), which has a frozen copy of the database
+ *
+ * @param1 func function to call for each record
+ * @param2 arg passed through to func
+ */
+void for_each_record(record_callback func, void *arg)
+{
+	db_engine->for_each_record(func, arg);
+}
+
+/* fork with the engine quiet, so the child gets a copy of the database that no change
+ * is part way through; the child must not call any other database function
+ *
+ * @return as fork()
+ */
+pid_t fork_db()
+{
+	return db_engine->fork();
+}
+
+/* close the engine and free everything it holds */
+void free_db()
+{
+	db_engine->free();
+}
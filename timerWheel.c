@@ -0,0 +1,133 @@
+/*************************************************************************
+  This file keeps timers on a hierarchical timer wheel
+
+   Level 0 has a slot for each of the next TIMER_WHEEL_SLOTS ticks;
+   each level above has slots TIMER_WHEEL_SLOTS times as wide. A timer
+   goes in the lowest level whose span covers its delay, in the slot its
+   expiry falls in, so setting and cancelling a timer are a list insert
+   and a list removal however many timers there are.
+
+   Each tick runs the one level 0 slot whose timers all expire then.
+   When level 0 comes round to slot 0, the next slot of level 1 is due
+   and its timers are set again, which spreads them over level 0; a
+   level above rolls over into the one below the same way. A tick costs
+   the timers that fire in it, plus, every 64th tick, the move of the
+   timers of a slot one level up: each timer is moved at most once per
+   level, whatever the number of timers.
+
+   A wheel belongs to a single thread (see eventLoop.c) and takes no
+   locks.
+ **************************************************************************/
+#include "timerWheel.h"
+
+/* empty every slot
+ *
+ * @param1 wheel the wheel
+ * @param2 now current tick
+ */
+void init_timer_wheel(timer_wheel *wheel, uint64_t now)
+{
+	wheel->now = now;
+	wheel->num_timers = 0;
+
+	int level, slot;
+	for(level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		for(slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+			wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+			wheel->slots[level][slot].next = &wheel->slots[level][slot];
+		}
+	}
+}
+
+/* put a timer in the slot of its expiry, on the lowest level whose span covers it
+ *
+ * @param1 wheel the wheel
+ * @param2 timer the timer; its expiry must not be before the current tick
+ */
+static void add_timer(timer_wheel *wheel, wheel_timer *timer)
+{
+	uint64_t delay = timer->expires - wheel->now;
+	int level = 0;
+	while(delay >> (TIMER_WHEEL_BITS * (level + 1))) level++;
+
+	wheel_timer *head = &wheel->slots[level][(timer->expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+
+	wheel->num_timers++;
+}
+
+/* set a timer that is not already set
+ *
+ * @param1 wheel the wheel
+ * @param2 timer the timer
+ * @param3 expires tick to fire at; one already run fires on the next tick
+ */
+void set_timer(timer_wheel *wheel, wheel_timer *timer, uint64_t expires)
+{
+	if(expires <= wheel->now) expires = wheel->now + 1;
+	if(expires - wheel->now > TIMER_WHEEL_MAX_TICKS) expires = wheel->now + TIMER_WHEEL_MAX_TICKS;
+
+	timer->expires = expires;
+	add_timer(wheel, timer);
+}
+
+/* cancel a timer; nothing happens if it is not set
+ *
+ * @param1 wheel the wheel
+ * @param2 timer the timer
+ */
+void cancel_timer(timer_wheel *wheel, wheel_timer *timer)
+{
+	if(!timer->next) return;
+
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = NULL;
+
+	wheel->num_timers--;
+}
+
+/* run every tick up to now: set again the timers of each higher slot that comes due,
+ * so they move down a level, and fire the timers expiring in each tick
+ *
+ * @param1 wheel the wheel
+ * @param2 now current tick
+ * @param3 expire called for each timer that fires
+ * @param4 arg passed through to expire
+ */
+void advance_timer_wheel(timer_wheel *wheel, uint64_t now, timer_callback expire, void *arg)
+{
+	while(wheel->now < now) {
+		uint64_t tick = wheel->now + 1;
+
+		//the levels rolling over at this tick, highest first, so their timers can fall through several levels
+		int top = 0;
+		while(top + 1 < TIMER_WHEEL_LEVELS && (tick & ((1ULL << (TIMER_WHEEL_BITS * (top + 1))) - 1)) == 0) top++;
+
+		//a slot of level k holds timers due within 64^k ticks of its first, which is this one, so each
+		//lands a level lower, and one due now lands in the level 0 slot run below
+		wheel->now = tick;
+
+		int level;
+		for(level = top; level > 0; level--) {
+			wheel_timer *head = &wheel->slots[level][(tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+			while(head->next != head) {
+				wheel_timer *timer = head->next;
+				cancel_timer(wheel, timer);
+				add_timer(wheel, timer);
+			}
+		}
+
+		//timers set again by expire() go after this tick, so expire() may set or cancel any timer
+		wheel_timer *head = &wheel->slots[0][tick & (TIMER_WHEEL_SLOTS - 1)];
+		while(head->next != head) {
+			wheel_timer *timer = head->next;
+			cancel_timer(wheel, timer);
+			expire(timer, arg);
+		}
+	}
+}
@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+/* a wheel has TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots; a slot of level k spans 64^k ticks */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+/* longest delay a timer can be set for; a later expiry is brought forward to it */
+#define TIMER_WHEEL_MAX_TICKS ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+/* a timer, kept inside whatever it times */
+typedef struct wheel_timer wheel_timer;
+struct wheel_timer {
+	uint64_t expires;	//tick the timer fires at
+	wheel_timer *prev;	//previous timer in its slot
+	wheel_timer *next;	//next timer in its slot; NULL while the timer is not set
+	void *data;		//left to the owner of the timer
+};
+
+/* timers of one thread; not thread safe */
+typedef struct timer_wheel timer_wheel;
+struct timer_wheel {
+	uint64_t now;						//last tick run
+	size_t num_timers;					//timers set
+	wheel_timer slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];	//list heads; each list is a circle through its head
+};
+
+/* called for each timer that fires, which is no longer set and may be set again */
+typedef void (*timer_callback)(wheel_timer *timer, void *arg);
+
+/* timer wheel functions */
+void init_timer_wheel(timer_wheel *wheel, uint64_t now);
+void set_timer(timer_wheel *wheel, wheel_timer *timer, uint64_t expires);
+void cancel_timer(timer_wheel *wheel, wheel_timer *timer);
+void advance_timer_wheel(timer_wheel *wheel, uint64_t now, timer_callback expire, void *arg);
@@ -0,0 +1,863 @@
+/*************************************************************************
+  This file handles the write-ahead log of the account database
+
+   Every CREATE, DEPOSIT, WITHDRAW, DELETE, TRANSFER and TRANSFER_BATCH
+   is appended to the log while the change is applied, so replaying the
+   log rebuilds the database after a crash. Each record is a fixed header
+   followed by the account name:
+
+   	checksum  4 bytes  FNV-1a of the rest of the record
+   	type      1 byte   wal_record_type: WAL_CREATE, WAL_DEPOSIT,
+   	                   WAL_WITHDRAW or WAL_DELETE
+   	name_len  1 byte   bytes of account name (no terminator)
+   	flags     2 bytes  WAL_AMOUNT_IN_CENTS, WAL_MORE_IN_GROUP
+   	amount    8 bytes  deposited or withdrawn amount; 0 for CREATE
+   	                   and DELETE
+   	name      name_len bytes
+
+   A transfer has no record type of its own: TRANSFER and TRANSFER_BATCH
+   are logged as a WAL_WITHDRAW and a WAL_DEPOSIT of the same amount per
+   leg, all but the last flagged WAL_MORE_IN_GROUP. Replay applies a
+   group only once its last record is read, so a transfer torn by a crash
+   is dropped whole, and replay_change() applies a group of such pairs
+   with transfer_batch(), so readers see all of its legs or none.
+
+   Logs written before amounts were fixed-point hold the amount as a
+   double and have no flags; replay converts those to cents.
+
+   A record's lsn counts the bytes logged before it and itself. Replay
+   stops at the first torn or corrupt record and cuts the log there.
+   wal_apply() is the same replay over log bytes in memory; a replica
+   applies the log its primary ships it with it (see replication.c).
+
+   Generations:
+   	the log is split into files <prefix>.<generation>; wal_rotate()
+   	starts a new generation when a snapshot is taken (see snapshot.c),
+   	so once the snapshot is on disk the older generations are removed
+
+   Durability modes:
+   	SYNC_COMMIT   every record is written under the log lock, and
+   	              fdatasync'd by wal_commit() once the caller has let
+   	              go of the log and segment locks, before the
+   	              operation returns; a committer whose record an
+   	              fdatasync already covered does not sync again
+   	GROUP_COMMIT  records are buffered; a flusher thread writes and
+   	              fdatasyncs everything buffered while the previous
+   	              fdatasync ran, and committers wait for their lsn
+   	ASYNC_COMMIT  records are buffered and flushed every
+   	              ASYNC_FLUSH_MS; committers do not wait
+ **************************************************************************/
+#include "wal.h"
+#include "database.h"
+#include "metrics.h"
+#include <time.h>
+#include <errno.h>
+#include <math.h>
+
+/* on disk header of a log record */
+typedef struct wal_record_header wal_record_header;
+struct wal_record_header {
+	uint32_t checksum;	//FNV-1a of everything after this field
+	uint8_t type;		//wal_record_type
+	uint8_t name_len;	//bytes of account name that follow the header
+	uint16_t flags;		//WAL_AMOUNT_IN_CENTS in every record written now
+	int64_t amount;		//amount of a deposit or withdrawal in cents
+};
+
+/* amount holds a money; without it amount holds the bits of a double */
+#define WAL_AMOUNT_IN_CENTS 1
+
+/* the next record belongs to the same change as this one */
+#define WAL_MORE_IN_GROUP 2
+
+/* largest record */
+#define WAL_MAX_RECORD_SIZE (sizeof(wal_record_header) + 255)
+
+/* records appended since the last flush */
+typedef struct wal_buffer wal_buffer;
+struct wal_buffer {
+	char *data;
+	size_t used;
+	size_t capacity;
+};
+
+#define WAL_BUFFER_SIZE (1 << 20)
+#define ASYNC_FLUSH_MS 10
+
+/******************************* GLOBALS **************************************/
+/* -1 while the log is closed; every log function is then a no-op */
+int wal_fd = -1;
+
+durability_mode wal_mode;
+
+/* files are named <wal_prefix>.<generation> */
+char *wal_prefix;
+
+/* newest generation; records appended now belong to it */
+uint32_t wal_generation;
+
+/* generation wal_fd belongs to; behind wal_generation until the flusher reaches the rotation */
+uint32_t wal_open_generation;
+
+/* set by wal_rotate(); the first wal_rotate_offset bytes of the active buffer belong to the old generation */
+int wal_rotate_pending;
+size_t wal_rotate_offset;
+
+/* guards the buffers, wal_appended_lsn and wal_durable_lsn;
+ * held by database.c from wal_begin() to wal_end() while a change is applied and logged
+ */
+pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* broadcast when wal_durable_lsn or wal_open_generation advances */
+pthread_cond_t wal_flushed = PTHREAD_COND_INITIALIZER;
+
+/* signalled when there are records for the flusher thread */
+pthread_cond_t wal_pending = PTHREAD_COND_INITIALIZER;
+
+/* records are appended to wal_buffers[wal_active] while the flusher writes the other one */
+wal_buffer wal_buffers[2];
+int wal_active;
+
+/* lsn of the last appended record and of the last record known to be on disk */
+uint64_t wal_appended_lsn;
+uint64_t wal_durable_lsn;
+
+pthread_t wal_flusher_id;
+
+/* set by wal_close() to stop the flusher thread */
+int wal_stopping;
+
+/******************************************************************************/
+
+/* checksum a log record
+ *
+ * @param1 data first byte after the checksum field
+ * @param2 len number of bytes to checksum
+ *
+ * @return 32 bit FNV-1a hash of the bytes
+ */
+uint32_t wal_checksum(unsigned char *data, size_t len)
+{
+	uint32_t hash = 2166136261U;
+	size_t i;
+	for(i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/* parse a durability mode name (sync, group or async)
+ *
+ * @param1 mode_name name given by the user
+ * @param2 mode pointer in which to put the mode
+ *
+ * @return 0 if successful; -1 if the name is unknown
+ */
+int parse_durability_mode(char *mode_name, durability_mode *mode)
+{
+	char *modes[] = {"sync", "group", "async"};
+
+	int i;
+	for(i = 0; i < 3; i++) {
+		if(strcmp(mode_name, modes[i]) == 0) {
+			*mode = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* write a whole buffer to the log file
+ *
+ * @param1 data bytes to write
+ * @param2 len number of bytes
+ */
+void write_to_log(char *data, size_t len)
+{
+	while(len > 0) {
+		ssize_t ret = write(wal_fd, data, len);
+		if(ret == -1) {
+			if(errno == EINTR) continue;
+			perror("write log: ");
+			exit(EXIT_FAILURE);
+		}
+		data += ret;
+		len -= ret;
+	}
+}
+
+/* build the path of a log generation
+ *
+ * @param1 path pointer in which to put the path; WAL_PATH_SIZE bytes
+ * @param2 prefix prefix of the log files
+ * @param3 generation generation of the file
+ */
+void log_file_path(char path[WAL_PATH_SIZE], char *prefix, uint32_t generation)
+{
+	snprintf(path, WAL_PATH_SIZE, "%s.%u", prefix, generation);
+}
+
+/* read a log record that has already been checked
+ *
+ * @param1 record first byte of the record
+ * @param2 header pointer in which to put the header
+ * @param3 account_name pointer in which to put the account name
+ *
+ * @return amount of the record in cents
+ */
+money decode_record(unsigned char *record, wal_record_header *header, char account_name[256])
+{
+	memcpy(header, record, sizeof(*header));
+
+	memcpy(account_name, record + sizeof(*header), header->name_len);
+	account_name[header->name_len] = '\0';
+
+	if(header->flags & WAL_AMOUNT_IN_CENTS) return header->amount;
+
+	double old_amount;
+	memcpy(&old_amount, &header->amount, sizeof(old_amount));
+	return llround(old_amount * MONEY_SCALE);
+}
+
+/* apply a run of log records that have already been checked, one at a time
+ *
+ * @param1 source name of the log, for error messages
+ * @param2 log the log
+ * @param3 offset offset of the first record
+ * @param4 end offset just past the last record
+ *
+ * @return number of records applied
+ */
+int replay_records(char *source, unsigned char *log, size_t offset, size_t end)
+{
+	int num_records = 0;
+
+	while(offset < end) {
+		wal_record_header header;
+		char account_name[256];
+		money amount = decode_record(log + offset, &header, account_name);
+
+		int status = 0;
+		switch(header.type) {
+			case WAL_CREATE:
+				status = create_account(account_name);
+				break;
+			case WAL_DEPOSIT:
+				status = deposit(account_name, amount);
+				break;
+			case WAL_WITHDRAW:
+				status = withdraw(account_name, amount);
+				break;
+			case WAL_DELETE:
+				status = delete_account(account_name);
+				break;
+			default:
+				break;
+		}
+
+		if(status != 0) {
+			fprintf(stderr, "%s: record at offset %zu did not replay cleanly (%d)\n", source, offset, status);
+		}
+
+		offset += sizeof(header) + header.name_len;
+		num_records++;
+	}
+
+	return num_records;
+}
+
+/* apply one change of the log, whose records have already been checked; a transfer
+ * goes through transfer_batch() as it did when it was logged, so anyone reading
+ * the database meanwhile (a replica's clients; see replication.c) sees all of its
+ * legs or none
+ *
+ * @param1 source name of the log, for error messages
+ * @param2 log the log
+ * @param3 offset offset of the first record of the change
+ * @param4 end offset just past its last record
+ *
+ * @return number of records applied
+ */
+int replay_change(char *source, unsigned char *log, size_t offset, size_t end)
+{
+	transfer_leg legs[MAX_TRANSFER_LEGS];
+	char names[2 * MAX_TRANSFER_LEGS][256];
+	int num_legs = 0;
+
+	//a transfer is a withdrawal and a deposit of the same amount per leg
+	size_t at = offset;
+	while(at < end && num_legs < MAX_TRANSFER_LEGS) {
+		wal_record_header withdrawal, credit;
+		money amount = decode_record(log + at, &withdrawal, names[2 * num_legs]);
+		size_t next = at + sizeof(withdrawal) + withdrawal.name_len;
+		if(next >= end || withdrawal.type != WAL_WITHDRAW) break;
+
+		money credited = decode_record(log + next, &credit, names[2 * num_legs + 1]);
+		if(credit.type != WAL_DEPOSIT || credited != amount) break;
+
+		legs[num_legs].from = names[2 * num_legs];
+		legs[num_legs].to = names[2 * num_legs + 1];
+		legs[num_legs].amount = amount;
+		num_legs++;
+
+		at = next + sizeof(credit) + credit.name_len;
+	}
+
+	//a single record, or a group that is not a transfer
+	if(num_legs == 0 || at != end) return replay_records(source, log, offset, end);
+
+	int status = transfer_batch(legs, num_legs);
+	if(status != 0) {
+		fprintf(stderr, "%s: transfer at offset %zu did not replay cleanly (%d)\n", source, offset, status);
+	}
+
+	return 2 * num_legs;
+}
+
+/* apply the whole changes at the start of a run of log bytes
+ *
+ * @param1 source name of the log, for error messages
+ * @param2 log the log bytes
+ * @param3 len number of bytes
+ * @param4 num_records pointer in which to put the number of records applied
+ * @param5 corrupt pointer in which to put whether a whole record failed its checksum
+ *
+ * @return offset just past the last change applied; what follows is a change not yet
+ *         complete, torn by a crash, or, if corrupt is set, garbage
+ */
+size_t wal_apply(char *source, unsigned char *log, size_t len, int *num_records, int *corrupt)
+{
+	size_t offset = 0;
+
+	//start of a group whose last record has not been read yet; -1 if there is none
+	ssize_t group_start = -1;
+
+	*num_records = 0;
+	*corrupt = 0;
+
+	while(offset + sizeof(wal_record_header) <= len) {
+		wal_record_header header;
+		memcpy(&header, log + offset, sizeof(header));
+
+		size_t record_len = sizeof(header) + header.name_len;
+		if(offset + record_len > len) break;
+
+		//torn write; everything from here on is garbage
+		if(wal_checksum(log + offset + sizeof(header.checksum), record_len - sizeof(header.checksum)) != header.checksum) {
+			*corrupt = 1;
+			break;
+		}
+
+		if(header.flags & WAL_MORE_IN_GROUP) {
+			if(group_start == -1) group_start = offset;
+		} else {
+			size_t first = (group_start == -1) ? offset : (size_t) group_start;
+			*num_records += replay_change(source, log, first, offset + record_len);
+			group_start = -1;
+		}
+
+		offset += record_len;
+	}
+
+	//the group has not been read whole; none of it has happened yet
+	if(group_start != -1) offset = group_start;
+
+	return offset;
+}
+
+/* replay one log file into the database
+ * a torn or corrupt tail is cut off so new records follow the last good one
+ *
+ * @param1 path path of the log file
+ *
+ * @return number of records replayed; -1 if the file does not exist or could not be read
+ */
+int replay_log_file(char *path)
+{
+	int fd = open(path, O_RDWR);
+	if(fd == -1) return -1;
+
+	struct stat st;
+	fstat(fd, &st);
+
+	if(st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	unsigned char *log = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(log == MAP_FAILED) {
+		perror("mmap log: ");
+		close(fd);
+		return -1;
+	}
+
+	int num_records, corrupt;
+	size_t offset = wal_apply(path, log, st.st_size, &num_records, &corrupt);
+
+	munmap(log, st.st_size);
+
+	if(offset < (size_t) st.st_size) {
+		fprintf(stderr, "%s: cutting %zu bytes of torn log at offset %zu\n", path, (size_t) st.st_size - offset, offset);
+		if(ftruncate(fd, offset) == -1) perror("ftruncate log: ");
+	}
+
+	close(fd);
+
+	return num_records;
+}
+
+/* replay the log into the database; must run before wal_open() so replayed changes are not logged again
+ * generations are replayed in order from first_generation until one is missing,
+ * and the last one found is the one wal_open() appends to
+ *
+ * @param1 prefix prefix of the log files
+ * @param2 first_generation oldest generation not covered by the loaded snapshot; 0 if there is none
+ *
+ * @return number of records replayed
+ */
+int wal_replay(char *prefix, uint32_t first_generation)
+{
+	char path[WAL_PATH_SIZE];
+	int num_records = 0;
+
+	wal_generation = first_generation;
+
+	uint32_t generation;
+	for(generation = first_generation; ; generation++) {
+		log_file_path(path, prefix, generation);
+
+		int ret = replay_log_file(path);
+		if(ret == -1) break;
+
+		num_records += ret;
+		wal_generation = generation;
+	}
+
+	return num_records;
+}
+
+/* remove the log generations older than a snapshot
+ *
+ * @param1 prefix prefix of the log files
+ * @param2 before generations below this one are removed
+ */
+void wal_remove_generations(char *prefix, uint32_t before)
+{
+	char path[WAL_PATH_SIZE];
+
+	//generations are consecutive, so stop at the first one already gone
+	uint32_t generation = before;
+	while(generation > 0) {
+		generation--;
+		log_file_path(path, prefix, generation);
+		if(unlink(path) == -1) break;
+	}
+}
+
+/* open a log generation for appending
+ *
+ * @param1 generation generation to open
+ *
+ * @return file descriptor; -1 if the file could not be opened
+ */
+int open_log_file(uint32_t generation)
+{
+	char path[WAL_PATH_SIZE];
+	log_file_path(path, wal_prefix, generation);
+
+	int fd = open(path, O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if(fd == -1) perror("open log: ");
+
+	return fd;
+}
+
+/* finish the current generation's file and continue in a new one
+ *
+ * @param1 generation generation of the new file
+ */
+void switch_log_file(uint32_t generation)
+{
+	fdatasync(wal_fd);
+	close(wal_fd);
+
+	wal_fd = open_log_file(generation);
+	if(wal_fd == -1) exit(EXIT_FAILURE);
+}
+
+/* thread runner that writes buffered records to disk for GROUP_COMMIT and ASYNC_COMMIT;
+ * whatever was appended while one fdatasync ran goes out together in the next
+ *
+ * @param1 arg unused
+ */
+void * wal_flusher_runner(void* arg)
+{
+	(void)arg;
+
+	while(1) {
+		pthread_mutex_lock(&wal_lock);
+
+		while(wal_buffers[wal_active].used == 0 && !wal_rotate_pending && !wal_stopping) {
+			if(wal_mode == ASYNC_COMMIT) {
+				struct timespec deadline;
+				clock_gettime(CLOCK_REALTIME, &deadline);
+				deadline.tv_nsec += ASYNC_FLUSH_MS * 1000000L;
+				if(deadline.tv_nsec >= 1000000000L) {
+					deadline.tv_sec++;
+					deadline.tv_nsec -= 1000000000L;
+				}
+				pthread_cond_timedwait(&wal_pending, &wal_lock, &deadline);
+			} else {
+				pthread_cond_wait(&wal_pending, &wal_lock);
+			}
+		}
+
+		if(wal_buffers[wal_active].used == 0 && !wal_rotate_pending && wal_stopping) {
+			pthread_mutex_unlock(&wal_lock);
+			return NULL;
+		}
+
+		//swap buffers so appenders keep going while this one is written
+		wal_buffer *flushing = &wal_buffers[wal_active];
+		uint64_t flushing_lsn = wal_appended_lsn;
+		wal_active = !wal_active;
+
+		//the start of this buffer still belongs to the old generation
+		int rotate = wal_rotate_pending;
+		size_t rotate_offset = wal_rotate_offset;
+		uint32_t generation = wal_generation;
+		wal_rotate_pending = 0;
+
+		pthread_mutex_unlock(&wal_lock);
+
+		if(rotate) {
+			write_to_log(flushing->data, rotate_offset);
+			switch_log_file(generation);
+			write_to_log(flushing->data + rotate_offset, flushing->used - rotate_offset);
+		} else {
+			write_to_log(flushing->data, flushing->used);
+		}
+		fdatasync(wal_fd);
+
+		pthread_mutex_lock(&wal_lock);
+		flushing->used = 0;
+		wal_durable_lsn = flushing_lsn;
+		wal_open_generation = generation;
+		pthread_cond_broadcast(&wal_flushed);
+		pthread_mutex_unlock(&wal_lock);
+
+		//give appenders a chance to fill the next batch
+		if(wal_mode == ASYNC_COMMIT && !wal_stopping) usleep(ASYNC_FLUSH_MS * 1000);
+	}
+}
+
+/* open the newest log generation for appending; changes made after this are logged
+ *
+ * @param1 prefix prefix of the log files
+ * @param2 mode durability mode
+ *
+ * @return 0 if successful; -1 if the log could not be opened
+ */
+int wal_open(char *prefix, durability_mode mode)
+{
+	wal_prefix = prefix;
+
+	int fd = open_log_file(wal_generation);
+	if(fd == -1) return -1;
+
+	wal_mode = mode;
+	wal_appended_lsn = 0;
+	wal_durable_lsn = 0;
+	wal_open_generation = wal_generation;
+	wal_rotate_pending = 0;
+	wal_active = 0;
+	wal_stopping = 0;
+
+	int i;
+	for(i = 0; i < 2; i++) {
+		wal_buffers[i].data = malloc(WAL_BUFFER_SIZE);
+		wal_buffers[i].used = 0;
+		wal_buffers[i].capacity = WAL_BUFFER_SIZE;
+	}
+
+	wal_fd = fd;
+
+	if(mode != SYNC_COMMIT) pthread_create(&wal_flusher_id, NULL, wal_flusher_runner, NULL);
+
+	return 0;
+}
+
+/* flush everything still buffered and close the log */
+void wal_close()
+{
+	if(wal_fd == -1) return;
+
+	if(wal_mode != SYNC_COMMIT) {
+		pthread_mutex_lock(&wal_lock);
+		wal_stopping = 1;
+		pthread_cond_signal(&wal_pending);
+		pthread_mutex_unlock(&wal_lock);
+
+		pthread_join(wal_flusher_id, NULL);
+	}
+
+	fdatasync(wal_fd);
+	close(wal_fd);
+	wal_fd = -1;
+
+	int i;
+	for(i = 0; i < 2; i++) {
+		free(wal_buffers[i].data);
+		wal_buffers[i].data = NULL;
+	}
+}
+
+/* start logging a change; the change must be applied and appended before wal_end()
+ * so the log and the database see changes in the same order
+ */
+void wal_begin()
+{
+	if(wal_fd == -1) return;
+
+	metrics_lock(&wal_lock, WAL_LOCK);
+}
+
+/* finish logging a change started with wal_begin() */
+void wal_end()
+{
+	if(wal_fd == -1) return;
+
+	pthread_mutex_unlock(&wal_lock);
+}
+
+/* start a new log generation; caller must be between wal_begin() and wal_end(),
+ * so every record appended before this call is in an older generation
+ *
+ * @return the new generation; a snapshot taken before wal_end() covers every older one
+ */
+uint32_t wal_rotate()
+{
+	if(wal_fd == -1) return 0;
+
+	wal_generation++;
+
+	if(wal_mode == SYNC_COMMIT) {
+		//the old file is synced before it is closed, so a committer syncing it meanwhile need not
+		switch_log_file(wal_generation);
+		wal_open_generation = wal_generation;
+		wal_durable_lsn = wal_appended_lsn;
+		pthread_cond_broadcast(&wal_flushed);
+		return wal_generation;
+	}
+
+	//the flusher writes what is buffered so far to the old file before switching
+	wal_rotate_pending = 1;
+	wal_rotate_offset = wal_buffers[wal_active].used;
+	pthread_cond_signal(&wal_pending);
+
+	return wal_generation;
+}
+
+/* wait until the flusher has finished writing the generations before a rotation
+ *
+ * @param1 generation the value returned by wal_rotate()
+ */
+void wal_wait_for_rotation(uint32_t generation)
+{
+	if(wal_fd == -1) return;
+
+	pthread_mutex_lock(&wal_lock);
+	while(wal_open_generation < generation) {
+		pthread_cond_wait(&wal_flushed, &wal_lock);
+	}
+	pthread_mutex_unlock(&wal_lock);
+}
+
+/* build a log record
+ *
+ * @param1 record pointer in which to put the record; WAL_MAX_RECORD_SIZE bytes
+ * @param2 type the kind of change
+ * @param3 account_name name of the account changed
+ * @param4 amount amount deposited or withdrawn in cents; 0 for WAL_CREATE and WAL_DELETE
+ * @param5 more true if the next record belongs to the same change
+ *
+ * @return size of the record
+ */
+size_t build_record(char *record, wal_record_type type, char account_name[256], money amount, int more)
+{
+	wal_record_header header;
+	header.type = type;
+	header.name_len = strlen(account_name);
+	header.flags = WAL_AMOUNT_IN_CENTS | (more ? WAL_MORE_IN_GROUP : 0);
+	header.amount = amount;
+
+	size_t record_len = sizeof(header) + header.name_len;
+	memcpy(record + sizeof(header), account_name, header.name_len);
+	memcpy(record, &header, sizeof(header));
+	header.checksum = wal_checksum((unsigned char*) record + sizeof(header.checksum), record_len - sizeof(header.checksum));
+	memcpy(record, &header.checksum, sizeof(header.checksum));
+
+	return record_len;
+}
+
+/* append whole records to the log; caller must be between wal_begin() and wal_end()
+ * in SYNC_COMMIT mode the records are written, and on disk once wal_commit() returns
+ *
+ * @param1 records the records
+ * @param2 len total size of the records
+ *
+ * @return lsn to pass to wal_commit()
+ */
+uint64_t append_records(char *records, size_t len)
+{
+	wal_appended_lsn += len;
+
+	if(wal_mode == SYNC_COMMIT) {
+		write_to_log(records, len);
+		return wal_appended_lsn;
+	}
+
+	wal_buffer *buffer = &wal_buffers[wal_active];
+	while(buffer->used + len > buffer->capacity) {
+		char *data = realloc(buffer->data, buffer->capacity * 2);
+		if(!data) {
+			perror("realloc log buffer: ");
+			exit(EXIT_FAILURE);
+		}
+		buffer->data = data;
+		buffer->capacity *= 2;
+	}
+
+	memcpy(buffer->data + buffer->used, records, len);
+	buffer->used += len;
+
+	//async mode leaves the flusher on its timer unless the buffer is getting large
+	if(wal_mode == GROUP_COMMIT || buffer->used > WAL_BUFFER_SIZE / 2) pthread_cond_signal(&wal_pending);
+
+	return wal_appended_lsn;
+}
+
+/* append a record to the log; caller must be between wal_begin() and wal_end()
+ * in SYNC_COMMIT mode the record is written, and on disk once wal_commit() returns
+ *
+ * @param1 type the kind of change
+ * @param2 account_name name of the account changed
+ * @param3 amount amount deposited or withdrawn in cents; 0 for WAL_CREATE and WAL_DELETE
+ *
+ * @return lsn to pass to wal_commit(); 0 if logging is off
+ */
+uint64_t wal_append(wal_record_type type, char account_name[256], money amount)
+{
+	if(wal_fd == -1) return 0;
+
+	char record[WAL_MAX_RECORD_SIZE];
+	size_t record_len = build_record(record, type, account_name, amount, 0);
+
+	return append_records(record, record_len);
+}
+
+/* append a transfer to the log as one group of records, written together;
+ * caller must be between wal_begin() and wal_end()
+ *
+ * @param1 legs the legs of the transfer
+ * @param2 num_legs number of legs; at most MAX_TRANSFER_LEGS
+ *
+ * @return lsn to pass to wal_commit(); 0 if logging is off
+ */
+uint64_t wal_append_transfer(transfer_leg *legs, int num_legs)
+{
+	if(wal_fd == -1) return 0;
+
+	char records[2 * MAX_TRANSFER_LEGS * WAL_MAX_RECORD_SIZE];
+	size_t len = 0;
+
+	int i;
+	for(i = 0; i < num_legs; i++) {
+		len += build_record(records + len, WAL_WITHDRAW, legs[i].from, legs[i].amount, 1);
+		len += build_record(records + len, WAL_DEPOSIT, legs[i].to, legs[i].amount, i < num_legs - 1);
+	}
+
+	return append_records(records, len);
+}
+
+/* fdatasync the log in SYNC_COMMIT mode without holding the log lock, unless an
+ * fdatasync that started after the record was written has already covered it
+ * a rotation may close the file meanwhile, but it syncs the file first, and
+ * marks everything appended before it durable
+ *
+ * @param1 lsn the value returned by wal_append()
+ */
+void sync_log(uint64_t lsn)
+{
+	pthread_mutex_lock(&wal_lock);
+	if(wal_durable_lsn >= lsn) {
+		pthread_mutex_unlock(&wal_lock);
+		return;
+	}
+	int fd = wal_fd;
+	uint64_t written = wal_appended_lsn;
+	pthread_mutex_unlock(&wal_lock);
+
+	fdatasync(fd);
+
+	pthread_mutex_lock(&wal_lock);
+	if(written > wal_durable_lsn) {
+		wal_durable_lsn = written;
+		pthread_cond_broadcast(&wal_flushed);
+	}
+	pthread_mutex_unlock(&wal_lock);
+}
+
+/* wait until a record is durable as required by the durability mode;
+ * must be called after wal_end() and after releasing any database locks
+ *
+ * @param1 lsn the value returned by wal_append()
+ */
+void wal_commit(uint64_t lsn)
+{
+	if(wal_fd == -1 || wal_mode == ASYNC_COMMIT) return;
+
+	if(wal_mode == SYNC_COMMIT) {
+		sync_log(lsn);
+		return;
+	}
+
+	pthread_mutex_lock(&wal_lock);
+	while(wal_durable_lsn < lsn) {
+		pthread_cond_wait(&wal_flushed, &wal_lock);
+	}
+	pthread_mutex_unlock(&wal_lock);
+}
+
+/* wait until records past an lsn are on disk, or for a while; used to follow the log
+ * as it is written (see replication.c)
+ *
+ * @param1 lsn the value this returned last time; 0 the first time
+ * @param2 timeout_ms longest wait in milliseconds
+ *
+ * @return lsn of the last record on disk, which is lsn itself if the wait timed out
+ */
+uint64_t wal_wait_for_flush(uint64_t lsn, int timeout_ms)
+{
+	if(wal_fd == -1) return 0;
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if(deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&wal_lock);
+	while(wal_durable_lsn <= lsn) {
+		if(pthread_cond_timedwait(&wal_flushed, &wal_lock, &deadline) != 0) break;
+	}
+	lsn = wal_durable_lsn;
+	pthread_mutex_unlock(&wal_lock);
+
+	return lsn;
+}
@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "money.h"
+
+/* enums */
+typedef enum _durability_mode{SYNC_COMMIT, GROUP_COMMIT, ASYNC_COMMIT} durability_mode;
+typedef enum _wal_record_type{WAL_CREATE = 1, WAL_DEPOSIT, WAL_WITHDRAW, WAL_DELETE} wal_record_type;
+
+/* room for the path of a log file */
+#define WAL_PATH_SIZE 4096
+
+/* defined in database.h */
+typedef struct transfer_leg transfer_leg;
+
+/* write-ahead log functions */
+int parse_durability_mode(char *mode_name, durability_mode *mode);
+void log_file_path(char path[WAL_PATH_SIZE], char *prefix, uint32_t generation);
+size_t wal_apply(char *source, unsigned char *log, size_t len, int *num_records, int *corrupt);
+int wal_replay(char *prefix, uint32_t first_generation);
+void wal_remove_generations(char *prefix, uint32_t before);
+int wal_open(char *prefix, durability_mode mode);
+void wal_close();
+void wal_begin();
+uint64_t wal_append(wal_record_type type, char account_name[256], money amount);
+uint64_t wal_append_transfer(transfer_leg *legs, int num_legs);
+void wal_end();
+uint32_t wal_rotate();
+void wal_wait_for_rotation(uint32_t generation);
+void wal_commit(uint64_t lsn);
+uint64_t wal_wait_for_flush(uint64_t lsn, int timeout_ms);